@@ -0,0 +1,54 @@
+//
+// Basic block vectors (BBV) for SimPoint.
+//
+
+#include "BasicBlockVector.h"
+#include <algorithm>
+
+namespace RISCV_EMULATOR {
+
+void BasicBlockVector::StartBlock(uint64_t pc) {
+  EndRun();
+  uint32_t index;
+  if (current_ != kNoBlock && blocks_[current_].successor_pc == pc) {
+    index = blocks_[current_].successor;
+  } else {
+    auto it = ids_.emplace(pc, static_cast<uint32_t>(blocks_.size()));
+    if (it.second) {
+      blocks_.emplace_back();
+    }
+    index = it.first->second;
+    if (current_ != kNoBlock) {
+      blocks_[current_].successor_pc = pc;
+      blocks_[current_].successor = index;
+    }
+  }
+  current_ = index;
+}
+
+void BasicBlockVector::EndRun() {
+  if (length_ == 0) {
+    return;
+  }
+  Block &block = blocks_[current_];
+  if (block.count == 0) {
+    touched_.push_back(current_);
+  }
+  block.count += length_;
+  length_ = 0;
+}
+
+void BasicBlockVector::EndInterval() {
+  // The current run goes on in the next interval, in the same block.
+  EndRun();
+  std::sort(touched_.begin(), touched_.end());
+  *out_ << "T";
+  for (uint32_t index : touched_) {
+    *out_ << ":" << index + 1 << ":" << blocks_[index].count << " ";
+    blocks_[index].count = 0;
+  }
+  *out_ << "\n";
+  touched_.clear();
+}
+
+}  // namespace RISCV_EMULATOR
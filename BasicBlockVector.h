@@ -0,0 +1,79 @@
+//
+// Basic block vectors (BBV) for SimPoint. Every interval instructions, the
+// number of instructions executed in each basic block during the interval
+// is written as a line of the format of SimPoint and valgrind exp-bbv:
+//   T:1:2200 :3:84 :4:900
+// Blocks are numbered from 1 in the order they first execute, and are told
+// apart by the pc where they start.
+//
+
+#ifndef ASSEMBLER_TEST_BASICBLOCKVECTOR_H
+#define ASSEMBLER_TEST_BASICBLOCKVECTOR_H
+
+#include <cstdint>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+namespace RISCV_EMULATOR {
+
+class BasicBlockVector {
+ public:
+  static constexpr uint64_t kDefaultInterval = 100000000;
+
+  // Writes the vectors to |out|, which must outlive the object.
+  BasicBlockVector(std::ostream *out, uint64_t interval = kDefaultInterval)
+      : out_(out), interval_(interval > 0 ? interval : 1) {}
+
+  uint64_t GetInterval() const { return interval_; }
+
+  // Called for every instruction that executes.
+  void Count(uint64_t pc, bool compressed) {
+    if (pc != next_pc_) {
+      StartBlock(pc);
+    }
+    ++length_;
+    next_pc_ = pc + (compressed ? 2 : 4);
+  }
+
+  // Writes the vector of the interval that ends now. A partial interval at
+  // the end of a run isn't written, as in exp-bbv.
+  void EndInterval();
+
+  // The number of the blocks seen so far.
+  size_t GetBlockCount() const { return blocks_.size(); }
+
+ private:
+  struct Block {
+    // The instructions executed in the current interval.
+    uint64_t count = 0;
+    // The block that followed it last time, to save the lookup in a loop.
+    uint64_t successor_pc = 1;
+    uint32_t successor = 0;
+  };
+
+  void StartBlock(uint64_t pc);
+
+  // Adds the instructions of the current run to its block.
+  void EndRun();
+
+  static constexpr uint32_t kNoBlock = UINT32_MAX;
+
+  std::ostream *out_;
+  uint64_t interval_;
+  // Never a pc, which is always even.
+  uint64_t next_pc_ = 1;
+  // The index of the current block in blocks_.
+  uint32_t current_ = kNoBlock;
+  // The instructions of the current run not yet added to its block.
+  size_t length_ = 0;
+  std::unordered_map<uint64_t, uint32_t> ids_;
+  // Indexed by the block id - 1.
+  std::vector<Block> blocks_;
+  // The indexes of the blocks that executed in the current interval.
+  std::vector<uint32_t> touched_;
+};
+
+}  // namespace RISCV_EMULATOR
+
+#endif  // ASSEMBLER_TEST_BASICBLOCKVECTOR_H
@@ -3,148 +3,196 @@
 //
 
 #include "Disassembler.h"
-#include <ios>
-#include <sstream>
+#include "RISCV_cpu.h"
 #include "instruction_encdec.h"
 
 namespace RISCV_EMULATOR {
 
-std::string GetRegName(int reg) {
-  std::array<std::string, 32> kRegNames = {
-      "ZERO", "RA", "SP", "GP", "TP",  "T0",  "T1", "T2", "FP", "S1", "A0",
-      "A1",   "A2", "A3", "A4", "A5",  "A6",  "A7", "S2", "S3", "S4", "S5",
-      "S6",   "S7", "S8", "S9", "S10", "S11", "T3", "T4", "T5", "T6",
-  };
-  return kRegNames[reg];
-}
+namespace {
 
-std::string NumberToHex(uint32_t num, int length = 0) {
-  std::stringstream s;
-  s << "0x" << std::hex << num;
-  return std::string(s.str());
-}
+const char *const kRegNames[32] = {
+    "ZERO", "RA", "SP", "GP", "TP",  "T0",  "T1", "T2", "FP", "S1", "A0",
+    "A1",   "A2", "A3", "A4", "A5",  "A6",  "A7", "S2", "S3", "S4", "S5",
+    "S6",   "S7", "S8", "S9", "S10", "S11", "T3", "T4", "T5", "T6",
+};
+
+struct Reg {
+  explicit Reg(uint32_t reg) : name(kRegNames[reg & 0x1F]) {}
+  const char *name;
+};
+
+// A 32 bit number as "0x" and its lower case digits.
+struct Hex {
+  explicit Hex(uint32_t num) : num(num) {}
+  uint32_t num;
+};
+
+// Appends text to a buffer of a fixed size, dropping what doesn't fit.
+class TextWriter {
+ public:
+  TextWriter(char *buffer, size_t size) : buffer_(buffer), size_(size) {}
+
+  TextWriter &operator<<(const char *text) {
+    while (*text) {
+      Put(*text++);
+    }
+    return *this;
+  }
+
+  TextWriter &operator<<(Reg reg) { return *this << reg.name; }
+
+  TextWriter &operator<<(Hex hex) {
+    *this << "0x";
+    int shift = 28;
+    while (shift > 0 && (hex.num >> shift) == 0) {
+      shift -= 4;
+    }
+    for (; shift >= 0; shift -= 4) {
+      Put("0123456789abcdef"[(hex.num >> shift) & 0xF]);
+    }
+    return *this;
+  }
+
+  bool IsEmpty() const { return length_ == 0; }
+
+  // Terminates the text, and returns its length.
+  size_t Finish() {
+    if (size_ > 0) {
+      buffer_[length_] = '\0';
+    }
+    return length_;
+  }
+
+ private:
+  void Put(char c) {
+    if (length_ + 1 < size_) {
+      buffer_[length_++] = c;
+    }
+  }
+
+  char *buffer_;
+  size_t size_;
+  size_t length_ = 0;
+};
 
-// TODO: Add tests for disassembly;
 // Disassemble16 and GetCode16 have very similar logic. Should be combined in
 // some way.
-std::string Disassemble16(uint32_t ir, int mxl = 1) {
-  std::string cmd = "Unsupported C Instruction";
+void Disassemble16(uint32_t ir, int mxl, TextWriter *writer) {
+  TextWriter &out = *writer;
+  const char *name = "Unsupported C Instruction";
   uint32_t instruction, rd, rs1, rs2;
   int32_t imm;
-  RiscvCpu::GetCode16(ir, mxl, &instruction, &rd, &rs1, &rs2, &imm);
+  // Without the reports of GetCode16, for the flight recorder dump in a
+  // signal handler.
+  RiscvCpu::DecodeCode16(ir, mxl, &instruction, &rd, &rs1, &rs2, &imm);
   uint16_t opcode = (bitcrop(ir, 3, 13) << 2) | bitcrop(ir, 2, 0);
   switch (opcode) {
     case 0b00000:
-      cmd = "C.ADDI4SPN " + GetRegName(rd) + ", SP, " + NumberToHex(imm);
+      out << "C.ADDI4SPN " << Reg(rd) << ", SP, " << Hex(imm);
       break;
     case 0b00001:
-      cmd = "C.ADDI " + GetRegName(rd) + ", " + NumberToHex(imm);
+      out << "C.ADDI " << Reg(rd) << ", " << Hex(imm);
       break;
     case 0b00010:
-      cmd = "C.SLLI " + GetRegName(rd) + ", " + NumberToHex(imm);
+      out << "C.SLLI " << Reg(rd) << ", " << Hex(imm);
       break;
     case 0b00101:
       if (mxl == 1) {
-        cmd = "C.JAL " + NumberToHex(SignExtend(imm, 12));
+        out << "C.JAL " << Hex(SignExtend(imm, 12));
       } else {
-        cmd = "C.ADDIW " + GetRegName(rd) + ", " + NumberToHex(imm);
+        out << "C.ADDIW " << Reg(rd) << ", " << Hex(imm);
       }
       break;
     case 0b01000:
-      cmd = "C.LW " + GetRegName(rd) + ", " + NumberToHex(imm) + "(" +
-            GetRegName(rs1) + ")";
+      out << "C.LW " << Reg(rd) << ", " << Hex(imm) << "(" << Reg(rs1) << ")";
       break;
     case 0b01001:
-      cmd = "C.LI " + GetRegName(rd) + ", " + NumberToHex(imm);
+      out << "C.LI " << Reg(rd) << ", " << Hex(imm);
       break;
     case 0b01010:
-      cmd = "C.LWSP " + GetRegName(rd) + ", " + NumberToHex(imm) + "(SP)";
+      out << "C.LWSP " << Reg(rd) << ", " << Hex(imm) << "(SP)";
       break;
     case 0b01100:
-      cmd = "C.LD " + GetRegName(rd) + ", " + NumberToHex(imm) + "(" +
-            GetRegName(rs1) + ")";
+      out << "C.LD " << Reg(rd) << ", " << Hex(imm) << "(" << Reg(rs1) << ")";
       break;
     case 0b01101:
       if (bitcrop(ir, 5, 7) == 0b00010) {
         // c.addi16sp.
-        cmd = "C.ADDI16SP SP, SP, " + NumberToHex(imm);
+        out << "C.ADDI16SP SP, SP, " << Hex(imm);
       } else {
-        cmd = "C.LUI " + GetRegName(rd) + ", " + NumberToHex(imm);
+        out << "C.LUI " << Reg(rd) << ", " << Hex(imm);
       }
       break;
     case 0b01110:
-      cmd = "C.LDSP " + GetRegName(rd) + ", " + NumberToHex(imm) + "(SP)";
+      out << "C.LDSP " << Reg(rd) << ", " << Hex(imm) << "(SP)";
       break;
     case 0b10010:  // c.add
       if (bitcrop(ir, 1, 12) == 1) {
         if (bitcrop(ir, 5, 2) == 0 && bitcrop(ir, 5, 7) == 0) {
-          cmd = "C.EBREAK";
+          name = "C.EBREAK";
         } else if (bitcrop(ir, 5, 2) == 0) {
-          cmd = "C.JALR " + GetRegName(rs1);
+          out << "C.JALR " << Reg(rs1);
         } else if (bitcrop(ir, 5, 7) != 0) {
-          cmd = "C.ADD " + GetRegName(rd) + ", " + GetRegName(rs2);
+          out << "C.ADD " << Reg(rd) << ", " << Reg(rs2);
         }
       } else if (bitcrop(ir, 5, 2) == 0) {
-        cmd = "C.JR " + GetRegName(rs1);
+        out << "C.JR " << Reg(rs1);
       } else {
-        cmd = "C.MV " + GetRegName(rd) + ", " + GetRegName(rs2);
+        out << "C.MV " << Reg(rd) << ", " << Reg(rs2);
       }
       break;
     case 0b10001:
       if (bitcrop(ir, 3, 10) == 0b011 && bitcrop(ir, 2, 5) == 0b11) {
         // c.and.
-        cmd = "C.AND " + GetRegName(rd) + ", " + GetRegName(rs2);
+        out << "C.AND " << Reg(rd) << ", " << Reg(rs2);
       } else if (bitcrop(ir, 3, 10) == 0b011 && bitcrop(ir, 2, 5) == 0b01) {
-        cmd = "C.XOR " + GetRegName(rd) + ", " + GetRegName(rs2);
+        out << "C.XOR " << Reg(rd) << ", " << Reg(rs2);
       } else if (bitcrop(ir, 3, 10) == 0b011 && bitcrop(ir, 2, 5) == 0b00) {
-        cmd = "C.SUB " + GetRegName(rd) + ", " + GetRegName(rs2);
+        out << "C.SUB " << Reg(rd) << ", " << Reg(rs2);
       } else if (bitcrop(ir, 3, 10) == 0b011 && bitcrop(ir, 2, 5) == 0b10) {
-        cmd = "C.OR " + GetRegName(rd) + ", " + GetRegName(rs2);
+        out << "C.OR " << Reg(rd) << ", " << Reg(rs2);
       } else if (bitcrop(ir, 3, 10) == 0b111 && bitcrop(ir, 2, 5) == 0b01) {
-        cmd = "C.ADDW " + GetRegName(rd) + ", " + GetRegName(rs2);
+        out << "C.ADDW " << Reg(rd) << ", " << Reg(rs2);
       } else if (bitcrop(ir, 3, 10) == 0b111 && bitcrop(ir, 2, 5) == 0b00) {
-        cmd = "C.SUBW " + GetRegName(rd) + ", " + GetRegName(rs2);
+        out << "C.SUBW " << Reg(rd) << ", " << Reg(rs2);
       } else if (bitcrop(ir, 2, 10) == 0b01) {
-        cmd = "C.SRAI " + GetRegName(rd) + ", " + NumberToHex(imm);
+        out << "C.SRAI " << Reg(rd) << ", " << Hex(imm);
       } else if (bitcrop(ir, 2, 10) == 0b00) {
-        cmd = "C.SRLI " + GetRegName(rd) + ", " + NumberToHex(imm);
+        out << "C.SRLI " << Reg(rd) << ", " << Hex(imm);
       } else if (bitcrop(ir, 2, 10) == 0b10) {
-        cmd = "C.ANDI " + GetRegName(rd) + ", " +
-              NumberToHex(SignExtend(imm, 6));
+        out << "C.ANDI " << Reg(rd) << ", " << Hex(SignExtend(imm, 6));
       }
       break;
     case 0b10101:
-      cmd = "C.J " + NumberToHex(SignExtend(imm, 12));
+      out << "C.J " << Hex(SignExtend(imm, 12));
       break;
     case 0b11000:
-      cmd = "C.SW " + GetRegName(rs2) + ", " + NumberToHex(imm) + "(" +
-            GetRegName(rs1) + ")";
+      out << "C.SW " << Reg(rs2) << ", " << Hex(imm) << "(" << Reg(rs1) << ")";
+      break;
     case 0b11001:
-      cmd = "C.BEQZ " + GetRegName(rs1) + ", " +
-            NumberToHex(SignExtend(imm, 9));
+      out << "C.BEQZ " << Reg(rs1) << ", " << Hex(SignExtend(imm, 9));
       break;
     case 0b11010:
-      cmd = "C.SWSP " + GetRegName(rs2) + ", " + NumberToHex(imm) + "(SP)";
+      out << "C.SWSP " << Reg(rs2) << ", " << Hex(imm) << "(SP)";
       break;
     case 0b11100:
-      cmd = "C.SD " + GetRegName(rs2) + ", " + NumberToHex(imm) + "(" +
-            GetRegName(rs1) + ")";
+      out << "C.SD " << Reg(rs2) << ", " << Hex(imm) << "(" << Reg(rs1) << ")";
       break;
     case 0b11101:
-      cmd = "C.BNEZ " + GetRegName(rs1) + ", " +
-            NumberToHex(SignExtend(imm, 9));
+      out << "C.BNEZ " << Reg(rs1) << ", " << Hex(SignExtend(imm, 9));
       break;
     case 0b11110:
-      cmd = "C.SDSP " + GetRegName(rs2) + ", " + NumberToHex(imm) + "(SP)";
+      out << "C.SDSP " << Reg(rs2) << ", " << Hex(imm) << "(SP)";
+  }
+  // Only a mnemonic, or nothing matched.
+  if (out.IsEmpty()) {
+    out << name;
   }
-  return cmd;
 }
 
-std::string Disassemble(uint32_t ir, int mxl) {
+void Disassemble32(uint32_t ir, TextWriter *writer) {
+  TextWriter &out = *writer;
   uint16_t opcode = bitcrop(ir, 7, 0);
-  if ((opcode & 0b11) != 0b11) {
-    return Disassemble16(ir, mxl);
-  }
   uint8_t funct3 = bitcrop(ir, 3, 12);
   uint8_t funct7 = bitcrop(ir, 7, 25);
   uint8_t funct5 = funct7 >> 2;
@@ -157,256 +205,290 @@ std::string Disassemble(uint32_t ir, int mxl) {
   int32_t imm21 = GetImm21(ir);
   int16_t imm12_stype = GetStypeImm12(ir);
   int32_t imm20 = GetImm20(ir);
-  std::string cmd = "UNDEF";
+  const char *name = "UNDEF";
   switch (opcode) {
     case OPCODE_ARITHLOG:  // ADD, SUB
       if (funct7 == FUNC_NORM || funct7 == FUNC_ALT) {
         if (funct3 == FUNC3_ADDSUB) {
-          cmd = (funct7 == FUNC_NORM) ? "ADD" : "SUB";
+          name = (funct7 == FUNC_NORM) ? "ADD" : "SUB";
         } else if (funct3 == FUNC3_AND) {
-          cmd = "AND";
+          name = "AND";
         } else if (funct3 == FUNC3_OR) {
-          cmd = "OR";
+          name = "OR";
         } else if (funct3 == FUNC3_XOR) {
-          cmd = "XOR";
+          name = "XOR";
         } else if (funct3 == FUNC3_SR) {
           if (funct7 == FUNC_NORM) {
-            cmd = "SRL";
+            name = "SRL";
           } else if (funct7 == FUNC_ALT) {
-            cmd = "SRA";
+            name = "SRA";
           }
         } else if (funct3 == FUNC3_SL) {
-          cmd = "SLL";
+          name = "SLL";
         } else if (funct3 == FUNC3_SLT) {
-          cmd = "SLT";
+          name = "SLT";
         } else if (funct3 == FUNC3_SLTU) {
-          cmd = "SLTU";
+          name = "SLTU";
         }
       } else if (funct7 == FUNC_MULT) {
         if (funct3 == FUNC3_MUL) {
-          cmd = "MUL";
+          name = "MUL";
         } else if (funct3 == FUNC3_MULH) {
-          cmd = "MULH";
+          name = "MULH";
         } else if (funct3 == FUNC3_MULHSU) {
-          cmd = "MULHSU";
+          name = "MULHSU";
         } else if (funct3 == FUNC3_MULHU) {
-          cmd = "MULHU";
+          name = "MULHU";
         } else if (funct3 == FUNC3_DIV) {
-          cmd = "DIV";
+          name = "DIV";
         } else if (funct3 == FUNC3_DIVU) {
-          cmd = "DIVU";
+          name = "DIVU";
         } else if (funct3 == FUNC3_REM) {
-          cmd = "REM";
+          name = "REM";
         } else if (funct3 == FUNC3_REMU) {
-          cmd = "REMU";
+          name = "REMU";
         }
-        cmd += " " + GetRegName(rd) + ", " + GetRegName(rs1) + ", " +
-               GetRegName(rs2);
+        out << name << " " << Reg(rd) << ", " << Reg(rs1) << ", " << Reg(rs2);
         break;
         case OPCODE_ARITHLOG_64:
           if (funct7 == FUNC_NORM || funct7 == FUNC_ALT) {
             if (funct3 == FUNC3_ADDSUB) {
-              cmd = (funct7 == FUNC_NORM) ? "ADDW" : "SUBW";
+              name = (funct7 == FUNC_NORM) ? "ADDW" : "SUBW";
             } else if (funct3 == FUNC3_SL) {
-              cmd = "SLLW";
+              name = "SLLW";
             } else if (funct3 == FUNC3_SR) {
               if (funct7 == FUNC_NORM) {
-                cmd = "SRLW";
+                name = "SRLW";
               } else if (funct7 == FUNC_ALT) {
-                cmd = "SRAW";
+                name = "SRAW";
               }
             }
           } else if (funct7 == FUNC_MULT) {
             if (funct3 == FUNC3_MUL) {
-              cmd = "MULW";
+              name = "MULW";
             } else if (funct3 == FUNC3_DIVU) {
-              cmd = "DIVUW";
+              name = "DIVUW";
             } else if (funct3 == FUNC3_DIV) {
-              cmd = "DIVW";
+              name = "DIVW";
             } else if (funct3 == FUNC3_REMU) {
-              cmd = "REMUW";
+              name = "REMUW";
             } else if (funct3 == FUNC3_REM) {
-              cmd = "REMW";
+              name = "REMW";
             }
           }
       }
-      cmd += " " + GetRegName(rd) + ", " + GetRegName(rs1) + ", " +
-             GetRegName(rs2);
+      out << name << " " << Reg(rd) << ", " << Reg(rs1) << ", " << Reg(rs2);
       break;
     case OPCODE_ARITHLOG_I:  // ADDI, SUBI
       if (funct3 == FUNC3_ADDSUB) {
-        cmd = "ADDI";
+        name = "ADDI";
       } else if (funct3 == FUNC3_AND) {
-        cmd = "ANDI";
+        name = "ANDI";
       } else if (funct3 == FUNC3_OR) {
-        cmd = "ORI";
+        name = "ORI";
       } else if (funct3 == FUNC3_XOR) {
-        cmd = "XORI";
+        name = "XORI";
       } else if (funct3 == FUNC3_SL) {
-        cmd = "SLLI";
+        name = "SLLI";
       } else if (funct3 == FUNC3_SR) {
         if ((funct7 >> 1) == 0b000000) {
-          cmd = "SRLI";
+          name = "SRLI";
         } else if ((funct7 >> 1) == 0b010000) {
-          cmd = "SRAI";
+          name = "SRAI";
         }
         // If top 6 bits do not match, it's an error.
       } else if (funct3 == FUNC3_SLT) {
-        cmd = "SLTI";
+        name = "SLTI";
       } else if (funct3 == FUNC3_SLTU) {
-        cmd = "SLTIU";
+        name = "SLTIU";
       }
-      cmd += " " + GetRegName(rd) + ", " + GetRegName(rs1) + ", " +
-             NumberToHex(imm12);
+      out << name << " " << Reg(rd) << ", " << Reg(rs1) << ", " << Hex(imm12);
       break;
     case OPCODE_ARITHLOG_I64:
       if (funct3 == FUNC3_ADDSUB) {
-        cmd = "ADDIW";
+        name = "ADDIW";
       } else if (funct3 == FUNC3_SL) {
-        cmd = "SLLIW";
+        name = "SLLIW";
       } else if (funct3 == FUNC3_SR) {
         if ((funct7 >> 1) == 0b000000) {
-          cmd = "SRLIW";
+          name = "SRLIW";
         } else if ((funct7 >> 1) == 0b010000) {
-          cmd = "SRAIW";
+          name = "SRAIW";
         }
       }
-      cmd += " " + GetRegName(rd) + ", " + GetRegName(rs1) + ", " +
-             NumberToHex(imm12);
+      out << name << " " << Reg(rd) << ", " << Reg(rs1) << ", " << Hex(imm12);
       break;
     case OPCODE_B:  // beq, bltu, bge, bne
       if (funct3 == FUNC3_BEQ) {
-        cmd = "BEQ";
+        name = "BEQ";
       } else if (funct3 == FUNC3_BLT) {
-        cmd = "BLT";
+        name = "BLT";
       } else if (funct3 == FUNC3_BLTU) {
-        cmd = "BLTU";
+        name = "BLTU";
       } else if (funct3 == FUNC3_BGE) {
-        cmd = "BGE";
+        name = "BGE";
       } else if (funct3 == FUNC3_BGEU) {
-        cmd = "BGEU";
+        name = "BGEU";
       } else if (funct3 == FUNC3_BNE) {
-        cmd = "BNE";
+        name = "BNE";
       }
-      cmd += " " + GetRegName(rs1) + ", " + GetRegName(rs2) + ", " +
-             NumberToHex(imm13);
+      out << name << " " << Reg(rs1) << ", " << Reg(rs2) << ", " << Hex(imm13);
       break;
     case OPCODE_J:  // jal
-      cmd = "JAL " + GetRegName(rd) + ", " + NumberToHex(imm21);
+      out << "JAL " << Reg(rd) << ", " << Hex(imm21);
       break;
     case OPCODE_JALR:  // jalr
       if (funct3 == FUNC3_JALR) {
-        cmd = "JALR " + GetRegName(rd) + ", " + NumberToHex(imm12) + "(" +
-              GetRegName(rs1) + ")";
+        out << "JALR " << Reg(rd) << ", " << Hex(imm12) << "(" << Reg(rs1)
+            << ")";
       }
       break;
     case OPCODE_LD:  // LW
       if (funct3 == FUNC3_LSB) {
-        cmd = "LB";
+        name = "LB";
       } else if (funct3 == FUNC3_LSBU) {
-        cmd = "LBU";
+        name = "LBU";
       } else if (funct3 == FUNC3_LSH) {
-        cmd = "LH";
+        name = "LH";
       } else if (funct3 == FUNC3_LSHU) {
-        cmd = "LHU";
+        name = "LHU";
       } else if (funct3 == FUNC3_LSW) {
-        cmd = "LW";
+        name = "LW";
       } else if (funct3 == FUNC3_LSWU) {
-        cmd = "LWU";
+        name = "LWU";
       } else if (funct3 == FUNC3_LSD) {
-        cmd = "LD";
+        name = "LD";
       }
-      cmd += " " + GetRegName(rd) + ", " + NumberToHex(imm12) + "(" +
-             GetRegName(rs1) + ")";
+      out << name << " " << Reg(rd) << ", " << Hex(imm12) << "(" << Reg(rs1)
+          << ")";
       break;
     case OPCODE_S:  // SW
       if (funct3 == FUNC3_LSB) {
-        cmd = "SB";
+        name = "SB";
       } else if (funct3 == FUNC3_LSH) {
-        cmd = "SH";
+        name = "SH";
       } else if (funct3 == FUNC3_LSW) {
-        cmd = "SW";
+        name = "SW";
       } else if (funct3 == FUNC3_LSD) {
-        cmd = "SD";
+        name = "SD";
       }
-      cmd += " " + GetRegName(rs2) + ", " + NumberToHex(imm12_stype) + "(" +
-             GetRegName(rs1) + ")";
+      out << name << " " << Reg(rs2) << ", " << Hex(imm12_stype) << "("
+          << Reg(rs1) << ")";
       break;
     case OPCODE_LUI:  // LUI
-      cmd = "LUI";
-      cmd += " " + GetRegName(rd) + ", " + NumberToHex(imm20) + " << 12";
+      name = "LUI";
+      out << name << " " << Reg(rd) << ", " << Hex(imm20) << " << 12";
       break;
     case OPCODE_AUIPC:  // AUIPC
-      cmd = "AUIPC";
-      cmd += " " + GetRegName(rd) + ", " + NumberToHex(imm20) + " << 12";
+      name = "AUIPC";
+      out << name << " " << Reg(rd) << ", " << Hex(imm20) << " << 12";
       break;
     case OPCODE_SYSTEM:  // EBREAK
       if (funct3 == FUNC3_SYSTEM) {
         if (imm12 == 0) {
-          cmd = "ECALL";
+          name = "ECALL";
         } else if (imm12 == 1) {
-          cmd = "EBREAK";
+          name = "EBREAK";
         } else if (imm12 == 0b001100000010) {
-          cmd = "MRET";
+          name = "MRET";
         } else if (imm12 == 0b000100000010) {
-          cmd = "SRET";
+          name = "SRET";
         } else if (((imm12 >> 5) == 0b0001001) && (rd == 0b00000)) {
-          cmd = "sfence.vma";
+          name = "sfence.vma";
         } else {
-          cmd = "Undefined System Instruction";
+          name = "Undefined System Instruction";
         }
       } else {
         if (funct3 == FUNC3_CSRRC) {
-          cmd = "CSRRC";
+          name = "CSRRC";
         } else if (funct3 == FUNC3_CSRRCI) {
-          cmd = "CSRRCI";
+          name = "CSRRCI";
         } else if (funct3 == FUNC3_CSRRS) {
-          cmd = "CSRRS";
+          name = "CSRRS";
         } else if (funct3 == FUNC3_CSRRSI) {
-          cmd = "CSRRSI";
+          name = "CSRRSI";
         } else if (funct3 == FUNC3_CSRRW) {
-          cmd = "CSRRW";
+          name = "CSRRW";
         } else if (funct3 == FUNC3_CSRRWI) {
-          cmd = "CSRRWI";
+          name = "CSRRWI";
         }
-        cmd += " " + GetRegName(rd) + ", " + NumberToHex(csr) + ", " +
-               GetRegName(rs1);
+        out << name << " " << Reg(rd) << ", " << Hex(csr) << ", " << Reg(rs1);
       }
       break;
     case OPCODE_FENCE:
       if (funct3 == FUNC3_FENCEI) {
-        cmd = "FENCEI";
+        name = "FENCEI";
       } else if (funct3 == FUNC3_FENCE) {
-        cmd = "FENCE";
+        name = "FENCE";
       }
       break;
     case OPCODE_AMO:
       if (funct5 == FUNC5_AMOADD) {
-        cmd = funct3 == FUNC3_AMOD ? "AMOADD.D" : "AMOADD.W";
+        name = funct3 == FUNC3_AMOD ? "AMOADD.D" : "AMOADD.W";
       } else if (funct5 == FUNC5_AMOAND) {
-        cmd = funct3 == FUNC3_AMOD ? "AMOAND.D" : "AMOAND.W";
+        name = funct3 == FUNC3_AMOD ? "AMOAND.D" : "AMOAND.W";
       } else if (funct5 == FUNC5_AMOMAX) {
-        cmd = funct3 == FUNC3_AMOD ? "AMOMAX.D" : "AMOMAX.W";
+        name = funct3 == FUNC3_AMOD ? "AMOMAX.D" : "AMOMAX.W";
       } else if (funct5 == FUNC5_AMOMAXU) {
-        cmd = funct3 == FUNC3_AMOD ? "AMOMAXU.D" : "AMOMAXU.W";
+        name = funct3 == FUNC3_AMOD ? "AMOMAXU.D" : "AMOMAXU.W";
       } else if (funct5 == FUNC5_AMOMIN) {
-        cmd = funct3 == FUNC3_AMOD ? "AMOMIN.D" : "AMOMIN.W";
+        name = funct3 == FUNC3_AMOD ? "AMOMIN.D" : "AMOMIN.W";
       } else if (funct5 == FUNC5_AMOMINU) {
-        cmd = funct3 == FUNC3_AMOD ? "AMOMINU.D" : "AMOMAIN.W";
+        name = funct3 == FUNC3_AMOD ? "AMOMINU.D" : "AMOMAIN.W";
       } else if (funct5 == FUNC5_AMOOR) {
-        cmd = funct3 == FUNC3_AMOD ? "AMOOR.D" : "AMOOR.W";
+        name = funct3 == FUNC3_AMOD ? "AMOOR.D" : "AMOOR.W";
       } else if (funct5 == FUNC5_AMOXOR) {
-        cmd = funct3 == FUNC3_AMOD ? "AMOXOR.D" : "AMOXOR.W";
+        name = funct3 == FUNC3_AMOD ? "AMOXOR.D" : "AMOXOR.W";
       } else if (funct5 == FUNC5_AMOSWAP) {
-        cmd = funct3 == FUNC3_AMOD ? "AMOSWAP.D" : "AMOSWAP.W";
+        name = funct3 == FUNC3_AMOD ? "AMOSWAP.D" : "AMOSWAP.W";
       }
-      cmd += " " + GetRegName(rd) + ", " + GetRegName(rs2) + ", (" +
-             GetRegName(rs1) + ")";
+      out << name << " " << Reg(rd) << ", " << Reg(rs2) << ", (" << Reg(rs1)
+          << ")";
       break;
     default:
-      cmd = "Undefined instruction";
+      name = "Undefined instruction";
       break;
   }
-  return cmd;
+  if (out.IsEmpty()) {
+    out << name;
+  }
 }
+
+} // namespace anonymous
+
+std::string Disassemble(uint32_t ir, int mxl) {
+  char buffer[kMaxDisassemblySize];
+  const size_t length = Disassemble(ir, mxl, buffer, sizeof(buffer));
+  return std::string(buffer, length);
+}
+
+size_t Disassemble(uint32_t ir, int mxl, char *buffer, size_t size) {
+  TextWriter out(buffer, size);
+  if ((ir & 0b11) != 0b11) {
+    Disassemble16(ir, mxl, &out);
+  } else {
+    Disassemble32(ir, &out);
+  }
+  return out.Finish();
+}
+
+const char *DisassemblyCache::Get(uint32_t ir, int mxl, size_t *length) {
+  // A compressed instruction is only its lower 16 bits.
+  if ((ir & 0b11) != 0b11) {
+    ir &= 0xFFFF;
+  }
+  Entry &entry = entries_[(ir * 0x9E3779B1u) >> 20];
+  static_assert(kEntries == 1 << 12, "The index is the top 12 bits.");
+  if (entry.mxl != mxl || entry.ir != ir) {
+    entry.length = static_cast<uint8_t>(
+        Disassemble(ir, mxl, entry.text, sizeof(entry.text)));
+    entry.ir = ir;
+    entry.mxl = static_cast<int8_t>(mxl);
+  }
+  if (length) {
+    *length = entry.length;
+  }
+  return entry.text;
+}
+
 }  // namespace RISCV_EMULATOR
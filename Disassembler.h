@@ -5,13 +5,48 @@
 #ifndef ASSEMBLER_TEST_DISASSEMBLER_H
 #define ASSEMBLER_TEST_DISASSEMBLER_H
 
-#include "RISCV_cpu.h"
+#include <cstddef>
+#include <cstdint>
 #include <string>
+#include <vector>
 
 namespace RISCV_EMULATOR {
 
+// A buffer of this size holds any disassembly and its null terminator.
+constexpr size_t kMaxDisassemblySize = 64;
+
 std::string Disassemble(uint32_t ir, int mxl = 1);
 
+// Writes the disassembly of |ir| into |buffer| of |size| bytes without
+// allocating memory. The text is null terminated, and cut if it doesn't fit.
+// Returns its length.
+size_t Disassemble(uint32_t ir, int mxl, char *buffer, size_t size);
+
+// The disassembly of the instruction words seen last, for the output of
+// every executed instruction. Direct mapped: a word replaces the one at its
+// slot.
+class DisassemblyCache {
+ public:
+  static constexpr size_t kEntries = 4096;
+
+  DisassemblyCache() : entries_(kEntries) {}
+
+  // Returns the disassembly of |ir|, and its length in |length| if not null.
+  // The text stays valid until the next call.
+  const char *Get(uint32_t ir, int mxl, size_t *length = nullptr);
+
+ private:
+  struct Entry {
+    uint32_t ir = 0;
+    // 0 for an empty entry.
+    int8_t mxl = 0;
+    uint8_t length = 0;
+    char text[kMaxDisassemblySize];
+  };
+
+  std::vector<Entry> entries_;
+};
+
 }
 
 #endif //ASSEMBLER_TEST_DISASSEMBLER_H
@@ -0,0 +1,129 @@
+//
+// Flight recorder of the recent execution.
+//
+
+#include "FlightRecorder.h"
+#include <cstring>
+#include "RISCV_cpu.h"
+#include "Trace.h"
+
+#ifdef _WIN32
+#include <io.h>
+#define CIO_write _write
+#else
+#include <unistd.h>
+#define CIO_write write
+#endif
+
+namespace RISCV_EMULATOR {
+
+namespace {
+
+void WriteAll(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    const auto written = CIO_write(fd, data, size);
+    if (written <= 0) {
+      return;
+    }
+    data += written;
+    size -= written;
+  }
+}
+
+// The writers below stand in for snprintf, which isn't async-signal-safe.
+// Each returns the end of what it wrote.
+char *PutString(char *p, const char *text) {
+  const size_t length = std::strlen(text);
+  std::memcpy(p, text, length);
+  return p + length;
+}
+
+// Right aligned in |width| characters, or wider if it doesn't fit.
+char *PutDecimal(char *p, uint64_t value, int width) {
+  char digits[20];
+  int length = 0;
+  do {
+    digits[length++] = static_cast<char>('0' + value % 10);
+    value /= 10;
+  } while (value != 0);
+  for (int i = length; i < width; ++i) {
+    *p++ = ' ';
+  }
+  while (length > 0) {
+    *p++ = digits[--length];
+  }
+  return p;
+}
+
+char *PutHex(char *p, uint64_t value, int digits) {
+  for (int i = digits - 1; i >= 0; --i) {
+    p[i] = "0123456789abcdef"[value & 0xF];
+    value >>= 4;
+  }
+  return p + digits;
+}
+
+char GetPrivilegeName(PrivilegeMode privilege) {
+  return privilege == PrivilegeMode::USER_MODE ? 'U' : privilege == PrivilegeMode::SUPERVISOR_MODE ? 'S' : 'M';
+}
+
+} // namespace anonymous
+
+void FlightRecorder::Dump(int fd, int mxl, uint64_t instruction_count) const {
+  char line[64 + kInstructionLineSize];
+  const size_t count = size_ < kRecords ? size_ : kRecords;
+  char *p = PutString(line, "Flight recorder, the last ");
+  p = PutDecimal(p, count, 0);
+  p = PutString(p, " blocks and traps, oldest first:\n");
+  WriteAll(fd, line, p - line);
+  // A block ends where the next one starts.
+  uint64_t block_sizes[kRecords];
+  uint64_t end = instruction_count;
+  for (size_t i = count; i > 0; --i) {
+    const Record &record = records_[(size_ - count + i - 1) & (kRecords - 1)];
+    if (record.type == kBlock) {
+      block_sizes[i - 1] = end - record.instruction_count;
+      end = record.instruction_count;
+    }
+  }
+  for (size_t i = 0; i < count; ++i) {
+    const Record &record = records_[(size_ - count + i) & (kRecords - 1)];
+    // A loop is shown once.
+    size_t repeats = 0;
+    while (record.type == kBlock && i + 1 < count) {
+      const Record &next = records_[(size_ - count + i + 1) & (kRecords - 1)];
+      if (next.type != kBlock || next.pc != record.pc || next.ir != record.ir ||
+          next.privilege != record.privilege || block_sizes[i + 1] != block_sizes[i]) {
+        break;
+      }
+      ++repeats;
+      ++i;
+    }
+    if (record.type == kBlock) {
+      p = PutDecimal(line, block_sizes[i], 12);
+    } else {
+      p = PutString(line, record.type == kInterrupt ? "interrupt " : "exception ");
+      p = PutDecimal(p, record.cause, 2);
+    }
+    p = PutString(p, "  ");
+    // An interrupt or a fetch fault has no instruction.
+    if (record.type == kInterrupt ||
+        (record.type == kException &&
+         (record.cause == INSTRUCTION_PAGE_FAULT || record.cause == INSTRUCTION_ACCESS_FAULT))) {
+      *p++ = GetPrivilegeName(record.privilege);
+      *p++ = ' ';
+      p = PutHex(p, record.pc, 16);
+      *p++ = '\n';
+    } else {
+      p += FormatInstructionLine(record.privilege, record.pc, record.ir, mxl, nullptr, p);
+    }
+    if (repeats > 0) {
+      p = PutString(p, "              (");
+      p = PutDecimal(p, repeats, 0);
+      p = PutString(p, " more times)\n");
+    }
+    WriteAll(fd, line, p - line);
+  }
+}
+
+}  // namespace RISCV_EMULATOR
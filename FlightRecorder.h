@@ -0,0 +1,85 @@
+//
+// Flight recorder of the recent execution, always on. A ring of the last
+// blocks and traps: where each block started, its first instruction and the
+// privilege mode, and the cause of each trap. The CPU writes a record only
+// when the pc jumps, and the instructions in between are counted by the
+// instruction count. The emulator dumps it, disassembled, when a run fails
+// or on a fatal signal.
+//
+
+#ifndef ASSEMBLER_TEST_FLIGHTRECORDER_H
+#define ASSEMBLER_TEST_FLIGHTRECORDER_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include "riscv_cpu_common.h"
+
+namespace RISCV_EMULATOR {
+
+class FlightRecorder {
+ public:
+  // The records kept. A power of two.
+  static constexpr size_t kRecords = 256;
+
+  // Called for every instruction before it executes, with the instruction
+  // count before it.
+  void Instruction(uint64_t pc, uint32_t ir, PrivilegeMode privilege, bool compressed, uint64_t instruction_count) {
+    if (pc != next_pc_) {
+      Add(pc, ir, privilege, kBlock, 0, instruction_count);
+    }
+    next_pc_ = pc + (compressed ? 2 : 4);
+  }
+
+  // Called when the instruction at |pc| traps, or an interrupt is taken
+  // before it. |ir| is shown for an exception that isn't a fetch fault.
+  void Trap(uint64_t pc, uint32_t ir, PrivilegeMode privilege, int cause, bool interrupt,
+            uint64_t instruction_count) {
+    Add(pc, ir, privilege, interrupt ? kInterrupt : kException, static_cast<uint8_t>(cause), instruction_count);
+    // The handler starts a block.
+    next_pc_ = kNoPc;
+  }
+
+  // Writes the records to the file descriptor |fd|, oldest first. The last
+  // block ends at |instruction_count|. Neither allocates memory nor calls
+  // anything that isn't async-signal-safe, so that a signal handler can
+  // call it.
+  void Dump(int fd, int mxl, uint64_t instruction_count) const;
+
+  void Clear() {
+    size_ = 0;
+    next_pc_ = kNoPc;
+  }
+
+ private:
+  enum Type : uint8_t { kBlock, kException, kInterrupt };
+
+  struct Record {
+    uint64_t pc;
+    // The instruction count at the start of the block, or at the trap.
+    uint64_t instruction_count;
+    uint32_t ir;
+    PrivilegeMode privilege;
+    Type type;
+    uint8_t cause;
+  };
+
+  void Add(uint64_t pc, uint32_t ir, PrivilegeMode privilege, Type type, uint8_t cause,
+           uint64_t instruction_count) {
+    records_[size_ & (kRecords - 1)] = {pc, instruction_count, ir, privilege, type, cause};
+    ++size_;
+  }
+
+  static_assert((kRecords & (kRecords - 1)) == 0, "kRecords is not a power of two.");
+  // Never a pc, which is always even.
+  static constexpr uint64_t kNoPc = 1;
+
+  std::array<Record, kRecords> records_;
+  // The records ever added. The last kRecords are in records_.
+  uint64_t size_ = 0;
+  uint64_t next_pc_ = kNoPc;
+};
+
+}  // namespace RISCV_EMULATOR
+
+#endif  // ASSEMBLER_TEST_FLIGHTRECORDER_H
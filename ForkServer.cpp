@@ -0,0 +1,173 @@
+//
+// Fork server for fuzzing with AFL.
+//
+// The protocol is the one of the AFL instrumentation runtime. The server
+// says hello on the status pipe, then for every input afl-fuzz asks on the
+// control pipe, and the server answers with the pid of the child that runs
+// it and the wait status of the child afterwards. A child runs inputs in a
+// loop and stops itself after each, like the persistent mode of AFL, so a
+// new child is only forked after a crash or a timeout.
+//
+
+#include "ForkServer.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#ifndef _WIN32
+#include <csignal>
+#include <sys/shm.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+#include "RISCV_cpu.h"
+#include "Snapshot.h"
+
+namespace RISCV_EMULATOR {
+
+namespace {
+
+constexpr int kControlFd = 198;
+constexpr int kStatusFd = kControlFd + 1;
+// Options in the hello of AFL++. The shared memory input starts with the
+// size as a uint32_t.
+constexpr uint32_t kOptionsEnabled = 0x80000001;
+constexpr uint32_t kOptionSharedInput = 0x01000000;
+constexpr size_t kMaxSharedInput = 1 << 20;
+
+} // namespace anonymous
+
+ForkServer::ForkServer(RiscvCpu *cpu, std::shared_ptr<MemoryWrapper> memory, uint64_t buffer, size_t buffer_size)
+    : cpu_(cpu), buffer_(buffer), buffer_size_(buffer_size), input_buffer_(buffer_size) {
+  entry_pc_ = cpu_->GetNextPc();
+  return_pc_ = cpu_->ReadRegister(RA);
+  SnapshotWriter writer;
+  cpu_->SaveState(writer);
+  state_ = writer.GetData();
+  // The memory at the entry becomes the base, and the dirty pages of the
+  // overlay are all that a run changed.
+  memory_ = std::make_shared<MemoryWrapper>(std::shared_ptr<const MemoryWrapper>(memory));
+  memory_->EnableHugePages(memory->IsHugePagesEnabled());
+  memory_->EnableDirtyTracking(true);
+  cpu_->SetMemory(memory_);
+}
+
+void ForkServer::Reset() {
+  reset_pages_ = memory_->RevertDirtyPages();
+  SnapshotReader reader(state_.data(), state_.size());
+  cpu_->RestoreState(reader);
+}
+
+bool ForkServer::RunInput(const uint8_t *data, size_t size) {
+  Reset();
+  size = std::min(size, buffer_size_);
+  memory_->WriteBlock(buffer_, data, size);
+  cpu_->ResetCoverageLocation();
+  cpu_->SetRegister(A0, buffer_);
+  cpu_->SetRegister(A1, size);
+  cpu_->SetStopPc(return_pc_);
+  return cpu_->RunCpu(entry_pc_, false) != 0;
+}
+
+void ForkServer::ReadInput() {
+  if (shared_input_) {
+    uint32_t size;
+    std::memcpy(&size, shared_input_, sizeof(size));
+    input_ = shared_input_ + sizeof(size);
+    input_size_ = std::min<size_t>(size, kMaxSharedInput);
+    return;
+  }
+  // afl-fuzz writes every input to the same file behind stdin.
+  std::fseek(stdin, 0, SEEK_SET);
+  std::clearerr(stdin);
+  input_ = input_buffer_.data();
+  input_size_ = std::fread(input_buffer_.data(), 1, input_buffer_.size(), stdin);
+}
+
+int ForkServer::Serve() {
+#ifndef _WIN32
+  if (StartAfl()) {
+    ServeAfl();
+    return 0;
+  }
+#endif
+  ReadInput();
+  return RunInput(input_, input_size_) ? 1 : 0;
+}
+
+#ifndef _WIN32
+bool ForkServer::StartAfl() {
+  // afl-fuzz clears the coverage map before each run.
+  const char *coverage_id = std::getenv("__AFL_SHM_ID");
+  if (coverage_id) {
+    void *coverage_map = shmat(std::atoi(coverage_id), nullptr, 0);
+    if (coverage_map != reinterpret_cast<void *>(-1)) {
+      cpu_->SetCoverageMap(static_cast<uint8_t *>(coverage_map), RiscvCpu::kCoverageMapSize);
+    }
+  }
+  const char *shared_memory_id = std::getenv("__AFL_SHM_FUZZ_ID");
+  if (shared_memory_id) {
+    void *shared_memory = shmat(std::atoi(shared_memory_id), nullptr, SHM_RDONLY);
+    if (shared_memory != reinterpret_cast<void *>(-1)) {
+      shared_input_ = static_cast<const uint8_t *>(shared_memory);
+    }
+  }
+  uint32_t hello = shared_input_ ? kOptionsEnabled | kOptionSharedInput : 0;
+  return write(kStatusFd, &hello, sizeof(hello)) == sizeof(hello);
+}
+
+void ForkServer::ServeAfl() {
+  pid_t child = -1;
+  bool child_stopped = false;
+  while (true) {
+    uint32_t was_killed;
+    if (read(kControlFd, &was_killed, sizeof(was_killed)) != sizeof(was_killed)) {
+      break;
+    }
+    int status;
+    // afl-fuzz killed the stopped child on a timeout.
+    if (child_stopped && was_killed) {
+      child_stopped = false;
+      waitpid(child, &status, 0);
+    }
+    if (child_stopped) {
+      kill(child, SIGCONT);
+      child_stopped = false;
+    } else {
+      child = fork();
+      if (child < 0) {
+        break;
+      }
+      if (child == 0) {
+        RunChild();
+      }
+    }
+    int32_t pid = child;
+    if (write(kStatusFd, &pid, sizeof(pid)) != sizeof(pid) || waitpid(child, &status, WUNTRACED) < 0) {
+      break;
+    }
+    child_stopped = WIFSTOPPED(status);
+    if (write(kStatusFd, &status, sizeof(status)) != sizeof(status)) {
+      break;
+    }
+  }
+  if (child_stopped) {
+    kill(child, SIGKILL);
+    waitpid(child, nullptr, 0);
+  }
+}
+
+void ForkServer::RunChild() {
+  close(kControlFd);
+  close(kStatusFd);
+  while (true) {
+    ReadInput();
+    if (RunInput(input_, input_size_)) {
+      std::abort();
+    }
+    raise(SIGSTOP);
+  }
+}
+#endif
+
+}  // namespace RISCV_EMULATOR
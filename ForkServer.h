@@ -0,0 +1,78 @@
+//
+// Fork server for fuzzing with AFL. The machine is prepared once and frozen
+// at the entry of the function under test. Every input runs from there, and
+// afterwards only the CPU state and the pages the run wrote are reset.
+//
+
+#ifndef ASSEMBLER_TEST_FORKSERVER_H
+#define ASSEMBLER_TEST_FORKSERVER_H
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "memory_wrapper.h"
+
+namespace RISCV_EMULATOR {
+
+class RiscvCpu;
+
+class ForkServer {
+ public:
+  // |cpu| must be stopped at the entry of the function under test, running
+  // on |memory|. From then on the CPU runs on a copy-on-write overlay of
+  // |memory|, which must not be written any more. Each input is copied to
+  // |buffer|, a physical address with room for |buffer_size| bytes, and the
+  // function is called with a0 = |buffer| and a1 = the input size.
+  ForkServer(RiscvCpu *cpu, std::shared_ptr<MemoryWrapper> memory, uint64_t buffer, size_t buffer_size);
+
+  // Runs |data| from the entry until the function returns to its caller or
+  // the program ends. Input beyond the buffer size is dropped. Returns true
+  // on an emulation error, which is reported to AFL as a crash.
+  bool RunInput(const uint8_t *data, size_t size);
+
+  // The number of pages reset before the last input.
+  size_t GetResetPages() const { return reset_pages_; }
+
+  // Serves afl-fuzz through the fork server pipes until it goes away, and
+  // returns 0. Inputs come from the shared memory of AFL++ when it offers
+  // one, otherwise from stdin. The edge coverage goes to the map of AFL.
+  // Without afl-fuzz, runs the input from stdin once and returns the error of
+  // the run.
+  int Serve();
+
+ private:
+  void Reset();
+
+  // Reads the next input into input_, or points it to the shared memory.
+  void ReadInput();
+
+#ifndef _WIN32
+  // Sends the hello of the fork server. Returns false without afl-fuzz.
+  bool StartAfl();
+
+  void ServeAfl();
+
+  // Runs inputs in a child process and stops after each, the persistent mode
+  // of AFL. Never returns.
+  void RunChild();
+#endif
+
+  RiscvCpu *cpu_;
+  std::shared_ptr<MemoryWrapper> memory_;
+  uint64_t buffer_;
+  size_t buffer_size_;
+  uint64_t entry_pc_;
+  uint64_t return_pc_;
+  // RiscvCpu::SaveState() at the entry.
+  std::vector<uint8_t> state_;
+  size_t reset_pages_ = 0;
+  // The input read from stdin, or the input in the AFL++ shared memory.
+  std::vector<uint8_t> input_buffer_;
+  const uint8_t *input_ = nullptr;
+  size_t input_size_ = 0;
+  const uint8_t *shared_input_ = nullptr;
+};
+
+}  // namespace RISCV_EMULATOR
+
+#endif  // ASSEMBLER_TEST_FORKSERVER_H
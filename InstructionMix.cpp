@@ -0,0 +1,131 @@
+//
+// Instruction mix of the guest.
+//
+
+#include "InstructionMix.h"
+#include <algorithm>
+#include <cstdio>
+#include "RISCV_cpu.h"
+
+namespace RISCV_EMULATOR {
+
+namespace {
+
+// In the order of the instruction enum.
+const char *const kNames[] = {
+    "error", "add", "addw", "and", "sub", "subw", "or", "xor", "sll", "sllw", "srl", "srlw", "sra", "sraw", "slt",
+    "sltu", "addi", "addiw", "andi", "ori", "xori", "slli", "slliw", "srli", "srliw", "srai", "sraiw", "slti",
+    "sltiu", "beq", "bge", "bgeu", "blt", "bltu", "bne", "jal", "jalr", "lb", "lbu", "lh", "lhu", "lw", "lwu", "ld",
+    "sb", "sh", "sw", "sd", "lui", "auipc", "system", "csrrc", "csrrci", "csrrs", "csrrsi", "csrrw", "csrrwi",
+    "fence", "fence.i", "mul", "mulh", "mulhsu", "mulhu", "mulw", "div", "divu", "divuw", "divw", "rem", "remu",
+    "remuw", "remw", "amoadd.d", "amoadd.w", "amoand.d", "amoand.w", "amomax.d", "amomax.w", "amomaxu.d",
+    "amomaxu.w", "amomin.d", "amomin.w", "amominu.d", "amominu.w", "amoor.d", "amoor.w", "amoxor.d", "amoxor.w",
+    "amoswap.d", "amoswap.w",
+};
+
+constexpr int kNameCount = sizeof(kNames) / sizeof(kNames[0]);
+static_assert(kNameCount == INST_AMOSWAPW + 1, "An instruction has no name.");
+static_assert(kNameCount <= InstructionMix::kInstructions, "The instructions don't fit in the counts.");
+
+} // namespace anonymous
+
+void InstructionMix::StartBlock(uint64_t pc, PrivilegeMode privilege) {
+  EndRun();
+  Block *block;
+  if (block_ && privilege == privilege_ && block_->successor_pc == pc) {
+    block = block_->successor;
+  } else {
+    block = &blocks_[static_cast<int>(privilege)][pc];
+    if (block_ && privilege == privilege_) {
+      block_->successor_pc = pc;
+      block_->successor = block;
+    }
+  }
+  block_ = block;
+  privilege_ = privilege;
+}
+
+void InstructionMix::TruncateBlock() {
+  // The current run isn't in the ends, and it goes on in what is kept.
+  AddCounts(*block_, static_cast<int>(privilege_), 0, &retired_counts_);
+  block_->instructions.resize(length_);
+  block_->irs.resize(length_);
+  block_->ends.clear();
+}
+
+void InstructionMix::EndRun() {
+  if (length_ == 0) {
+    return;
+  }
+  if (block_->ends.size() < length_) {
+    block_->ends.resize(length_);
+  }
+  ++block_->ends[length_ - 1];
+  length_ = 0;
+}
+
+void InstructionMix::AddCounts(const Block &block, int privilege, size_t current_length, Counts *counts) {
+  // A run that ends at an instruction executed all the ones before it.
+  uint64_t runs = 0;
+  for (size_t i = block.instructions.size(); i > 0; --i) {
+    if (i <= block.ends.size()) {
+      runs += block.ends[i - 1];
+    }
+    const uint8_t code = block.instructions[i - 1];
+    (*counts)[privilege][(code & kCompressed) != 0][code & ~kCompressed] += runs + (i <= current_length ? 1 : 0);
+  }
+}
+
+InstructionMix::Counts InstructionMix::GetCounts() const {
+  Counts counts = retired_counts_;
+  for (int privilege = 0; privilege < static_cast<int>(blocks_.size()); ++privilege) {
+    for (const auto &block : blocks_[privilege]) {
+      AddCounts(block.second, privilege, &block.second == block_ ? length_ : 0, &counts);
+    }
+  }
+  return counts;
+}
+
+void InstructionMix::Report(std::ostream &out) const {
+  const Counts counts = GetCounts();
+  struct Row {
+    uint64_t total;
+    int compressed;
+    int instruction;
+  };
+  std::vector<Row> rows;
+  uint64_t total = 0;
+  for (int compressed = 0; compressed < 2; ++compressed) {
+    for (int instruction = 0; instruction < kNameCount; ++instruction) {
+      uint64_t row_total = 0;
+      for (const auto &privilege_counts : counts) {
+        row_total += privilege_counts[compressed][instruction];
+      }
+      if (row_total > 0) {
+        rows.push_back({row_total, compressed, instruction});
+        total += row_total;
+      }
+    }
+  }
+  std::sort(rows.begin(), rows.end(), [](const Row &a, const Row &b) { return a.total > b.total; });
+  out << "Instruction mix: " << total << " instructions." << std::endl;
+  if (total == 0) {
+    return;
+  }
+  char line[128];
+  std::snprintf(line, sizeof(line), "%-12s %7s %14s %14s %14s %14s", "instruction", "%", "total", "U", "S", "M");
+  out << line << std::endl;
+  for (const Row &row : rows) {
+    const std::string name = std::string(row.compressed ? "c." : "") + kNames[row.instruction];
+    auto count = [&](PrivilegeMode privilege) {
+      return static_cast<unsigned long long>(counts[static_cast<int>(privilege)][row.compressed][row.instruction]);
+    };
+    std::snprintf(line, sizeof(line), "%-12s %6.2f%% %14llu %14llu %14llu %14llu", name.c_str(),
+                  100.0 * row.total / total, static_cast<unsigned long long>(row.total),
+                  count(PrivilegeMode::USER_MODE), count(PrivilegeMode::SUPERVISOR_MODE),
+                  count(PrivilegeMode::MACHINE_MODE));
+    out << line << std::endl;
+  }
+}
+
+}  // namespace RISCV_EMULATOR
@@ -0,0 +1,104 @@
+//
+// Instruction mix of the guest. Counts how often each value of the
+// instruction enum executes, full width and compressed, per privilege mode.
+//
+// The counts are kept per basic block, as the number of runs of the block
+// that end at each of its instructions, next to the instructions of the
+// block. The run loop only checks whether an instruction follows the
+// previous one, and the counts are multiplied out for the report.
+//
+
+#ifndef ASSEMBLER_TEST_INSTRUCTIONMIX_H
+#define ASSEMBLER_TEST_INSTRUCTIONMIX_H
+
+#include <array>
+#include <cstdint>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+#include "riscv_cpu_common.h"
+
+namespace RISCV_EMULATOR {
+
+class InstructionMix {
+ public:
+  // Above the number of the values of the instruction enum.
+  static constexpr int kInstructions = 128;
+
+  // Indexed by the privilege mode, compressed or not, and the instruction.
+  using Counts = std::array<std::array<std::array<uint64_t, kInstructions>, 2>, 4>;
+
+  // Called for every instruction that executes, with its first 32 bits
+  // |ir|.
+  void Count(uint64_t pc, PrivilegeMode privilege, uint32_t ir, uint32_t instruction, bool compressed) {
+    if (pc != next_pc_ || privilege != privilege_) {
+      StartBlock(pc, privilege);
+    }
+    const uint32_t word = compressed ? ir & 0xFFFF : ir;
+    if (length_ < block_->irs.size() && block_->irs[length_] != word) {
+      TruncateBlock();
+    }
+    if (length_ == block_->instructions.size()) {
+      block_->instructions.push_back(static_cast<uint8_t>(instruction | (compressed ? kCompressed : 0)));
+      block_->irs.push_back(word);
+    }
+    ++length_;
+    next_pc_ = pc + (compressed ? 2 : 4);
+  }
+
+  Counts GetCounts() const;
+
+  uint64_t GetCount(PrivilegeMode privilege, bool compressed, uint32_t instruction) const {
+    return GetCounts()[static_cast<int>(privilege)][compressed][instruction];
+  }
+
+  // Writes the count of each instruction that executed, the most frequent
+  // first. Compressed ones are prefixed with "c.".
+  void Report(std::ostream &out) const;
+
+ private:
+  // Set in an instruction of a block if it is compressed.
+  static constexpr uint8_t kCompressed = 0x80;
+
+  struct Block {
+    std::vector<uint8_t> instructions;
+    // The instruction word at each position, 16 bits if compressed. Code of
+    // a block that changed, like another user program at the same address,
+    // cuts the block where it differs.
+    std::vector<uint32_t> irs;
+    // The number of the runs that ended at each instruction, but for the
+    // current run.
+    std::vector<uint64_t> ends;
+    // The block that followed it last time, to save the lookup in a loop.
+    uint64_t successor_pc = 1;
+    Block *successor = nullptr;
+  };
+
+  // Ends the current run and starts one of the block at |pc|.
+  void StartBlock(uint64_t pc, PrivilegeMode privilege);
+
+  // Moves the counts of the current block to retired_counts_, and drops its
+  // instructions from where the current run differs.
+  void TruncateBlock();
+
+  void EndRun();
+
+  // Adds the counts of |block| to |counts|, and the current run if
+  // |current_length| is not 0.
+  static void AddCounts(const Block &block, int privilege, size_t current_length, Counts *counts);
+
+  // Never a pc, which is always even.
+  uint64_t next_pc_ = 1;
+  PrivilegeMode privilege_ = PrivilegeMode::MACHINE_MODE;
+  Block *block_ = nullptr;
+  // The instructions of the current run so far.
+  size_t length_ = 0;
+  // Indexed by the privilege mode, and keyed by the pc of the block.
+  std::array<std::unordered_map<uint64_t, Block>, 4> blocks_;
+  // The counts of blocks that were cut.
+  Counts retired_counts_{};
+};
+
+}  // namespace RISCV_EMULATOR
+
+#endif  // ASSEMBLER_TEST_INSTRUCTIONMIX_H
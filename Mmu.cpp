@@ -20,49 +20,228 @@ void Mmu::SetPrivilege(const PrivilegeMode privilege) {
 uint64_t Mmu::VirtualToPhysical(uint64_t virtual_address, uint64_t satp,
                                 bool write_access) {
   page_fault_ = false;
+  access_fault_ = false;
   faulting_address_ = 0;
   // privilege_ here must take MPRV into account.
-  if (privilege_ == PrivilegeMode::MACHINE_MODE) {
+  if (privilege_ == PrivilegeMode::MACHINE_MODE || !IsPagingEnabled(satp)) {
     return virtual_address;
   }
+  // Guests may switch page tables without sfence.vma, as the MMU had no cache
+  // before. Keep that working.
+  if (satp != tlb_satp_) {
+    FlushTlb();
+    tlb_satp_ = satp;
+  }
+  const uint64_t vpn = GetVpn(virtual_address, satp);
+  const uint16_t asid = GetAsid(satp);
+  const uint64_t offset = virtual_address & (kPageSize - 1);
+  const TlbEntry *cached = LookupTlb(vpn, asid);
+  // The first store to a clean page walks the table again to set D.
+  if (cached && (!write_access || (cached->flags & kTlbDirty))) {
+    ++statistics_.tlb_hits;
+    return cached->physical_page | offset;
+  }
+  ++statistics_.tlb_misses;
+  TlbEntry entry;
+  uint64_t physical_address;
   if (mxl_ == 1) {
-    return VirtualToPhysical32(virtual_address, satp, write_access);
+    physical_address = VirtualToPhysical32(virtual_address, satp, write_access, &entry);
   } else {
     // if (xlen == 64) {
-    return VirtualToPhysical64(virtual_address, satp, write_access);
+    physical_address = VirtualToPhysical64(virtual_address, satp, write_access, &entry);
+  }
+  if (!page_fault_ && !access_fault_) {
+    entry.vpn = vpn;
+    entry.asid = asid;
+    entry.physical_page = physical_address & ~static_cast<uint64_t>(kPageSize - 1);
+    InsertTlb(entry);
+  }
+  return physical_address;
+}
+
+// The page walk accesses memory as supervisor mode.
+bool Mmu::CheckPteAccess(uint64_t pte_address, int size, uint8_t access, uint64_t virtual_address) {
+  if (pmp_ && !pmp_->Check(pte_address, size, access, PrivilegeMode::SUPERVISOR_MODE)) {
+    access_fault_ = true;
+    faulting_address_ = virtual_address;
+    return false;
+  }
+  return true;
+}
+
+bool Mmu::IsPagingEnabled(uint64_t satp) const {
+  if (mxl_ == 1) {
+    return bitcrop(satp, 1, 31) != 0;
+  }
+  return bitcrop(satp, 4, 60) != 0;
+}
+
+uint16_t Mmu::GetAsid(uint64_t satp) const {
+  if (mxl_ == 1) {
+    return bitcrop(satp, 9, 22);
+  }
+  return bitcrop(satp, 16, 44);
+}
+
+uint64_t Mmu::GetVpn(uint64_t virtual_address, uint64_t satp) const {
+  // The page walk ignores the bits above the VPN, so does the TLB.
+  if (mxl_ == 1) {
+    return bitcrop(virtual_address, 20, 12);
+  }
+  switch (bitcrop(satp, 4, 60)) {
+    case kSv48:
+      return bitcrop(virtual_address, 36, 12);
+    case kSv57:
+      return bitcrop(virtual_address, 45, 12);
+    default:
+      return bitcrop(virtual_address, 27, 12);
+  }
+}
+
+const Mmu::TlbEntry *Mmu::LookupTlb(uint64_t vpn, uint16_t asid) const {
+  const TlbSet &set = tlb_[vpn & (kTlbSets - 1)];
+  for (const TlbEntry &entry : set.ways) {
+    if ((entry.flags & kTlbValid) && entry.vpn == vpn && (entry.asid == asid || (entry.flags & kTlbGlobal))) {
+      return &entry;
+    }
+  }
+  return nullptr;
+}
+
+void Mmu::InsertTlb(const TlbEntry &entry) {
+  TlbSet &set = tlb_[entry.vpn & (kTlbSets - 1)];
+  // Replace the stale entry of the same page, e.g. when D is set.
+  for (TlbEntry &way : set.ways) {
+    if ((way.flags & kTlbValid) && way.vpn == entry.vpn && way.asid == entry.asid) {
+      way = entry;
+      return;
+    }
+  }
+  set.ways[set.next_victim] = entry;
+  set.next_victim = (set.next_victim + 1) % kTlbWays;
+}
+
+const Mmu::WalkCacheEntry *Mmu::LookupWalkCache(int level, uint64_t tag) const {
+  const WalkCacheEntry &entry = walk_cache_[level - 1][tag & (kWalkCacheEntries - 1)];
+  return (entry.valid && entry.tag == tag) ? &entry : nullptr;
+}
+
+void Mmu::InsertWalkCache(int level, uint64_t tag, uint64_t ppn, bool global) {
+  WalkCacheEntry &entry = walk_cache_[level - 1][tag & (kWalkCacheEntries - 1)];
+  entry.tag = tag;
+  entry.ppn = ppn;
+  entry.valid = true;
+  entry.global = global;
+}
+
+void Mmu::FlushWalkCache() {
+  for (auto &level : walk_cache_) {
+    for (WalkCacheEntry &entry : level) {
+      entry.valid = false;
+    }
+  }
+}
+
+void Mmu::FlushTlb() {
+  for (TlbSet &set : tlb_) {
+    for (TlbEntry &entry : set.ways) {
+      entry.flags = 0;
+    }
+  }
+  FlushWalkCache();
+  ++statistics_.tlb_flushes;
+}
+
+void Mmu::FlushTlb(bool match_address, uint64_t virtual_address, bool match_asid, uint64_t asid) {
+  if (!match_address && !match_asid) {
+    FlushTlb();
+    return;
+  }
+  // Non-leaf PTEs are not tagged with the ASID, and a changed non-leaf PTE
+  // may affect any address below it. Drop them all.
+  FlushWalkCache();
+  const uint64_t vpn = GetVpn(virtual_address, tlb_satp_);
+  for (TlbSet &set : tlb_) {
+    for (TlbEntry &entry : set.ways) {
+      // A superpage is cached as several entries. Flush all of them.
+      if (match_address && ((entry.vpn ^ vpn) & entry.vpn_mask) != 0) {
+        continue;
+      }
+      if (match_asid && (entry.asid != asid || (entry.flags & kTlbGlobal))) {
+        continue;
+      }
+      entry.flags = 0;
+    }
   }
+  ++statistics_.tlb_flushes;
+}
+
+uint8_t Mmu::GetTlbFlags(uint64_t virtual_address) const {
+  const TlbEntry *entry = LookupTlb(GetVpn(virtual_address, tlb_satp_), GetAsid(tlb_satp_));
+  return entry ? entry->flags : 0;
 }
 
 uint64_t Mmu::VirtualToPhysical64(uint64_t virtual_address, uint64_t satp,
-                                  bool write_access) {
-  // TODO: Implement v48 MMU emulation.
+                                  bool write_access, TlbEntry *entry) {
+  uint8_t mode = bitcrop(satp, 4, 60);
+  switch (mode) {
+    case kSv39:
+      return WalkPageTable64<3>(virtual_address, satp, write_access, entry);
+    case kSv48:
+      return WalkPageTable64<4>(virtual_address, satp, write_access, entry);
+    case kSv57:
+      return WalkPageTable64<5>(virtual_address, satp, write_access, entry);
+    default:
+      std::cerr << "Unsupported virtual address translation mode (" << static_cast<int>(mode) << ")"
+                << std::endl;
+      page_fault_ = true;
+      faulting_address_ = virtual_address;
+      return virtual_address;
+  }
+}
+
+// The VPN bits above |level| - 1.
+template <int kLevels>
+uint64_t Mmu::GetWalkCacheTag64(uint64_t virtual_address, int level) {
+  return bitcrop(virtual_address, (kLevels - level) * 9, 12 + level * 9);
+}
+
+// Page walk of Sv39, Sv48 and Sv57. They only differ in the number of
+// levels, so the loop is unrolled for each mode.
+template <int kLevels>
+uint64_t Mmu::WalkPageTable64(uint64_t virtual_address, uint64_t satp,
+                              bool write_access, TlbEntry *entry) {
   constexpr int kPteSize = 8;
+  constexpr int kVpnBits = 9;
   uint64_t physical_address = virtual_address;
   MemoryWrapper &mem = *memory_;
-//  uint64_t satp = csrs_[SATP];
-  uint8_t mode = bitcrop(satp, 4, 60);
-  if (mode == 0) {
-    return physical_address;
-  } else if (mode != 8) {
-    std::cerr << "Unsupported virtual address translation mode (" << mode << ")"
-              << std::endl;
-    page_fault_ = true;
-    faulting_address_ = virtual_address;
-    return physical_address;
-  }
-  // uint16_t asid = bitcrop(sptbr, 9, 22);
   uint64_t ppn = bitcrop(satp, 44, 0);
-  uint64_t vpn[3];
-  vpn[2] = bitcrop(virtual_address, 9, 30);
-  vpn[1] = bitcrop(virtual_address, 9, 21);
-  vpn[0] = bitcrop(virtual_address, 9, 12);
-  uint16_t offset = bitcrop(virtual_address, 12, 0);
   Pte64 pte;
-  int level;
+  int level = kLevels - 1;
+  bool global = false;
   uint64_t pte_address;
-  constexpr int k64BitMmuLevels = 3;
-  for (level = k64BitMmuLevels - 1; level >= 0; --level) {
-    pte_address = ppn * kPageSize + vpn[level] * kPteSize;
+  // Start from the lowest table found in the page walk cache.
+  for (int cached_level = 1; cached_level < kLevels; ++cached_level) {
+    const uint64_t tag = GetWalkCacheTag64<kLevels>(virtual_address, cached_level);
+    const WalkCacheEntry *cached = LookupWalkCache(cached_level, tag);
+    if (cached) {
+      ppn = cached->ppn;
+      global = cached->global;
+      level = cached_level - 1;
+      break;
+    }
+  }
+  if (level == kLevels - 1) {
+    ++statistics_.walk_cache_misses;
+  } else {
+    ++statistics_.walk_cache_hits;
+  }
+  for (; level >= 0; --level) {
+    uint64_t vpn = bitcrop(virtual_address, kVpnBits, 12 + level * kVpnBits);
+    pte_address = ppn * kPageSize + vpn * kPteSize;
+    if (!CheckPteAccess(pte_address, kPteSize, Pmp::kRead, virtual_address)) {
+      return physical_address;
+    }
     uint64_t pte_value = mem.Read64(pte_address);
     pte = pte_value;
     if (!pte.IsValid()) {
@@ -83,26 +262,39 @@ uint64_t Mmu::VirtualToPhysical64(uint64_t virtual_address, uint64_t satp,
       faulting_address_ = virtual_address;
       return physical_address;
     }
+    global |= pte.GetG();
     ppn = pte.GetPpn();
+    InsertWalkCache(level, GetWalkCacheTag64<kLevels>(virtual_address, level), ppn, global);
   }
-  if ((level > 0 && pte.GetPpn0() != 0) || (level > 1 && pte.GetPpn1() != 0)) {
+  // A superpage maps the VPN bits below its level directly.
+  const int superpage_bits = level * kVpnBits;
+  const uint64_t leaf_ppn = pte.GetPpn();
+  if ((leaf_ppn & ((1ull << superpage_bits) - 1)) != 0) {
     // Misaligned superpage.
     std::cerr << "Misaligned super page." << std::endl;
     page_fault_ = true;
     faulting_address_ = virtual_address;
     return physical_address;
   }
-  // Access and Dirty bit process;
+  // Access and Dirty bit process. The PTE is only written when a bit changes,
+  // so that page table pages don't become dirty on every walk.
+  const auto original_pte_value = pte.GetValue();
   pte.SetA(1);
   if (write_access) {
     pte.SetD(1);
   }
-  mem.Write64(pte_address, pte.GetValue());
-  // TODO: Add PMP check. (Page 70 of RISC-V Privileged Architectures Manual Vol. II.)
-  uint64_t ppn2 = pte.GetPpn2();
-  uint64_t ppn1 = (level > 1) ? vpn[1] : pte.GetPpn1();
-  uint32_t ppn0 = (level > 0) ? vpn[0] : pte.GetPpn0();
-  physical_address = (ppn2 << 30) | (ppn1 << 21) | ((uint64_t)ppn0 << 12) | offset;
+  if (pte.GetValue() != original_pte_value) {
+    if (!CheckPteAccess(pte_address, kPteSize, Pmp::kWrite, virtual_address)) {
+      return physical_address;
+    }
+    mem.Write64(pte_address, pte.GetValue());
+  }
+  global |= pte.GetG();
+  entry->flags = (pte.GetValue() & 0xFF) | (global ? kTlbGlobal : 0);
+  entry->vpn_mask = ~((1ull << superpage_bits) - 1);
+  // The PMP check of the physical address is done by the CPU for each access.
+  const uint64_t offset_mask = (1ull << (superpage_bits + 12)) - 1;
+  physical_address = ((leaf_ppn << 12) & ~offset_mask) | (virtual_address & offset_mask);
 
   constexpr uint64_t kMask56Bit = 0x00FFFFFFFFFFFFFF;
   uint64_t physical_address_64bit = static_cast<uint64_t >(physical_address & kMask56Bit);
@@ -110,7 +302,7 @@ uint64_t Mmu::VirtualToPhysical64(uint64_t virtual_address, uint64_t satp,
 }
 
 uint64_t Mmu::VirtualToPhysical32(uint64_t virtual_address, uint64_t satp,
-                                  bool write_access) {
+                                  bool write_access, TlbEntry *entry) {
   constexpr int kPteSize = 4;
   uint64_t physical_address = virtual_address;
   MemoryWrapper &mem = *memory_;
@@ -126,10 +318,25 @@ uint64_t Mmu::VirtualToPhysical32(uint64_t virtual_address, uint64_t satp,
   uint16_t offset = bitcrop(virtual_address, 12, 0);
   Pte32 pte;
   int level;
+  bool global = false;
   uint32_t vpn = vpn1;
   uint32_t pte_address;
-  for (level = kMmuLevels - 1; level >= 0; --level) {
+  level = kMmuLevels - 1;
+  const WalkCacheEntry *cached = LookupWalkCache(1, vpn1);
+  if (cached) {
+    ppn = cached->ppn;
+    global = cached->global;
+    vpn = vpn0;
+    level = 0;
+    ++statistics_.walk_cache_hits;
+  } else {
+    ++statistics_.walk_cache_misses;
+  }
+  for (; level >= 0; --level) {
     pte_address = ppn * kPageSize + vpn * kPteSize;
+    if (!CheckPteAccess(pte_address, kPteSize, Pmp::kRead, virtual_address)) {
+      return physical_address;
+    }
     uint32_t pte_value = mem.Read32(pte_address);
     pte = pte_value;
     if (!pte.IsValid()) {
@@ -151,7 +358,9 @@ uint64_t Mmu::VirtualToPhysical32(uint64_t virtual_address, uint64_t satp,
       faulting_address_ = virtual_address;
       return physical_address;
     }
+    global |= pte.GetG();
     ppn = pte.GetPpn();
+    InsertWalkCache(1, vpn1, ppn, global);
     vpn = vpn0;
   }
   if (level > 0 && pte.GetPpn0() != 0) {
@@ -163,13 +372,23 @@ uint64_t Mmu::VirtualToPhysical32(uint64_t virtual_address, uint64_t satp,
     return physical_address;
   }
   // TODO(moizumi): Is this the right place to check the dirty bit?
-  // Access and Dirty bit process;
+  // Access and Dirty bit process. The PTE is only written when a bit changes,
+  // so that page table pages don't become dirty on every walk.
+  const auto original_pte_value = pte.GetValue();
   pte.SetA(1);
   if (write_access) {
     pte.SetD(1);
   }
-  mem.Write32(pte_address, pte.GetValue());
-  // TODO: Add PMP check. (Page 70 of RISC-V Privileged Architectures Manual Vol. II.)
+  if (pte.GetValue() != original_pte_value) {
+    if (!CheckPteAccess(pte_address, kPteSize, Pmp::kWrite, virtual_address)) {
+      return physical_address;
+    }
+    mem.Write32(pte_address, pte.GetValue());
+  }
+  global |= pte.GetG();
+  entry->flags = (pte.GetValue() & 0xFF) | (global ? kTlbGlobal : 0);
+  entry->vpn_mask = ~((1ull << (level * 10)) - 1);
+  // The PMP check of the physical address is done by the CPU for each access.
   uint64_t ppn1 = pte.GetPpn1();
   uint32_t ppn0 = (level == 1) ? vpn0 : pte.GetPpn0();
   physical_address = (ppn1 << 22) | ((uint64_t)ppn0 << 12) | offset;
@@ -5,7 +5,9 @@
 #ifndef ASSEMBLER_TEST_MMU_H
 #define ASSEMBLER_TEST_MMU_H
 
+#include <array>
 #include <memory>
+#include "Pmp.h"
 #include "memory_wrapper.h"
 #include "riscv_cpu_common.h"
 
@@ -13,25 +15,124 @@ namespace RISCV_EMULATOR {
 
 class Mmu {
  public:
+  struct Statistics {
+    uint64_t tlb_hits = 0;
+    uint64_t tlb_misses = 0;
+    uint64_t tlb_flushes = 0;
+    // Page walks that started below the root with a cached non-leaf PTE, and
+    // the ones that read the root.
+    uint64_t walk_cache_hits = 0;
+    uint64_t walk_cache_misses = 0;
+  };
+
+  // Permission bits of a TLB entry, in the layout of the low byte of a PTE.
+  // They are copied from the leaf PTE, except kTlbGlobal which is also set by
+  // a global non-leaf PTE.
+  static constexpr uint8_t kTlbValid = 1 << 0;
+  static constexpr uint8_t kTlbRead = 1 << 1;
+  static constexpr uint8_t kTlbWrite = 1 << 2;
+  static constexpr uint8_t kTlbExecute = 1 << 3;
+  static constexpr uint8_t kTlbUser = 1 << 4;
+  static constexpr uint8_t kTlbGlobal = 1 << 5;
+  static constexpr uint8_t kTlbAccessed = 1 << 6;
+  static constexpr uint8_t kTlbDirty = 1 << 7;
+
   void SetMemory(std::shared_ptr<MemoryWrapper> memory);
   void SetMxl(const int mxl) { mxl_ = mxl; }
   void SetPrivilege(const PrivilegeMode privilege);
+  // The PTE accesses of page walks are checked with |pmp| if set.
+  void SetPmp(const Pmp *pmp) { pmp_ = pmp; }
   uint64_t VirtualToPhysical(uint64_t virtual_address, uint64_t satp, bool write_access = false);
   bool GetPageFault() { return page_fault_; }
+  // Set when a PTE access of the page walk is denied by PMP.
+  bool GetAccessFault() { return access_fault_; }
   uint64_t GetFaultingAddress() { return faulting_address_; }
 
+  // Invalidates all cached translations.
+  void FlushTlb();
+
+  // sfence.vma. Without |match_address| all addresses are flushed, and without
+  // |match_asid| all address spaces. Global entries are kept when only one
+  // ASID is flushed.
+  void FlushTlb(bool match_address, uint64_t virtual_address, bool match_asid, uint64_t asid);
+
+  // Returns the permission bits of the cached translation of
+  // |virtual_address| in the current address space, or 0 if it isn't cached.
+  uint8_t GetTlbFlags(uint64_t virtual_address) const;
+
+  const Statistics &GetStatistics() const { return statistics_; }
+
  private:
-  uint64_t VirtualToPhysical32(uint64_t virtual_address, uint64_t satp, bool write_access = false);
+  // Set associative TLB of 4 KiB pages. A superpage is cached one 4 KiB
+  // page at a time.
+  static constexpr int kTlbSets = 256;
+  static constexpr int kTlbWays = 4;
+
+  struct TlbEntry {
+    uint64_t vpn = 0;
+    // VPN bits that identify the leaf PTE. Fewer bits for superpages.
+    uint64_t vpn_mask = 0;
+    uint64_t physical_page = 0;
+    uint16_t asid = 0;
+    uint8_t flags = 0;
+  };
+
+  struct TlbSet {
+    std::array<TlbEntry, kTlbWays> ways;
+    uint8_t next_victim = 0;
+  };
+
+  // Page walk cache of non-leaf PTEs. An entry of level L holds the table of
+  // level L - 1 for the VPN bits above level L - 1, so that a walk can skip
+  // the upper levels. Direct mapped, one array per level.
+  static constexpr int kWalkCacheLevels = 4;
+  static constexpr int kWalkCacheEntries = 16;
+
+  struct WalkCacheEntry {
+    uint64_t tag = 0;
+    uint64_t ppn = 0;
+    bool valid = false;
+    bool global = false;
+  };
+
+  uint64_t VirtualToPhysical32(uint64_t virtual_address, uint64_t satp, bool write_access, TlbEntry *entry);
+
+  uint64_t VirtualToPhysical64(uint64_t virtual_address, uint64_t satp, bool write_access, TlbEntry *entry);
+
+  template <int kLevels>
+  static uint64_t GetWalkCacheTag64(uint64_t virtual_address, int level);
+
+  template <int kLevels>
+  uint64_t WalkPageTable64(uint64_t virtual_address, uint64_t satp, bool write_access, TlbEntry *entry);
 
-  uint64_t VirtualToPhysical64(uint64_t virtual_address, uint64_t satp, bool write_access = false);
+  bool CheckPteAccess(uint64_t pte_address, int size, uint8_t access, uint64_t virtual_address);
+  bool IsPagingEnabled(uint64_t satp) const;
+  uint16_t GetAsid(uint64_t satp) const;
+  uint64_t GetVpn(uint64_t virtual_address, uint64_t satp) const;
+  const TlbEntry *LookupTlb(uint64_t vpn, uint16_t asid) const;
+  void InsertTlb(const TlbEntry &entry);
+  const WalkCacheEntry *LookupWalkCache(int level, uint64_t tag) const;
+  void InsertWalkCache(int level, uint64_t tag, uint64_t ppn, bool global);
+  void FlushWalkCache();
 
   std::shared_ptr<MemoryWrapper> memory_;
   int mxl_ = 0;
   bool page_fault_ = false;
+  bool access_fault_ = false;
   uint64_t faulting_address_ = 0;
+  const Pmp *pmp_ = nullptr;
   PrivilegeMode privilege_ = PrivilegeMode::MACHINE_MODE;
   static constexpr int kPageSize = 1 << 12;  // PAGESIZE is 2^12.
   static constexpr int kMmuLevels = 2;
+  // SATP.MODE of RV64.
+  static constexpr int kSv39 = 8;
+  static constexpr int kSv48 = 9;
+  static constexpr int kSv57 = 10;
+  std::array<TlbSet, kTlbSets> tlb_;
+  std::array<std::array<WalkCacheEntry, kWalkCacheEntries>, kWalkCacheLevels> walk_cache_;
+  // The SATP value the TLB contents belong to.
+  uint64_t tlb_satp_ = 0;
+  Statistics statistics_;
 };
 
 }  // namespace RISCV_EMULATOR
@@ -5,7 +5,9 @@
 #include "PeripheralEmulator.h"
 #include <cassert>
 #include <iostream>
+#include "ReplayLog.h"
 #include "ScreenEmulation.h"
+#include "Snapshot.h"
 
 namespace RISCV_EMULATOR {
 
@@ -15,7 +17,42 @@ PeripheralEmulator::PeripheralEmulator(int mxl) : mxl_(mxl) {}
 
 void PeripheralEmulator::SetMemory(std::shared_ptr<MemoryWrapper> memory) { memory_ = memory; }
 
-void PeripheralEmulator::SetDiskImage(std::shared_ptr<std::vector<uint8_t>> disk_image) { disk_image_ = disk_image; };
+void PeripheralEmulator::SetDiskImage(std::shared_ptr<std::vector<uint8_t>> disk_image) {
+  disk_image_ = disk_image;
+  EnableDiskDirtyTracking(disk_dirty_tracking_);
+}
+
+void PeripheralEmulator::EnableDiskDirtyTracking(bool enable) {
+  disk_dirty_tracking_ = enable;
+  const size_t blocks = disk_image_ ? (disk_image_->size() + kDiskBlockSize - 1) / kDiskBlockSize : 0;
+  disk_dirty_.assign(enable ? (blocks + 63) / 64 : 0, 0);
+}
+
+void PeripheralEmulator::MarkDiskWritten(size_t offset, size_t length) {
+  if (!disk_dirty_tracking_ || length == 0) {
+    return;
+  }
+  for (size_t block = offset / kDiskBlockSize; block <= (offset + length - 1) / kDiskBlockSize; ++block) {
+    disk_dirty_[block / 64] |= 1ull << (block % 64);
+  }
+}
+
+std::vector<size_t> PeripheralEmulator::TakeDirtyDiskBlocks() {
+  std::vector<size_t> blocks;
+  for (size_t i = 0; i < disk_dirty_.size(); ++i) {
+    const uint64_t word = disk_dirty_[i];
+    if (word == 0) {
+      continue;
+    }
+    for (int bit = 0; bit < 64; ++bit) {
+      if ((word >> bit) & 1) {
+        blocks.push_back((i * 64 + bit) * kDiskBlockSize);
+      }
+    }
+    disk_dirty_[i] = 0;
+  }
+  return blocks;
+}
 
 void PeripheralEmulator::SetHostEmulationEnable(bool enable) { host_emulation_enable_ = enable; }
 
@@ -25,6 +62,51 @@ bool PeripheralEmulator::GetHostErrorFlag() { return error_flag_; }
 
 bool PeripheralEmulator::GetHostEndFlag() { return end_flag_; }
 
+void PeripheralEmulator::SaveState(SnapshotWriter &writer) const {
+  writer.Put(host_write_);
+  writer.Put(host_value_);
+  writer.Put(end_flag_);
+  writer.Put(error_flag_);
+  writer.Put(uart_write_);
+  writer.Put(uart_read_);
+  writer.Put(uart_full_);
+  writer.Put(uart_write_value_);
+  writer.Put(uart_interrupt_);
+  writer.Put(elapsed_cycles_);
+  writer.Put(next_cycle_);
+  writer.Put(timercmp_update_);
+  writer.Put(timer_interrupt_);
+  writer.Put(virtio_write_);
+  writer.Put(virtio_address_);
+  writer.Put(virtio_width_);
+  writer.Put(virtio_data_);
+  writer.Put(queue_num_);
+  writer.Put(virtio_interrupt_);
+}
+
+void PeripheralEmulator::RestoreState(SnapshotReader &reader) {
+  host_write_ = reader.Get<int>();
+  host_value_ = reader.Get<uint64_t>();
+  end_flag_ = reader.Get<bool>();
+  error_flag_ = reader.Get<bool>();
+  uart_write_ = reader.Get<bool>();
+  uart_read_ = reader.Get<bool>();
+  uart_full_ = reader.Get<bool>();
+  uart_write_value_ = reader.Get<uint8_t>();
+  uart_interrupt_ = reader.Get<bool>();
+  uart_break_ = false;
+  elapsed_cycles_ = reader.Get<uint64_t>();
+  next_cycle_ = reader.Get<uint64_t>();
+  timercmp_update_ = reader.Get<bool>();
+  timer_interrupt_ = reader.Get<bool>();
+  virtio_write_ = reader.Get<bool>();
+  virtio_address_ = reader.Get<uint64_t>();
+  virtio_width_ = reader.Get<uint64_t>();
+  virtio_data_ = reader.Get<uint64_t>();
+  queue_num_ = reader.Get<int>();
+  virtio_interrupt_ = reader.Get<bool>();
+}
+
 void PeripheralEmulator::Initialize() {
   UartInit();
   VirtioInit();
@@ -66,6 +148,20 @@ void PeripheralEmulator::CheckDeviceRead(uint64_t address, int width) {
 
 void PeripheralEmulator::MemoryMappedValueUpdate() { memory_->Write64(kTimerMtime, elapsed_cycles_); }
 
+bool PeripheralEmulator::IsDevicePage(uint64_t physical_address) const {
+  constexpr uint64_t kPageMask = ~static_cast<uint64_t>(MemoryWrapper::kPageSize - 1);
+  // The host interface is compared in 32 bit in RV32.
+  const uint64_t page = (mxl_ == 1 ? physical_address & 0xFFFFFFFF : physical_address) & kPageMask;
+  const uint64_t devices[] = {kToHost0, kToHost1, kFromHost, kUartBase, kVirtioBase, kVirtioEnd, kTimerCmp,
+                              kTimerMtime};
+  for (uint64_t device : devices) {
+    if (page == (device & kPageMask)) {
+      return true;
+    }
+  }
+  return false;
+}
+
 void PeripheralEmulator::Emulation() {
   if (host_emulation_enable_) {
     HostEmulation();
@@ -161,10 +257,20 @@ void PeripheralEmulator::UartEmulation() {
   if (uart_full_) {
     return;
   }
-  if (!scr_emulation->CheckInput()) {
-    return;
+  int key_input;
+  if (replay_log_ && replay_log_->IsReplaying()) {
+    if (!replay_log_->ReplayKey(&key_input)) {
+      return;
+    }
+  } else {
+    if (!scr_emulation->CheckInput()) {
+      return;
+    }
+    key_input = scr_emulation->GetKeyValue();
+    if (replay_log_ && replay_log_->IsRecording()) {
+      replay_log_->RecordKey(key_input);
+    }
   }
-  int key_input = scr_emulation->GetKeyValue();
   switch (key_input) {
     case KEY_BACKSPACE:
       key_input = 8;
@@ -359,13 +465,10 @@ void PeripheralEmulator::disc_access(uint64_t sector, uint64_t buffer_address, u
   // std::cerr << (write ? "Disk Write: " : "Disk Read: ");
   // std::cerr << "sector = " << std::hex << sector << ", size = " << std::dec << len << std::endl;
   if (write) {
-    for (uint64_t offset = 0; offset < len; ++offset) {
-      (*disk_image_)[kSectorAddress + offset] = memory_->ReadByte(buffer_address + offset);
-    }
+    memory_->ReadBlock(buffer_address, disk_image_->data() + kSectorAddress, len);
+    MarkDiskWritten(kSectorAddress, len);
   } else {
-    for (uint64_t offset = 0; offset < len; ++offset) {
-      memory_->WriteByte(buffer_address + offset, (*disk_image_)[kSectorAddress + offset]);
-    }
+    memory_->WriteBlock(buffer_address, disk_image_->data() + kSectorAddress, len);
   }
 }
 
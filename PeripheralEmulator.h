@@ -13,6 +13,10 @@
 
 namespace RISCV_EMULATOR {
 
+class SnapshotWriter;
+class SnapshotReader;
+class ReplayLog;
+
 struct VRingDesc {
   uint64_t addr;
   uint32_t len;
@@ -67,10 +71,19 @@ class PeripheralEmulator {
   void SetMemory(std::shared_ptr<MemoryWrapper> memory);
   void Emulation();
 
+  // The state of the host interface, UART, timer and virtio disk. The device
+  // registers themselves are in the memory. A pending UART break is left
+  // out, as it only stops the current run.
+  void SaveState(SnapshotWriter &writer) const;
+  void RestoreState(SnapshotReader &reader);
+
   void Initialize();
   void CheckDeviceWrite(uint64_t address, int width, uint64_t data);
   void CheckDeviceRead(uint64_t address, int width);
   void MemoryMappedValueUpdate();
+  // True if loads or stores to the 4 KiB page of |physical_address| have to
+  // be checked with the functions above.
+  bool IsDevicePage(uint64_t physical_address) const;
 
   // Host Emulation.
   void SetHostEmulationEnable(bool enable);
@@ -96,11 +109,29 @@ class PeripheralEmulator {
   bool GetUartInterruptStatus() {return uart_interrupt_; }
   void ClearUartInterruptStatus() { uart_interrupt_ = false;}
   bool GetUartBreak() { return uart_break_; }
+  // Key strokes are logged to |log| while it records, and taken from it
+  // instead of the terminal while it replays.
+  void SetReplayLog(std::shared_ptr<ReplayLog> log) { replay_log_ = log; }
 
   // Virtio Disk Emulation.
   void VirtioInit();
   void VirtioEmulation();
   void SetDiskImage(std::shared_ptr<std::vector<uint8_t>> disk_image);
+
+  // Dirty block tracking of the disk image. While enabled, every write of the
+  // disk marks its blocks. Enabling starts with all blocks clean.
+  static constexpr size_t kDiskBlockSize = 4096;
+
+  void EnableDiskDirtyTracking(bool enable);
+
+  // Marks the blocks of |length| bytes from |offset|, for a write to the
+  // image that doesn't come from the guest.
+  void MarkDiskWritten(size_t offset, size_t length);
+
+  // Returns the offsets of the dirty blocks in ascending order, and marks
+  // them clean.
+  std::vector<size_t> TakeDirtyDiskBlocks();
+
   bool GetInterruptStatus() {return virtio_interrupt_; }
   void ClearInterruptStatus() { virtio_interrupt_ = false;}
 
@@ -108,6 +139,7 @@ class PeripheralEmulator {
   std::shared_ptr<MemoryWrapper> memory_;
   int mxl_;
   bool host_emulation_enable_ = false;
+  std::shared_ptr<ReplayLog> replay_log_;
   int host_write_ = false;
   uint64_t host_value_ = 0;
   bool end_flag_ = false;
@@ -136,6 +168,9 @@ class PeripheralEmulator {
   // Virtio
   static constexpr int kSectorSize = 512; // 1 sector = 512 bytes.
   std::shared_ptr<std::vector<uint8_t>> disk_image_;
+  bool disk_dirty_tracking_ = false;
+  // A bit per block of the disk image.
+  std::vector<uint64_t> disk_dirty_;
   bool virtio_write_ = false;
   uint64_t virtio_address_ = 0;
   uint64_t virtio_width_ = 0;
@@ -0,0 +1,166 @@
+//
+// Physical memory protection (PMP) of the RISC-V privileged architecture.
+//
+
+#include "Pmp.h"
+#include "bit_tools.h"
+
+namespace RISCV_EMULATOR {
+
+Pmp::Pmp() {
+  Compile();
+}
+
+void Pmp::Reset() {
+  cfg_.fill(0);
+  address_.fill(0);
+  Compile();
+}
+
+uint64_t Pmp::ReadCsr(uint32_t csr) const {
+  if (csr >= kPmpAddr0) {
+    return address_[csr - kPmpAddr0];
+  }
+  const int index = csr - kPmpCfg0;
+  // RV64 has only the even numbered pmpcfg, each of which holds 8 entries.
+  if (mxl_ == 2 && (index & 1)) {
+    return 0;
+  }
+  const int entries = mxl_ == 2 ? 8 : 4;
+  uint64_t value = 0;
+  for (int i = 0; i < entries; ++i) {
+    value |= static_cast<uint64_t>(cfg_[index * 4 + i]) << (i * 8);
+  }
+  return value;
+}
+
+void Pmp::WriteCsr(uint32_t csr, uint64_t value) {
+  const auto cfg = cfg_;
+  const auto address = address_;
+  if (csr >= kPmpAddr0) {
+    const int entry = csr - kPmpAddr0;
+    if (!IsAddressLocked(entry)) {
+      // pmpaddr holds bits 33-2 of the address in RV32, and 55-2 in RV64.
+      address_[entry] = value & (mxl_ == 2 ? GenMask<uint64_t>(54, 0) : GenMask<uint64_t>(32, 0));
+    }
+  } else {
+    const int index = csr - kPmpCfg0;
+    if (mxl_ == 2 && (index & 1)) {
+      return;
+    }
+    const int entries = mxl_ == 2 ? 8 : 4;
+    for (int i = 0; i < entries; ++i) {
+      WriteCfg(index * 4 + i, (value >> (i * 8)) & 0xFF);
+    }
+  }
+  // CSR reads and writes of unchanged values don't drop the cached results.
+  if (cfg != cfg_ || address != address_) {
+    Compile();
+  }
+}
+
+void Pmp::WriteCfg(int entry, uint8_t cfg) {
+  if (cfg_[entry] & kCfgL) {
+    return;
+  }
+  // Bits 6-5 are reserved, and so is W without R.
+  cfg &= kCfgL | (0b11 << kAddressMatchingShift) | kExecute | kWrite | kRead;
+  if (!(cfg & kRead)) {
+    cfg &= ~kWrite;
+  }
+  cfg_[entry] = cfg;
+}
+
+bool Pmp::IsAddressLocked(int entry) const {
+  if (cfg_[entry] & kCfgL) {
+    return true;
+  }
+  // The address of a locked TOR entry includes the previous pmpaddr.
+  return entry + 1 < kEntries && (cfg_[entry + 1] & kCfgL) &&
+         ((cfg_[entry + 1] >> kAddressMatchingShift) & 0b11) == TOR;
+}
+
+void Pmp::Compile() {
+  regions_.clear();
+  active_ = false;
+  locked_ = false;
+  for (int i = 0; i < kEntries; ++i) {
+    const int matching = (cfg_[i] >> kAddressMatchingShift) & 0b11;
+    if (matching == OFF) {
+      continue;
+    }
+    // An enabled entry denies the unmatched S and U mode accesses, even if
+    // it matches no address.
+    active_ = true;
+    Region region;
+    region.permission = cfg_[i] & (kExecute | kWrite | kRead);
+    region.locked = (cfg_[i] & kCfgL) != 0;
+    locked_ |= region.locked;
+    const uint64_t address = address_[i];
+    if (matching == TOR) {
+      region.begin = i == 0 ? 0 : address_[i - 1] << 2;
+      region.end = address << 2;
+    } else if (matching == NA4) {
+      region.begin = address << 2;
+      region.end = region.begin + 4;
+    } else {
+      // NAPOT. The trailing ones give the size.
+      const uint64_t mask = address ^ (address + 1);
+      region.begin = (address & ~mask) << 2;
+      region.end = region.begin + ((mask + 1) << 2);
+    }
+    if (region.begin < region.end) {
+      regions_.push_back(region);
+    }
+  }
+  for (PageCacheEntry &entry : page_cache_) {
+    entry.valid = false;
+  }
+  ++generation_;
+}
+
+uint8_t Pmp::GetPagePermission(uint64_t page, bool machine) const {
+  const uint64_t tag = (page << 1) | machine;
+  PageCacheEntry &entry = page_cache_[tag & (kPageCacheEntries - 1)];
+  if (!entry.valid || entry.tag != tag) {
+    entry.tag = tag;
+    entry.permission = ComputePagePermission(page, machine);
+    entry.valid = true;
+  }
+  return entry.permission;
+}
+
+// The first region that overlaps the page decides. If it doesn't cover the
+// whole page, different parts of the page may have different permissions.
+uint8_t Pmp::ComputePagePermission(uint64_t page, bool machine) const {
+  const uint64_t page_begin = page << kPageBits;
+  const uint64_t page_end = page_begin + kPageSize;
+  for (const Region &region : regions_) {
+    if (region.end <= page_begin || page_end <= region.begin) {
+      continue;
+    }
+    if (region.begin <= page_begin && page_end <= region.end) {
+      return GetRegionPermission(region, machine);
+    }
+    return kPartial;
+  }
+  return machine ? (kRead | kWrite | kExecute) : 0;
+}
+
+// The first region that matches any byte decides. An access that is only
+// partially in it fails.
+bool Pmp::CheckRange(uint64_t physical_address, int width, uint8_t access, bool machine) const {
+  const uint64_t end = physical_address + width;
+  for (const Region &region : regions_) {
+    if (region.end <= physical_address || end <= region.begin) {
+      continue;
+    }
+    if (region.begin <= physical_address && end <= region.end) {
+      return (GetRegionPermission(region, machine) & access) == access;
+    }
+    return false;
+  }
+  return machine;
+}
+
+}  // namespace RISCV_EMULATOR
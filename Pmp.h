@@ -0,0 +1,126 @@
+//
+// Physical memory protection (PMP) of the RISC-V privileged architecture.
+//
+
+#ifndef ASSEMBLER_TEST_PMP_H
+#define ASSEMBLER_TEST_PMP_H
+
+#include <array>
+#include <cstdint>
+#include <vector>
+#include "riscv_cpu_common.h"
+
+namespace RISCV_EMULATOR {
+
+// 16 PMP entries, pmpcfg0-3 and pmpaddr0-15.
+// The configuration is compiled into a list of address ranges when a CSR is
+// written, and the permission of each 4 KiB page is cached, so that a check
+// is usually one table lookup. While no entry is enabled, every access is
+// allowed without a lookup.
+class Pmp {
+ public:
+  static constexpr int kEntries = 16;
+  static constexpr uint32_t kPmpCfg0 = 0x3A0;
+  static constexpr uint32_t kPmpAddr0 = 0x3B0;
+
+  // Access types, in the layout of the R, W and X bits of pmpcfg.
+  static constexpr uint8_t kRead = 1 << 0;
+  static constexpr uint8_t kWrite = 1 << 1;
+  static constexpr uint8_t kExecute = 1 << 2;
+
+  Pmp();
+
+  void SetMxl(int mxl) { mxl_ = mxl; }
+
+  // Clears every entry, the locked ones too, as at reset.
+  void Reset();
+
+  static bool IsPmpCsr(uint32_t csr) {
+    return (kPmpCfg0 <= csr && csr < kPmpCfg0 + kEntries / 4) || (kPmpAddr0 <= csr && csr < kPmpAddr0 + kEntries);
+  }
+
+  // Reads and writes pmpcfg and pmpaddr, with the WARL behavior and the
+  // locked entries.
+  uint64_t ReadCsr(uint32_t csr) const;
+  void WriteCsr(uint32_t csr, uint64_t value);
+
+  // Returns true if |width| bytes from |physical_address| may be accessed
+  // with |access| in |privilege|.
+  bool Check(uint64_t physical_address, int width, uint8_t access, PrivilegeMode privilege) const {
+    if (!active_) {
+      return true;
+    }
+    const bool machine = privilege == PrivilegeMode::MACHINE_MODE;
+    if (machine && !locked_) {
+      return true;
+    }
+    const uint8_t permission = GetPagePermission(physical_address >> kPageBits, machine);
+    if (!(permission & kPartial) &&
+        (physical_address & (kPageSize - 1)) + width <= static_cast<uint64_t>(kPageSize)) {
+      return (permission & access) == access;
+    }
+    return CheckRange(physical_address, width, access, machine);
+  }
+
+  bool IsActive() const { return active_; }
+
+  // Incremented on every change of the configuration, so that a cached
+  // check result can be validated.
+  uint64_t GetGeneration() const { return generation_; }
+
+ private:
+  static constexpr int kPageBits = 12;
+  static constexpr int kPageSize = 1 << kPageBits;
+  static constexpr int kPageCacheEntries = 256;
+  // Set in a page permission when the page is not covered by one region,
+  // and the address range of each access has to be checked.
+  static constexpr uint8_t kPartial = 1 << 7;
+
+  static constexpr uint8_t kCfgL = 1 << 7;
+  static constexpr int kAddressMatchingShift = 3;
+  enum AddressMatching {
+    OFF = 0,
+    TOR = 1,  // Top of range.
+    NA4 = 2,  // Naturally aligned four-byte region.
+    NAPOT = 3  // Naturally aligned power-of-two region.
+  };
+
+  // The address range of an enabled entry, [begin, end).
+  struct Region {
+    uint64_t begin;
+    uint64_t end;
+    uint8_t permission;
+    bool locked;
+  };
+
+  struct PageCacheEntry {
+    uint64_t tag = 0;
+    uint8_t permission = 0;
+    bool valid = false;
+  };
+
+  void WriteCfg(int entry, uint8_t cfg);
+  bool IsAddressLocked(int entry) const;
+  void Compile();
+  uint8_t GetPagePermission(uint64_t page, bool machine) const;
+  uint8_t ComputePagePermission(uint64_t page, bool machine) const;
+  bool CheckRange(uint64_t physical_address, int width, uint8_t access, bool machine) const;
+  // The permission of a region for the privilege mode.
+  static uint8_t GetRegionPermission(const Region &region, bool machine) {
+    return (machine && !region.locked) ? (kRead | kWrite | kExecute) : region.permission;
+  }
+
+  int mxl_ = 1;
+  std::array<uint8_t, kEntries> cfg_{};
+  std::array<uint64_t, kEntries> address_{};
+  // Enabled entries in the priority order.
+  std::vector<Region> regions_;
+  bool active_ = false;
+  bool locked_ = false;
+  uint64_t generation_ = 0;
+  mutable std::array<PageCacheEntry, kPageCacheEntries> page_cache_;
+};
+
+}  // namespace RISCV_EMULATOR
+
+#endif  // ASSEMBLER_TEST_PMP_H
@@ -0,0 +1,139 @@
+//
+// Statistical profiler of the guest.
+//
+
+#include "Profiler.h"
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <utility>
+
+namespace RISCV_EMULATOR {
+
+namespace {
+
+const char *PrivilegeName(int privilege) {
+  switch (privilege) {
+    case static_cast<int>(PrivilegeMode::USER_MODE):
+      return "U";
+    case static_cast<int>(PrivilegeMode::SUPERVISOR_MODE):
+      return "S";
+    default:
+      return "M";
+  }
+}
+
+const char *PrivilegeFullName(int privilege) {
+  switch (privilege) {
+    case static_cast<int>(PrivilegeMode::USER_MODE):
+      return "user";
+    case static_cast<int>(PrivilegeMode::SUPERVISOR_MODE):
+      return "supervisor";
+    default:
+      return "machine";
+  }
+}
+
+} // namespace anonymous
+
+uint64_t Profiler::GetSamples(uint64_t pc, PrivilegeMode privilege) const {
+  const auto &samples = histogram_[static_cast<int>(privilege)];
+  auto it = samples.find(pc);
+  return it == samples.end() ? 0 : it->second;
+}
+
+void Profiler::SetSymbols(std::vector<Symbol> symbols) {
+  // Symbols without a name or at 0 are section or file markers.
+  symbols.erase(std::remove_if(symbols.begin(), symbols.end(),
+                               [](const Symbol &symbol) { return symbol.name.empty() || symbol.address == 0; }),
+                symbols.end());
+  // Of aliases, the sized one is kept.
+  std::sort(symbols.begin(), symbols.end(), [](const Symbol &a, const Symbol &b) {
+    return a.address != b.address ? a.address < b.address : a.size > b.size;
+  });
+  symbols.erase(std::unique(symbols.begin(), symbols.end(),
+                            [](const Symbol &a, const Symbol &b) { return a.address == b.address; }),
+                symbols.end());
+  symbols_ = std::move(symbols);
+}
+
+const std::string &Profiler::FindSymbol(uint64_t address) const {
+  static const std::string kNone;
+  auto it = std::upper_bound(symbols_.begin(), symbols_.end(), address,
+                             [](uint64_t a, const Symbol &symbol) { return a < symbol.address; });
+  if (it == symbols_.begin()) {
+    return kNone;
+  }
+  const Symbol &symbol = *(it - 1);
+  if (symbol.size > 0 && address - symbol.address >= symbol.size) {
+    return kNone;
+  }
+  return symbol.name;
+}
+
+std::string Profiler::GetFrameName(uint64_t address) const {
+  const std::string &name = FindSymbol(address);
+  if (!name.empty()) {
+    return name;
+  }
+  char hex[24];
+  std::snprintf(hex, sizeof(hex), "0x%llx", static_cast<unsigned long long>(address));
+  return hex;
+}
+
+void Profiler::SampleCallStack(uint64_t pc, PrivilegeMode privilege) {
+  const std::vector<uint64_t> &stack = call_stacks_[static_cast<int>(privilege)];
+  std::vector<uint64_t> key;
+  key.reserve(stack.size() + 2);
+  key.push_back(static_cast<uint64_t>(privilege));
+  key.insert(key.end(), stack.begin(), stack.end());
+  key.push_back(pc);
+  ++call_stack_samples_[key];
+}
+
+void Profiler::Report(std::ostream &out, size_t max_lines) const {
+  out << "Profile: " << sample_count_ << " samples, one every " << period_ << " instructions." << std::endl;
+  if (sample_count_ == 0) {
+    return;
+  }
+  std::map<std::pair<std::string, int>, uint64_t> functions;
+  for (int privilege = 0; privilege < static_cast<int>(histogram_.size()); ++privilege) {
+    for (const auto &sample : histogram_[privilege]) {
+      functions[{GetFrameName(sample.first), privilege}] += sample.second;
+    }
+  }
+  std::vector<std::pair<uint64_t, std::pair<std::string, int>>> ranking;
+  for (const auto &function : functions) {
+    ranking.emplace_back(function.second, function.first);
+  }
+  std::sort(ranking.begin(), ranking.end(), [](const decltype(ranking)::value_type &a,
+                                               const decltype(ranking)::value_type &b) {
+    return a.first != b.first ? a.first > b.first : a.second < b.second;
+  });
+  char line[64];
+  for (size_t i = 0; i < ranking.size() && i < max_lines; ++i) {
+    std::snprintf(line, sizeof(line), "%6.2f%% %10llu %s ", 100.0 * ranking[i].first / sample_count_,
+                  static_cast<unsigned long long>(ranking[i].first), PrivilegeName(ranking[i].second.second));
+    out << line << ranking[i].second.first << std::endl;
+  }
+}
+
+void Profiler::WriteFoldedStacks(std::ostream &out) const {
+  // Different pcs in the same functions fold into one line.
+  std::map<std::string, uint64_t> folded;
+  for (const auto &sample : call_stack_samples_) {
+    const std::vector<uint64_t> &key = sample.first;
+    std::string stack = PrivilegeFullName(static_cast<int>(key[0]));
+    for (size_t i = 1; i < key.size(); ++i) {
+      // A return address may be past the end of the caller, if the call is
+      // its last instruction.
+      stack += ";" + GetFrameName(i + 1 < key.size() ? key[i] - 1 : key[i]);
+    }
+    folded[stack] += sample.second;
+  }
+  for (const auto &line : folded) {
+    out << line.first << " " << line.second << "\n";
+  }
+}
+
+}  // namespace RISCV_EMULATOR
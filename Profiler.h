@@ -0,0 +1,120 @@
+//
+// Statistical profiler of the guest. The CPU hands over its pc and privilege
+// mode every period instructions, and the report ranks the functions of the
+// ELF symbol table by their share of the samples. With call stacks, it also
+// follows the calls and returns in a shadow stack per privilege mode, and
+// counts the samples per call stack for flame graphs.
+//
+
+#ifndef ASSEMBLER_TEST_PROFILER_H
+#define ASSEMBLER_TEST_PROFILER_H
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "riscv_cpu_common.h"
+
+namespace RISCV_EMULATOR {
+
+class Profiler {
+ public:
+  struct Symbol {
+    uint64_t address;
+    // 0 if unknown. The symbol then reaches up to the next one.
+    uint64_t size;
+    std::string name;
+  };
+
+  // A prime, so that the samples don't run in step with a loop.
+  static constexpr uint64_t kDefaultPeriod = 1009;
+
+  explicit Profiler(uint64_t period = kDefaultPeriod) : period_(period > 0 ? period : 1) {}
+
+  uint64_t GetPeriod() const { return period_; }
+
+  void Sample(uint64_t pc, PrivilegeMode privilege) {
+    ++histogram_[static_cast<int>(privilege)][pc];
+    ++sample_count_;
+    if (call_stacks_enabled_) {
+      SampleCallStack(pc, privilege);
+    }
+  }
+
+  // Call stacks are followed once the CPU is handed the profiler.
+  void EnableCallStacks() { call_stacks_enabled_ = true; }
+
+  bool IsCallStacksEnabled() const { return call_stacks_enabled_; }
+
+  // A jal or jalr that links to ra.
+  void Call(uint64_t return_address, PrivilegeMode privilege) {
+    std::vector<uint64_t> &stack = call_stacks_[static_cast<int>(privilege)];
+    if (stack.size() == kMaxCallDepth) {
+      // Likely calls that never return, like a scheduler switching tasks.
+      stack.erase(stack.begin());
+    }
+    stack.push_back(return_address);
+  }
+
+  // A jalr x0, ra. Unwinds to the call that returns to |target|. A return to
+  // none of them leaves the stack as it is.
+  void Return(uint64_t target, PrivilegeMode privilege) {
+    std::vector<uint64_t> &stack = call_stacks_[static_cast<int>(privilege)];
+    for (size_t i = stack.size(); i > 0; --i) {
+      if (stack[i - 1] == target) {
+        stack.resize(i - 1);
+        return;
+      }
+    }
+  }
+
+  // A trap from a lower privilege mode starts the stack of |privilege| anew.
+  void ResetCallStack(PrivilegeMode privilege) { call_stacks_[static_cast<int>(privilege)].clear(); }
+
+  uint64_t GetSampleCount() const { return sample_count_; }
+
+  // The samples at |pc| in |privilege| mode.
+  uint64_t GetSamples(uint64_t pc, PrivilegeMode privilege) const;
+
+  void SetSymbols(std::vector<Symbol> symbols);
+
+  // The name of the symbol that covers |address|, or "" if none does.
+  const std::string &FindSymbol(uint64_t address) const;
+
+  // Writes the |max_lines| functions with the most samples, per privilege
+  // mode. Addresses outside of any symbol are listed on their own.
+  void Report(std::ostream &out, size_t max_lines = 30) const;
+
+  // Writes the sampled call stacks in the folded format of flamegraph.pl,
+  // "mode;caller;callee count" per line, rooted at the privilege mode so that
+  // all modes share one graph.
+  void WriteFoldedStacks(std::ostream &out) const;
+
+ private:
+  uint64_t period_;
+  uint64_t sample_count_ = 0;
+  // Indexed by the privilege mode.
+  std::array<std::unordered_map<uint64_t, uint64_t>, 4> histogram_;
+  // Sorted by the address.
+  std::vector<Symbol> symbols_;
+
+  static constexpr size_t kMaxCallDepth = 256;
+
+  void SampleCallStack(uint64_t pc, PrivilegeMode privilege);
+
+  // The name of the symbol at |address|, or |address| in hex.
+  std::string GetFrameName(uint64_t address) const;
+
+  bool call_stacks_enabled_ = false;
+  // The return addresses of the calls in progress, per privilege mode.
+  std::array<std::vector<uint64_t>, 4> call_stacks_;
+  // The privilege mode, the return addresses and the pc of each sample.
+  std::map<std::vector<uint64_t>, uint64_t> call_stack_samples_;
+};
+
+}  // namespace RISCV_EMULATOR
+
+#endif  // ASSEMBLER_TEST_PROFILER_H
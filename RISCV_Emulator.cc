@@ -1,14 +1,26 @@
 #include "RISCV_Emulator.h"
 #include "memory_wrapper.h"
 #include "RISCV_cpu.h"
+#include "Snapshot.h"
+#include "ForkServer.h"
+#include "ReplayLog.h"
+#include "TimeTravel.h"
+#include "InstructionMix.h"
+#include "BasicBlockVector.h"
+#include "Trace.h"
+#include "Profiler.h"
 #include "pte.h"
 #include <iostream>
 #include <vector>
 #include <fstream>
 #include <string>
 #include <cstring>
-#include <tuple>
 #include <cassert>
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <csignal>
+#include <cstdio>
 
 #ifndef _WIN32
 #include <elf.h>
@@ -214,9 +226,8 @@ void Load32BitElfFile(std::vector<uint8_t> &program, MemoryWrapper &memory) {
                   << " from 0x" << static_cast<int>(phdr->p_offset) << std::dec
                   << ", size " << static_cast<int>(phdr->p_filesz) << ". ";
 
-        for (Elf32_Word i = 0; i < phdr->p_filesz; i++) {
-          memory.WriteByte(phdr->p_vaddr + i, program[phdr->p_offset + i]);
-        }
+        memory.WriteBlock(phdr->p_vaddr, program.data() + phdr->p_offset,
+                          phdr->p_filesz);
         std::cerr << "Loaded" << std::endl;
         break;
       default:
@@ -232,9 +243,7 @@ void Load32BitElfFile(std::vector<uint8_t> &program, MemoryWrapper &memory) {
     std::cerr << "BSS start address: " << std::hex << shdr->sh_addr;
     std::cerr << ", end address: " << shdr->sh_addr + shdr->sh_size
               << std::endl;
-    for (uint32_t i = shdr->sh_addr; i < shdr->sh_addr + shdr->sh_size; i++) {
-      memory.WriteByte(i, 0);
-    }
+    memory.Fill(shdr->sh_addr, 0, shdr->sh_size);
   } else {
     std::cerr << "No BSS found." << std::endl;
   }
@@ -254,9 +263,8 @@ void Load64BitElfFile(std::vector<uint8_t> &program, MemoryWrapper &memory) {
                   << " from 0x" << static_cast<int>(phdr->p_offset) << std::dec
                   << ", size " << static_cast<int>(phdr->p_filesz) << ". ";
 
-        for (Elf64_Word i = 0; i < phdr->p_filesz; i++) {
-          memory.WriteByte(phdr->p_vaddr + i, program[phdr->p_offset + i]);
-        }
+        memory.WriteBlock(phdr->p_vaddr, program.data() + phdr->p_offset,
+                          phdr->p_filesz);
         std::cerr << "Loaded" << std::endl;
         break;
       default:
@@ -272,9 +280,7 @@ void Load64BitElfFile(std::vector<uint8_t> &program, MemoryWrapper &memory) {
     std::cerr << "BSS start address: " << std::hex << shdr->sh_addr;
     std::cerr << ", end address: " << shdr->sh_addr + shdr->sh_size
               << std::endl;
-    for (uint32_t i = shdr->sh_addr; i < shdr->sh_addr + shdr->sh_size; i++) {
-      memory.WriteByte(i, 0);
-    }
+    memory.Fill(shdr->sh_addr, 0, shdr->sh_size);
   } else {
     std::cerr << "No BSS found." << std::endl;
   }
@@ -365,6 +371,70 @@ FindElf64Symbol(std::vector<uint8_t> &program, std::string target_name) {
   return NULL;
 }
 
+// Finds the address and the size of the symbol |name|. Returns false if the
+// program has no such symbol.
+bool FindSymbol(std::vector<uint8_t> &program, const std::string &name, uint64_t *address, uint64_t *size) {
+  if (flag_64bit) {
+    Elf64_Sym *symbol = FindElf64Symbol(program, name);
+    if (!symbol) {
+      return false;
+    }
+    *address = symbol->st_value;
+    *size = symbol->st_size;
+  } else {
+    Elf32_Sym *symbol = FindElf32Symbol(program, name);
+    if (!symbol) {
+      return false;
+    }
+    *address = symbol->st_value;
+    *size = symbol->st_size;
+  }
+  return true;
+}
+
+// Collects the functions and the code labels of the symbol table.
+std::vector<Profiler::Symbol> GetElf32FunctionSymbols(std::vector<uint8_t> &program) {
+  std::vector<Profiler::Symbol> symbols;
+  Elf32_Shdr *shdr = SearchElf32Shdr(program, SHT_SYMTAB);
+  Elf32_Shdr *strtab_shdr = SearchElf32Shdr(program, ".strtab");
+  if (!shdr || !strtab_shdr) {
+    return symbols;
+  }
+  int number = shdr->sh_size / sizeof(Elf32_Sym);
+  for (int i = 0; i < number; i++) {
+    Elf32_Sym *symbol = (Elf32_Sym *) (program.data() + shdr->sh_offset + i * sizeof(Elf32_Sym));
+    const int type = ELF32_ST_TYPE(symbol->st_info);
+    if ((type == STT_FUNC || type == STT_NOTYPE) && symbol->st_shndx != SHN_UNDEF && symbol->st_shndx < SHN_LORESERVE) {
+      char *symbol_name = (char *) (program.data()) + strtab_shdr->sh_offset + symbol->st_name;
+      symbols.push_back({symbol->st_value, symbol->st_size, symbol_name});
+    }
+  }
+  return symbols;
+}
+
+std::vector<Profiler::Symbol> GetElf64FunctionSymbols(std::vector<uint8_t> &program) {
+  std::vector<Profiler::Symbol> symbols;
+  Elf64_Shdr *shdr = SearchElf64Shdr(program, SHT_SYMTAB);
+  Elf64_Shdr *strtab_shdr = SearchElf64Shdr(program, ".strtab");
+  if (!shdr || !strtab_shdr) {
+    return symbols;
+  }
+  int number = shdr->sh_size / sizeof(Elf64_Sym);
+  for (int i = 0; i < number; i++) {
+    Elf64_Sym *symbol = (Elf64_Sym *) (program.data() + shdr->sh_offset + i * sizeof(Elf64_Sym));
+    const int type = ELF64_ST_TYPE(symbol->st_info);
+    if ((type == STT_FUNC || type == STT_NOTYPE) && symbol->st_shndx != SHN_UNDEF && symbol->st_shndx < SHN_LORESERVE) {
+      char *symbol_name = (char *) (program.data()) + strtab_shdr->sh_offset + symbol->st_name;
+      symbols.push_back({symbol->st_value, symbol->st_size, symbol_name});
+    }
+  }
+  return symbols;
+}
+
+std::vector<Profiler::Symbol> GetFunctionSymbols(std::vector<uint8_t> &program) {
+  return flag_64bit ? GetElf64FunctionSymbols(program) : GetElf32FunctionSymbols(program);
+}
+
 uint32_t GetElf32GlobalPointer(std::vector<uint8_t> &program) {
   std::string target_name = "__global_pointer$";
   Elf32_Sym *symbol = FindElf32Symbol(program, target_name);
@@ -415,156 +485,238 @@ uint64_t GetEntryPoint(std::vector<uint8_t> &program) {
   }
 }
 
-std::tuple<bool, std::string, bool, bool, bool, bool, bool, bool, bool, std::string>
-ParseCmd(int argc, char (***argv)) {
+struct Options {
   bool error = false;
   bool verbose = false;
   bool address64bit = false;
   bool paging = false;
   bool ecall_emulation = false;
   bool host_emulation = false;
-  bool device_enable = false;
+  bool device_emulation = false;
   bool disable_machine_interrupt_delegation = false;
-  std::string diskimage_file = "";
+  bool huge_pages = false;
+  std::string disk_image_file = "";
   std::string filename = "";
-  if (argc < 2) {
-    error = true;
-  } else {
-    for (int i = 1; i < argc && !error; ++i) {
-      if ((*argv)[i][0] == '-') {
-        if ((*argv)[i][1] == 'v') {
-          verbose = true;
-        } else if ((*argv)[i][1] == '6' && (*argv)[i][2] == '4') {
-          address64bit = true;
-        } else if ((*argv)[i][1] == 'p') {
-          paging = true;
-        } else if ((*argv)[i][1] == 'e') {
-          ecall_emulation = true;
-        } else if ((*argv)[i][1] == 'h') {
-          host_emulation = true;
-        } else if ((*argv)[i][1] == 'd') {
-          device_enable = true;
-        } else if ((*argv)[i][1] == 'm') {
-          disable_machine_interrupt_delegation = true;
-        } else if ((*argv)[i][1] == 's') {
-          if (i < argc - 1) {
-            diskimage_file = std::string((*argv)[++i]);
-          } else {
-            error = true;
-          }
-        } else {
-          error = true;
-        }
+  // Snapshots.
+  std::string save_snapshot_file = "";
+  std::string load_snapshot_file = "";
+  bool snapshot_at_pc = false;
+  uint64_t snapshot_pc = 0;
+  // Fork server.
+  std::string fuzz_entry = "";
+  std::string fuzz_buffer = "";
+  std::string coverage_file = "";
+  // Record and replay.
+  std::string record_file = "";
+  std::string replay_file = "";
+  // Time travel.
+  uint64_t checkpoint_interval = 0;
+  uint64_t checkpoint_budget = 512;
+  // Profiler.
+  bool profile = false;
+  uint64_t profile_period = Profiler::kDefaultPeriod;
+  std::string profile_stacks_file = "";
+  // More programs to take function names from, like the user programs of a
+  // kernel.
+  std::vector<std::string> profile_symbol_files;
+  bool instruction_mix = false;
+  // Basic block vectors.
+  std::string bbv_file = "";
+  uint64_t bbv_interval = BasicBlockVector::kDefaultInterval;
+  // Runs to this instruction count before the analyses start.
+  uint64_t fast_forward = 0;
+  // Ends the run this many instructions after the fast forward, if not 0.
+  uint64_t slice = 0;
+  // Binary trace.
+  std::string trace_file = "";
+  bool trace_thread = false;
+};
+
+Options ParseCmd(int argc, char (***argv)) {
+  Options options;
+  for (int i = 1; i < argc && !options.error; ++i) {
+    const std::string arg = (*argv)[i];
+    // Options with a value take it from the next argument.
+    auto value = [&]() {
+      if (i < argc - 1) {
+        return std::string((*argv)[++i]);
+      }
+      options.error = true;
+      return std::string();
+    };
+    if (arg == "--save-snapshot") {
+      options.save_snapshot_file = value();
+    } else if (arg == "--snapshot-at") {
+      std::string pc = value();
+      options.snapshot_at_pc = true;
+      try {
+        options.snapshot_pc = std::stoull(pc, nullptr, 0);
+      } catch (const std::exception &) {
+        options.error = true;
+      }
+    } else if (arg == "--load-snapshot") {
+      options.load_snapshot_file = value();
+    } else if (arg == "--fuzz") {
+      options.fuzz_entry = value();
+    } else if (arg == "--fuzz-buffer") {
+      options.fuzz_buffer = value();
+    } else if (arg == "--coverage") {
+      options.coverage_file = value();
+    } else if (arg == "--record") {
+      options.record_file = value();
+    } else if (arg == "--replay") {
+      options.replay_file = value();
+    } else if (arg == "--profile") {
+      options.profile = true;
+    } else if (arg == "--profile-period") {
+      std::string number = value();
+      options.profile = true;
+      try {
+        options.profile_period = std::stoull(number, nullptr, 0);
+      } catch (const std::exception &) {
+        options.error = true;
+      }
+    } else if (arg == "--profile-stacks") {
+      options.profile = true;
+      options.profile_stacks_file = value();
+    } else if (arg == "--instruction-mix") {
+      options.instruction_mix = true;
+    } else if (arg == "--profile-symbols") {
+      options.profile_symbol_files.push_back(value());
+    } else if (arg == "--trace") {
+      options.trace_file = value();
+    } else if (arg == "--trace-thread") {
+      options.trace_thread = true;
+    } else if (arg == "--bbv") {
+      options.bbv_file = value();
+    } else if (arg == "--bbv-interval" || arg == "--fast-forward" || arg == "--slice") {
+      std::string number = value();
+      try {
+        (arg == "--bbv-interval" ? options.bbv_interval : arg == "--fast-forward" ? options.fast_forward
+                                                                                   : options.slice) =
+            std::stoull(number, nullptr, 0);
+      } catch (const std::exception &) {
+        options.error = true;
+      }
+    } else if (arg == "--checkpoints" || arg == "--checkpoint-budget") {
+      std::string number = value();
+      try {
+        (arg == "--checkpoints" ? options.checkpoint_interval : options.checkpoint_budget) =
+            std::stoull(number, nullptr, 0);
+      } catch (const std::exception &) {
+        options.error = true;
+      }
+    } else if (arg[0] == '-') {
+      if (arg[1] == 'v') {
+        options.verbose = true;
+      } else if (arg[1] == '6' && arg[2] == '4') {
+        options.address64bit = true;
+      } else if (arg[1] == 'p') {
+        options.paging = true;
+      } else if (arg[1] == 'e') {
+        options.ecall_emulation = true;
+      } else if (arg[1] == 'h') {
+        options.host_emulation = true;
+      } else if (arg[1] == 'd') {
+        options.device_emulation = true;
+      } else if (arg[1] == 'm') {
+        options.disable_machine_interrupt_delegation = true;
+      } else if (arg[1] == 'l') {
+        options.huge_pages = true;
+      } else if (arg[1] == 's') {
+        options.disk_image_file = value();
       } else {
-        if (filename == "") {
-          filename = std::string((*argv)[i]);
-        } else {
-          error = true;
-        }
+        options.error = true;
       }
+    } else if (options.filename == "") {
+      options.filename = arg;
+    } else {
+      options.error = true;
     }
   }
-  return std::make_tuple(error, filename, verbose, address64bit, paging,
-                         ecall_emulation, host_emulation, device_enable,
-                         disable_machine_interrupt_delegation, diskimage_file);
+  // A snapshot replaces the ELF file.
+  if (options.filename == "" && options.load_snapshot_file == "") {
+    options.error = true;
+  }
+  if (options.snapshot_at_pc && options.save_snapshot_file == "") {
+    options.error = true;
+  }
+  // The fork server needs the symbols of the ELF file.
+  if ((options.fuzz_entry == "") != (options.fuzz_buffer == "") ||
+      (options.fuzz_entry != "" && (options.filename == "" || options.load_snapshot_file != "" ||
+                                    options.save_snapshot_file != ""))) {
+    options.error = true;
+  }
+  if ((options.record_file != "" && options.replay_file != "") ||
+      ((options.record_file != "" || options.replay_file != "") && options.fuzz_entry != "")) {
+    options.error = true;
+  }
+  // The memory of the run is in the checkpoints.
+  if (options.checkpoint_interval > 0 && (options.fuzz_entry != "" || options.save_snapshot_file != "")) {
+    options.error = true;
+  }
+  // The fork server and time travel stop the run on their own.
+  if ((options.fast_forward > 0 || options.slice > 0) &&
+      (options.fuzz_entry != "" || options.checkpoint_interval > 0)) {
+    options.error = true;
+  }
+  // Both run parts of the execution again, which the analyses would count
+  // twice.
+  if ((options.bbv_file != "" || options.profile || options.instruction_mix) &&
+      (options.fuzz_entry != "" || options.checkpoint_interval > 0)) {
+    options.error = true;
+  }
+  return options;
 }
 
 constexpr int k32BitMmuLevelOneSize = 1024; // 1024 x 4 B = 4 KiB.
-constexpr int k32BitMmuLevelZeroSize = 1024; // 1024 x 4 B = 4 KiB.
 constexpr int k32BitPteSize = 4;
+constexpr int k32BitMegapageBits = 10; // A megapage is 1024 pages.
 
 void SetDefaultMmuTable32(std::shared_ptr<MemoryWrapper> memory) {
   uint32_t level1 = k32BitMmuLevel1;
-  uint32_t level0 = k32BitMmuLevel0;
-  // Sv32. Physical address = virtual address.
-  // Level1.
+  // Sv32. Physical address = virtual address, with 4 MiB megapages.
   Pte32 pte(0);
   pte.SetV(1);
-  for (int i = 0; i < k32BitMmuLevelOneSize; ++i) {
-    uint32_t address = level1 + i * k32BitPteSize;
-    uint32_t ppn = (level0 + i * k32BitMmuLevelZeroSize * k32BitPteSize) >> 12;
-    pte.SetPpn(ppn);
-    uint32_t pte_value = pte.GetValue();
-    memory->Write32(address, pte_value);
-  }
-  // Level0.
   pte.SetX(1);
   pte.SetW(1);
   pte.SetR(1);
-  for (int j = 0; j < k32BitMmuLevelOneSize; ++j) {
-    for (int i = 0; i < k32BitMmuLevelZeroSize; ++i) {
-      uint32_t ppn = j * k32BitMmuLevelZeroSize + i;
-      uint32_t address = level0 + ppn * k32BitPteSize;
-      assert(address < level1 ||
-             level1 + k32BitMmuLevelOneSize * k32BitPteSize <= address);
-      // ((ppn << 12) + offset) will be the physical address. So, x4096 is not needed here.
-      pte.SetPpn(ppn);
-      memory->Write32(address, pte.GetValue());
-    }
+  for (int i = 0; i < k32BitMmuLevelOneSize; ++i) {
+    uint32_t address = level1 + i * k32BitPteSize;
+    // ((ppn << 12) + offset) will be the physical address. PPN[0] is 0 in a megapage.
+    pte.SetPpn(i << k32BitMegapageBits);
+    memory->Write32(address, pte.GetValue());
   }
   return;
 }
 
 constexpr uint64_t k64BitMmuLevelTwoSize = 512; // 512 x 8 B = 4 KiB.
-constexpr uint64_t k64BitMmuLevelOneSize = 512; // 512 x 8 B = 4 KiB.
-constexpr uint64_t k64BitMmuLevelZeroSize = 512; // 512 x 8 B = 4 KiB.
 constexpr int k64BitPteSize = 8;
+constexpr int k64BitGigapageBits = 18; // A gigapage is 512 x 512 pages.
 
 void SetDefaultMmuTable64(std::shared_ptr<MemoryWrapper> memory) {
   uint64_t level2 = k64BitMmuLevel2;
-  uint64_t level1 = k64BitMmuLevel1;
-  uint64_t level0 = k64BitMmuLevel0;
-  // Sv32. Physical address = virtual address.
-  Pte32 pte(0);
+  // Sv39. Physical address = virtual address, with 1 GiB gigapages.
+  Pte64 pte(0);
   // Level2. Map only 32bit range = 4 entry at level 2.
   unsigned kLevel2ValidEntry = 4;
   for (unsigned i = 0; i < k64BitMmuLevelTwoSize; i++) {
-    uint32_t address = level2 + i * k64BitPteSize;
+    uint64_t address = level2 + i * k64BitPteSize;
     if (i < kLevel2ValidEntry) {
       pte.SetV(1);
-      uint64_t ppn = (level1 + i * k64BitMmuLevelOneSize * k64BitPteSize) >> 12;
-      pte.SetPpn(ppn);
+      pte.SetX(1);
+      pte.SetW(1);
+      pte.SetR(1);
+      // PPN[1] and PPN[0] are 0 in a gigapage.
+      pte.SetPpn(static_cast<uint64_t>(i) << k64BitGigapageBits);
     } else {
-      pte.SetPpn(0);
-    }
-    uint64_t pte_value = pte.GetValue();
-    memory->Write64(address, pte_value);
-  }
-  // Level1.
-  pte.SetV(1);
-  for (unsigned j = 0; j < kLevel2ValidEntry; ++j) {
-    for (unsigned i = 0; i < k64BitMmuLevelOneSize; ++i) {
-      uint32_t address =
-        level1 + j * k64BitMmuLevelOneSize * k64BitPteSize + i * k64BitPteSize;
-      uint64_t ppn = (level0 +
-                      j * k64BitMmuLevelOneSize * k64BitMmuLevelZeroSize *
-                      k64BitPteSize +
-                      i * k64BitMmuLevelZeroSize * k64BitPteSize) >> 12;
-      pte.SetPpn(ppn);
-      uint64_t pte_value = pte.GetValue();
-      memory->Write64(address, pte_value);
-    }
-  }
-  // Level0.
-  pte.SetX(1);
-  pte.SetW(1);
-  pte.SetR(1);
-  for (unsigned k = 0; k < kLevel2ValidEntry; ++k) {
-    for (unsigned j = 0; j < k64BitMmuLevelOneSize; ++j) {
-      for (unsigned i = 0; i < k64BitMmuLevelZeroSize; ++i) {
-        // ((ppn << 12) + offset) will be the physical address. So, x4096 is not needed for ppn.
-        uint64_t ppn = k * k64BitMmuLevelOneSize * k64BitMmuLevelZeroSize +
-                       j * k64BitMmuLevelZeroSize + i;
-        uint32_t address = level0 + ppn * k64BitPteSize;
-        pte.SetPpn(ppn);
-        memory->Write64(address, pte.GetValue());
-      }
+      pte = Pte64(0);
     }
+    memory->Write64(address, pte.GetValue());
   }
   return;
 }
 
-
 void SetDefaultMmuTable(bool address64bit, std::shared_ptr<MemoryWrapper> memory) {
   if (address64bit) {
     SetDefaultMmuTable64(memory);
@@ -573,27 +725,174 @@ void SetDefaultMmuTable(bool address64bit, std::shared_ptr<MemoryWrapper> memory
   }
 }
 
+void WriteCoverage(const std::string &filename, const std::vector<uint8_t> &coverage) {
+  std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+  file.write(reinterpret_cast<const char *>(coverage.data()), coverage.size());
+  if (!file) {
+    std::cerr << "Failed to write coverage to " << filename << "." << std::endl;
+  }
+}
+
+// Reads time travel commands from stdin until "q" or the end of the input.
+void TimeTravelPrompt(TimeTravel *time_travel, RiscvCpu *cpu) {
+  uint64_t break_pc = TimeTravel::kNoBreak;
+  auto show_position = [&]() {
+    std::cerr << "Instruction " << cpu->GetInstructionCount() << ", pc " << std::hex << cpu->GetNextPc() << std::dec
+              << (time_travel->IsEnd() ? ", end of the run" : "") << "." << std::endl;
+  };
+  show_position();
+  std::string line;
+  while (std::cerr << "(time travel) " << std::flush, std::getline(std::cin, line)) {
+    std::istringstream stream(line);
+    std::string command;
+    uint64_t value;
+    stream >> command >> std::setbase(0) >> value;
+    const bool has_value = !stream.fail();
+    if (!has_value) {
+      value = 1;
+    }
+    const uint64_t now = cpu->GetInstructionCount();
+    if (command == "s") {
+      time_travel->RunTo(now + value);
+    } else if (command == "rs" || (command == "g" && has_value)) {
+      const uint64_t count = command == "rs" ? now - std::min(now, value) : value;
+      if (!time_travel->GoTo(count)) {
+        std::cerr << "The oldest checkpoint is at instruction " << time_travel->GetOldestInstructionCount() << "."
+                  << std::endl;
+      }
+    } else if (command == "c") {
+      time_travel->RunTo(UINT64_MAX, break_pc);
+    } else if (command == "rc") {
+      if (break_pc == TimeTravel::kNoBreak || !time_travel->ReverseContinue(break_pc)) {
+        std::cerr << "The break point wasn't reached since instruction " << time_travel->GetOldestInstructionCount()
+                  << "." << std::endl;
+      }
+    } else if (command == "b") {
+      break_pc = has_value ? value : TimeTravel::kNoBreak;
+      continue;
+    } else if (command == "r") {
+      for (int i = 0; i < 32; ++i) {
+        std::cerr << "x" << std::dec << i << " = " << std::hex << cpu->ReadRegister(i) << ((i % 4 == 3) ? "\n" : "\t");
+      }
+      std::cerr << std::dec;
+      continue;
+    } else if (command == "x" && has_value) {
+      std::cerr << std::hex << value << ": " << time_travel->GetMemory().Read32(value) << std::dec << std::endl;
+      continue;
+    } else if (command == "q") {
+      break;
+    } else {
+      if (command != "") {
+        std::cerr << "s [n]: step, rs [n]: step back, g count: go to an instruction count, b [pc]: set or clear the"
+                  << " break point, c: continue, rc: continue back, r: registers, x address: physical memory, q: quit"
+                  << std::endl;
+      }
+      continue;
+    }
+    show_position();
+  }
+}
+
+// Starts the machine from the ELF file of |options|, which is read into
+// |program|. Returns the entry point.
+uint64_t LoadProgram(const Options &options, std::vector<uint8_t> *program_out, std::unique_ptr<RiscvCpu> *cpu,
+                     std::shared_ptr<MemoryWrapper> *memory_out) {
+  std::cerr << "Elf file name: " << options.filename << std::endl;
+  *program_out = ReadFile(options.filename);
+  std::vector<uint8_t> &program = *program_out;
+
+  // The loaded ELF image is kept read-only and the CPU runs on a
+  // copy-on-write overlay of it.
+  auto image = std::make_shared<MemoryWrapper>();
+  image->EnableHugePages(options.huge_pages);
+  LoadElfFile(program, *image);
+  auto memory = std::make_shared<MemoryWrapper>(std::shared_ptr<const MemoryWrapper>(image));
+  memory->EnableHugePages(options.huge_pages);
+  uint32_t entry_point = GetEntryPoint(program);
+  std::cerr << "Entry point is 0x" << std::hex << entry_point << std::dec
+            << std::endl;
+
+  int64_t global_pointer = GetGlobalPointer(program);
+  if (global_pointer == -1) {
+    global_pointer = entry_point;
+  }
+  std::cerr << "Global Pointer is 0x" << std::hex << global_pointer << std::dec
+            << std::endl;
+
+  uint32_t sp_value = kTop;
+
+  cpu->reset(new RiscvCpu(options.address64bit));
+  (*cpu)->SetEcallEmulationEnable(options.ecall_emulation);
+  (*cpu)->SetRegister(SP, sp_value);
+  (*cpu)->SetRegister(GP, global_pointer);
+  uint64_t satp = 0;
+  if (options.paging) {
+    std::cerr << "Paging enabled." << std::endl;
+    SetDefaultMmuTable(options.address64bit, memory);
+    if (options.address64bit) {
+      satp = (k64BitMmuLevel2 >> 12) | (static_cast<uint64_t>(8) << 60);
+    } else {
+      satp = (k32BitMmuLevel1 >> 12) | (1 << 31);
+    }
+  }
+  (*cpu)->SetCsr(SATP, satp);
+  (*cpu)->SetMemory(memory);
+  (*cpu)->SetWorkMemory(kTop, kBottom);
+  (*cpu)->SetHostEmulationEnable(options.host_emulation);
+  (*cpu)->SetDeviceEmulationEnable(options.device_emulation);
+  (*cpu)->DisableMachineInterruptDelegation(options.disable_machine_interrupt_delegation);
+  *memory_out = memory;
+  return entry_point;
+}
+
+// The file descriptor of stderr.
+constexpr int kStderrFd = 2;
+
+// The CPU whose flight recorder a fatal signal dumps.
+const RiscvCpu *signal_cpu = nullptr;
+
+constexpr int kDumpSignals[] = {
+    SIGSEGV, SIGFPE, SIGILL, SIGABRT, SIGINT, SIGTERM,
+#ifdef SIGBUS
+    SIGBUS,
+#endif
+};
+
+void DumpFlightRecorderOnSignal(int signal) {
+  if (signal_cpu) {
+    signal_cpu->DumpFlightRecorder(kStderrFd);
+  }
+  std::signal(signal, SIG_DFL);
+  std::raise(signal);
+}
+
+// Dumps the flight recorder of a CPU on a fatal signal while it exists.
+class SignalDump {
+ public:
+  explicit SignalDump(const RiscvCpu *cpu) {
+    signal_cpu = cpu;
+    for (int signal : kDumpSignals) {
+      std::signal(signal, DumpFlightRecorderOnSignal);
+    }
+  }
+
+  ~SignalDump() {
+    for (int signal : kDumpSignals) {
+      std::signal(signal, SIG_DFL);
+    }
+    signal_cpu = nullptr;
+  }
+};
+
 int run(int argc, char *argv[]) {
-  bool cmdline_error, verbose, address64bit, paging, ecall_emulation, host_emulation,
-      device_emulation, disable_machine_interrupt_delegation;
-  std::string disk_image_file;
-  std::string filename;
-
-  auto options = ParseCmd(argc, &argv);
-  cmdline_error = std::get<0>(options);
-  filename = std::get<1>(options);
-  verbose = std::get<2>(options);
-  address64bit = std::get<3>(options);
-  paging = std::get<4>(options);
-  ecall_emulation = std::get<5>(options);
-  host_emulation = std::get<6>(options);
-  device_emulation = std::get<7>(options);
-  disable_machine_interrupt_delegation = std::get<8>(options);
-  disk_image_file = std::get<9>(options);
-
-
-  if (cmdline_error) {
-    std::cerr << "Uasge: " << argv[0] << " elf_file " << "[-v][-64][-p][-e][-h][-m][-s disk.img]"
+  Options options = ParseCmd(argc, &argv);
+  if (options.error) {
+    std::cerr << "Uasge: " << argv[0] << " elf_file " << "[-v][-64][-p][-e][-h][-m][-l][-s disk.img]"
+              << "[--save-snapshot file [--snapshot-at pc]][--load-snapshot file]"
+              << "[--fuzz function --fuzz-buffer buffer][--coverage file][--record file|--replay file]"
+              << "[--checkpoints interval [--checkpoint-budget MiB]][--profile [--profile-period n]]"
+              << "[--profile-stacks file][--profile-symbols elf_file][--instruction-mix]"
+              << "[--bbv file [--bbv-interval n]][--fast-forward count][--slice n][--trace file [--trace-thread]]"
               << std::endl;
     std::cerr << "-v: Verbose" << std::endl;
     std::cerr << "-e: System Call Emulation" << std::endl;
@@ -603,68 +902,238 @@ int run(int argc, char *argv[]) {
     std::cerr << "-d: Device emulation of UART and VirtioDisk (needed to use -s option). Press Ctrl-a to exit." << std::endl;
     std::cerr << "-h: Use tohost and fromhost function" << std::endl;
     std::cerr << "-m: disable delegation of machine interrupt (for compatibility with QEMU)" << std::endl;
+    std::cerr << "-l: back guest memory with 2 MiB huge pages when available" << std::endl;
     std::cerr << "-s disk.img: specify disk image" << std::endl;
+    std::cerr << "--save-snapshot file: save the machine to file at exit" << std::endl;
+    std::cerr << "--snapshot-at pc: save the snapshot when pc is first reached instead, and continue" << std::endl;
+    std::cerr << "--load-snapshot file: start from a snapshot instead of elf_file, with the options it was saved"
+              << " with. -s replaces its disk image." << std::endl;
+    std::cerr << "--fuzz function: run to function, then serve afl-fuzz as a fork server. Each input is copied to"
+              << " --fuzz-buffer and run until function returns, with a0 = buffer and a1 = input size."
+              << " Without afl-fuzz, runs stdin once" << std::endl;
+    std::cerr << "--fuzz-buffer buffer: symbol of the input buffer, which takes up to its symbol size" << std::endl;
+    std::cerr << "--coverage file: write the AFL edge coverage map of the run to file. Under afl-fuzz the map"
+              << " of afl-fuzz is used instead" << std::endl;
+    std::cerr << "--record file: log the key strokes, the system call results and the disk image hash of the run"
+              << " to file" << std::endl;
+    std::cerr << "--replay file: rerun a recorded run with the logged inputs, with the same elf_file or snapshot"
+              << " and options" << std::endl;
+    std::cerr << "--checkpoints interval: take a checkpoint every interval instructions, and when the run ends, read"
+              << " commands to step and continue forwards and backwards from stdin" << std::endl;
+    std::cerr << "--checkpoint-budget MiB: drop the oldest checkpoints beyond this size (default 512)" << std::endl;
+    std::cerr << "--profile: sample the pc every " << Profiler::kDefaultPeriod << " instructions, and print the"
+              << " functions with the most samples at exit" << std::endl;
+    std::cerr << "--profile-period n: sample every n instructions instead" << std::endl;
+    std::cerr << "--profile-stacks file: also follow the calls, and write the sampled call stacks to file in the"
+              << " folded format of flamegraph.pl" << std::endl;
+    std::cerr << "--profile-symbols elf_file: take function names from elf_file too, e.g. a user program of a"
+              << " kernel. May be repeated" << std::endl;
+    std::cerr << "--instruction-mix: count the instructions that execute, full width and compressed, per privilege"
+              << " mode, and print the counts at exit" << std::endl;
+    std::cerr << "--bbv file: write the basic block vector of every interval to file, for SimPoint" << std::endl;
+    std::cerr << "--bbv-interval n: instructions per interval (default " << BasicBlockVector::kDefaultInterval
+              << ")" << std::endl;
+    std::cerr << "--fast-forward count: run without the analyses until the instruction count is count, e.g. the"
+              << " start of an interval. --save-snapshot saves the snapshot there" << std::endl;
+    std::cerr << "--slice n: end the run n instructions after the fast forward" << std::endl;
+    std::cerr << "--trace file: write a binary trace of the instructions, their register write backs and memory"
+              << " accesses to file. trace_decoder turns it into the text of -v" << std::endl;
+    std::cerr << "--trace-thread: write the trace from a thread of its own" << std::endl;
     return -1;
   }
 
-  std::cerr << "Elf file name: " << filename << std::endl;
-  if (verbose) {
+  if (options.verbose) {
     std::cerr << "Verbose mode." << std::endl;
   }
 
-  std::vector<uint8_t> program = ReadFile(filename);
-
-  auto memory = std::make_shared<MemoryWrapper>(MemoryWrapper());
-  LoadElfFile(program, *memory);
-  uint32_t entry_point = GetEntryPoint(program);
-  std::cerr << "Entry point is 0x" << std::hex << entry_point << std::dec
-            << std::endl;
-
-  int64_t global_pointer = GetGlobalPointer(program);
-  if (global_pointer == -1) {
-    global_pointer = entry_point;
+  std::unique_ptr<RiscvCpu> cpu;
+  std::shared_ptr<MemoryWrapper> memory;
+  std::shared_ptr<std::vector<uint8_t>> disk_image;
+  std::vector<uint8_t> program;
+  uint64_t start_pc;
+  if (options.load_snapshot_file != "") {
+    if (!LoadSnapshot(options.load_snapshot_file, &cpu, &memory, &disk_image)) {
+      return -1;
+    }
+    std::cerr << "Snapshot " << options.load_snapshot_file << " loaded." << std::endl;
+    memory->EnableHugePages(options.huge_pages);
+    start_pc = cpu->GetNextPc();
+  } else {
+    start_pc = LoadProgram(options, &program, &cpu, &memory);
   }
-  std::cerr << "Global Pointer is 0x" << std::hex << global_pointer << std::dec
-            << std::endl;
-
-  uint32_t sp_value = kTop;
 
   // Read DiskImage.
-  std::shared_ptr<std::vector<uint8_t>> disk_image;
-  if (disk_image_file != "") {
-    disk_image = std::make_shared<std::vector<uint8_t >>(ReadFile(disk_image_file));
+  if (options.disk_image_file != "") {
+    disk_image = std::make_shared<std::vector<uint8_t >>(ReadFile(options.disk_image_file));
   }
 
   // Run CPU emulator
   std::cerr << "Execution start" << std::endl;
-
-  RiscvCpu cpu(address64bit);
-  cpu.SetEcallEmulationEnable(ecall_emulation);
-  cpu.SetRegister(SP, sp_value);
-  cpu.SetRegister(GP, global_pointer);
-  SetDefaultMmuTable(address64bit, memory);
-  uint64_t satp = 0;
-  if (paging) {
-    std::cerr << "Paging enabled." << std::endl;
-    if (address64bit) {
-      satp = (k64BitMmuLevel2 >> 12) | (static_cast<uint64_t>(8) << 60);
-    } else {
-      satp = (k32BitMmuLevel1 >> 12) | (1 << 31);
+  SignalDump signal_dump(cpu.get());
+
+  cpu->DeviceInitialization();
+  cpu->SetDiskImage(disk_image);
+  std::shared_ptr<ReplayLog> replay_log;
+  // Time travel runs parts again, so the inputs are recorded in any case.
+  if (options.record_file != "" || options.replay_file != "" || options.checkpoint_interval > 0) {
+    replay_log = std::make_shared<ReplayLog>();
+    const bool started = options.replay_file != "" ? replay_log->StartReplay(options.replay_file, disk_image.get())
+                                                   : replay_log->StartRecording(options.record_file, disk_image.get());
+    if (!started) {
+      return -1;
+    }
+    cpu->SetReplayLog(replay_log);
+  }
+  // The analyses start where the fast forward ends.
+  if (options.fast_forward > cpu->GetInstructionCount()) {
+    cpu->SetStopInstructionCount(options.fast_forward);
+    cpu->RunCpu(start_pc, false);
+    if (!cpu->IsStopped()) {
+      std::cerr << "The program ended before instruction " << options.fast_forward << "." << std::endl;
+      return -1;
+    }
+    start_pc = cpu->GetNextPc();
+    std::cerr << "Fast forwarded to instruction " << options.fast_forward << "." << std::endl;
+    if (options.save_snapshot_file != "" && !options.snapshot_at_pc) {
+      SaveSnapshot(options.save_snapshot_file, *cpu, *memory, disk_image.get());
+      options.save_snapshot_file = "";
+    }
+  }
+  Profiler profiler(options.profile_period);
+  if (options.profile) {
+    std::vector<Profiler::Symbol> symbols;
+    if (!program.empty()) {
+      symbols = GetFunctionSymbols(program);
+    }
+    for (const std::string &filename : options.profile_symbol_files) {
+      std::vector<uint8_t> elf = ReadFile(filename);
+      std::vector<Profiler::Symbol> elf_symbols = GetFunctionSymbols(elf);
+      symbols.insert(symbols.end(), elf_symbols.begin(), elf_symbols.end());
+    }
+    profiler.SetSymbols(std::move(symbols));
+    if (options.profile_stacks_file != "") {
+      profiler.EnableCallStacks();
+    }
+    cpu->SetProfiler(&profiler);
+  }
+  InstructionMix instruction_mix;
+  if (options.instruction_mix) {
+    cpu->SetInstructionMix(&instruction_mix);
+  }
+  std::ofstream bbv_file;
+  BasicBlockVector bbv(&bbv_file, options.bbv_interval);
+  if (options.bbv_file != "") {
+    bbv_file.open(options.bbv_file, std::ios::trunc);
+    if (!bbv_file) {
+      std::cerr << "Failed to create " << options.bbv_file << "." << std::endl;
+      return -1;
+    }
+    cpu->SetBasicBlockVector(&bbv);
+  }
+  TraceWriter trace_writer;
+  if (options.trace_file != "") {
+    if (!trace_writer.Open(options.trace_file, cpu->GetMxl(), options.trace_thread)) {
+      return -1;
+    }
+    cpu->SetTraceWriter(&trace_writer);
+  }
+  std::vector<uint8_t> coverage;
+  if (options.coverage_file != "") {
+    coverage.resize(RiscvCpu::kCoverageMapSize);
+    cpu->SetCoverageMap(coverage.data(), coverage.size());
+  }
+  if (options.fuzz_entry != "") {
+    uint64_t entry, entry_size, buffer, buffer_size;
+    if (!FindSymbol(program, options.fuzz_entry, &entry, &entry_size) ||
+        !FindSymbol(program, options.fuzz_buffer, &buffer, &buffer_size) || buffer_size == 0) {
+      std::cerr << "Symbol " << options.fuzz_entry << " or " << options.fuzz_buffer << " not found." << std::endl;
+      return -1;
+    }
+    cpu->SetStopPc(entry);
+    cpu->RunCpu(start_pc, options.verbose);
+    if (!cpu->IsStopped()) {
+      std::cerr << "The program ended before " << options.fuzz_entry << "." << std::endl;
+      return -1;
+    }
+    // Only the coverage of the input counts.
+    std::fill(coverage.begin(), coverage.end(), 0);
+    ForkServer server(cpu.get(), memory, buffer, buffer_size);
+    int error = server.Serve();
+    if (options.coverage_file != "") {
+      WriteCoverage(options.coverage_file, coverage);
+    }
+    return error;
+  }
+  int error;
+  if (options.checkpoint_interval > 0) {
+    // Stops right away, so that the first checkpoint is at the start.
+    cpu->SetStopInstructionCount(cpu->GetInstructionCount());
+    cpu->RunCpu(start_pc, false);
+    TimeTravel time_travel(cpu.get(), memory, disk_image, replay_log, options.checkpoint_interval,
+                           options.checkpoint_budget << 20);
+    error = time_travel.RunTo(UINT64_MAX);
+    TimeTravelPrompt(&time_travel, cpu.get());
+  } else {
+    if (options.snapshot_at_pc) {
+      cpu->SetStopPc(options.snapshot_pc);
+    }
+    const uint64_t slice_end =
+        options.slice > 0 ? cpu->GetInstructionCount() + options.slice : RiscvCpu::kNoStopInstructionCount;
+    cpu->SetStopInstructionCount(slice_end);
+    error = cpu->RunCpu(start_pc, options.verbose);
+    if (cpu->IsStopped() && cpu->GetInstructionCount() != slice_end) {
+      SaveSnapshot(options.save_snapshot_file, *cpu, *memory, disk_image.get());
+      error = cpu->RunCpu(cpu->GetNextPc(), options.verbose);
+    } else if (options.save_snapshot_file != "" && !options.snapshot_at_pc) {
+      SaveSnapshot(options.save_snapshot_file, *cpu, *memory, disk_image.get());
+    }
+    if (cpu->IsStopped() && cpu->GetInstructionCount() == slice_end) {
+      std::cerr << "The slice ended at instruction " << slice_end << "." << std::endl;
     }
   }
-  cpu.SetCsr(SATP, satp);
-  cpu.SetMemory(memory);
-  cpu.SetWorkMemory(kTop, kBottom);
-  cpu.SetHostEmulationEnable(host_emulation);
-  cpu.SetDeviceEmulationEnable(device_emulation);
-  cpu.DisableMachineInterruptDelegation(disable_machine_interrupt_delegation);
-  cpu.DeviceInitialization();
-  cpu.SetDiskImage(disk_image);
-  int error = cpu.RunCpu(entry_point, verbose);
   if (error) {
     printf("CPU execution fail.\n");
+    std::fflush(stdout);
+    cpu->DumpFlightRecorder(kStderrFd);
+  }
+  if (options.replay_file != "" && !replay_log->HasDiverged() && !replay_log->IsEnd()) {
+    std::cerr << "The replay ended before the last logged event, at instruction " << cpu->GetInstructionCount()
+              << "." << std::endl;
+  }
+  if (options.coverage_file != "") {
+    WriteCoverage(options.coverage_file, coverage);
+  }
+  if (options.profile) {
+    profiler.Report(std::cerr);
+  }
+  if (options.instruction_mix) {
+    instruction_mix.Report(std::cerr);
+  }
+  if (options.trace_file != "" && !trace_writer.Close()) {
+    std::cerr << "Failed to write the trace to " << options.trace_file << "." << std::endl;
+  }
+  if (options.bbv_file != "" && !bbv_file.flush()) {
+    std::cerr << "Failed to write " << options.bbv_file << "." << std::endl;
+  }
+  if (options.profile_stacks_file != "") {
+    std::ofstream stacks(options.profile_stacks_file, std::ios::trunc);
+    profiler.WriteFoldedStacks(stacks);
+    if (!stacks) {
+      std::cerr << "Failed to write call stacks to " << options.profile_stacks_file << "." << std::endl;
+    }
+  }
+  int return_value = cpu->ReadRegister(A0);
+
+  const Mmu::Statistics &mmu_statistics = cpu->GetMmuStatistics();
+  if (mmu_statistics.tlb_hits + mmu_statistics.tlb_misses > 0) {
+    std::cerr << "TLB hits: " << mmu_statistics.tlb_hits << ", misses: " << mmu_statistics.tlb_misses
+              << ", flushes: " << mmu_statistics.tlb_flushes << "." << std::endl;
+    const uint64_t walks = mmu_statistics.walk_cache_hits + mmu_statistics.walk_cache_misses;
+    if (walks > 0) {
+      std::cerr << "Page walk cache hits: " << mmu_statistics.walk_cache_hits << " of " << walks << " walks ("
+                << mmu_statistics.walk_cache_hits * 100 / walks << "%)." << std::endl;
+    }
   }
-  int return_value = cpu.ReadRegister(A0);
 
   std::cerr << "Return GetValue: " << return_value << "." << std::endl;
 
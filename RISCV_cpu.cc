@@ -2,10 +2,16 @@
 #include <stdint.h>
 #include <algorithm>
 #include <cassert>
+#include <cstring>
 #include <iostream>
-#include "Disassembler.h"
+#include "BasicBlockVector.h"
+#include "InstructionMix.h"
 #include "Mmu.h"
+#include "Profiler.h"
+#include "ReplayLog.h"
 #include "bit_tools.h"
+#include "Snapshot.h"
+#include "Trace.h"
 #include "instruction_encdec.h"
 #include "memory_wrapper.h"
 #include "system_call_emulator.h"
@@ -23,6 +29,8 @@ RiscvCpu::RiscvCpu(bool en64bit) {
   InitializeCsrs();
   ClearTimerInterruptFlag();
   peripheral_ = std::make_unique<PeripheralEmulator>(mxl_);
+  pmp_.SetMxl(mxl_);
+  mmu_.SetPmp(&pmp_);
 }
 
 RiscvCpu::RiscvCpu() : RiscvCpu(false) {}
@@ -42,6 +50,84 @@ void RiscvCpu::InitializeCsrs() {
   }
 }
 
+void RiscvCpu::SaveState(SnapshotWriter &writer) const {
+  writer.Put(mxl_);
+  for (uint64_t reg : reg_) {
+    writer.Put(reg);
+  }
+  writer.Put(next_pc_);
+  writer.Put(instruction_count_);
+  writer.Put(static_cast<uint8_t>(privilege_));
+  writer.Put(mstatus_);
+  writer.Put(mie_);
+  writer.Put(mip_);
+  for (uint64_t csr : csrs_) {
+    writer.Put(csr);
+  }
+  writer.Put(timer_interrupt_);
+  writer.Put(prev_page_fault_);
+  writer.Put(prev_faulting_address_);
+  writer.Put(virtio_interrupt_);
+  writer.Put(uart_interrupt_);
+  writer.Put(ecall_emulation_);
+  writer.Put(host_emulation_);
+  writer.Put(peripheral_emulation_);
+  writer.Put(disable_machine_interrupt_delegation_);
+  writer.Put(top_);
+  writer.Put(bottom_);
+  writer.Put(brk_);
+  peripheral_->SaveState(writer);
+}
+
+bool RiscvCpu::RestoreState(SnapshotReader &reader) {
+  if (reader.Get<int>() != mxl_) {
+    return false;
+  }
+  for (uint64_t &reg : reg_) {
+    reg = reader.Get<uint64_t>();
+  }
+  next_pc_ = reader.Get<uint64_t>();
+  instruction_count_ = reader.Get<uint64_t>();
+  privilege_ = static_cast<PrivilegeMode>(reader.Get<uint8_t>());
+  mstatus_ = reader.Get<uint64_t>();
+  mie_ = reader.Get<uint64_t>();
+  mip_ = reader.Get<uint64_t>();
+  for (uint64_t &csr : csrs_) {
+    csr = reader.Get<uint64_t>();
+  }
+  timer_interrupt_ = reader.Get<bool>();
+  prev_page_fault_ = reader.Get<bool>();
+  prev_faulting_address_ = reader.Get<uint64_t>();
+  virtio_interrupt_ = reader.Get<bool>();
+  uart_interrupt_ = reader.Get<bool>();
+  ecall_emulation_ = reader.Get<bool>();
+  SetHostEmulationEnable(reader.Get<bool>());
+  SetDeviceEmulationEnable(reader.Get<bool>());
+  disable_machine_interrupt_delegation_ = reader.Get<bool>();
+  top_ = reader.Get<uint64_t>();
+  bottom_ = reader.Get<uint64_t>();
+  brk_ = reader.Get<uint64_t>();
+  peripheral_->RestoreState(reader);
+  // The PMP entries are rebuilt from the CSRs. The addresses go first, as a
+  // locked entry ignores later address writes, and the entries locked since
+  // the state was saved are cleared before.
+  pmp_.Reset();
+  for (int i = 0; i < Pmp::kEntries; ++i) {
+    pmp_.WriteCsr(Pmp::kPmpAddr0 + i, csrs_[Pmp::kPmpAddr0 + i]);
+  }
+  for (int i = 0; i < Pmp::kEntries / 4; ++i) {
+    pmp_.WriteCsr(Pmp::kPmpCfg0 + i, csrs_[Pmp::kPmpCfg0 + i]);
+  }
+  mmu_.FlushTlb();
+  fetch_page_ = nullptr;
+  FlushHostTlb();
+  SetProfiler(profiler_);
+  SetBasicBlockVector(basic_block_vector_);
+  // The records are of another run.
+  flight_recorder_.Clear();
+  return !reader.HasError() && reader.IsEnd();
+}
+
 void RiscvCpu::DeviceInitialization() {
   if (!peripheral_emulation_) {
     return;
@@ -54,8 +140,7 @@ void RiscvCpu::SetDiskImage(std::shared_ptr<std::vector<uint8_t> > disk_image) {
   peripheral_->SetDiskImage(disk_image);
 }
 
-uint64_t RiscvCpu::VirtualToPhysical(uint64_t virtual_address, bool write_access) {
-  mmu_.SetMxl(mxl_);
+PrivilegeMode RiscvCpu::GetTranslationPrivilege() {
   PrivilegeMode privilege = privilege_;
   if (privilege == PrivilegeMode::MACHINE_MODE) {
     uint32_t mprv = bitcrop(csrs_[MSTATUS], 1, 17);
@@ -64,15 +149,39 @@ uint64_t RiscvCpu::VirtualToPhysical(uint64_t virtual_address, bool write_access
       privilege = IntToPrivilegeMode(mpp);
     }
   }
-  mmu_.SetPrivilege(privilege);
+  return privilege;
+}
+
+uint64_t RiscvCpu::VirtualToPhysical(uint64_t virtual_address, bool write_access) {
+  mmu_.SetMxl(mxl_);
+  mmu_.SetPrivilege(GetTranslationPrivilege());
   uint64_t physical_address = mmu_.VirtualToPhysical(virtual_address, csrs_[SATP], write_access);
   if (mmu_.GetPageFault()) {
     page_fault_ = true;
     faulting_address_ = mmu_.GetFaultingAddress();
+  } else if (mmu_.GetAccessFault()) {
+    access_fault_ = true;
+    faulting_address_ = mmu_.GetFaultingAddress();
   }
   return physical_address;
 }
 
+// Sets the access fault if PMP denies the access. Instruction fetch is
+// checked in the current privilege mode, and loads and stores in the one
+// MPRV selects.
+bool RiscvCpu::CheckPmp(uint64_t virtual_address, uint64_t physical_address, int width, uint8_t access) {
+  if (!pmp_.IsActive()) {
+    return true;
+  }
+  const PrivilegeMode privilege = access == Pmp::kExecute ? privilege_ : GetTranslationPrivilege();
+  if (pmp_.Check(physical_address, width, access, privilege)) {
+    return true;
+  }
+  access_fault_ = true;
+  faulting_address_ = virtual_address;
+  return false;
+}
+
 // A helper function to record shift sign error.
 bool RiscvCpu::CheckShiftSign(uint8_t shamt, uint8_t instruction, const std::string &message_str) {
   if (xlen_ == 32 || instruction == INST_SLLIW || instruction == INST_SRAIW || instruction == INST_SRLIW) {
@@ -88,18 +197,169 @@ void RiscvCpu::SetMemory(std::shared_ptr<MemoryWrapper> memory) {
   this->memory_ = memory;
   peripheral_->SetMemory(memory);
   mmu_.SetMemory(memory);
+  fetch_page_ = nullptr;
+  FlushHostTlb();
+}
+
+void RiscvCpu::SetProfiler(Profiler *profiler) {
+  profiler_ = profiler;
+  track_calls_ = profiler && profiler->IsCallStacksEnabled();
+  next_sample_count_ = profiler ? instruction_count_ + profiler->GetPeriod() : kNoStopInstructionCount;
+  ScheduleEvents();
+}
+
+void RiscvCpu::SetBasicBlockVector(BasicBlockVector *bbv) {
+  basic_block_vector_ = bbv;
+  next_interval_count_ = bbv ? instruction_count_ + bbv->GetInterval() : kNoStopInstructionCount;
+  ScheduleEvents();
+}
+
+bool RiscvCpu::InstructionCountEvent() {
+  if (instruction_count_ == next_sample_count_) {
+    profiler_->Sample(pc_, privilege_);
+    next_sample_count_ += profiler_->GetPeriod();
+  }
+  if (instruction_count_ == next_interval_count_) {
+    basic_block_vector_->EndInterval();
+    next_interval_count_ += basic_block_vector_->GetInterval();
+  }
+  bool stop = false;
+  if (instruction_count_ == stop_instruction_count_) {
+    stop_instruction_count_ = kNoStopInstructionCount;
+    stop = true;
+  }
+  ScheduleEvents();
+  return stop;
+}
+
+void RiscvCpu::SetReplayLog(std::shared_ptr<ReplayLog> log) {
+  replay_log_ = log;
+  if (log) {
+    log->SetClock(&instruction_count_);
+  }
+  peripheral_->SetReplayLog(log);
+}
+
+void RiscvCpu::FlushHostTlb() {
+  for (HostTlbEntry &entry : host_tlb_) {
+    entry.read_tag = kHostTlbInvalid;
+    entry.write_tag = kHostTlbInvalid;
+  }
+}
+
+// Enters the page of a load or store that completed on the slow path.
+void RiscvCpu::FillHostTlb(uint64_t virtual_address, uint64_t physical_address, bool write) {
+  constexpr uint64_t kPageMask = ~static_cast<uint64_t>(MemoryWrapper::kPageSize - 1);
+  const uint64_t physical_page = physical_address & kPageMask;
+  if (peripheral_->IsDevicePage(physical_page) ||
+      !pmp_.Check(physical_page, MemoryWrapper::kPageSize, write ? Pmp::kWrite : Pmp::kRead,
+                  GetTranslationPrivilege())) {
+    return;
+  }
+  const uint8_t *read_page = nullptr;
+  uint8_t *write_page = nullptr;
+  if (write) {
+    write_page = memory_->GetWritableHostPage(physical_page);
+  } else {
+    read_page = memory_->GetHostPage(physical_page);
+    if (!read_page) {
+      return;
+    }
+  }
+  // Other entries may point to memory that the page has moved from.
+  if (memory_->GetMappingEpoch() != host_tlb_epoch_) {
+    FlushHostTlb();
+    host_tlb_epoch_ = memory_->GetMappingEpoch();
+  }
+  HostTlbEntry &entry = host_tlb_[(virtual_address >> MemoryWrapper::kPageBits) & (kHostTlbEntries - 1)];
+  const uint64_t virtual_page = virtual_address & kPageMask;
+  if (write) {
+    entry.write_tag = virtual_page;
+    entry.write_page = write_page;
+  } else {
+    entry.read_tag = virtual_page;
+    entry.read_page = read_page;
+  }
+  // A read entry of the same slot may belong to another page.
+  if (entry.read_tag != virtual_page) {
+    entry.read_tag = kHostTlbInvalid;
+  }
+  if (entry.write_tag != virtual_page) {
+    entry.write_tag = kHostTlbInvalid;
+  }
+}
+
+// Returns the host memory of the code page of |pc|. The translation is reused
+// until the fetch leaves the page, or the privilege, SATP, TLB, PMP or host
+// mapping changes. Returns nullptr on a fault, if the page has never been
+// written, or if PMP doesn't allow execution of the whole page.
+const uint8_t *RiscvCpu::GetFetchPage(uint64_t pc) {
+  const uint64_t virtual_page = pc & ~static_cast<uint64_t>(MemoryWrapper::kPageSize - 1);
+  const PrivilegeMode privilege = GetTranslationPrivilege();
+  if (fetch_page_ && virtual_page == fetch_virtual_page_ && privilege == fetch_privilege_ &&
+      csrs_[SATP] == fetch_satp_ && mmu_.GetStatistics().tlb_flushes == fetch_tlb_flushes_ &&
+      memory_->GetMappingEpoch() == fetch_mapping_epoch_ && privilege_ == fetch_pmp_privilege_ &&
+      pmp_.GetGeneration() == fetch_pmp_generation_) {
+    return fetch_page_;
+  }
+  fetch_page_ = nullptr;
+  uint64_t physical_address = VirtualToPhysical(pc);
+  if (page_fault_ || access_fault_) {
+    return nullptr;
+  }
+  const uint64_t physical_page = physical_address & ~static_cast<uint64_t>(MemoryWrapper::kPageSize - 1);
+  if (!pmp_.Check(physical_page, MemoryWrapper::kPageSize, Pmp::kExecute, privilege_)) {
+    return nullptr;
+  }
+  const uint8_t *page = memory_->GetHostPage(physical_address);
+  if (page) {
+    fetch_page_ = page;
+    fetch_virtual_page_ = virtual_page;
+    fetch_privilege_ = privilege;
+    fetch_satp_ = csrs_[SATP];
+    fetch_tlb_flushes_ = mmu_.GetStatistics().tlb_flushes;
+    fetch_mapping_epoch_ = memory_->GetMappingEpoch();
+    fetch_pmp_privilege_ = privilege_;
+    fetch_pmp_generation_ = pmp_.GetGeneration();
+  }
+  return page;
 }
 
 uint32_t RiscvCpu::LoadCmd(uint64_t pc) {
+  const uint64_t offset = pc & (MemoryWrapper::kPageSize - 1);
+  const uint8_t *page = GetFetchPage(pc);
+  if (page_fault_ || access_fault_) {
+    return 0;
+  }
+  if (page && offset <= MemoryWrapper::kPageSize - 4) {
+    uint32_t cmd;
+    std::memcpy(&cmd, page + offset, sizeof(cmd));
+    return (cmd & 0b11) == 0b11 ? cmd : cmd & 0xFFFF;
+  }
+  // The last halfword of a page, a page that has never been written, or a
+  // page that PMP doesn't allow as a whole.
+  return LoadCmdSlow(pc);
+}
+
+uint32_t RiscvCpu::LoadCmdSlow(uint64_t pc) {
   auto &mem = *memory_;
   uint64_t physical_address = VirtualToPhysical(pc);
+  if (page_fault_ || access_fault_ || !CheckPmp(pc, physical_address, 2, Pmp::kExecute)) {
+    return 0;
+  }
   uint64_t dram_address = (physical_address >> 2) << 2;
   uint32_t cmd = mem.Read32(dram_address);
   if ((pc & 0b10) == 0b10) {
     cmd = (cmd >> 16) & 0xFFFF;
   }
-  if (!page_fault_ && (pc & 0b10) == 0b10 && (cmd & 0b11) == 0b11) {
+  if ((pc & 0b10) == 0 && (cmd & 0b11) == 0b11 && !CheckPmp(pc + 2, physical_address + 2, 2, Pmp::kExecute)) {
+    return 0;
+  }
+  if ((pc & 0b10) == 0b10 && (cmd & 0b11) == 0b11) {
     uint64_t physical_address_upper = VirtualToPhysical(pc + 2);
+    if (page_fault_ || access_fault_ || !CheckPmp(pc + 2, physical_address_upper, 2, Pmp::kExecute)) {
+      return 0;
+    }
     uint32_t cmd_upper = mem.Read32((physical_address_upper >> 2) << 2);
     cmd = (cmd & 0xFFFF) | (cmd_upper & 0xFFFF) << 16;
   }
@@ -111,7 +371,10 @@ void RiscvCpu::SetRegister(uint32_t num, uint64_t value) { reg_[num] = value; }
 
 uint64_t RiscvCpu::ReadRegister(uint32_t num) { return reg_[num]; }
 
-void RiscvCpu::SetCsr(uint32_t index, uint64_t value) { csrs_[index] = value; }
+void RiscvCpu::SetCsr(uint32_t index, uint64_t value) {
+  csrs_[index] = value;
+  FlushHostTlb();
+}
 
 uint64_t RiscvCpu::ReadCsr(uint32_t index) { return csrs_[index]; }
 
@@ -124,7 +387,9 @@ void RiscvCpu::SetWorkMemory(uint64_t top, uint64_t bottom) {
  * riscv-gnu-toolchain/linux-headers/include/asm-generic/unistd.h
  */
 
-std::pair<bool, bool> RiscvCpu::SystemCall() { return SystemCallEmulation(memory_, reg_, top_, &brk_); }
+std::pair<bool, bool> RiscvCpu::SystemCall() {
+  return SystemCallEmulation(memory_, reg_, top_, &brk_, false, replay_log_.get());
+}
 
 uint64_t RiscvCpu::LoadWd(uint64_t physical_address, int width) {
   assert(1 <= width && width <= 8);
@@ -160,13 +425,15 @@ void RiscvCpu::StoreWd(uint64_t physical_address, uint64_t data, int width) {
 }
 
 void RiscvCpu::Trap(int cause, bool interrupt) {
-  // Currently supported exceptions: page fault (12, 13, 15) and ecall (8, 9, 11).
+  // Currently supported exceptions: access fault (1, 5, 7), page fault (12, 13, 15) and ecall (8, 9, 11).
   // Currently supported interrupts: Supervisor Software Interrupt (1), Machine Timer Intetrupt (7)
   assert((interrupt && (cause == MACHINE_TIMER_INTERRUPT || cause == SUPERVISOR_SOFTWARRE_INTERRUPT ||
                         cause == SUPERVISOR_EXTERNAL_INTERRUPT)) ||
              ((!interrupt) &
          (cause == INSTRUCTION_PAGE_FAULT || cause == LOAD_PAGE_FAULT || cause == STORE_PAGE_FAULT ||
+          cause == INSTRUCTION_ACCESS_FAULT || cause == LOAD_ACCESS_FAULT || cause == STORE_ACCESS_FAULT ||
           cause == ECALL_UMODE || cause == ECALL_SMODE || cause == ECALL_MMODE)));
+  flight_recorder_.Trap(pc_, ir_, privilege_, cause, interrupt, instruction_count_);
   // Check the Machine Level Enable.
   // Machine interrupt is enabled if the privilege mode is lower than Machine Mode.
   const uint64_t global_mie = (privilege_ == PrivilegeMode::MACHINE_MODE && bitcrop(mstatus_, 1, 3) == 1) ||
@@ -188,6 +455,11 @@ void RiscvCpu::Trap(int cause, bool interrupt) {
     prev_faulting_address_ = faulting_address_;
     page_fault_ = false;
   }
+  const bool access_fault =
+      !interrupt && (cause == INSTRUCTION_ACCESS_FAULT || cause == LOAD_ACCESS_FAULT || cause == STORE_ACCESS_FAULT);
+  if (access_fault) {
+    access_fault_ = false;
+  }
 
   // Check supervisor mode delegation status.
   // The original machine privilege mode must be user or supervisor mode.
@@ -208,7 +480,8 @@ void RiscvCpu::Trap(int cause, bool interrupt) {
   // MTVAL, and STVAL.
   uint64_t tval = 0;
   if (!interrupt) {
-    if (cause == INSTRUCTION_PAGE_FAULT || cause == LOAD_PAGE_FAULT || cause == STORE_PAGE_FAULT) {
+    if (cause == INSTRUCTION_PAGE_FAULT || cause == LOAD_PAGE_FAULT || cause == STORE_PAGE_FAULT ||
+        access_fault) {
       tval = faulting_address_;
     } else if (cause == ILLEGAL_INSTRUCTION) {
       tval = ir_;
@@ -243,6 +516,9 @@ void RiscvCpu::Trap(int cause, bool interrupt) {
     const uint64_t new_mpp = PriviledgeToInt(privilege_);
     mstatus_ = bitset(mstatus_, 1, 8, new_mpp);
     ApplyMstatusToCsr();
+    if (track_calls_ && privilege_ == PrivilegeMode::USER_MODE) {
+      profiler_->ResetCallStack(PrivilegeMode::SUPERVISOR_MODE);
+    }
     privilege_ = PrivilegeMode::SUPERVISOR_MODE;
   } else {
     csrs_[MCAUSE] = cause | interrupt_cause_mask;
@@ -267,6 +543,9 @@ void RiscvCpu::Trap(int cause, bool interrupt) {
     const uint64_t new_mpp = PriviledgeToInt(privilege_);
     mstatus_ = bitset(mstatus_, 2, 11, new_mpp);
     ApplyMstatusToCsr();
+    if (track_calls_ && privilege_ != PrivilegeMode::MACHINE_MODE) {
+      profiler_->ResetCallStack(PrivilegeMode::MACHINE_MODE);
+    }
     // Clear interrupt pending bit.
     privilege_ = PrivilegeMode::MACHINE_MODE;
   }
@@ -275,6 +554,7 @@ void RiscvCpu::Trap(int cause, bool interrupt) {
     ClearInterruptPending(cause);
   }
   ApplyMstatusToCsr();
+  FlushHostTlb();
 }
 
 uint64_t kUpper32bitMask = 0xFFFFFFFF00000000;
@@ -493,16 +773,43 @@ int RiscvCpu::GetLoadWidth(uint32_t instruction) {
 }
 
 void RiscvCpu::LoadInstruction(uint32_t instruction, uint32_t rd, uint32_t rs1, int32_t imm12) {
-  peripheral_->MemoryMappedValueUpdate();
   uint64_t source_address = reg_[rs1] + imm12;
+  int width = GetLoadWidth(instruction);
+  // An aligned access matches the tag only if the page offset is a multiple of
+  // the width, so that it doesn't cross the page.
+  const HostTlbEntry &entry = host_tlb_[(source_address >> MemoryWrapper::kPageBits) & (kHostTlbEntries - 1)];
+  if (entry.read_tag == (source_address & ~static_cast<uint64_t>(MemoryWrapper::kPageSize - width)) &&
+      memory_->GetMappingEpoch() == host_tlb_epoch_) {
+    const uint8_t *data = entry.read_page + (source_address & (MemoryWrapper::kPageSize - 1));
+    uint64_t load_data;
+    if (width == 8) {
+      std::memcpy(&load_data, data, 8);
+    } else if (width == 4) {
+      uint32_t word;
+      std::memcpy(&word, data, 4);
+      load_data = instruction == INST_LW ? static_cast<uint64_t>(static_cast<int32_t>(word)) : word;
+    } else if (width == 2) {
+      uint16_t half;
+      std::memcpy(&half, data, 2);
+      load_data = instruction == INST_LH ? static_cast<uint64_t>(static_cast<int16_t>(half)) : half;
+    } else {
+      load_data = instruction == INST_LB ? static_cast<uint64_t>(static_cast<int8_t>(*data)) : *data;
+    }
+    reg_[rd] = load_data;
+    return;
+  }
+  peripheral_->MemoryMappedValueUpdate();
   uint64_t address = VirtualToPhysical(source_address);
   if (page_fault_) {
     Trap(ExceptionCode::LOAD_PAGE_FAULT, kException);
     return;
   }
-  int width = GetLoadWidth(instruction);
   int access_width = GetAccessWidth(width, address);
   int next_width = width - access_width;
+  if (access_fault_ || !CheckPmp(source_address, address, access_width, Pmp::kRead)) {
+    Trap(ExceptionCode::LOAD_ACCESS_FAULT, kException);
+    return;
+  }
   uint64_t load_data = LoadWd(address, access_width);
   if (next_width > 0) {
     uint64_t next_address = VirtualToPhysical(address + access_width, false);
@@ -510,8 +817,14 @@ void RiscvCpu::LoadInstruction(uint32_t instruction, uint32_t rd, uint32_t rs1,
       Trap(ExceptionCode::LOAD_PAGE_FAULT, kException);
       return;
     }
+    if (access_fault_ || !CheckPmp(source_address + access_width, next_address, next_width, Pmp::kRead)) {
+      Trap(ExceptionCode::LOAD_ACCESS_FAULT, kException);
+      return;
+    }
     uint64_t load_data_high = LoadWd(next_address, next_width);
     load_data |= (load_data_high << access_width * 8);
+  } else {
+    FillHostTlb(source_address, address, false);
   }
   if (instruction == INST_LB || instruction == INST_LH || instruction == INST_LW) {
     load_data = SignExtend(load_data, width * 8);
@@ -556,15 +869,37 @@ int RiscvCpu::GetAccessWidth(uint32_t width, uint64_t address) {
 
 void RiscvCpu::StoreInstruction(uint32_t instruction, uint32_t rd, uint32_t rs1, uint32_t rs2, int32_t imm12_stype) {
   uint64_t dst_address = reg_[rs1] + imm12_stype;
+  int width = GetStoreWidth(instruction);
+  HostTlbEntry &entry = host_tlb_[(dst_address >> MemoryWrapper::kPageBits) & (kHostTlbEntries - 1)];
+  if (entry.write_tag == (dst_address & ~static_cast<uint64_t>(MemoryWrapper::kPageSize - width)) &&
+      memory_->GetMappingEpoch() == host_tlb_epoch_) {
+    uint8_t *data = entry.write_page + (dst_address & (MemoryWrapper::kPageSize - 1));
+    const uint64_t value = reg_[rs2];
+    if (width == 8) {
+      std::memcpy(data, &value, 8);
+    } else if (width == 4) {
+      const uint32_t word = static_cast<uint32_t>(value);
+      std::memcpy(data, &word, 4);
+    } else if (width == 2) {
+      const uint16_t half = static_cast<uint16_t>(value);
+      std::memcpy(data, &half, 2);
+    } else {
+      *data = static_cast<uint8_t>(value);
+    }
+    return;
+  }
   // Check if the access crosses memory access unit (64 bit).
   uint64_t address = VirtualToPhysical(dst_address, true);
   if (page_fault_) {
     Trap(ExceptionCode::STORE_PAGE_FAULT, kException);
     return;
   }
-  int width = GetStoreWidth(instruction);
   int access_width = GetAccessWidth(width, dst_address);
   int next_width = width - access_width;
+  if (access_fault_ || !CheckPmp(dst_address, address, access_width, Pmp::kWrite)) {
+    Trap(ExceptionCode::STORE_ACCESS_FAULT, kException);
+    return;
+  }
   int64_t data = reg_[rs2] & GenerateBitMask(access_width * 8);
   StoreWd(address, data, access_width);
   if (next_width > 0) {
@@ -573,13 +908,19 @@ void RiscvCpu::StoreInstruction(uint32_t instruction, uint32_t rd, uint32_t rs1,
       Trap(ExceptionCode::STORE_PAGE_FAULT, kException);
       return;
     }
+    if (access_fault_ || !CheckPmp(dst_address + access_width, next_address, next_width, Pmp::kWrite)) {
+      Trap(ExceptionCode::STORE_ACCESS_FAULT, kException);
+      return;
+    }
     uint64_t next_data = reg_[rs2] >> (access_width * 8);
     StoreWd(next_address, next_data, next_width);
+  } else {
+    FillHostTlb(dst_address, address, true);
   }
   peripheral_->CheckDeviceWrite(address, width, reg_[rs2]);
 }
 
-void RiscvCpu::SystemInstruction(uint32_t instruction, uint32_t rd, int32_t imm) {
+void RiscvCpu::SystemInstruction(uint32_t instruction, uint32_t rd, uint32_t rs1, int32_t imm) {
   if (imm == 0b000000000000) {
     // ECALL
     if (ecall_emulation_) {
@@ -595,9 +936,10 @@ void RiscvCpu::SystemInstruction(uint32_t instruction, uint32_t rd, int32_t imm)
   } else if (imm == 0b000100000010) {
     Sret();
   } else if (((imm >> 5) == 0b0001001) && (rd == 0b00000)) {
-    // sfence.vma.
-    // TODO: Implement this function.
-    ;
+    // sfence.vma. rs1 = x0 flushes all addresses, and rs2 = x0 all ASIDs.
+    uint32_t rs2 = imm & 0b11111;
+    mmu_.FlushTlb(rs1 != 0, reg_[rs1], rs2 != 0, reg_[rs2]);
+    FlushHostTlb();
   } else {
     // not defined.
     std::cerr << "Undefined System instruction." << std::endl;
@@ -795,6 +1137,11 @@ void RiscvCpu::AmoInstruction(uint32_t instruction, uint32_t rd, uint32_t rs1, u
                          instruction == INST_AMOORD || instruction == INST_AMOXORD || instruction == INST_AMOSWAPD)
                             ? 8
                             : 4;
+  // An AMO that PMP denies is a store/AMO access fault.
+  if (access_fault_ || !CheckPmp(virtual_address, physical_address, word_width, Pmp::kRead | Pmp::kWrite)) {
+    Trap(ExceptionCode::STORE_ACCESS_FAULT, kException);
+    return;
+  }
   uint64_t t = LoadWd(physical_address, word_width);
   if (word_width == 4) {
     t = SignExtend(t, 32);
@@ -915,20 +1262,117 @@ void RiscvCpu::DumpDisassembly(bool verbose) {
   if (!verbose) {
     return;
   }
-  char machine_status = privilege_ == PrivilegeMode::USER_MODE         ? 'U'
-                        : privilege_ == PrivilegeMode::SUPERVISOR_MODE ? 'S'
-                                                                       : 'M';
-  printf("%c %016lx (%04x): ", machine_status, pc_, ir_);
-  std::cout << Disassemble(ir_, mxl_) << std::endl;
+  // Per thread, in case CPUs run on several threads.
+  static thread_local DisassemblyCache cache;
+  char line[kInstructionLineSize];
+  std::cout.write(line, FormatInstructionLine(privilege_, pc_, ir_, mxl_, &cache, line)) << std::flush;
+}
+
+void RiscvCpu::BeginTraceEntry(uint32_t instruction, uint32_t rs1, uint32_t rs2, int32_t imm, TraceEntry *entry) {
+  entry->pc = pc_;
+  entry->ir = ir_;
+  entry->privilege = privilege_;
+  entry->flags = 0;
+  switch (instruction) {
+    case INST_LB:
+    case INST_LBU:
+    case INST_LH:
+    case INST_LHU:
+    case INST_LW:
+    case INST_LWU:
+    case INST_LD:
+      entry->flags = TraceEntry::kMemory;
+      entry->address = reg_[rs1] + imm;
+      break;
+    case INST_SB:
+    case INST_SH:
+    case INST_SW:
+    case INST_SD:
+      entry->flags = TraceEntry::kMemory | TraceEntry::kStore;
+      entry->address = reg_[rs1] + imm;
+      entry->store_value = instruction == INST_SD ? reg_[rs2] : reg_[rs2] & ((1ull << (GetStoreWidth(instruction) * 8)) - 1);
+      break;
+    default:
+      // AMOs. The loaded value is the write back.
+      if (instruction >= INST_AMOADDD) {
+        entry->flags = TraceEntry::kMemory;
+        entry->address = reg_[rs1];
+      }
+      break;
+  }
+}
+
+void RiscvCpu::EndTraceEntry(uint32_t instruction, uint32_t rd, TraceEntry *entry) {
+  switch (instruction) {
+    case INST_BEQ:
+    case INST_BGE:
+    case INST_BGEU:
+    case INST_BLT:
+    case INST_BLTU:
+    case INST_BNE:
+    case INST_SB:
+    case INST_SH:
+    case INST_SW:
+    case INST_SD:
+    case INST_FENCE:
+    case INST_FENCEI:
+    case INST_ERROR:
+      rd = ZERO;
+      break;
+    case INST_SYSTEM:
+      // An emulated system call returns in a0.
+      rd = ecall_emulation_ ? A0 : ZERO;
+      break;
+    default:
+      break;
+  }
+  if (rd != ZERO) {
+    entry->flags |= TraceEntry::kWriteBack;
+    entry->rd = static_cast<uint8_t>(rd);
+    entry->value = reg_[rd];
+  }
+  trace_writer_->Instruction(*entry);
+}
+
+void RiscvCpu::SetCoverageMap(uint8_t *map, size_t size) {
+  assert(!map || (size > 0 && (size & (size - 1)) == 0));
+  coverage_map_ = map;
+  coverage_mask_ = size - 1;
+  coverage_location_ = 0;
 }
 
 int RiscvCpu::RunCpu(uint64_t start_pc, bool verbose) {
   error_flag_ = false;
   end_flag_ = false;
+  stopped_ = false;
 
   next_pc_ = start_pc;
+  if (trace_writer_) {
+    trace_writer_->Registers(start_pc, reg_);
+  }
+  // Without coverage or block counts, the loop has no trace of them.
+  const bool block_counts = instruction_mix_ || basic_block_vector_;
+  if (coverage_map_) {
+    return block_counts ? RunLoop<true, true>(verbose) : RunLoop<true, false>(verbose);
+  }
+  return block_counts ? RunLoop<false, true>(verbose) : RunLoop<false, false>(verbose);
+}
+
+template <bool kCoverage, bool kBlockCounts>
+int RiscvCpu::RunLoop(bool verbose) {
   do {
     pc_ = next_pc_;
+    if (pc_ == stop_pc_ || instruction_count_ == event_instruction_count_) {
+      // Both are checked, as both may be due.
+      const bool stop_at_count = instruction_count_ == event_instruction_count_ && InstructionCountEvent();
+      if (pc_ == stop_pc_ || stop_at_count) {
+        if (pc_ == stop_pc_) {
+          stop_pc_ = kNoStopPc;
+        }
+        stopped_ = true;
+        break;
+      }
+    }
     TimerTick();
     InterruptCheck();
     if (CheckPendingInterrupt()) {
@@ -937,10 +1381,17 @@ int RiscvCpu::RunCpu(uint64_t start_pc, bool verbose) {
 
     ir_ = LoadCmd(pc_);
     DumpDisassembly(verbose);
+    if (trace_writer_ && (page_fault_ || access_fault_)) {
+      trace_writer_->Instruction({pc_, ir_, privilege_, TraceEntry::kFetchFault, 0, 0, 0, 0});
+    }
     if (page_fault_) {
       Trap(ExceptionCode::INSTRUCTION_PAGE_FAULT, kException);
       continue;
     }
+    if (access_fault_) {
+      Trap(ExceptionCode::INSTRUCTION_ACCESS_FAULT, kException);
+      continue;
+    }
     // Decode. Mimick the HW behavior. (In HW, decode is in parallel.)
     ctype_ = (ir_ & 0b11) != 0b11;
 
@@ -958,6 +1409,19 @@ int RiscvCpu::RunCpu(uint64_t start_pc, bool verbose) {
       next_pc_ = pc_ + 2;
       GetCode16(ir_, mxl_, &instruction, &rd, &rs1, &rs2, &imm);
     }
+    flight_recorder_.Instruction(pc_, ir_, privilege_, ctype_, instruction_count_);
+    if (kBlockCounts) {
+      if (instruction_mix_) {
+        instruction_mix_->Count(pc_, privilege_, ir_, instruction, ctype_);
+      }
+      if (basic_block_vector_) {
+        basic_block_vector_->Count(pc_, ctype_);
+      }
+    }
+    TraceEntry trace_entry;
+    if (trace_writer_) {
+      BeginTraceEntry(instruction, rs1, rs2, imm, &trace_entry);
+    }
     uint64_t t;  // 't' is used in RISCV Reader to show a temporary address.
     switch (instruction) {
       uint64_t temp64;
@@ -1012,6 +1476,9 @@ int RiscvCpu::RunCpu(uint64_t start_pc, bool verbose) {
         next_pc_ = BranchInstruction(instruction, rs1, rs2, imm);
         break;
       case INST_JAL:
+        if (track_calls_ && rd == RA) {
+          profiler_->Call(next_pc_, privilege_);
+        }
         reg_[rd] = next_pc_;
         next_pc_ = pc_ + imm;
         if (next_pc_ == pc_) {
@@ -1022,6 +1489,13 @@ int RiscvCpu::RunCpu(uint64_t start_pc, bool verbose) {
         t = next_pc_;
         next_pc_ = (reg_[rs1] + imm) & ~1;
         reg_[rd] = t;
+        if (track_calls_) {
+          if (rd == RA) {
+            profiler_->Call(t, privilege_);
+          } else if (rd == ZERO && rs1 == RA) {
+            profiler_->Return(next_pc_, privilege_);
+          }
+        }
         // Below lines are only for simulation purpose.
         // Remove once a better solution is found.
         if (rd == ZERO && rs1 == RA && reg_[rs1] == 0 && imm == 0) {
@@ -1058,7 +1532,7 @@ int RiscvCpu::RunCpu(uint64_t start_pc, bool verbose) {
         reg_[rd] = temp64;
         break;
       case INST_SYSTEM:
-        SystemInstruction(instruction, rd, imm);
+        SystemInstruction(instruction, rd, rs1, imm);
         break;
       case INST_CSRRC:
       case INST_CSRRCI:
@@ -1118,7 +1592,14 @@ int RiscvCpu::RunCpu(uint64_t start_pc, bool verbose) {
       std::cerr << "Infinite loop detected." << std::endl;
       error_flag_ = true;
     }
+    if (kCoverage && next_pc_ != pc_ + (ctype_ ? 2 : 4)) {
+      RecordEdge(next_pc_);
+    }
+    if (trace_writer_) {
+      EndTraceEntry(instruction, rd, &trace_entry);
+    }
     reg_[ZERO] = 0;
+    ++instruction_count_;
 
     if (verbose) {
       DumpRegisters();
@@ -1220,13 +1701,26 @@ bool in(T obj, std::array<T, N> target) {
 void RiscvCpu::UpdateStatus(int16_t csr) {
   if (in<int16_t, 3>(csr, {USTATUS, SSTATUS, MSTATUS})) {
     UpdateMstatus(csr);
+    // MPRV and MPP select the privilege of loads and stores.
+    FlushHostTlb();
   } else if (in<int16_t, 3>(csr, {UIP, SIP, MIP})) {
     UpdateInterruptPending(csr);
   } else if (in<int16_t, 3>(csr, {UIE, SIE, MIE})) {
     UpdateInterruptEnable(csr);
+  } else if (Pmp::IsPmpCsr(csr)) {
+    UpdatePmp(csr);
+    FlushHostTlb();
+  } else if (csr == SATP) {
+    FlushHostTlb();
   }
 }
 
+void RiscvCpu::UpdatePmp(int16_t csr) {
+  pmp_.WriteCsr(csr, csrs_[csr]);
+  // WARL fields and locked entries.
+  csrs_[csr] = pmp_.ReadCsr(csr);
+}
+
 void RiscvCpu::UpdateMstatus(int16_t csr) {
   const uint64_t ustatus_mask = mxl_ == 1 ? kUstatusMask_32 : kUstatusMask_64;
   const uint64_t sstatus_mask = mxl_ == 1 ? kSstatusMask_32 : kSstatusMask_64;
@@ -1297,28 +1791,8 @@ void RiscvCpu::DumpCpuStatus() {
 }
 
 void RiscvCpu::DumpRegisters() {
-  std::cout << "           X1/RA            X2/SP            X3/GP            X4/TP  "
-               "          "
-               "X5/T0            X6/T1            X7/T2         X8/S0/FP            "
-               "X9/S1           X10/A0           X11/A1           X12/A2           "
-               "X13/A3           X14/A4           X15/A5           X16/A6 "
-            << std::endl;
-  printf(
-      "%016lx %016lx %016lx %016lx %016lx %016lx %016lx %016lx "
-      "%016lx %016lx %016lx %016lx %016lx %016lx %016lx %016lx\n",
-      reg_[1], reg_[2], reg_[3], reg_[4], reg_[5], reg_[6], reg_[7], reg_[8], reg_[9], reg_[10], reg_[11], reg_[12],
-      reg_[13], reg_[14], reg_[15], reg_[16]);
-  std::cout << "          X17/A7           X18/S2           X19/S3           X20/S4  "
-               "         "
-               "X21/S5           X22/S6           X23/S7           X24/S8           "
-               "X25/S9          X26/S10          X27/S11          X28/T3           "
-               "X29/T4           X30/T5           X31/T6"
-            << std::endl;
-  printf(
-      "%016lx %016lx %016lx %016lx %016lx %016lx %016lx %016lx "
-      "%016lx %016lx %016lx %016lx %016lx %016lx %016lx\n",
-      reg_[17], reg_[18], reg_[19], reg_[20], reg_[21], reg_[22], reg_[23], reg_[24], reg_[25], reg_[26], reg_[27],
-      reg_[28], reg_[29], reg_[30], reg_[31]);
+  char text[kRegistersTextSize];
+  std::cout.write(text, FormatRegisters(reg_, text)) << std::flush;
 }
 
 PrivilegeMode RiscvCpu::IntToPrivilegeMode(int value) {
@@ -1361,6 +1835,7 @@ void RiscvCpu::Mret() {
   constexpr uint64_t kNewMpp = 0;
   mstatus_ = bitset(mstatus_, 2, 11, kNewMpp);
   ApplyMstatusToCsr();
+  FlushHostTlb();
   next_pc_ = csrs_[MEPC];
 }
 
@@ -1379,6 +1854,7 @@ void RiscvCpu::Sret() {
   mstatus_ = bitset(mstatus_, 2, 8, kNewSpp);
   csrs_[MSTATUS] = mstatus_;
   ApplyMstatusToCsr();
+  FlushHostTlb();
   next_pc_ = csrs_[SEPC];
 }
 
@@ -1609,6 +2085,17 @@ uint32_t RiscvCpu::GetCode32(uint32_t ir) {
 
 void RiscvCpu::GetCode16(uint32_t ir, int mxl, uint32_t *instruction_out, uint32_t *rd_out, uint32_t *rs1_out,
                          uint32_t *rs2_out, int32_t *imm_out) {
+  DecodeCompressed<true>(ir, mxl, instruction_out, rd_out, rs1_out, rs2_out, imm_out);
+}
+
+void RiscvCpu::DecodeCode16(uint32_t ir, int mxl, uint32_t *instruction_out, uint32_t *rd_out, uint32_t *rs1_out,
+                            uint32_t *rs2_out, int32_t *imm_out) {
+  DecodeCompressed<false>(ir, mxl, instruction_out, rd_out, rs1_out, rs2_out, imm_out);
+}
+
+template <bool kReport>
+void RiscvCpu::DecodeCompressed(uint32_t ir, int mxl, uint32_t *instruction_out, uint32_t *rd_out,
+                                uint32_t *rs1_out, uint32_t *rs2_out, int32_t *imm_out) {
   uint32_t opcode = (((ir >> 13) & 0b111) << 2) | (ir & 0b11);
   uint32_t instruction = INST_ERROR;
   uint32_t rd = 0, rs1 = 0, rs2 = 0;
@@ -1616,7 +2103,9 @@ void RiscvCpu::GetCode16(uint32_t ir, int mxl, uint32_t *instruction_out, uint32
   switch (opcode) {
     case 0b00000:
       if (bitcrop(ir, 8, 5) == 0) {
-        std::cerr << "uimm must not be zero for c.addi4spn." << std::endl;
+        if (kReport) {
+          std::cerr << "uimm must not be zero for c.addi4spn." << std::endl;
+        }
         break;
       }
       instruction = INST_ADDI;
@@ -1849,7 +2338,9 @@ void RiscvCpu::GetCode16(uint32_t ir, int mxl, uint32_t *instruction_out, uint32
       imm |= bitcrop(ir, 3, 7) << 6;
       break;
     default:
-      std::cerr << "Unsupported C Instruction." << std::endl;
+      if (kReport) {
+        std::cerr << "Unsupported C Instruction." << std::endl;
+      }
       break;
   }
   *instruction_out = instruction;
@@ -1,18 +1,31 @@
 #ifndef RISCV_CPU_H
 #define RISCV_CPU_H
 
+#include <algorithm>
+#include <array>
 #include <cstdint>
 #include <memory>
 #include <utility>
 #include <vector>
+#include "FlightRecorder.h"
 #include "Mmu.h"
 #include "PeripheralEmulator.h"
+#include "Pmp.h"
 #include "bit_tools.h"
 #include "memory_wrapper.h"
 #include "riscv_cpu_common.h"
 
 namespace RISCV_EMULATOR {
 
+class SnapshotWriter;
+class SnapshotReader;
+class ReplayLog;
+class BasicBlockVector;
+class InstructionMix;
+class Profiler;
+class TraceWriter;
+struct TraceEntry;
+
 class RiscvCpu {
   static constexpr int kCsrSize = 4096;
   static constexpr int kRegSize = 32;
@@ -41,18 +54,147 @@ class RiscvCpu {
 
   int RunCpu(uint64_t start_pc, bool verbose = true);
 
+  // Makes RunCpu return without an error before it executes the instruction
+  // at |pc| for the first time.
+  void SetStopPc(uint64_t pc) { stop_pc_ = pc; }
+
+  // Makes RunCpu return without an error once the instruction count reaches
+  // |count|, before the next instruction. kNoStopInstructionCount for none.
+  void SetStopInstructionCount(uint64_t count) {
+    stop_instruction_count_ = count;
+    ScheduleEvents();
+  }
+
+  static constexpr uint64_t kNoStopInstructionCount = UINT64_MAX;
+
+  // True if the last RunCpu returned at the stop pc or the stop count.
+  bool IsStopped() const { return stopped_; }
+
+  int GetMxl() const { return mxl_; }
+
+  // The pc of the next instruction, where RunCpu continues after it returned.
+  uint64_t GetNextPc() const { return next_pc_; }
+
+  // The number of instructions executed, including the ones that trapped.
+  // Interrupts and faults on instruction fetch don't count.
+  uint64_t GetInstructionCount() const { return instruction_count_; }
+
+  // Logs the key strokes and the system call results to |log| while it
+  // records, and takes them from it while it replays. The events are keyed by
+  // the instruction count.
+  void SetReplayLog(std::shared_ptr<ReplayLog> log);
+
+  // Saves and restores the architectural state, the emulation settings and
+  // the device state. The memory and the disk image are saved separately.
+  // Returns false if the state is broken or of the other XLEN.
+  void SaveState(SnapshotWriter &writer) const;
+
+  bool RestoreState(SnapshotReader &reader);
+
+  const Mmu::Statistics &GetMmuStatistics() const { return mmu_.GetStatistics(); }
+
+  // Edge coverage like AFL. Whenever the pc doesn't move to the next
+  // instruction, i.e. on a taken branch, a jump or a trap, the counter of the
+  // edge from the previous block to the new one is incremented in |map|.
+  // |size| is a power of two. nullptr turns the coverage off, and RunCpu then
+  // runs a loop without it.
+  void SetCoverageMap(uint8_t *map, size_t size);
+
+  // The map size of AFL.
+  static constexpr size_t kCoverageMapSize = 1 << 16;
+
+  // Starts the next edge from nowhere, for a new run.
+  void ResetCoverageLocation() { coverage_location_ = 0; }
+
+  // Hands the pc and the privilege mode to |profiler| every period
+  // instructions, and the calls and returns if it follows call stacks.
+  // nullptr turns the sampling off.
+  void SetProfiler(Profiler *profiler);
+
+  // Counts the instructions that execute into |mix|. nullptr turns the
+  // counting off, and RunCpu then runs a loop without it.
+  void SetInstructionMix(InstructionMix *mix) { instruction_mix_ = mix; }
+
+  // Writes every instruction to |writer|. nullptr turns the trace off.
+  void SetTraceWriter(TraceWriter *writer) { trace_writer_ = writer; }
+
+  // Writes a basic block vector to |bbv| every interval instructions from
+  // now. nullptr turns it off.
+  void SetBasicBlockVector(BasicBlockVector *bbv);
+
+  // Writes the last blocks and traps to the file descriptor |fd|. A signal
+  // handler can call it.
+  void DumpFlightRecorder(int fd) const { flight_recorder_.Dump(fd, mxl_, instruction_count_); }
+
+  // Decodes the compressed instruction |ir|, and reports an unsupported one
+  // on std::cerr.
   static void GetCode16(uint32_t ir, int mxl, uint32_t *instruction_out,
                    uint32_t *rd_out, uint32_t *rs1_out, uint32_t *rs2_out, int32_t *imm_out);
 
+  // GetCode16 without the reports. Has no side effects, so that a signal
+  // handler can disassemble.
+  static void DecodeCode16(uint32_t ir, int mxl, uint32_t *instruction_out, uint32_t *rd_out, uint32_t *rs1_out,
+                           uint32_t *rs2_out, int32_t *imm_out);
+
  private:
+  template <bool kCoverage, bool kBlockCounts>
+  int RunLoop(bool verbose);
+
+  template <bool kReport>
+  static void DecodeCompressed(uint32_t ir, int mxl, uint32_t *instruction_out, uint32_t *rd_out, uint32_t *rs1_out,
+                               uint32_t *rs2_out, int32_t *imm_out);
+
+  // The instruction count of the next stop, sample or end of a BBV interval.
+  void ScheduleEvents() {
+    event_instruction_count_ = std::min({stop_instruction_count_, next_sample_count_, next_interval_count_});
+  }
+
+  // Takes a due sample, ends a due BBV interval and stops at the stop count.
+  // Returns true to stop.
+  bool InstructionCountEvent();
+
+  inline void RecordEdge(uint64_t pc) {
+    // A multiplicative hash of the block address gives the block id.
+    const uint64_t location = ((pc >> 1) * 0x9E3779B97F4A7C15ull) >> 32;
+    ++coverage_map_[(location ^ coverage_location_) & coverage_mask_];
+    // Shifted, so that A -> B and B -> A differ, and so do tight loops.
+    coverage_location_ = location >> 1;
+  }
+
   uint64_t VirtualToPhysical(uint64_t virtual_address,
                              bool write_access = false);
 
+  bool CheckPmp(uint64_t virtual_address, uint64_t physical_address, int width, uint8_t access);
+
+  void FlushHostTlb();
+
+  void FillHostTlb(uint64_t virtual_address, uint64_t physical_address, bool write);
+
   uint64_t Sext32bit(uint64_t data32bit);
 
   uint64_t reg_[kRegSize];
   uint64_t pc_;
   bool timer_interrupt_;
+  // Never a pc, which is always even.
+  static constexpr uint64_t kNoStopPc = 1;
+  uint64_t stop_pc_ = kNoStopPc;
+  uint64_t stop_instruction_count_ = kNoStopInstructionCount;
+  Profiler *profiler_ = nullptr;
+  uint64_t next_sample_count_ = kNoStopInstructionCount;
+  bool track_calls_ = false;
+  InstructionMix *instruction_mix_ = nullptr;
+  BasicBlockVector *basic_block_vector_ = nullptr;
+  uint64_t next_interval_count_ = kNoStopInstructionCount;
+  TraceWriter *trace_writer_ = nullptr;
+  // The first of the stop, the sample and the interval count, which the run
+  // loop checks.
+  uint64_t event_instruction_count_ = kNoStopInstructionCount;
+  bool stopped_ = false;
+  uint8_t *coverage_map_ = nullptr;
+  uint64_t coverage_mask_ = 0;
+  uint64_t coverage_location_ = 0;
+  uint64_t instruction_count_ = 0;
+  std::shared_ptr<ReplayLog> replay_log_;
 
   uint32_t ir_;
   uint64_t next_pc_;
@@ -93,7 +235,7 @@ class RiscvCpu {
   void StoreInstruction(uint32_t instruction, uint32_t rd, uint32_t rs1,
                         uint32_t rs2, int32_t imm12_stype);
 
-  void SystemInstruction(uint32_t instruction, uint32_t rd, int32_t imm);
+  void SystemInstruction(uint32_t instruction, uint32_t rd, uint32_t rs1, int32_t imm);
 
   void MultInstruction(uint32_t instruction, uint32_t rd, uint32_t rs1,
                        uint32_t rs2);
@@ -107,6 +249,12 @@ class RiscvCpu {
 
   uint32_t LoadCmd(uint64_t pc);
 
+  uint32_t LoadCmdSlow(uint64_t pc);
+
+  const uint8_t *GetFetchPage(uint64_t pc);
+
+  PrivilegeMode GetTranslationPrivilege();
+
   uint32_t GetCode32(uint32_t ir);
 
   int GetLoadWidth(uint32_t instruction);
@@ -126,11 +274,42 @@ class RiscvCpu {
   static constexpr bool kException = false;
 
   bool page_fault_ = false;
+  bool access_fault_ = false;
   bool prev_page_fault_ = false;
   uint64_t prev_faulting_address_ = 0;
   bool error_flag_, end_flag_;
   uint64_t faulting_address_;
   Mmu mmu_;
+  Pmp pmp_;
+  FlightRecorder flight_recorder_;
+
+  // Translation of the current code page, and the state it was made in.
+  const uint8_t *fetch_page_ = nullptr;
+  uint64_t fetch_virtual_page_ = 0;
+  PrivilegeMode fetch_privilege_ = PrivilegeMode::MACHINE_MODE;
+  uint64_t fetch_satp_ = 0;
+  uint64_t fetch_tlb_flushes_ = 0;
+  uint64_t fetch_mapping_epoch_ = 0;
+  PrivilegeMode fetch_pmp_privilege_ = PrivilegeMode::MACHINE_MODE;
+  uint64_t fetch_pmp_generation_ = 0;
+
+  // Host TLB of loads and stores. An entry maps a virtual page to the host
+  // memory of its physical page, separately for reads and writes. Only pages
+  // without devices that PMP allows as a whole are entered, so an aligned
+  // access that hits needs no translation, PMP or device check. Flushed when
+  // the privilege, SATP, MSTATUS or PMP changes, on sfence.vma, and when the
+  // memory mapping epoch changes.
+  static constexpr int kHostTlbEntries = 256;
+  // Bits 11-3 of a tag are always zero.
+  static constexpr uint64_t kHostTlbInvalid = ~static_cast<uint64_t>(0);
+  struct HostTlbEntry {
+    uint64_t read_tag = kHostTlbInvalid;
+    uint64_t write_tag = kHostTlbInvalid;
+    const uint8_t *read_page = nullptr;
+    uint8_t *write_page = nullptr;
+  };
+  std::array<HostTlbEntry, kHostTlbEntries> host_tlb_;
+  uint64_t host_tlb_epoch_ = 0;
 
   inline bool CheckShiftSign(uint8_t shamt, uint8_t instruction,
                              const std::string &message_str);
@@ -146,12 +325,21 @@ class RiscvCpu {
 
   void DumpRegisters();
 
+  // Fills in the memory access of the instruction about to execute.
+  void BeginTraceEntry(uint32_t instruction, uint32_t rs1, uint32_t rs2, int32_t imm, TraceEntry *entry);
+
+  // Fills in the write back of the instruction that executed, and writes the
+  // entry.
+  void EndTraceEntry(uint32_t instruction, uint32_t rd, TraceEntry *entry);
+
   void UpdateStatus(int16_t csr);
 
   void UpdateMstatus(int16_t csr);
 
   void UpdateInterruptPending(int16_t csr);
 
+  void UpdatePmp(int16_t csr);
+
   static constexpr uint64_t kUipMask = 0b0000100010001;
   static constexpr uint64_t kSipMask = 0b0001100110011;
   void ApplyInterruptPending();
@@ -188,6 +376,11 @@ class RiscvCpu {
 
   void SetDiskImage(std::shared_ptr<std::vector<uint8_t>> disk_image);
 
+  // Dirty block tracking of the disk image. See PeripheralEmulator.
+  void EnableDiskDirtyTracking(bool enable) { peripheral_->EnableDiskDirtyTracking(enable); }
+  void MarkDiskWritten(size_t offset, size_t length) { peripheral_->MarkDiskWritten(offset, length); }
+  std::vector<size_t> TakeDirtyDiskBlocks() { return peripheral_->TakeDirtyDiskBlocks(); }
+
   void DeviceInitialization();
 
  private:
@@ -272,6 +465,11 @@ enum CsrsAddresses {
   MCAUSE = 0x342,    // Machine trap cause.
   MTVAL = 0x343,     // Machine bad address
   MIP = 0x344,       // Machine interrupt pending
+  // Machine Memory Protection.
+  PMPCFG0 = 0x3A0,   // Physical memory protection configuration.
+  PMPCFG3 = 0x3A3,
+  PMPADDR0 = 0x3B0,  // Physical memory protection address register.
+  PMPADDR15 = 0x3BF,
   // TDOD: add other CSR addresses.
   // https://riscv.org/specifications/privileged-isa/
 };
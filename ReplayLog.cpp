@@ -0,0 +1,214 @@
+//
+// Record and replay of the nondeterministic inputs of a run.
+//
+// File layout, all integers of the header little endian:
+//   Header: magic "M99RPLY", version, and the size and the hash of the disk
+//           image.
+//   Events: until the end of the file.
+//
+
+#include "ReplayLog.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include "Snapshot.h"
+
+namespace RISCV_EMULATOR {
+
+namespace {
+
+constexpr char kMagic[8] = "M99RPLY";
+// Incremented on every change of the layout or of the events.
+constexpr uint32_t kVersion = 1;
+constexpr size_t kHeaderSize = sizeof(kMagic) + 4 + 2 * 8;
+
+// FNV-1a.
+uint64_t HashDiskImage(const std::vector<uint8_t> *disk_image) {
+  uint64_t hash = 0xCBF29CE484222325ull;
+  if (disk_image) {
+    for (uint8_t byte : *disk_image) {
+      hash = (hash ^ byte) * 0x100000001B3ull;
+    }
+  }
+  return hash;
+}
+
+} // namespace anonymous
+
+bool ReplayLog::StartRecording(const std::string &filename, const std::vector<uint8_t> *disk_image) {
+  if (filename != "") {
+    file_.open(filename, std::ios::binary | std::ios::trunc);
+    if (!file_) {
+      std::cerr << "Failed to create replay log " << filename << "." << std::endl;
+      return false;
+    }
+  }
+  SnapshotWriter header;
+  header.PutBytes(kMagic, sizeof(kMagic));
+  header.Put(kVersion);
+  header.Put(static_cast<uint64_t>(disk_image ? disk_image->size() : 0));
+  header.Put(HashDiskImage(disk_image));
+  buffer_ = header.GetData();
+  Flush();
+  recording_ = true;
+  return true;
+}
+
+bool ReplayLog::StartReplay(const std::string &filename, const std::vector<uint8_t> *disk_image) {
+  std::ifstream file(filename, std::ios::binary);
+  if (!file) {
+    std::cerr << "Failed to open replay log " << filename << "." << std::endl;
+    return false;
+  }
+  log_.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+  SnapshotReader header(log_.data(), std::min(log_.size(), kHeaderSize));
+  char magic[sizeof(kMagic)];
+  header.GetBytes(magic, sizeof(magic));
+  const uint32_t version = header.Get<uint32_t>();
+  const uint64_t disk_size = header.Get<uint64_t>();
+  const uint64_t disk_hash = header.Get<uint64_t>();
+  if (header.HasError() || std::memcmp(magic, kMagic, sizeof(kMagic)) != 0) {
+    std::cerr << filename << " is not a replay log." << std::endl;
+    return false;
+  }
+  if (version != kVersion) {
+    std::cerr << "Replay log version " << version << " is not supported (expected " << kVersion << ")."
+              << std::endl;
+    return false;
+  }
+  if (disk_size != (disk_image ? disk_image->size() : 0) || disk_hash != HashDiskImage(disk_image)) {
+    std::cerr << "The disk image differs from the one of the recording." << std::endl;
+    return false;
+  }
+  position_ = kHeaderSize;
+  replaying_ = true;
+  PeekEvent();
+  return true;
+}
+
+void ReplayLog::RecordKey(int key) {
+  PutEvent(kKey);
+  PutVarint(static_cast<uint32_t>(key));
+  Flush();
+}
+
+bool ReplayLog::ReplayKey(int *key) {
+  if (diverged_ || !next_valid_) {
+    return false;
+  }
+  if (next_count_ < *clock_) {
+    Diverge("a logged event was not taken");
+    return false;
+  }
+  if (next_count_ != *clock_ || next_type_ != kKey) {
+    return false;
+  }
+  *key = static_cast<int>(static_cast<uint32_t>(GetVarint()));
+  PeekEvent();
+  return true;
+}
+
+void ReplayLog::RecordSystemCall(uint64_t result, const std::vector<uint8_t> &data) {
+  PutEvent(kSystemCall);
+  PutVarint(result);
+  PutVarint(data.size());
+  buffer_.insert(buffer_.end(), data.begin(), data.end());
+  Flush();
+}
+
+bool ReplayLog::ReplaySystemCall(uint64_t *result, std::vector<uint8_t> *data) {
+  if (diverged_) {
+    return false;
+  }
+  if (!next_valid_ || next_count_ != *clock_ || next_type_ != kSystemCall) {
+    Diverge("the log has no system call here");
+    return false;
+  }
+  *result = GetVarint();
+  const uint64_t size = GetVarint();
+  if (size > log_.size() - position_) {
+    Diverge("the log is truncated");
+    return false;
+  }
+  data->assign(log_.begin() + position_, log_.begin() + position_ + size);
+  position_ += size;
+  PeekEvent();
+  return true;
+}
+
+void ReplayLog::Rewind(uint64_t count) {
+  replay_end_ = std::max(replay_end_, *clock_);
+  diverged_ = false;
+  replaying_ = true;
+  position_ = kHeaderSize;
+  last_count_ = 0;
+  PeekEvent();
+  while (next_valid_ && next_count_ < count) {
+    SkipEvent();
+    PeekEvent();
+  }
+}
+
+void ReplayLog::PutEvent(EventType type) {
+  PutVarint(*clock_ - last_count_);
+  PutVarint(type);
+  last_count_ = *clock_;
+}
+
+// LEB128. Seven bits per byte, lowest first, and the top bit marks that more
+// bytes follow.
+void ReplayLog::PutVarint(uint64_t value) {
+  while (value >= 0x80) {
+    buffer_.push_back(static_cast<uint8_t>(value) | 0x80);
+    value >>= 7;
+  }
+  buffer_.push_back(static_cast<uint8_t>(value));
+}
+
+uint64_t ReplayLog::GetVarint() {
+  uint64_t value = 0;
+  for (int shift = 0; position_ < log_.size() && shift < 64; shift += 7) {
+    const uint8_t byte = log_[position_++];
+    value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+    if ((byte & 0x80) == 0) {
+      break;
+    }
+  }
+  return value;
+}
+
+void ReplayLog::PeekEvent() {
+  next_valid_ = position_ < log_.size();
+  if (next_valid_) {
+    next_count_ = last_count_ + GetVarint();
+    next_type_ = static_cast<uint8_t>(GetVarint());
+    last_count_ = next_count_;
+  }
+}
+
+void ReplayLog::SkipEvent() {
+  if (next_type_ == kKey) {
+    GetVarint();
+  } else {
+    GetVarint();
+    const uint64_t size = GetVarint();
+    position_ += std::min<uint64_t>(size, log_.size() - position_);
+  }
+}
+
+void ReplayLog::Diverge(const char *reason) {
+  diverged_ = true;
+  std::cerr << "Replay diverged at instruction " << *clock_ << ": " << reason << "." << std::endl;
+}
+
+void ReplayLog::Flush() {
+  log_.insert(log_.end(), buffer_.begin(), buffer_.end());
+  if (file_.is_open()) {
+    file_.write(reinterpret_cast<const char *>(buffer_.data()), buffer_.size());
+    file_.flush();
+  }
+  buffer_.clear();
+}
+
+}  // namespace RISCV_EMULATOR
@@ -0,0 +1,106 @@
+//
+// Record and replay of the nondeterministic inputs of a run: the key strokes
+// of the UART, the results of emulated system calls and the disk image. Each
+// input is logged with the retired instruction count it arrived at, so that a
+// replay delivers it at exactly the same point, without the terminal or the
+// host files.
+//
+
+#ifndef ASSEMBLER_TEST_REPLAYLOG_H
+#define ASSEMBLER_TEST_REPLAYLOG_H
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace RISCV_EMULATOR {
+
+class ReplayLog {
+ public:
+  // Creates |filename| and logs into it. Only the size and the hash of
+  // |disk_image| are logged, as the run never writes back to the image file.
+  // Every event is flushed, so that the log survives a crash of the emulator.
+  // An empty |filename| keeps the log in memory only.
+  bool StartRecording(const std::string &filename, const std::vector<uint8_t> *disk_image);
+
+  // Reads |filename| for a replay. Returns false with a message if it is not
+  // a log of this version, or if |disk_image| is not the recorded one.
+  bool StartReplay(const std::string &filename, const std::vector<uint8_t> *disk_image);
+
+  // After a rewind, a recording replays its own events until the clock is
+  // past the furthest point it recorded, then records again.
+  bool IsRecording() const { return recording_ && !IsReplaying(); }
+
+  bool IsReplaying() const { return replaying_ && (next_valid_ || !recording_ || *clock_ < replay_end_); }
+
+  // Replays from the first event at |count| on, for a run that went back to
+  // an earlier state with this count.
+  void Rewind(uint64_t count);
+
+  // Events are logged at the count |*instruction_count| has then.
+  void SetClock(const uint64_t *instruction_count) { clock_ = instruction_count; }
+
+  void RecordKey(int key);
+
+  // Returns true and the key if the log has one at the current count.
+  bool ReplayKey(int *key);
+
+  // Logs a system call that returned |result| and wrote |data| to the guest
+  // memory.
+  void RecordSystemCall(uint64_t result, const std::vector<uint8_t> &data);
+
+  // Returns the result and the data of the system call at the current count.
+  // Returns false if the log has no system call here.
+  bool ReplaySystemCall(uint64_t *result, std::vector<uint8_t> *data);
+
+  // True if the run has left the path of the log.
+  bool HasDiverged() const { return diverged_; }
+
+  // True if every event of the replay was delivered.
+  bool IsEnd() const { return !next_valid_; }
+
+ private:
+  enum EventType : uint8_t {
+    kKey = 1,
+    kSystemCall = 2,
+  };
+
+  // Appends the instruction count and the type of an event.
+  void PutEvent(EventType type);
+
+  void PutVarint(uint64_t value);
+
+  uint64_t GetVarint();
+
+  // Decodes the count and the type of the next event, if any.
+  void PeekEvent();
+
+  // Skips the payload of the next event.
+  void SkipEvent();
+
+  void Diverge(const char *reason);
+
+  void Flush();
+
+  bool recording_ = false;
+  bool replaying_ = false;
+  bool diverged_ = false;
+  const uint64_t *clock_ = nullptr;
+  // Events are encoded as the instruction count since the previous event and
+  // the type, both as varints, then the payload.
+  uint64_t last_count_ = 0;
+  std::ofstream file_;
+  std::vector<uint8_t> buffer_;
+  // The whole log. A recording keeps its events here too, for rewinds.
+  std::vector<uint8_t> log_;
+  uint64_t replay_end_ = 0;
+  size_t position_ = 0;
+  bool next_valid_ = false;
+  uint64_t next_count_ = 0;
+  uint8_t next_type_ = 0;
+};
+
+}  // namespace RISCV_EMULATOR
+
+#endif  // ASSEMBLER_TEST_REPLAYLOG_H
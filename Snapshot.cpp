@@ -0,0 +1,231 @@
+//
+// Machine snapshots.
+//
+// File layout, all integers little endian:
+//   Header: magic "M99SNAP", version, XLEN, and the offset and size of
+//           each section below.
+//   State:  RiscvCpu::SaveState().
+//   Disk:   The disk image, if any.
+//   Pages:  The address of each saved page, in ascending order.
+//   Data:   The saved pages, 4 KiB each, from a 4 KiB aligned offset so that
+//           they can be mapped.
+//
+
+#include "Snapshot.h"
+#include <cstdio>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+#include "RISCV_cpu.h"
+
+namespace RISCV_EMULATOR {
+
+namespace {
+
+constexpr char kMagic[8] = "M99SNAP";
+// Incremented on every change of the layout or of the saved state.
+constexpr uint32_t kVersion = 2;
+constexpr size_t kPageSize = MemoryWrapper::kPageSize;
+
+struct Header {
+  uint32_t version = kVersion;
+  uint32_t mxl = 0;
+  uint64_t state_offset = 0;
+  uint64_t state_size = 0;
+  uint64_t disk_offset = 0;
+  uint64_t disk_size = 0;
+  uint64_t pages_offset = 0;
+  uint64_t page_count = 0;
+  uint64_t data_offset = 0;
+};
+
+void WriteHeader(SnapshotWriter &writer, const Header &header) {
+  writer.PutBytes(kMagic, sizeof(kMagic));
+  writer.Put(header.version);
+  writer.Put(header.mxl);
+  writer.Put(header.state_offset);
+  writer.Put(header.state_size);
+  writer.Put(header.disk_offset);
+  writer.Put(header.disk_size);
+  writer.Put(header.pages_offset);
+  writer.Put(header.page_count);
+  writer.Put(header.data_offset);
+}
+
+constexpr size_t kHeaderSize = sizeof(kMagic) + 2 * 4 + 7 * 8;
+
+bool ReadHeader(SnapshotReader &reader, Header *header) {
+  char magic[sizeof(kMagic)];
+  reader.GetBytes(magic, sizeof(magic));
+  if (reader.HasError() || std::memcmp(magic, kMagic, sizeof(kMagic)) != 0) {
+    std::cerr << "Not a snapshot file." << std::endl;
+    return false;
+  }
+  header->version = reader.Get<uint32_t>();
+  if (header->version != kVersion) {
+    std::cerr << "Snapshot version " << header->version << " is not supported (expected " << kVersion << ")."
+              << std::endl;
+    return false;
+  }
+  header->mxl = reader.Get<uint32_t>();
+  header->state_offset = reader.Get<uint64_t>();
+  header->state_size = reader.Get<uint64_t>();
+  header->disk_offset = reader.Get<uint64_t>();
+  header->disk_size = reader.Get<uint64_t>();
+  header->pages_offset = reader.Get<uint64_t>();
+  header->page_count = reader.Get<uint64_t>();
+  header->data_offset = reader.Get<uint64_t>();
+  return !reader.HasError() && (header->mxl == 1 || header->mxl == 2);
+}
+
+bool ReadSection(std::ifstream &file, uint64_t offset, void *data, uint64_t size) {
+  file.seekg(offset);
+  file.read(static_cast<char *>(data), size);
+  return file.good();
+}
+
+} // namespace anonymous
+
+bool SaveSnapshot(const std::string &filename, const RiscvCpu &cpu, const MemoryWrapper &memory,
+                  const std::vector<uint8_t> *disk_image) {
+  SnapshotWriter state;
+  cpu.SaveState(state);
+  const std::vector<size_t> pages = memory.GetNonZeroPages();
+
+  Header header;
+  header.mxl = cpu.GetMxl();
+  header.state_offset = kHeaderSize;
+  header.state_size = state.GetData().size();
+  header.disk_offset = header.state_offset + header.state_size;
+  header.disk_size = disk_image ? disk_image->size() : 0;
+  header.pages_offset = header.disk_offset + header.disk_size;
+  header.page_count = pages.size();
+  header.data_offset = (header.pages_offset + pages.size() * 8 + kPageSize - 1) & ~(kPageSize - 1);
+
+  SnapshotWriter prefix;
+  WriteHeader(prefix, header);
+  prefix.PutBytes(state.GetData().data(), state.GetData().size());
+  if (disk_image) {
+    prefix.PutBytes(disk_image->data(), disk_image->size());
+  }
+  for (size_t page : pages) {
+    prefix.Put(static_cast<uint64_t>(page));
+  }
+  std::vector<uint8_t> padding(header.data_offset - prefix.GetData().size(), 0);
+  prefix.PutBytes(padding.data(), padding.size());
+
+  const std::string temporary = filename + ".tmp";
+  std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+  file.write(reinterpret_cast<const char *>(prefix.GetData().data()), prefix.GetData().size());
+  std::vector<uint8_t> page_data(kPageSize);
+  for (size_t page : pages) {
+    memory.ReadBlock(page, page_data.data(), kPageSize);
+    file.write(reinterpret_cast<const char *>(page_data.data()), kPageSize);
+  }
+  file.close();
+  if (!file) {
+    std::cerr << "Failed to write snapshot " << temporary << "." << std::endl;
+    std::remove(temporary.c_str());
+    return false;
+  }
+#ifdef _WIN32
+  std::remove(filename.c_str());
+#endif
+  if (std::rename(temporary.c_str(), filename.c_str()) != 0) {
+    std::cerr << "Failed to rename " << temporary << " to " << filename << "." << std::endl;
+    return false;
+  }
+  std::cerr << "Snapshot saved to " << filename << " (" << pages.size() << " pages)." << std::endl;
+  return true;
+}
+
+bool LoadSnapshot(const std::string &filename, std::unique_ptr<RiscvCpu> *cpu,
+                  std::shared_ptr<MemoryWrapper> *memory, std::shared_ptr<std::vector<uint8_t>> *disk_image) {
+  std::ifstream file(filename, std::ios::binary);
+  if (!file) {
+    std::cerr << "Failed to open snapshot " << filename << "." << std::endl;
+    return false;
+  }
+  std::vector<uint8_t> header_data(kHeaderSize);
+  Header header;
+  if (!ReadSection(file, 0, header_data.data(), kHeaderSize)) {
+    std::cerr << "Not a snapshot file." << std::endl;
+    return false;
+  }
+  SnapshotReader header_reader(header_data.data(), header_data.size());
+  if (!ReadHeader(header_reader, &header)) {
+    return false;
+  }
+  // Mapped pages past the end of the file would fault on access.
+  file.seekg(0, std::ios::end);
+  if (static_cast<uint64_t>(file.tellg()) < header.data_offset + header.page_count * kPageSize) {
+    std::cerr << "Snapshot " << filename << " is truncated." << std::endl;
+    return false;
+  }
+  std::vector<uint8_t> state(header.state_size);
+  std::vector<uint8_t> page_table(header.page_count * 8);
+  std::shared_ptr<std::vector<uint8_t>> disk;
+  if (header.disk_size > 0) {
+    disk = std::make_shared<std::vector<uint8_t>>(header.disk_size);
+  }
+  if (!ReadSection(file, header.state_offset, state.data(), state.size()) ||
+      (disk && !ReadSection(file, header.disk_offset, disk->data(), disk->size())) ||
+      !ReadSection(file, header.pages_offset, page_table.data(), page_table.size())) {
+    std::cerr << "Snapshot " << filename << " is truncated." << std::endl;
+    return false;
+  }
+  std::vector<uint64_t> pages(header.page_count);
+  SnapshotReader page_reader(page_table.data(), page_table.size());
+  for (uint64_t &page : pages) {
+    page = page_reader.Get<uint64_t>();
+  }
+
+  auto new_memory = std::make_shared<MemoryWrapper>();
+#ifndef _WIN32
+  int fd = open(filename.c_str(), O_RDONLY);
+#else
+  int fd = _open(filename.c_str(), _O_RDONLY | _O_BINARY);
+#endif
+  bool mapped = fd >= 0;
+  // Consecutive pages are mapped together.
+  for (size_t first = 0; mapped && first < pages.size();) {
+    size_t last = first + 1;
+    while (last < pages.size() && pages[last] == pages[last - 1] + kPageSize) {
+      ++last;
+    }
+    mapped = new_memory->MapFile(pages[first], fd, header.data_offset + first * kPageSize,
+                                 (last - first) * kPageSize);
+    first = last;
+  }
+  if (fd >= 0) {
+#ifndef _WIN32
+    close(fd);
+#else
+    _close(fd);
+#endif
+  }
+  if (!mapped) {
+    std::cerr << "Failed to map the memory of snapshot " << filename << "." << std::endl;
+    return false;
+  }
+
+  auto new_cpu = std::unique_ptr<RiscvCpu>(new RiscvCpu(header.mxl == 2));
+  new_cpu->SetMemory(new_memory);
+  SnapshotReader reader(state.data(), state.size());
+  if (!new_cpu->RestoreState(reader)) {
+    std::cerr << "Broken CPU state in snapshot " << filename << "." << std::endl;
+    return false;
+  }
+  new_cpu->SetDiskImage(disk);
+  *cpu = std::move(new_cpu);
+  *memory = new_memory;
+  *disk_image = disk;
+  return true;
+}
+
+}  // namespace RISCV_EMULATOR
@@ -0,0 +1,103 @@
+//
+// Machine snapshots. A snapshot holds the CPU and device state, the disk
+// image and the guest memory, so that a run can be started again from the
+// point where it was saved.
+//
+
+#ifndef ASSEMBLER_TEST_SNAPSHOT_H
+#define ASSEMBLER_TEST_SNAPSHOT_H
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "memory_wrapper.h"
+
+namespace RISCV_EMULATOR {
+
+class RiscvCpu;
+
+// Appends integers in little endian order, for the state of RiscvCpu and
+// PeripheralEmulator.
+class SnapshotWriter {
+ public:
+  template <class T>
+  void Put(T value) {
+    static_assert(std::is_integral<T>::value || std::is_enum<T>::value, "Integers only.");
+    uint64_t bits = static_cast<uint64_t>(value);
+    for (size_t i = 0; i < sizeof(T); ++i) {
+      data_.push_back(static_cast<uint8_t>(bits >> (i * 8)));
+    }
+  }
+
+  void PutBytes(const void *bytes, size_t size) {
+    const uint8_t *begin = static_cast<const uint8_t *>(bytes);
+    data_.insert(data_.end(), begin, begin + size);
+  }
+
+  const std::vector<uint8_t> &GetData() const { return data_; }
+
+ private:
+  std::vector<uint8_t> data_;
+};
+
+// Reads what SnapshotWriter wrote. Reading past the end returns zeros and
+// sets the error.
+class SnapshotReader {
+ public:
+  SnapshotReader(const uint8_t *data, size_t size) : data_(data), size_(size) {}
+
+  template <class T>
+  T Get() {
+    static_assert(std::is_integral<T>::value || std::is_enum<T>::value, "Integers only.");
+    if (size_ - position_ < sizeof(T)) {
+      error_ = true;
+      return static_cast<T>(0);
+    }
+    uint64_t bits = 0;
+    for (size_t i = 0; i < sizeof(T); ++i) {
+      bits |= static_cast<uint64_t>(data_[position_ + i]) << (i * 8);
+    }
+    position_ += sizeof(T);
+    return static_cast<T>(bits);
+  }
+
+  void GetBytes(void *bytes, size_t size) {
+    if (size_ - position_ < size) {
+      error_ = true;
+      std::memset(bytes, 0, size);
+      return;
+    }
+    std::memcpy(bytes, data_ + position_, size);
+    position_ += size;
+  }
+
+  bool HasError() const { return error_; }
+
+  bool IsEnd() const { return position_ == size_; }
+
+ private:
+  const uint8_t *data_;
+  size_t size_;
+  size_t position_ = 0;
+  bool error_ = false;
+};
+
+// Saves the machine to |filename|. Pages of zeros are left out. The file is
+// written under a temporary name and then renamed, so that a snapshot the
+// running machine was restored from stays intact. Returns false on error.
+bool SaveSnapshot(const std::string &filename, const RiscvCpu &cpu, const MemoryWrapper &memory,
+                  const std::vector<uint8_t> *disk_image);
+
+// Restores a machine from |filename| into a new CPU, memory and disk image.
+// The memory is mapped from the file, so that only the pages the guest
+// touches are read. Returns false with a message if the file is not a
+// snapshot of this version.
+bool LoadSnapshot(const std::string &filename, std::unique_ptr<RiscvCpu> *cpu,
+                  std::shared_ptr<MemoryWrapper> *memory, std::shared_ptr<std::vector<uint8_t>> *disk_image);
+
+}  // namespace RISCV_EMULATOR
+
+#endif  // ASSEMBLER_TEST_SNAPSHOT_H
@@ -0,0 +1,264 @@
+//
+// Time travel debugging.
+//
+// Checkpoints are incremental. Each holds the CPU and device state, and the
+// pages and disk blocks written since the previous one. The content of a
+// page at a checkpoint is that of the last checkpoint up to it that has the
+// page, or else that of the oldest checkpoint, which is kept in full.
+//
+
+#include "TimeTravel.h"
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <set>
+#include "RISCV_cpu.h"
+#include "ReplayLog.h"
+#include "Snapshot.h"
+
+namespace RISCV_EMULATOR {
+
+// std::min takes it by reference.
+constexpr size_t TimeTravel::kDiskBlockSize;
+
+TimeTravel::TimeTravel(RiscvCpu *cpu, std::shared_ptr<MemoryWrapper> memory,
+                       std::shared_ptr<std::vector<uint8_t>> disk_image, std::shared_ptr<ReplayLog> log,
+                       uint64_t interval, size_t budget)
+    : cpu_(cpu), base_memory_(memory), disk_image_(disk_image), log_(log), interval_(std::max<uint64_t>(interval, 1)),
+      budget_(budget) {
+  static_assert(kDiskBlockSize == PeripheralEmulator::kDiskBlockSize,
+                "The blocks of a checkpoint are not the dirty blocks of the disk image.");
+  overlay_ = std::make_shared<MemoryWrapper>(std::shared_ptr<const MemoryWrapper>(memory));
+  overlay_->EnableHugePages(memory->IsHugePagesEnabled());
+  overlay_->EnableDirtyTracking(true);
+  cpu_->SetMemory(overlay_);
+  if (disk_image_) {
+    base_disk_ = *disk_image_;
+    cpu_->EnableDiskDirtyTracking(true);
+  }
+  Checkpoint first;
+  first.instruction_count = Now();
+  SnapshotWriter writer;
+  cpu_->SaveState(writer);
+  first.state = writer.GetData();
+  history_bytes_ = first.GetBytes();
+  checkpoints_.push_back(std::move(first));
+}
+
+size_t TimeTravel::Checkpoint::GetBytes() const {
+  return state.size() + pages.size() * kPageSize + disk_blocks.size() * kDiskBlockSize;
+}
+
+uint64_t TimeTravel::Now() const { return cpu_->GetInstructionCount(); }
+
+uint64_t TimeTravel::NextCheckpointCount() const {
+  const uint64_t origin = GetOldestInstructionCount();
+  return origin + ((Now() - origin) / interval_ + 1) * interval_;
+}
+
+int TimeTravel::RunTo(uint64_t count, uint64_t break_pc) {
+  // Off a break pc the first step goes alone, so that it doesn't stop
+  // right away.
+  bool step = cpu_->GetNextPc() == break_pc;
+  while (!ended_ && Now() < count) {
+    const uint64_t next_checkpoint = NextCheckpointCount();
+    cpu_->SetStopInstructionCount(step ? Now() + 1 : std::min(count, next_checkpoint));
+    cpu_->SetStopPc(step ? kNoBreak : break_pc);
+    error_ = cpu_->RunCpu(cpu_->GetNextPc(), false);
+    cpu_->SetStopInstructionCount(RiscvCpu::kNoStopInstructionCount);
+    cpu_->SetStopPc(kNoBreak);
+    step = false;
+    if (!cpu_->IsStopped()) {
+      ended_ = true;
+      break;
+    }
+    if (Now() == next_checkpoint) {
+      AtCheckpointCount();
+    }
+    if (cpu_->GetNextPc() == break_pc) {
+      break;
+    }
+  }
+  return error_;
+}
+
+void TimeTravel::AtCheckpointCount() {
+  if (Now() > checkpoints_.back().instruction_count) {
+    TakeCheckpoint();
+    return;
+  }
+  // The run repeats, so the machine is the checkpoint of this count again.
+  current_ = FindCheckpoint(Now());
+  assert(checkpoints_[current_].instruction_count == Now());
+  overlay_->ClearDirtyPages();
+  cpu_->TakeDirtyDiskBlocks();
+}
+
+void TimeTravel::TakeCheckpoint() {
+  // Checkpoints are only added past the last one, which the machine is at.
+  assert(current_ == checkpoints_.size() - 1);
+  Checkpoint checkpoint;
+  checkpoint.instruction_count = Now();
+  SnapshotWriter writer;
+  cpu_->SaveState(writer);
+  checkpoint.state = writer.GetData();
+  for (size_t address : overlay_->TakeDirtyPages()) {
+    std::vector<uint8_t> page(kPageSize);
+    overlay_->ReadBlock(address, page.data(), kPageSize);
+    checkpoint.pages.emplace(address, std::move(page));
+  }
+  for (size_t offset : cpu_->TakeDirtyDiskBlocks()) {
+    const size_t size = std::min(kDiskBlockSize, disk_image_->size() - offset);
+    checkpoint.disk_blocks.emplace(
+        offset, std::vector<uint8_t>(disk_image_->begin() + offset, disk_image_->begin() + offset + size));
+  }
+  history_bytes_ += checkpoint.GetBytes();
+  checkpoints_.push_back(std::move(checkpoint));
+  current_ = checkpoints_.size() - 1;
+  while (history_bytes_ > budget_ && checkpoints_.size() > 1) {
+    DropOldest();
+  }
+}
+
+void TimeTravel::DropOldest() {
+  Checkpoint &next = checkpoints_[1];
+  history_bytes_ -= checkpoints_[0].GetBytes() + next.GetBytes();
+  // The pages of a checkpoint are all copied into the overlay, as they were
+  // written, so the overlay doesn't see the writes.
+  for (const auto &page : next.pages) {
+    assert(overlay_->IsPagePrivate(page.first));
+    base_memory_->WriteBlock(page.first, page.second.data(), kPageSize);
+  }
+  for (const auto &block : next.disk_blocks) {
+    std::memcpy(base_disk_.data() + block.first, block.second.data(), block.second.size());
+  }
+  next.pages.clear();
+  next.disk_blocks.clear();
+  history_bytes_ += next.GetBytes();
+  checkpoints_.pop_front();
+  --current_;
+}
+
+size_t TimeTravel::FindCheckpoint(uint64_t count) const {
+  auto it = std::upper_bound(checkpoints_.begin(), checkpoints_.end(), count,
+                             [](uint64_t c, const Checkpoint &checkpoint) { return c < checkpoint.instruction_count; });
+  assert(it != checkpoints_.begin());
+  return it - checkpoints_.begin() - 1;
+}
+
+void TimeTravel::Restore(size_t index) {
+  // What differs from the target are the writes since the current
+  // checkpoint, and the pages of the checkpoints in between.
+  std::set<size_t> pages;
+  std::set<size_t> disk_blocks;
+  for (size_t address : overlay_->TakeDirtyPages()) {
+    pages.insert(address);
+  }
+  for (size_t offset : cpu_->TakeDirtyDiskBlocks()) {
+    disk_blocks.insert(offset);
+  }
+  for (size_t i = std::min(index, current_) + 1; i <= std::max(index, current_); ++i) {
+    for (const auto &page : checkpoints_[i].pages) {
+      pages.insert(page.first);
+    }
+    for (const auto &block : checkpoints_[i].disk_blocks) {
+      disk_blocks.insert(block.first);
+    }
+  }
+  std::vector<uint8_t> buffer(kPageSize);
+  for (size_t address : pages) {
+    const uint8_t *page = nullptr;
+    for (size_t i = index; i > 0 && !page; --i) {
+      auto it = checkpoints_[i].pages.find(address);
+      if (it != checkpoints_[i].pages.end()) {
+        page = it->second.data();
+      }
+    }
+    if (!page) {
+      base_memory_->ReadBlock(address, buffer.data(), kPageSize);
+      page = buffer.data();
+    }
+    overlay_->WriteBlock(address, page, kPageSize);
+  }
+  overlay_->ClearDirtyPages();
+  for (size_t offset : disk_blocks) {
+    const uint8_t *block = base_disk_.data() + offset;
+    for (size_t i = index; i > 0; --i) {
+      auto it = checkpoints_[i].disk_blocks.find(offset);
+      if (it != checkpoints_[i].disk_blocks.end()) {
+        block = it->second.data();
+        break;
+      }
+    }
+    std::memcpy(disk_image_->data() + offset, block, std::min(kDiskBlockSize, disk_image_->size() - offset));
+  }
+  const Checkpoint &checkpoint = checkpoints_[index];
+  if (log_) {
+    log_->Rewind(checkpoint.instruction_count);
+  }
+  SnapshotReader reader(checkpoint.state.data(), checkpoint.state.size());
+  cpu_->RestoreState(reader);
+  current_ = index;
+  ended_ = false;
+  error_ = 0;
+}
+
+bool TimeTravel::GoTo(uint64_t count) {
+  if (count < GetOldestInstructionCount()) {
+    return false;
+  }
+  if (count < Now()) {
+    Restore(FindCheckpoint(count));
+  }
+  RunTo(count);
+  return true;
+}
+
+bool TimeTravel::ReverseContinue(uint64_t pc) {
+  const uint64_t now = Now();
+  if (now == GetOldestInstructionCount()) {
+    return false;
+  }
+  // Searches the intervals between the checkpoints backwards, each from its
+  // checkpoint forward, for the last time the pc stood there.
+  uint64_t end = now;
+  for (size_t index = FindCheckpoint(now - 1);; --index) {
+    Restore(index);
+    uint64_t hit = 0;
+    bool found = false;
+    while (Now() < end) {
+      cpu_->SetStopInstructionCount(end);
+      cpu_->SetStopPc(pc);
+      cpu_->RunCpu(cpu_->GetNextPc(), false);
+      cpu_->SetStopPc(kNoBreak);
+      if (!cpu_->IsStopped() || Now() >= end) {
+        cpu_->SetStopInstructionCount(RiscvCpu::kNoStopInstructionCount);
+        break;
+      }
+      hit = Now();
+      found = true;
+      // Steps over the hit.
+      cpu_->SetStopInstructionCount(Now() + 1);
+      cpu_->RunCpu(cpu_->GetNextPc(), false);
+      cpu_->SetStopInstructionCount(RiscvCpu::kNoStopInstructionCount);
+      if (!cpu_->IsStopped()) {
+        break;
+      }
+    }
+    if (found) {
+      GoTo(hit);
+      // An interrupt may come first at the count of the hit.
+      if (cpu_->GetNextPc() != pc) {
+        RunTo(hit + 1, pc);
+      }
+      return true;
+    }
+    if (index == 0) {
+      GoTo(now);
+      return false;
+    }
+    end = checkpoints_[index].instruction_count;
+  }
+}
+
+}  // namespace RISCV_EMULATOR
@@ -0,0 +1,121 @@
+//
+// Time travel debugging. Checkpoints of the machine are taken every interval
+// instructions while it runs. Going back restores the last checkpoint before
+// the target and runs forward to it again, which repeats the run exactly as
+// the inputs come from a replay log.
+//
+
+#ifndef ASSEMBLER_TEST_TIMETRAVEL_H
+#define ASSEMBLER_TEST_TIMETRAVEL_H
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <vector>
+#include "memory_wrapper.h"
+
+namespace RISCV_EMULATOR {
+
+class ReplayLog;
+class RiscvCpu;
+
+class TimeTravel {
+ public:
+  // Never a pc, which is always even.
+  static constexpr uint64_t kNoBreak = 1;
+
+  // The history starts with a checkpoint where |cpu| stands now, running on
+  // |memory|. From then on the CPU runs on a copy-on-write overlay of
+  // |memory|, and |memory| holds the oldest checkpoint. |disk_image| is the
+  // disk image of |cpu|, or nullptr. The inputs must come from |log|,
+  // recording or replaying, or the run must have none. The checkpoints
+  // beyond the first take up to |budget| bytes, and the oldest ones are
+  // dropped to stay within it.
+  TimeTravel(RiscvCpu *cpu, std::shared_ptr<MemoryWrapper> memory, std::shared_ptr<std::vector<uint8_t>> disk_image,
+             std::shared_ptr<ReplayLog> log, uint64_t interval, size_t budget);
+
+  // Runs until the instruction count is |count|, the pc is |break_pc|, or
+  // the program ends. A break pc where the CPU stands is stepped over first.
+  // Returns the error of the run.
+  int RunTo(uint64_t count, uint64_t break_pc = kNoBreak);
+
+  // Moves to the instruction count |count|, backwards from the last
+  // checkpoint at or before it. Returns false if it is before the oldest
+  // checkpoint.
+  bool GoTo(uint64_t count);
+
+  // Goes back to the last time the pc was |pc|. Returns false and stays if
+  // it wasn't since the oldest checkpoint.
+  bool ReverseContinue(uint64_t pc);
+
+  // True if the program ended or failed where the CPU stands.
+  bool IsEnd() const { return ended_; }
+
+  uint64_t GetOldestInstructionCount() const { return checkpoints_.front().instruction_count; }
+
+  size_t GetCheckpointCount() const { return checkpoints_.size(); }
+
+  // The bytes taken by the checkpoints, without the memory and the disk
+  // image of the oldest one.
+  size_t GetHistoryBytes() const { return history_bytes_; }
+
+  MemoryWrapper &GetMemory() { return *overlay_; }
+
+ private:
+  static constexpr size_t kPageSize = MemoryWrapper::kPageSize;
+  static constexpr size_t kDiskBlockSize = 4096;
+
+  struct Checkpoint {
+    uint64_t instruction_count;
+    // RiscvCpu::SaveState().
+    std::vector<uint8_t> state;
+    // The memory pages and the disk blocks written since the previous
+    // checkpoint, as they are at this one. Empty in the oldest one.
+    std::map<size_t, std::vector<uint8_t>> pages;
+    std::map<size_t, std::vector<uint8_t>> disk_blocks;
+
+    size_t GetBytes() const;
+  };
+
+  uint64_t Now() const;
+
+  uint64_t NextCheckpointCount() const;
+
+  // Called at every multiple of the interval on the way forward.
+  void AtCheckpointCount();
+
+  void TakeCheckpoint();
+
+  // Folds the second oldest checkpoint into the memory and the disk image of
+  // the oldest, and drops the oldest.
+  void DropOldest();
+
+  // The index of the last checkpoint at or before |count|.
+  size_t FindCheckpoint(uint64_t count) const;
+
+  void Restore(size_t index);
+
+  RiscvCpu *cpu_;
+  // The memory at the oldest checkpoint. Only the pages the overlay has its
+  // own copy of are written, when the oldest checkpoint is dropped.
+  std::shared_ptr<MemoryWrapper> base_memory_;
+  std::shared_ptr<MemoryWrapper> overlay_;
+  std::shared_ptr<std::vector<uint8_t>> disk_image_;
+  // The disk image at the oldest checkpoint.
+  std::vector<uint8_t> base_disk_;
+  std::shared_ptr<ReplayLog> log_;
+  uint64_t interval_;
+  size_t budget_;
+  std::deque<Checkpoint> checkpoints_;
+  // The machine is the checkpoint at this index, plus the dirty pages of the
+  // overlay and the dirty blocks of the disk image.
+  size_t current_ = 0;
+  size_t history_bytes_ = 0;
+  bool ended_ = false;
+  int error_ = 0;
+};
+
+}  // namespace RISCV_EMULATOR
+
+#endif  // ASSEMBLER_TEST_TIMETRAVEL_H
@@ -0,0 +1,369 @@
+//
+// Binary instruction trace.
+//
+// File layout:
+//   Header: magic "M99TRCE", and the version and the MXL as 32 bit little
+//           endian integers.
+//   Records: until the end of the file. The first byte holds the flags of
+//            TraceEntry in bits 0-3 and the privilege mode in bits 4-5. Bit 6
+//            marks a pc that doesn't follow the previous instruction, and
+//            bit 7 a record of the registers instead:
+//     Instruction: flags, pc delta if bit 6, instruction word (4 bytes), rd
+//                  (1 byte) and its value, address delta, store value.
+//     Registers: 0x80, pc, and x1 to x31.
+//   Integers are LEB128, and the deltas are zigzag encoded.
+//
+
+#include "Trace.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include "Disassembler.h"
+
+namespace RISCV_EMULATOR {
+
+namespace {
+
+constexpr char kMagic[8] = "M99TRCE";
+// Incremented on every change of the layout.
+constexpr uint32_t kVersion = 1;
+constexpr size_t kHeaderSize = sizeof(kMagic) + 2 * 4;
+
+constexpr uint8_t kPrivilegeShift = 4;
+constexpr uint8_t kJump = 1 << 6;
+constexpr uint8_t kRegisters = 1 << 7;
+constexpr size_t kRegistersRecordSize = 1 + 32 * 10;
+// The decoder reads the file in chunks of this size.
+constexpr size_t kReadSize = 1 << 20;
+
+// The lines of the register names above their values.
+constexpr char kRegistersHeader1[] =
+    "           X1/RA            X2/SP            X3/GP            X4/TP  "
+    "          "
+    "X5/T0            X6/T1            X7/T2         X8/S0/FP            "
+    "X9/S1           X10/A0           X11/A1           X12/A2           "
+    "X13/A3           X14/A4           X15/A5           X16/A6 \n";
+constexpr char kRegistersHeader2[] =
+    "          X17/A7           X18/S2           X19/S3           X20/S4  "
+    "         "
+    "X21/S5           X22/S6           X23/S7           X24/S8           "
+    "X25/S9          X26/S10          X27/S11          X28/T3           "
+    "X29/T4           X30/T5           X31/T6\n";
+static_assert(sizeof(kRegistersHeader1) + sizeof(kRegistersHeader2) + 31 * 17 <= kRegistersTextSize,
+              "The registers don't fit in their text.");
+
+uint64_t GetInstructionSize(uint32_t ir) {
+  return (ir & 0b11) == 0b11 ? 4 : 2;
+}
+
+// Writes the lower |digits| hexadecimal digits of |value|, and returns the
+// end.
+char *PutHex(char *p, uint64_t value, int digits) {
+  for (int i = digits - 1; i >= 0; --i) {
+    p[i] = "0123456789abcdef"[value & 0xF];
+    value >>= 4;
+  }
+  return p + digits;
+}
+
+// "M 0000000080000000 (00a00513): ", as the start of the line of an
+// instruction.
+char *PutLineHead(char *p, PrivilegeMode privilege, uint64_t pc, uint32_t ir) {
+  *p++ = privilege == PrivilegeMode::USER_MODE ? 'U' : privilege == PrivilegeMode::SUPERVISOR_MODE ? 'S' : 'M';
+  *p++ = ' ';
+  p = PutHex(p, pc, 16);
+  *p++ = ' ';
+  *p++ = '(';
+  // At least 4 digits, as "%04x".
+  int digits = 4;
+  while (digits < 8 && (ir >> (4 * digits)) != 0) {
+    ++digits;
+  }
+  p = PutHex(p, ir, digits);
+  *p++ = ')';
+  *p++ = ':';
+  *p++ = ' ';
+  return p;
+}
+
+void PutUint32(std::vector<uint8_t> *data, uint32_t value) {
+  for (int i = 0; i < 4; ++i) {
+    data->push_back(static_cast<uint8_t>(value >> (8 * i)));
+  }
+}
+
+} // namespace anonymous
+
+bool TraceWriter::Open(const std::string &filename, int mxl, bool background) {
+  file_.open(filename, std::ios::binary | std::ios::trunc);
+  if (!file_) {
+    std::cerr << "Failed to create trace " << filename << "." << std::endl;
+    return false;
+  }
+  block_.reserve(kBlockSize);
+  block_.insert(block_.end(), kMagic, kMagic + sizeof(kMagic));
+  PutUint32(&block_, kVersion);
+  PutUint32(&block_, static_cast<uint32_t>(mxl));
+  background_ = background;
+  closing_ = false;
+  if (background_) {
+    thread_ = std::thread(&TraceWriter::WriterThread, this);
+  }
+  return true;
+}
+
+bool TraceWriter::Close() {
+  if (!file_.is_open()) {
+    return true;
+  }
+  FlushBlock();
+  if (background_) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closing_ = true;
+    }
+    condition_.notify_all();
+    thread_.join();
+  }
+  file_.close();
+  return !file_.fail();
+}
+
+void TraceWriter::Registers(uint64_t pc, const uint64_t *reg) {
+  if (block_.size() + kRegistersRecordSize > kBlockSize) {
+    FlushBlock();
+  }
+  block_.push_back(kRegisters);
+  PutVarint(pc);
+  for (int i = 1; i < 32; ++i) {
+    PutVarint(reg[i]);
+  }
+  next_pc_ = pc;
+}
+
+void TraceWriter::Instruction(const TraceEntry &entry) {
+  if (block_.size() + kMaxRecordSize > kBlockSize) {
+    FlushBlock();
+  }
+  const bool jump = entry.pc != next_pc_;
+  block_.push_back(static_cast<uint8_t>(entry.flags | (static_cast<int>(entry.privilege) << kPrivilegeShift) |
+                                        (jump ? kJump : 0)));
+  if (jump) {
+    PutSignedVarint(static_cast<int64_t>(entry.pc - next_pc_));
+  }
+  PutUint32(&block_, entry.ir);
+  if (entry.flags & TraceEntry::kWriteBack) {
+    block_.push_back(entry.rd);
+    PutVarint(entry.value);
+  }
+  if (entry.flags & TraceEntry::kMemory) {
+    PutSignedVarint(static_cast<int64_t>(entry.address - last_address_));
+    last_address_ = entry.address;
+  }
+  if (entry.flags & TraceEntry::kStore) {
+    PutVarint(entry.store_value);
+  }
+  next_pc_ = entry.pc + GetInstructionSize(entry.ir);
+}
+
+void TraceWriter::FlushBlock() {
+  if (block_.empty()) {
+    return;
+  }
+  if (!background_) {
+    file_.write(reinterpret_cast<const char *>(block_.data()), block_.size());
+    block_.clear();
+    return;
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  // The run waits rather than the queue taking all of the memory.
+  condition_.wait(lock, [this]() { return queue_.size() < kMaxQueuedBlocks; });
+  queue_.push_back(std::move(block_));
+  if (free_blocks_.empty()) {
+    block_ = std::vector<uint8_t>();
+    block_.reserve(kBlockSize);
+  } else {
+    block_ = std::move(free_blocks_.back());
+    free_blocks_.pop_back();
+  }
+  lock.unlock();
+  condition_.notify_all();
+}
+
+void TraceWriter::WriterThread() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    condition_.wait(lock, [this]() { return !queue_.empty() || closing_; });
+    if (queue_.empty()) {
+      return;
+    }
+    std::vector<uint8_t> block = std::move(queue_.front());
+    queue_.pop_front();
+    lock.unlock();
+    file_.write(reinterpret_cast<const char *>(block.data()), block.size());
+    block.clear();
+    lock.lock();
+    free_blocks_.push_back(std::move(block));
+    condition_.notify_all();
+  }
+}
+
+bool TraceReader::Open(const std::string &filename) {
+  file_.open(filename, std::ios::binary);
+  if (!file_) {
+    std::cerr << "Failed to open trace " << filename << "." << std::endl;
+    return false;
+  }
+  Fill(kHeaderSize);
+  if (data_.size() < kHeaderSize || std::memcmp(data_.data(), kMagic, sizeof(kMagic)) != 0) {
+    std::cerr << filename << " is not a trace." << std::endl;
+    return false;
+  }
+  uint32_t header[2];
+  for (int i = 0; i < 2; ++i) {
+    header[i] = 0;
+    for (int j = 0; j < 4; ++j) {
+      header[i] |= static_cast<uint32_t>(data_[sizeof(kMagic) + 4 * i + j]) << (8 * j);
+    }
+  }
+  if (header[0] != kVersion) {
+    std::cerr << "Trace version " << header[0] << " is not supported (expected " << kVersion << ")." << std::endl;
+    return false;
+  }
+  mxl_ = static_cast<int>(header[1]);
+  position_ = kHeaderSize;
+  return true;
+}
+
+void TraceReader::Fill(size_t size) {
+  if (data_.size() - position_ >= size || !file_) {
+    return;
+  }
+  data_.erase(data_.begin(), data_.begin() + position_);
+  position_ = 0;
+  const size_t old_size = data_.size();
+  data_.resize(old_size + kReadSize);
+  file_.read(reinterpret_cast<char *>(data_.data() + old_size), kReadSize);
+  data_.resize(old_size + file_.gcount());
+}
+
+uint64_t TraceReader::GetVarint() {
+  uint64_t value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (position_ >= data_.size()) {
+      error_ = true;
+      return 0;
+    }
+    const uint8_t byte = data_[position_++];
+    value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+    if ((byte & 0x80) == 0) {
+      break;
+    }
+  }
+  return value;
+}
+
+uint32_t TraceReader::GetUint32() {
+  if (data_.size() - position_ < 4) {
+    error_ = true;
+    position_ = data_.size();
+    return 0;
+  }
+  uint32_t value = 0;
+  for (int i = 0; i < 4; ++i) {
+    value |= static_cast<uint32_t>(data_[position_++]) << (8 * i);
+  }
+  return value;
+}
+
+bool TraceReader::Next(TraceEntry *entry) {
+  while (!error_) {
+    Fill(kRegistersRecordSize);
+    if (position_ == data_.size()) {
+      return false;
+    }
+    const uint8_t flags = data_[position_++];
+    if (flags == kRegisters) {
+      next_pc_ = GetVarint();
+      for (int i = 1; i < 32; ++i) {
+        reg_[i] = GetVarint();
+      }
+      continue;
+    }
+    if (flags & kRegisters) {
+      error_ = true;
+      break;
+    }
+    entry->flags = flags & 0x0F;
+    entry->privilege = static_cast<PrivilegeMode>((flags >> kPrivilegeShift) & 0b11);
+    entry->pc = next_pc_;
+    if (flags & kJump) {
+      entry->pc += GetSignedVarint();
+    }
+    entry->ir = GetUint32();
+    if (entry->flags & TraceEntry::kWriteBack) {
+      entry->rd = position_ < data_.size() ? data_[position_++] & 0x1F : 0;
+      entry->value = GetVarint();
+      if (entry->rd != 0) {
+        reg_[entry->rd] = entry->value;
+      }
+    }
+    if (entry->flags & TraceEntry::kMemory) {
+      last_address_ += GetSignedVarint();
+      entry->address = last_address_;
+    }
+    if (entry->flags & TraceEntry::kStore) {
+      entry->store_value = GetVarint();
+    }
+    next_pc_ = entry->pc + GetInstructionSize(entry->ir);
+    if (!error_) {
+      return true;
+    }
+  }
+  std::cerr << "The trace is broken." << std::endl;
+  return false;
+}
+
+std::string FormatInstructionLine(PrivilegeMode privilege, uint64_t pc, uint32_t ir, int mxl) {
+  char line[kInstructionLineSize];
+  return std::string(line, FormatInstructionLine(privilege, pc, ir, mxl, nullptr, line));
+}
+
+std::string FormatRegisters(const uint64_t *reg) {
+  char text[kRegistersTextSize];
+  return std::string(text, FormatRegisters(reg, text));
+}
+
+size_t FormatInstructionLine(PrivilegeMode privilege, uint64_t pc, uint32_t ir, int mxl, DisassemblyCache *cache,
+                             char *buffer) {
+  char *p = PutLineHead(buffer, privilege, pc, ir);
+  if (cache) {
+    size_t length;
+    const char *text = cache->Get(ir, mxl, &length);
+    std::memcpy(p, text, length);
+    p += length;
+  } else {
+    p += Disassemble(ir, mxl, p, kMaxDisassemblySize);
+  }
+  *p++ = '\n';
+  return p - buffer;
+}
+
+size_t FormatRegisters(const uint64_t *reg, char *buffer) {
+  char *p = buffer;
+  std::memcpy(p, kRegistersHeader1, sizeof(kRegistersHeader1) - 1);
+  p += sizeof(kRegistersHeader1) - 1;
+  for (int i = 1; i <= 16; ++i) {
+    p = PutHex(p, reg[i], 16);
+    *p++ = i < 16 ? ' ' : '\n';
+  }
+  std::memcpy(p, kRegistersHeader2, sizeof(kRegistersHeader2) - 1);
+  p += sizeof(kRegistersHeader2) - 1;
+  for (int i = 17; i <= 31; ++i) {
+    p = PutHex(p, reg[i], 16);
+    *p++ = i < 31 ? ' ' : '\n';
+  }
+  return p - buffer;
+}
+
+}  // namespace RISCV_EMULATOR
@@ -0,0 +1,164 @@
+//
+// Binary instruction trace. Every instruction is a record of its pc, as a
+// delta to the instruction after the previous one, its instruction word, the
+// register it writes back, and the address and the value of its memory
+// access. A decoder regenerates the text of -v from it.
+//
+
+#ifndef ASSEMBLER_TEST_TRACE_H
+#define ASSEMBLER_TEST_TRACE_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Disassembler.h"
+#include "riscv_cpu_common.h"
+
+namespace RISCV_EMULATOR {
+
+struct TraceEntry {
+  // Flags.
+  static constexpr uint8_t kWriteBack = 1 << 0;
+  static constexpr uint8_t kMemory = 1 << 1;
+  static constexpr uint8_t kStore = 1 << 2;
+  // The fetch failed, and the instruction didn't execute.
+  static constexpr uint8_t kFetchFault = 1 << 3;
+
+  uint64_t pc;
+  // 32 bits from the pc, also for a compressed instruction.
+  uint32_t ir;
+  PrivilegeMode privilege;
+  uint8_t flags;
+  // With kWriteBack, the register and its value after the instruction.
+  uint8_t rd;
+  uint64_t value;
+  // With kMemory, the virtual address of the access.
+  uint64_t address;
+  // With kStore, the value stored.
+  uint64_t store_value;
+};
+
+class TraceWriter {
+ public:
+  // Records are written in blocks of this size.
+  static constexpr size_t kBlockSize = 1 << 20;
+
+  ~TraceWriter() { Close(); }
+
+  // Starts a trace of a CPU of |mxl| in |filename|. With |background|, the
+  // blocks are written by a thread of their own.
+  bool Open(const std::string &filename, int mxl, bool background);
+
+  // Writes the rest and waits for the writer thread. Returns false if a
+  // write failed.
+  bool Close();
+
+  bool IsOpen() const { return file_.is_open(); }
+
+  // The registers where a run starts at |pc|, as the host may have changed
+  // them between runs.
+  void Registers(uint64_t pc, const uint64_t *reg);
+
+  void Instruction(const TraceEntry &entry);
+
+ private:
+  // The largest record.
+  static constexpr size_t kMaxRecordSize = 1 + 10 + 4 + 1 + 3 * 10;
+  static constexpr size_t kMaxQueuedBlocks = 8;
+
+  void PutVarint(uint64_t value) {
+    while (value >= 0x80) {
+      block_.push_back(static_cast<uint8_t>(value) | 0x80);
+      value >>= 7;
+    }
+    block_.push_back(static_cast<uint8_t>(value));
+  }
+
+  // Signed values keep their small magnitude.
+  void PutSignedVarint(int64_t value) { PutVarint((static_cast<uint64_t>(value) << 1) ^ (value < 0 ? ~0ull : 0)); }
+
+  // Hands the block over to the writer thread, or writes it.
+  void FlushBlock();
+
+  void WriterThread();
+
+  std::ofstream file_;
+  std::vector<uint8_t> block_;
+  uint64_t next_pc_ = 0;
+  uint64_t last_address_ = 0;
+  bool background_ = false;
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  std::deque<std::vector<uint8_t>> queue_;
+  // Written blocks, to reuse their memory.
+  std::vector<std::vector<uint8_t>> free_blocks_;
+  bool closing_ = false;
+};
+
+class TraceReader {
+ public:
+  // Returns false with a message if |filename| is not a trace of this
+  // version.
+  bool Open(const std::string &filename);
+
+  int GetMxl() const { return mxl_; }
+
+  // Reads the next instruction. Returns false at the end of the trace, or
+  // if it is broken.
+  bool Next(TraceEntry *entry);
+
+  bool HasError() const { return error_; }
+
+  // The registers after the last instruction read.
+  const uint64_t *GetRegisters() const { return reg_; }
+
+ private:
+  uint64_t GetVarint();
+
+  int64_t GetSignedVarint() {
+    const uint64_t value = GetVarint();
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+  }
+
+  // Reads more of the file, unless |size| bytes are left in data_.
+  void Fill(size_t size);
+
+  uint32_t GetUint32();
+
+  std::ifstream file_;
+  // A window of the file.
+  std::vector<uint8_t> data_;
+  size_t position_ = 0;
+  int mxl_ = 1;
+  uint64_t reg_[32] = {};
+  uint64_t next_pc_ = 0;
+  uint64_t last_address_ = 0;
+  bool error_ = false;
+};
+
+// The text of -v: the line of an instruction before it executes, and the
+// registers after.
+std::string FormatInstructionLine(PrivilegeMode privilege, uint64_t pc, uint32_t ir, int mxl);
+
+std::string FormatRegisters(const uint64_t *reg);
+
+// The same without allocating memory, for the text of every instruction.
+// Each writes into |buffer| of the size below, and returns the length of
+// the text, which is not null terminated. |cache| may be null.
+constexpr size_t kInstructionLineSize = 32 + kMaxDisassemblySize;
+constexpr size_t kRegistersTextSize = 1280;
+
+size_t FormatInstructionLine(PrivilegeMode privilege, uint64_t pc, uint32_t ir, int mxl, DisassemblyCache *cache,
+                             char *buffer);
+
+size_t FormatRegisters(const uint64_t *reg, char *buffer);
+
+}  // namespace RISCV_EMULATOR
+
+#endif  // ASSEMBLER_TEST_TRACE_H
@@ -0,0 +1,38 @@
+//
+// Decodes a binary trace of the emulator (--trace) into the text that -v
+// writes: the line of each instruction and the registers after it.
+//
+
+#include <cstdio>
+#include "Trace.h"
+
+namespace RISCV_EMULATOR {
+
+int DecodeTrace(int argc, char *argv[]) {
+  if (argc != 2) {
+    std::fprintf(stderr, "Usage: %s trace_file\n", argv[0]);
+    return -1;
+  }
+  TraceReader reader;
+  if (!reader.Open(argv[1])) {
+    return -1;
+  }
+  TraceEntry entry;
+  DisassemblyCache cache;
+  char text[kInstructionLineSize + kRegistersTextSize];
+  while (reader.Next(&entry)) {
+    size_t length = FormatInstructionLine(entry.privilege, entry.pc, entry.ir, reader.GetMxl(), &cache, text);
+    // A failed fetch goes to the trap without the registers.
+    if (!(entry.flags & TraceEntry::kFetchFault)) {
+      length += FormatRegisters(reader.GetRegisters(), text + length);
+    }
+    std::fwrite(text, 1, length, stdout);
+  }
+  return reader.HasError() ? -1 : 0;
+}
+
+}  // namespace RISCV_EMULATOR
+
+int main(int argc, char *argv[]) {
+  return RISCV_EMULATOR::DecodeTrace(argc, argv);
+}
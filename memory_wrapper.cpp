@@ -3,14 +3,28 @@
 //
 #include <stdexcept>
 #include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <new>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#include <cstdlib>
+#include <io.h>
+#endif
 #include "memory_wrapper.h"
 
 namespace RISCV_EMULATOR {
 
 MemoryWrapper::MemoryWrapper() {
-    assigned_ = {}; // Default value
-  for (auto &a: assigned_) {
-    a = false;
+  mapping_.fill(nullptr);
+}
+
+MemoryWrapper::MemoryWrapper(std::shared_ptr<const MemoryWrapper> base) : MemoryWrapper() {
+  base_ = std::move(base);
+  if (base_) {
+    private_.assign(kPageNumber / 64, 0);
   }
 }
 
@@ -61,6 +75,9 @@ void MemoryWrapper::Write16(size_t i, uint16_t data) {
 
 const uint32_t MemoryWrapper::Read32(size_t i) const {
   assert((i & 0b11) == 0);
+  if (IsSharedPage(i)) {
+    return base_->Read32(i);
+  }
   int entry = (i >> kOffsetBits) & kEntryMask;
   uint32_t read_data = 0;
   if (CheckRange(entry)) {
@@ -74,13 +91,15 @@ const uint32_t MemoryWrapper::Read32(size_t i) const {
 void MemoryWrapper::Write32(size_t i, uint32_t value) {
   assert((i & 0b11) == 0);
   int entry = (i >> kOffsetBits) & kEntryMask;
-  if (!CheckRange(entry)) {
-    assigned_[entry] = true;
-    mapping_[entry].resize(1 << (kOffsetBits - kWordBits));
+  if (IsSharedPage(i)) {
+    PrivatizePage(i, true);
+  } else if (!CheckRange(entry)) {
+    AllocateChunk(entry);
   }
   int offset = i & kOffsetMask;
   int word_offset = offset >> kWordBits;
   mapping_[entry][word_offset] = value;
+  MarkDirty(i);
 }
 
 const uint64_t MemoryWrapper::Read64(size_t i) const {
@@ -99,12 +118,525 @@ void MemoryWrapper::Write64(size_t i, uint64_t value) {
   Write32(dram_address + 4, (value >> 32) & 0xFFFFFFFF);
 }
 
-bool MemoryWrapper::operator==(MemoryWrapper &r) {
-  return (mapping_ == r.mapping_ && assigned_ == r.assigned_);
+void MemoryWrapper::AllocateChunk(int entry) {
+  if (huge_pages_ && AllocateHugeChunks(entry)) {
+    return;
+  }
+  // Anonymous mappings are zero filled and only take host memory for the
+  // pages that are touched, which keeps sparse overlays cheap.
+#ifndef _WIN32
+  void *chunk = mmap(nullptr, kChunkSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (chunk == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+  regions_.emplace_back(chunk, [](void *p) { munmap(p, kChunkSize); });
+#else
+  void *chunk = std::calloc(kChunkSize, 1);
+  if (!chunk) {
+    throw std::bad_alloc();
+  }
+  regions_.emplace_back(chunk, std::free);
+#endif
+  mapping_[entry] = static_cast<uint32_t *>(chunk);
+}
+
+bool MemoryWrapper::AllocateHugeChunks(int entry) {
+  static_assert(kHugePageSize == 2 * kChunkSize, "A huge page holds two chunks.");
+  int first = entry & ~1;
+  if (mapping_[first] || mapping_[first + 1]) {
+    return false;
+  }
+#if defined(MAP_HUGETLB) || defined(MADV_HUGEPAGE)
+  uint8_t *region = nullptr;
+#ifdef MAP_HUGETLB
+  void *huge = mmap(nullptr, kHugePageSize, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (huge != MAP_FAILED) {
+    region = static_cast<uint8_t *>(huge);
+    ++huge_tlb_regions_;
+  }
+#endif
+#ifdef MADV_HUGEPAGE
+  if (!region) {
+    // Map twice the size and trim it to a 2 MiB aligned region, which the
+    // kernel can then back with a transparent huge page.
+    void *raw = mmap(nullptr, 2 * kHugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+      return false;
+    }
+    uint8_t *start = static_cast<uint8_t *>(raw);
+    uintptr_t aligned = (reinterpret_cast<uintptr_t>(start) + kHugePageSize - 1) & ~(kHugePageSize - 1);
+    region = reinterpret_cast<uint8_t *>(aligned);
+    size_t head = region - start;
+    if (head > 0) {
+      munmap(start, head);
+    }
+    munmap(region + kHugePageSize, kHugePageSize - head);
+    if (madvise(region, kHugePageSize, MADV_HUGEPAGE) == 0) {
+      ++transparent_huge_regions_;
+    }
+  }
+#endif
+  if (!region) {
+    return false;
+  }
+  regions_.emplace_back(region, [](void *p) { munmap(p, kHugePageSize); });
+  mapping_[first] = reinterpret_cast<uint32_t *>(region);
+  mapping_[first + 1] = reinterpret_cast<uint32_t *>(region + kChunkSize);
+  return true;
+#else
+  return false;
+#endif
+}
+
+void MemoryWrapper::PrivatizePage(size_t address, bool copy) {
+  int entry = (address >> kOffsetBits) & kEntryMask;
+  if (!CheckRange(entry)) {
+    AllocateChunk(entry);
+  }
+  size_t page = (address >> kPageBits) & kPageMask;
+  size_t page_address = page << kPageBits;
+  if (copy) {
+    base_->ReadBlock(page_address, ChunkBytes(entry) + (page_address & kOffsetMask), kPageSize);
+  }
+  private_[page >> 6] |= 1ull << (page & 63);
+  ++mapping_epoch_;
+}
+
+uint8_t *MemoryWrapper::GetWritableHostPage(size_t address) {
+  int entry = (address >> kOffsetBits) & kEntryMask;
+  if (IsSharedPage(address)) {
+    PrivatizePage(address, true);
+  } else if (!CheckRange(entry)) {
+    AllocateChunk(entry);
+  }
+  MarkDirty(address);
+  return ChunkBytes(entry) + (address & kOffsetMask & ~(kPageSize - 1));
+}
+
+size_t MemoryWrapper::StepSize(size_t address, size_t length) const {
+  size_t boundary = kChunkSize;
+  if (base_) {
+    boundary = kPageSize;
+  }
+  return std::min(length, boundary - (address & (boundary - 1)));
+}
+
+const uint8_t *MemoryWrapper::PageBytes(size_t page) const {
+  size_t page_address = page << kPageBits;
+  if (IsSharedPage(page_address)) {
+    return base_->PageBytes(page);
+  }
+  int entry = (page_address >> kOffsetBits) & kEntryMask;
+  if (!CheckRange(entry)) {
+    return nullptr;
+  }
+  return ChunkBytes(entry) + (page_address & kOffsetMask);
+}
+
+void MemoryWrapper::ReadBlock(size_t address, void *dst, size_t length) const {
+  uint8_t *dst_bytes = static_cast<uint8_t *>(dst);
+  while (length > 0) {
+    int entry = (address >> kOffsetBits) & kEntryMask;
+    size_t offset = address & kOffsetMask;
+    size_t size = StepSize(address, length);
+    if (IsSharedPage(address)) {
+      base_->ReadBlock(address, dst_bytes, size);
+    } else if (CheckRange(entry)) {
+      std::memcpy(dst_bytes, ChunkBytes(entry) + offset, size);
+    } else {
+      std::memset(dst_bytes, 0, size);
+    }
+    dst_bytes += size;
+    address += size;
+    length -= size;
+  }
+}
+
+void MemoryWrapper::WriteBlock(size_t address, const void *src, size_t length) {
+  const uint8_t *src_bytes = static_cast<const uint8_t *>(src);
+  while (length > 0) {
+    int entry = (address >> kOffsetBits) & kEntryMask;
+    size_t offset = address & kOffsetMask;
+    size_t size = StepSize(address, length);
+    if (IsSharedPage(address)) {
+      PrivatizePage(address, size < kPageSize);
+    } else if (!CheckRange(entry)) {
+      AllocateChunk(entry);
+    }
+    std::memcpy(ChunkBytes(entry) + offset, src_bytes, size);
+    MarkDirtyRange(address, size);
+    src_bytes += size;
+    address += size;
+    length -= size;
+  }
+}
+
+void MemoryWrapper::Fill(size_t address, uint8_t value, size_t length) {
+  while (length > 0) {
+    int entry = (address >> kOffsetBits) & kEntryMask;
+    size_t offset = address & kOffsetMask;
+    size_t size = StepSize(address, length);
+    if (IsSharedPage(address)) {
+      PrivatizePage(address, size < kPageSize);
+    } else if (!CheckRange(entry)) {
+      AllocateChunk(entry);
+    }
+    std::memset(ChunkBytes(entry) + offset, value, size);
+    MarkDirtyRange(address, size);
+    address += size;
+    length -= size;
+  }
+}
+
+size_t MemoryWrapper::FindByte(size_t address, uint8_t value, size_t max) const {
+  size_t position = 0;
+  while (position < max) {
+    int entry = (address >> kOffsetBits) & kEntryMask;
+    size_t offset = address & kOffsetMask;
+    size_t size = StepSize(address, max - position);
+    if (IsSharedPage(address)) {
+      size_t found = base_->FindByte(address, value, size);
+      if (found < size) {
+        return position + found;
+      }
+    } else if (CheckRange(entry)) {
+      const void *found = std::memchr(ChunkBytes(entry) + offset, value, size);
+      if (found) {
+        return position + (static_cast<const uint8_t *>(found) - (ChunkBytes(entry) + offset));
+      }
+    } else if (value == 0) {
+      // Unassigned chunks read as zero.
+      return position;
+    }
+    position += size;
+    address += size;
+  }
+  return max;
+}
+
+void MemoryWrapper::EnableDirtyTracking(bool enable) {
+  dirty_tracking_ = enable;
+  ++mapping_epoch_;
+  if (enable) {
+    dirty_.assign(kPageNumber / 64, 0);
+  } else {
+    dirty_.clear();
+  }
+}
+
+void MemoryWrapper::MarkPageWritten(size_t page) {
+  if (dirty_tracking_) {
+    dirty_[page >> 6] |= 1ull << (page & 63);
+  }
+  if (page_hashing_) {
+    PageHashes *hashes = page_hashes_[page >> kChunkPageBits].get();
+    if (hashes) {
+      size_t index = page & (kChunkPages - 1);
+      hashes->valid[index >> 6] &= ~(1ull << (index & 63));
+    }
+  }
+}
+
+void MemoryWrapper::MarkDirtyRange(size_t address, size_t length) {
+  if ((!dirty_tracking_ && !page_hashing_) || length == 0) {
+    return;
+  }
+  // The range never crosses a chunk boundary, so it never wraps around.
+  size_t first = (address >> kPageBits) & kPageMask;
+  size_t last = ((address + length - 1) >> kPageBits) & kPageMask;
+  for (size_t page = first; page <= last; ++page) {
+    MarkPageWritten(page);
+  }
+}
+
+bool MemoryWrapper::IsPageDirty(size_t address) const {
+  if (!dirty_tracking_) {
+    return false;
+  }
+  size_t page = (address >> kPageBits) & kPageMask;
+  return (dirty_[page >> 6] >> (page & 63)) & 1;
+}
+
+void MemoryWrapper::ClearDirtyPages() {
+  std::fill(dirty_.begin(), dirty_.end(), 0);
+  ++mapping_epoch_;
+}
+
+std::vector<size_t> MemoryWrapper::TakeDirtyPages() {
+  std::vector<size_t> pages;
+  for (size_t address : *this) {
+    pages.push_back(address);
+  }
+  ClearDirtyPages();
+  return pages;
+}
+
+size_t MemoryWrapper::RevertDirtyPages() {
+  assert(base_ && dirty_tracking_);
+  size_t count = 0;
+  // The dirty and private bitmaps have the same layout, so whole words of
+  // pages are reverted at once.
+  for (size_t i = 0; i < dirty_.size(); ++i) {
+    const uint64_t word = dirty_[i];
+    if (word == 0) {
+      continue;
+    }
+    for (int bit = 0; bit < 64; ++bit) {
+      if ((word >> bit) & 1) {
+        // Drops the cached hash.
+        MarkPageWritten(i * 64 + bit);
+        ++count;
+      }
+    }
+    private_[i] &= ~word;
+    dirty_[i] = 0;
+  }
+  ++mapping_epoch_;
+  return count;
+}
+
+MemoryWrapperIterator MemoryWrapper::begin() const {
+  return MemoryWrapperIterator(dirty_, 0);
+}
+
+MemoryWrapperIterator MemoryWrapper::end() const {
+  return MemoryWrapperIterator(dirty_, dirty_.size() * 64);
+}
+
+MemoryWrapperIterator::MemoryWrapperIterator(const std::vector<uint64_t> &bitmap, size_t page)
+    : bitmap_(bitmap), page_(page) {
+  SkipCleanPages();
+}
+
+MemoryWrapperIterator &MemoryWrapperIterator::operator++() {
+  ++page_;
+  SkipCleanPages();
+  return *this;
+}
+
+void MemoryWrapperIterator::SkipCleanPages() {
+  const size_t total = bitmap_.size() * 64;
+  while (page_ < total) {
+    uint64_t word = bitmap_[page_ >> 6] >> (page_ & 63);
+    if (word == 0) {
+      // Nothing left in this word. Jump to the next one.
+      page_ = (page_ | 63) + 1;
+      continue;
+    }
+    while ((word & 1) == 0) {
+      word >>= 1;
+      ++page_;
+    }
+    return;
+  }
+  page_ = total;
+}
+
+namespace {
+
+// Hashes a page in four independent lanes of 64 bit words, so that the
+// multiplications of the lanes overlap.
+uint64_t HashPageBytes(const uint8_t *bytes, size_t length) {
+  constexpr uint64_t kMultiplier = 0x9E3779B97F4A7C15ull;
+  uint64_t lane[4] = {0x243F6A8885A308D3ull, 0x13198A2E03707344ull, 0xA4093822299F31D0ull, 0x082EFA98EC4E6C89ull};
+  for (size_t i = 0; i + 32 <= length; i += 32) {
+    uint64_t word[4];
+    std::memcpy(word, bytes + i, sizeof(word));
+    for (int j = 0; j < 4; ++j) {
+      lane[j] = (lane[j] ^ word[j]) * kMultiplier;
+      lane[j] ^= lane[j] >> 29;
+    }
+  }
+  uint64_t hash = length;
+  for (int j = 0; j < 4; ++j) {
+    hash = (hash ^ lane[j]) * kMultiplier;
+    hash ^= hash >> 32;
+  }
+  return hash;
+}
+
+const std::array<uint8_t, MemoryWrapper::kPageSize> kZeroPage = {};
+
+uint64_t ZeroPageHash() {
+  static const uint64_t hash = HashPageBytes(kZeroPage.data(), kZeroPage.size());
+  return hash;
+}
+
+} // namespace anonymous
+
+void MemoryWrapper::EnablePageHashing(bool enable) {
+  page_hashing_ = enable;
+  ++mapping_epoch_;
+  page_hashes_.clear();
+  if (enable) {
+    page_hashes_.resize(kMapEntry);
+  }
+}
+
+bool MemoryWrapper::GetCachedPageHash(size_t page, uint64_t *hash) const {
+  if (!page_hashing_) {
+    return false;
+  }
+  const PageHashes *hashes = page_hashes_[page >> kChunkPageBits].get();
+  size_t index = page & (kChunkPages - 1);
+  if (!hashes || !((hashes->valid[index >> 6] >> (index & 63)) & 1)) {
+    return false;
+  }
+  *hash = hashes->hash[index];
+  return true;
+}
+
+uint64_t MemoryWrapper::PageHash(size_t address) const {
+  size_t page = (address >> kPageBits) & kPageMask;
+  uint64_t hash;
+  if (GetCachedPageHash(page, &hash)) {
+    return hash;
+  }
+  const uint8_t *bytes = PageBytes(page);
+  hash = bytes ? HashPageBytes(bytes, kPageSize) : ZeroPageHash();
+  if (page_hashing_) {
+    std::unique_ptr<PageHashes> &hashes = page_hashes_[page >> kChunkPageBits];
+    if (!hashes) {
+      hashes.reset(new PageHashes());
+    }
+    size_t index = page & (kChunkPages - 1);
+    hashes->hash[index] = hash;
+    hashes->valid[index >> 6] |= 1ull << (index & 63);
+    ++mapping_epoch_;
+  }
+  return hash;
+}
+
+uint64_t MemoryWrapper::Fingerprint() const {
+  constexpr uint64_t kMultiplier = 0x9E3779B97F4A7C15ull;
+  const uint64_t zero_hash = ZeroPageHash();
+  uint64_t fingerprint = 0;
+  for (int entry = 0; entry < kMapEntry; ++entry) {
+    if (!ChunkHasData(entry)) {
+      continue;
+    }
+    for (size_t page = entry * kChunkPages; page < (entry + 1) * kChunkPages; ++page) {
+      uint64_t hash = PageHash(page << kPageBits);
+      if (hash != zero_hash) {
+        fingerprint = (fingerprint ^ hash ^ (page * kMultiplier)) * kMultiplier;
+        fingerprint ^= fingerprint >> 32;
+      }
+    }
+  }
+  return fingerprint;
+}
+
+std::vector<size_t> MemoryWrapper::GetNonZeroPages() const {
+  std::vector<size_t> pages;
+  for (int entry = 0; entry < kMapEntry; ++entry) {
+    if (!ChunkHasData(entry)) {
+      continue;
+    }
+    for (size_t page = entry * kChunkPages; page < (entry + 1) * kChunkPages; ++page) {
+      const uint8_t *bytes = PageBytes(page);
+      if (bytes && std::memcmp(bytes, kZeroPage.data(), kPageSize) != 0) {
+        pages.push_back(page << kPageBits);
+      }
+    }
+  }
+  return pages;
+}
+
+bool MemoryWrapper::MapFile(size_t address, int fd, uint64_t offset, size_t length) {
+  assert(!base_);
+  assert(((address | offset | length) & (kPageSize - 1)) == 0);
+  while (length > 0) {
+    int entry = (address >> kOffsetBits) & kEntryMask;
+    size_t size = std::min(length, kChunkSize - (address & kOffsetMask));
+    if (!CheckRange(entry)) {
+      AllocateChunk(entry);
+    }
+    uint8_t *bytes = ChunkBytes(entry) + (address & kOffsetMask);
+    bool mapped = false;
+#ifndef _WIN32
+    // Replaces the pages of the chunk in place. They are still unmapped with
+    // the chunk. Fails e.g. in hugetlbfs chunks or at the limit of mappings.
+    mapped = mmap(bytes, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset) != MAP_FAILED;
+#endif
+    if (!mapped) {
+      for (size_t done = 0; done < size;) {
+#ifndef _WIN32
+        ssize_t count = pread(fd, bytes + done, size - done, offset + done);
+#else
+        _lseeki64(fd, offset + done, SEEK_SET);
+        int count = _read(fd, bytes + done, static_cast<unsigned>(size - done));
+#endif
+        if (count <= 0) {
+          return false;
+        }
+        done += count;
+      }
+    }
+    MarkDirtyRange(address, size);
+    address += size;
+    offset += size;
+    length -= size;
+  }
+  ++mapping_epoch_;
+  return true;
+}
+
+bool MemoryWrapper::ChunkHasData(int entry) const {
+  return mapping_[entry] || (base_ && base_->ChunkHasData(entry));
+}
+
+bool MemoryWrapper::IsPageEqual(const MemoryWrapper &r, size_t page) const {
+  const uint8_t *left = PageBytes(page);
+  const uint8_t *right = r.PageBytes(page);
+  if (left == right) {
+    return true;
+  }
+  uint64_t left_hash, right_hash;
+  if (GetCachedPageHash(page, &left_hash) && r.GetCachedPageHash(page, &right_hash) &&
+      left_hash != right_hash) {
+    return false;
+  }
+  return std::memcmp(left ? left : kZeroPage.data(), right ? right : kZeroPage.data(), kPageSize) == 0;
+}
+
+std::vector<std::pair<size_t, size_t>> MemoryWrapper::DiffPages(const MemoryWrapper &r) const {
+  std::vector<std::pair<size_t, size_t>> ranges;
+  for (int entry = 0; entry < kMapEntry; ++entry) {
+    if (!ChunkHasData(entry) && !r.ChunkHasData(entry)) {
+      continue;
+    }
+    for (size_t page = entry * kChunkPages; page < (entry + 1) * kChunkPages; ++page) {
+      if (IsPageEqual(r, page)) {
+        continue;
+      }
+      size_t start = page << kPageBits;
+      if (!ranges.empty() && ranges.back().second == start) {
+        ranges.back().second = start + kPageSize;
+      } else {
+        ranges.emplace_back(start, start + kPageSize);
+      }
+    }
+  }
+  return ranges;
+}
+
+bool MemoryWrapper::operator==(const MemoryWrapper &r) const {
+  for (int entry = 0; entry < kMapEntry; ++entry) {
+    if (!ChunkHasData(entry) && !r.ChunkHasData(entry)) {
+      continue;
+    }
+    for (size_t page = entry * kChunkPages; page < (entry + 1) * kChunkPages; ++page) {
+      if (!IsPageEqual(r, page)) {
+        return false;
+      }
+    }
+  }
+  return true;
 }
 
-bool MemoryWrapper::operator!=(MemoryWrapper &r) {
-  return (mapping_ != r.mapping_ || assigned_ != r.assigned_);
+bool MemoryWrapper::operator!=(const MemoryWrapper &r) const {
+  return !(*this == r);
 }
 
 } // namespace RISCV_EMULATOR
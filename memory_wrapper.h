@@ -8,7 +8,9 @@
 #include <vector>
 #include <cstdint>
 #include <array>
+#include <memory>
 #include <stdexcept>
+#include <utility>
 
 namespace RISCV_EMULATOR {
 
@@ -24,6 +26,14 @@ constexpr int GenerateBitMask(const int bits) {
 }
 
 class MemoryWrapper {
+public:
+  // Granularity of the dirty page tracking.
+  static constexpr int kPageBits = 12;
+  static constexpr size_t kPageSize = 1 << kPageBits;
+  // Host huge page size used when huge pages are enabled.
+  static constexpr size_t kHugePageSize = 1 << 21;
+
+private:
   static constexpr int kTotalBits = 32;
   static constexpr int kOffsetBits = 20;
   static constexpr int kWordBits = 2;
@@ -31,10 +41,29 @@ class MemoryWrapper {
   static constexpr int kEntryBits = kTotalBits - kOffsetBits;
   static constexpr int kEntryMask = GenerateBitMask(kEntryBits);
   static constexpr int kMapEntry = 1 << kEntryBits;
+  static constexpr size_t kChunkSize = 1 << kOffsetBits;
   static constexpr size_t kMaxAddress = ((1ull << kTotalBits) - 1);
+  static constexpr size_t kPageNumber = 1ull << (kTotalBits - kPageBits);
+  static constexpr size_t kPageMask = kPageNumber - 1;
+  static constexpr int kChunkPageBits = kOffsetBits - kPageBits;
+  static constexpr size_t kChunkPages = 1 << kChunkPageBits;
 public:
   MemoryWrapper();
 
+  // Creates a copy-on-write overlay of |base|. Pages read from the base until
+  // they are first written, then the page is copied into the overlay. While
+  // overlays of it exist, the base may only be modified in the pages that
+  // are private in every overlay, which none of them reads from the base.
+  explicit MemoryWrapper(std::shared_ptr<const MemoryWrapper> base);
+
+  MemoryWrapper(const MemoryWrapper &) = delete;
+
+  MemoryWrapper &operator=(const MemoryWrapper &) = delete;
+
+  MemoryWrapper(MemoryWrapper &&) = default;
+
+  MemoryWrapper &operator=(MemoryWrapper &&) = default;
+
   const uint8_t ReadByte(size_t i) const;
 
   const uint16_t Read16(size_t i) const;
@@ -51,24 +80,221 @@ public:
 
   void Write64(size_t i, uint64_t value);
 
-  MemoryWrapperIterator begin();
+  // Bulk accessors. They copy between guest memory and a contiguous host
+  // buffer, and only split the access at chunk boundaries.
+  void ReadBlock(size_t address, void *dst, size_t length) const;
+
+  void WriteBlock(size_t address, const void *src, size_t length);
+
+  void Fill(size_t address, uint8_t value, size_t length);
+
+  // Returns the offset of the first |value| from |address|, or |max| if it is
+  // not found in the first |max| bytes.
+  size_t FindByte(size_t address, uint8_t value, size_t max) const;
+
+  // Dirty page tracking. While enabled, every write marks its 4 KiB page.
+  // Enabling starts with all pages clean.
+  void EnableDirtyTracking(bool enable);
+
+  bool IsDirtyTrackingEnabled() const { return dirty_tracking_; }
+
+  bool IsPageDirty(size_t address) const;
+
+  void ClearDirtyPages();
+
+  // Returns the start addresses of the dirty pages and marks them clean in
+  // the same step, so that no write is lost between reading and clearing.
+  std::vector<size_t> TakeDirtyPages();
+
+  // Makes the dirty pages of an overlay read from the base again and marks
+  // them clean, which undoes every write since the pages were last clean.
+  // Only the dirty pages are visited. Returns the number of pages reverted.
+  size_t RevertDirtyPages();
+
+  // Iterates over the start addresses of the dirty pages.
+  MemoryWrapperIterator begin() const;
+
+  MemoryWrapperIterator end() const;
+
+  // Backs chunks allocated from now on with 2 MiB host huge pages. Each
+  // region covers a 2 MiB aligned guest range. hugetlbfs pages are tried
+  // first, then transparent huge pages. Without either the region still
+  // works with normal pages.
+  void EnableHugePages(bool enable) { huge_pages_ = enable; }
+
+  bool IsHugePagesEnabled() const { return huge_pages_; }
+
+  // The number of 2 MiB regions backed by hugetlbfs or advised for
+  // transparent huge pages.
+  size_t GetHugeTlbRegionCount() const { return huge_tlb_regions_; }
+
+  size_t GetTransparentHugeRegionCount() const { return transparent_huge_regions_; }
+
+  // Returns the host memory of the page of |address| for reading, or nullptr
+  // if the page has never been written. The pointer stays valid until
+  // GetMappingEpoch() changes.
+  const uint8_t *GetHostPage(size_t address) const { return PageBytes((address >> kPageBits) & kPageMask); }
+
+  // Returns the host memory of the page of |address| for writing. The page is
+  // allocated or copied from the base as needed, and marked written. Writes
+  // through the pointer are not marked again, so it is only valid until
+  // GetMappingEpoch() changes.
+  uint8_t *GetWritableHostPage(size_t address);
+
+  // Changes whenever a page moves to other host memory, e.g. when an overlay
+  // copies a page from its base, and whenever a written page may need to be
+  // marked again for dirty tracking or the page hash cache.
+  uint64_t GetMappingEpoch() const { return mapping_epoch_; }
+
+  const std::shared_ptr<const MemoryWrapper> &GetBase() const { return base_; }
+
+  // True if the page of |address| has its own copy in this overlay. Always
+  // true without a base.
+  bool IsPagePrivate(size_t address) const { return !IsSharedPage(address); }
+
+  // Start addresses of the pages that hold any non-zero byte, in ascending
+  // order.
+  std::vector<size_t> GetNonZeroPages() const;
+
+  // Backs |length| bytes from |address| with the file |fd| from |offset|.
+  // Where the host allows it, the file is mapped copy-on-write, so a page is
+  // only read when it is first accessed, and writes never reach the file.
+  // Otherwise the range is read right away. All of |address|, |offset| and
+  // |length| are multiples of kPageSize. Not for overlays. Returns false if
+  // the file can't be read.
+  bool MapFile(size_t address, int fd, uint64_t offset, size_t length);
+
+  // Content hash of the page of |address|. Pages that were never written
+  // hash like a zero filled page.
+  uint64_t PageHash(size_t address) const;
+
+  // Hash of the whole guest memory. Zero pages don't contribute, so it
+  // doesn't depend on which pages happen to be allocated.
+  uint64_t Fingerprint() const;
+
+  // Caches the page hashes until the page is written again. The cache is
+  // allocated per chunk on first use.
+  void EnablePageHashing(bool enable);
 
-  MemoryWrapperIterator end();
+  bool IsPageHashingEnabled() const { return page_hashing_; }
 
-  bool operator==(MemoryWrapper &r);
+  // Returns the [start, end) address ranges of the pages whose contents
+  // differ between the two wrappers. Adjacent pages are merged.
+  std::vector<std::pair<size_t, size_t>> DiffPages(const MemoryWrapper &r) const;
 
-  bool operator!=(MemoryWrapper &r);
+  // Pages shared through the same base image or never written on both sides
+  // are skipped. Cached hashes reject differing pages without reading them.
+  bool operator==(const MemoryWrapper &r) const;
+
+  bool operator!=(const MemoryWrapper &r) const;
 
 private:
   inline bool CheckRange(int entry) const {
     if (entry < 0 || entry >= kMapEntry) {
       throw std::out_of_range("Memory wrapper size out of range.");
     }
-    return assigned_[entry];
+    return mapping_[entry] != nullptr;
   }
 
-  std::array<std::vector<uint32_t>, kMapEntry> mapping_;
-  std::array<bool, kMapEntry> assigned_;
+  // True if accesses to the page of |i| still go to the base image.
+  inline bool IsSharedPage(size_t i) const {
+    if (!base_) {
+      return false;
+    }
+    size_t page = (i >> kPageBits) & kPageMask;
+    return !((private_[page >> 6] >> (page & 63)) & 1);
+  }
+
+  // Gives the overlay its own copy of the page of |address|. The copy from
+  // the base is skipped if the caller is about to overwrite the whole page.
+  void PrivatizePage(size_t address, bool copy);
+
+  // Length of the next piece of a bulk access, which never crosses a chunk
+  // boundary, nor a page boundary in an overlay.
+  size_t StepSize(size_t address, size_t length) const;
+
+  // Returns the bytes of the page seen through this wrapper, or nullptr if it
+  // has never been written.
+  const uint8_t *PageBytes(size_t page) const;
+
+  void AllocateChunk(int entry);
+
+  // Allocates the two chunks of the 2 MiB region that contains |entry| as
+  // one huge page. Returns false if the region can't be allocated that way.
+  bool AllocateHugeChunks(int entry);
+
+  // Byte view of a chunk. Words are stored in the host byte order, which is
+  // little endian like RISC-V on all supported hosts.
+  inline uint8_t *ChunkBytes(int entry) {
+    return reinterpret_cast<uint8_t *>(mapping_[entry]);
+  }
+
+  inline const uint8_t *ChunkBytes(int entry) const {
+    return reinterpret_cast<const uint8_t *>(mapping_[entry]);
+  }
+
+  // Records a write to the page of |i| for dirty tracking and the page hash
+  // cache.
+  inline void MarkDirty(size_t i) {
+    if (dirty_tracking_ || page_hashing_) {
+      MarkPageWritten((i >> kPageBits) & kPageMask);
+    }
+  }
+
+  void MarkPageWritten(size_t page);
+
+  void MarkDirtyRange(size_t address, size_t length);
+
+  // True if the chunk has data here or in the base image.
+  bool ChunkHasData(int entry) const;
+
+  bool GetCachedPageHash(size_t page, uint64_t *hash) const;
+
+  bool IsPageEqual(const MemoryWrapper &r, size_t page) const;
+
+  struct PageHashes {
+    std::array<uint64_t, kChunkPages / 64> valid;
+    std::array<uint64_t, kChunkPages> hash;
+  };
+
+  // Chunks are nullptr until written. The host memory behind them is owned
+  // by regions_.
+  std::array<uint32_t *, kMapEntry> mapping_;
+  std::vector<std::shared_ptr<void>> regions_;
+  std::shared_ptr<const MemoryWrapper> base_;
+  // One bit per page. Set when the page has been copied into the overlay.
+  std::vector<uint64_t> private_;
+  // Mutable, as caching a page hash is a change for the writable host pages.
+  mutable uint64_t mapping_epoch_ = 0;
+  bool huge_pages_ = false;
+  size_t huge_tlb_regions_ = 0;
+  size_t transparent_huge_regions_ = 0;
+  bool dirty_tracking_ = false;
+  std::vector<uint64_t> dirty_;
+  bool page_hashing_ = false;
+  mutable std::vector<std::unique_ptr<PageHashes>> page_hashes_;
+
+  friend class MemoryWrapperIterator;
+};
+
+class MemoryWrapperIterator {
+public:
+  MemoryWrapperIterator(const std::vector<uint64_t> &bitmap, size_t page);
+
+  size_t operator*() const { return page_ << MemoryWrapper::kPageBits; }
+
+  MemoryWrapperIterator &operator++();
+
+  bool operator==(const MemoryWrapperIterator &r) const { return page_ == r.page_; }
+
+  bool operator!=(const MemoryWrapperIterator &r) const { return page_ != r.page_; }
+
+private:
+  // Moves to the first dirty page at or after page_.
+  void SkipCleanPages();
+
+  const std::vector<uint64_t> &bitmap_;
+  size_t page_;
 };
 
 
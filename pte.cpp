@@ -139,7 +139,7 @@ uint64_t Pte64::GetValue() const {
   return pte_;
 };
 
-uint32_t Pte64::GetPpn() const {
+uint64_t Pte64::GetPpn() const {
   return bitcrop(pte_, 44, 10);
 }
 
@@ -192,7 +192,7 @@ uint32_t Pte64::GetV() const {
 }
 
 void Pte64::SetPpn(uint64_t ppn) {
-  pte_ = (pte_ & ~GenMask<uint64_t>(22, 10)) | (ppn << 10);
+  pte_ = (pte_ & ~GenMask<uint64_t>(44, 10)) | ((ppn & GenMask<uint64_t>(44, 0)) << 10);
 }
 
 void Pte64::SetRsw(uint32_t rsw) {
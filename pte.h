@@ -81,7 +81,7 @@ public:
 
   uint64_t GetValue() const;
 
-  uint32_t GetPpn() const;
+  uint64_t GetPpn() const;
 
   uint32_t GetPpn2() const;
 
@@ -2,7 +2,9 @@
 // Created by moiz on 2/1/20.
 //
 
+#include <cstring>
 #include <iostream>
+#include <vector>
 #include <sys/stat.h>
 
 #ifndef _WIN32
@@ -16,6 +18,7 @@
 
 #include "system_call_emulator.h"
 #include "RISCV_cpu.h"
+#include "ReplayLog.h"
 
 #ifdef _WIN32
 #include "io.h"
@@ -115,28 +118,49 @@ void ConvHostStatToGuestStat(const struct stat &host_stat,
 
 size_t
 MemoryWrapperStrlen(const MemoryWrapper &mem, size_t address, size_t max) {
-  size_t counter = 0;
-  size_t index = address;
-  while (mem.ReadByte(index++) && counter < max) {
-    ++counter;
-  }
-  return counter;
+  return mem.FindByte(address, 0, max);
 }
 
 char *MemoryWrapperCopy(const MemoryWrapper &mem, size_t address, size_t length,
                         char *dst) {
-  for (size_t i = 0; i < length; ++i) {
-    dst[i] = mem.ReadByte(address + i);
-  }
+  mem.ReadBlock(address, dst, length);
   return dst;
 }
 
 int openHandles = 0;
 
+namespace {
+
+// Runs |host_call| and logs its result with |data|, the bytes it produced for
+// the guest. While |log| replays, takes both from the log instead of the host.
+template<typename HostCall>
+int64_t HostCallOrReplay(ReplayLog *log, std::vector<uint8_t> *data, bool *error_flag, HostCall host_call) {
+  std::vector<uint8_t> no_data;
+  if (!data) {
+    data = &no_data;
+  }
+  if (log && log->IsReplaying()) {
+    uint64_t result;
+    if (!log->ReplaySystemCall(&result, data)) {
+      *error_flag = true;
+      data->clear();
+      return -1;
+    }
+    return static_cast<int64_t>(result);
+  }
+  int64_t result = host_call();
+  if (log && log->IsRecording()) {
+    log->RecordSystemCall(result, *data);
+  }
+  return result;
+}
+
+} // namespace anonymous
+
 std::pair<bool, bool>
 SystemCallEmulation(std::shared_ptr<MemoryWrapper> memory, uint64_t *reg,
                     const uint64_t top,
-                    uint64_t *break_address, bool debug) {
+                    uint64_t *break_address, bool debug, ReplayLog *log) {
   auto &brk = *break_address;
   auto &mem = *memory;
   bool end_flag = false;
@@ -155,11 +179,15 @@ SystemCallEmulation(std::shared_ptr<MemoryWrapper> memory, uint64_t *reg,
     }
     int length = reg[A2];
     unsigned char *buffer = new unsigned char[length];
-    for (int i = 0; i < length; i++) {
-      buffer[i] = mem.ReadByte(reg[A1] + i);
-    }
+    mem.ReadBlock(reg[A1], buffer, length);
     std::cerr << std::endl;
-    ssize_t return_value = CIO_write(reg[A0], buffer, length);
+    ssize_t return_value = HostCallOrReplay(log, nullptr, &error_flag, [&] {
+      return CIO_write(reg[A0], buffer, length);
+    });
+    // The console output is still shown in a replay.
+    if (log && log->IsReplaying() && (reg[A0] == 1 || reg[A0] == 2)) {
+      CIO_write(reg[A0], buffer, length);
+    }
     reg[A0] = return_value;
     delete[] buffer;
   } else if (reg[A7] == 214) {
@@ -181,13 +209,17 @@ SystemCallEmulation(std::shared_ptr<MemoryWrapper> memory, uint64_t *reg,
       std::cerr << "Read System Call" << std::endl;
     }
     int length = reg[A2];
-    unsigned char *buffer = new unsigned char[length];
-    size_t return_value = CIO_read(reg[A0], buffer, length);
+    std::vector<uint8_t> buffer;
+    ssize_t return_value = HostCallOrReplay(log, &buffer, &error_flag, [&] {
+      buffer.resize(length);
+      ssize_t read_size = CIO_read(reg[A0], buffer.data(), length);
+      buffer.resize(read_size > 0 ? read_size : 0);
+      return read_size;
+    });
     reg[A0] = (uint32_t) return_value;
-    for (int i = 0; i < length; i++) {
-      mem.WriteByte(reg[A1] + i, buffer[i]);
+    if (return_value > 0 && buffer.size() == static_cast<size_t>(return_value)) {
+      mem.WriteBlock(reg[A1], buffer.data(), return_value);
     }
-    delete[] buffer;
   } else if (reg[A7] == 80) {
     // FSTAT.
     struct Riscv32NewlibStat guest_stat;
@@ -197,20 +229,24 @@ SystemCallEmulation(std::shared_ptr<MemoryWrapper> memory, uint64_t *reg,
       std::cerr << "riscv32_stat size: " << sizeof(struct Riscv32NewlibStat)
                 << std::endl;
     }
-    unsigned char *statbuf_p = (unsigned char *) &guest_stat;
-
-    struct stat host_stat;
-    int return_value = fstat(reg[A0], &host_stat);
-
-    ConvHostStatToGuestStat(host_stat, &guest_stat);
+    std::vector<uint8_t> data;
+    int return_value = HostCallOrReplay(log, &data, &error_flag, [&] {
+      struct stat host_stat;
+      int result = fstat(reg[A0], &host_stat);
+      ConvHostStatToGuestStat(host_stat, &guest_stat);
+      data.resize(sizeof(guest_stat));
+      std::memcpy(data.data(), &guest_stat, sizeof(guest_stat));
+      return result;
+    });
+    if (data.size() == sizeof(guest_stat)) {
+      std::memcpy(&guest_stat, data.data(), sizeof(guest_stat));
+    }
     if (debug) {
       std::cerr << "ret: " << reg[A0] << std::endl;
       std::cerr << "Guest: struct stat\n";
       ShowGuestStat(guest_stat);
     }
-    for (unsigned int i = 0; i < sizeof(Riscv32NewlibStat); i++) {
-      mem.WriteByte(reg[A1] + i, statbuf_p[i]);
-    }
+    mem.WriteBlock(reg[A1], &guest_stat, sizeof(Riscv32NewlibStat));
     reg[A0] = return_value;
   } else if (reg[A7] == 57) {
     // Close.
@@ -221,7 +257,7 @@ SystemCallEmulation(std::shared_ptr<MemoryWrapper> memory, uint64_t *reg,
 
     // Try to prevent closing if open is not used
     if (openHandles > 0) {
-      return_value = CIO_close(reg[A0]);
+      return_value = HostCallOrReplay(log, nullptr, &error_flag, [&] { return CIO_close(reg[A0]); });
       openHandles--;
     } else {
       return_value = 0;
@@ -279,7 +315,7 @@ SystemCallEmulation(std::shared_ptr<MemoryWrapper> memory, uint64_t *reg,
                   << std::dec << std::endl;
         std::cerr << "Flag = " << std::hex << flag << std::dec << std::endl;
       }
-      return_value = CIO_open(buffer, flag, reg[A2]);
+      return_value = HostCallOrReplay(log, nullptr, &error_flag, [&] { return CIO_open(buffer, flag, reg[A2]); });
       if (return_value >= 0) openHandles++;
       delete[] buffer;
     }
@@ -287,7 +323,9 @@ SystemCallEmulation(std::shared_ptr<MemoryWrapper> memory, uint64_t *reg,
   } else if (reg[A7] == 62) {
     // lseek.
     std::cerr << "Lseek System Call" << std::endl;
-    int return_value = CIO_lseek(reg[A0], reg[A1], reg[A2]);
+    int return_value = HostCallOrReplay(log, nullptr, &error_flag, [&] {
+      return CIO_lseek(reg[A0], reg[A1], reg[A2]);
+    });
     reg[A0] = return_value;
   } else {
     std::cerr << "Undefined system call (" << reg[A7] << "). Exit.\n";
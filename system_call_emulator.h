@@ -10,6 +10,8 @@
 
 namespace RISCV_EMULATOR {
 
+class ReplayLog;
+
 struct Riscv32NewlibStat {
   uint16_t st_dev;  // 0
   uint16_t st_ino;  // 2
@@ -47,8 +49,10 @@ size_t MemoryWrapperStrlen(const MemoryWrapper &mem, size_t address, size_t max
 
 char *MemoryWrapperCopy(const MemoryWrapper &mem, size_t address, size_t length, char *dst);
 
+// The results of host calls are logged to |log| while it records, and taken
+// from it while it replays.
 std::pair<bool, bool> SystemCallEmulation(std::shared_ptr<MemoryWrapper> memory, uint64_t *reg, const uint64_t top,
-                                          uint64_t *break_address, bool debug = false);
+                                          uint64_t *break_address, bool debug = false, ReplayLog *log = nullptr);
 
 } // namespace RISCV_EMULATOR
 
@@ -1,11 +1,28 @@
 #include "RISCV_cpu.h"
+#include "Snapshot.h"
+#include "ForkServer.h"
+#include "ReplayLog.h"
+#include "TimeTravel.h"
+#include "Profiler.h"
+#include "InstructionMix.h"
+#include "BasicBlockVector.h"
+#include "Trace.h"
 #include "bit_tools.h"
 #include "load_assembler.h"
 #include "assembler.h"
 #include <map>
 #include <random>
+#include <algorithm>
 #include <iostream>
 #include <cassert>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#ifndef _WIN32
+#include <csignal>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 using namespace RISCV_EMULATOR;
 using namespace CPU_TEST;
@@ -2141,6 +2158,954 @@ bool TestSortQuiet(bool verbose) {
 }
 // Sort test ends here.
 
+// Instruction fetch test starts here.
+// Runs code from a copy-on-write overlay. The code overwrites an instruction
+// in its own page, and ends with an instruction across a page boundary.
+bool TestFetch(bool verbose) {
+  constexpr uint64_t kStart = 0x1000;
+  constexpr uint64_t kPatched = 0x1100;
+  constexpr uint64_t kStraddle = 0x1FFE;
+  auto image = std::make_shared<MemoryWrapper>();
+  uint64_t address = kStart;
+  address = AddCmd(*image, address, AsmAddi(T0, ZERO, kPatched >> 4));
+  address = AddCmd(*image, address, AsmSlli(T0, T0, 4));
+  address = AddCmd(*image, address, AsmLw(T1, T0, 4));
+  address = AddCmd(*image, address, AsmSw(T0, T1, 0));
+  AddCmd(*image, address, AsmJal(ZERO, kPatched - address));
+  address = AddCmd(*image, kPatched, AsmAddi(A0, ZERO, 1));
+  // Not executed. Copied over the instruction above.
+  address = AddCmd(*image, address, AsmAddi(A0, ZERO, 7));
+  AddCmd(*image, address, AsmJal(ZERO, kStraddle - address));
+  address = AddCmd(*image, kStraddle, AsmAddi(A1, A0, 100));
+  address = AddCmd(*image, address, AsmXor(RA, RA, RA));
+  AddCmd(*image, address, AsmJalr(ZERO, RA, 0));
+
+  auto overlay = std::make_shared<MemoryWrapper>(std::shared_ptr<const MemoryWrapper>(image));
+  RiscvCpu cpu(en_64_bit);
+  RandomizeRegisters(cpu);
+  cpu.SetMemory(overlay);
+  bool error = cpu.RunCpu(kStart, false) != 0;
+  error |= cpu.ReadRegister(A0) != 7;
+  error |= cpu.ReadRegister(A1) != 107;
+  error |= image->Read32(kPatched) != AsmAddi(A0, ZERO, 1);
+  if (verbose) {
+    printf("Instruction fetch test %s.\n", error ? "failed" : "passed");
+  }
+  return error;
+}
+// Instruction fetch test ends here.
+
+// PMP test starts here.
+// M-mode allows U-mode to read and execute [0, 0x2000) and to read and write
+// [0x3000, 0x4000). Then a U-mode store to the code is a store access fault.
+bool TestPmp(bool verbose) {
+  constexpr uint64_t kStart = 0x1000;
+  constexpr uint64_t kUserCode = 0x1200;
+  constexpr uint64_t kHandler = 0x1800;
+  constexpr uint32_t kPmpAddr1 = (0x3000 >> 2) | ((0x1000 >> 3) - 1);  // NAPOT 4 KiB.
+  constexpr uint32_t kPmpCfg0 = (0b01 << 3 | 0b101) | (0b11 << 3 | 0b011) << 8;  // TOR RX, NAPOT RW.
+  auto memory = std::make_shared<MemoryWrapper>();
+  uint64_t address = kStart;
+  // Writes |value| to |csr| with T0.
+  auto write_csr = [&](uint32_t csr, uint32_t value) {
+    uint32_t val20, val12;
+    std::tie(val20, val12) = SplitImmediate(value);
+    address = AddCmd(*memory, address, AsmLui(T0, val20));
+    address = AddCmd(*memory, address, AsmAddi(T0, T0, val12));
+    address = AddCmd(*memory, address, AsmCsrrw(ZERO, T0, csr));
+  };
+  write_csr(PMPADDR0, 0x2000 >> 2);
+  write_csr(PMPADDR0 + 1, kPmpAddr1);
+  write_csr(PMPCFG0, kPmpCfg0);
+  write_csr(MTVEC, kHandler);
+  write_csr(MEPC, kUserCode);
+  // MPP is U-mode.
+  AddCmd(*memory, address, AsmMret());
+  address = AddCmd(*memory, kUserCode, AsmLui(T1, 3));
+  address = AddCmd(*memory, address, AsmAddi(A0, ZERO, 42));
+  address = AddCmd(*memory, address, AsmSw(T1, A0, 0));
+  address = AddCmd(*memory, address, AsmLw(A3, T1, 0));
+  address = AddCmd(*memory, address, AsmLui(T2, 1));
+  AddCmd(*memory, address, AsmSw(T2, A0, 0x700));
+  address = AddCmd(*memory, kHandler, AsmCsrrs(A1, ZERO, MCAUSE));
+  address = AddCmd(*memory, address, AsmCsrrs(A2, ZERO, MTVAL));
+  address = AddCmd(*memory, address, AsmXor(RA, RA, RA));
+  AddCmd(*memory, address, AsmJalr(ZERO, RA, 0));
+
+  RiscvCpu cpu(en_64_bit);
+  RandomizeRegisters(cpu);
+  cpu.SetMemory(memory);
+  bool error = cpu.RunCpu(kStart, false) != 0;
+  error |= cpu.ReadRegister(A3) != 42;
+  error |= cpu.ReadRegister(A1) != STORE_ACCESS_FAULT;
+  error |= cpu.ReadRegister(A2) != 0x1700;
+  error |= memory->Read32(0x1700) != 0;
+  error |= cpu.ReadCsr(PMPCFG0) != kPmpCfg0;
+
+  // An entry locked after the state was saved is unlocked by restoring it.
+  constexpr uint64_t kRelock = 0x1400;
+  constexpr uint32_t kLockedCfg0 = 0x80 | 0b11 << 3 | 0b101;  // Locked NAPOT RX.
+  constexpr uint32_t kPmpAddr0 = (0x5000 >> 2) | ((0x1000 >> 3) - 1);  // NAPOT 4 KiB.
+  auto lock_memory = std::make_shared<MemoryWrapper>();
+  memory = lock_memory;
+  address = kStart;
+  write_csr(PMPADDR0, kPmpAddr1);
+  write_csr(PMPCFG0, kLockedCfg0);
+  address = AddCmd(*lock_memory, address, AsmXor(RA, RA, RA));
+  AddCmd(*lock_memory, address, AsmJalr(ZERO, RA, 0));
+  address = kRelock;
+  write_csr(PMPADDR0, kPmpAddr0);
+  address = AddCmd(*lock_memory, address, AsmXor(RA, RA, RA));
+  AddCmd(*lock_memory, address, AsmJalr(ZERO, RA, 0));
+  RiscvCpu lock_cpu(en_64_bit);
+  lock_cpu.SetMemory(lock_memory);
+  SnapshotWriter writer;
+  lock_cpu.SaveState(writer);
+  error |= lock_cpu.RunCpu(kStart, false) != 0;
+  error |= lock_cpu.ReadCsr(PMPCFG0) != kLockedCfg0 || lock_cpu.ReadCsr(PMPADDR0) != kPmpAddr1;
+  SnapshotReader reader(writer.GetData().data(), writer.GetData().size());
+  error |= !lock_cpu.RestoreState(reader);
+  error |= lock_cpu.RunCpu(kRelock, false) != 0;
+  error |= lock_cpu.ReadCsr(PMPCFG0) != 0 || lock_cpu.ReadCsr(PMPADDR0) != kPmpAddr0;
+  if (verbose) {
+    printf("PMP test %s.\n", error ? "failed" : "passed");
+  }
+  return error;
+}
+// PMP test ends here.
+
+// Host TLB test starts here.
+bool TestHostTlb(bool verbose) {
+  constexpr uint64_t kStart = 0x1000;
+  constexpr uint64_t kHandler = 0x1700;
+  constexpr uint32_t kPmpAddr0 = (0x3000 >> 2) | ((0x1000 >> 3) - 1);  // NAPOT 4 KiB.
+  constexpr uint32_t kPmpCfg0 = 0x80 | 0b11 << 3 | 0b101;  // Locked NAPOT RX.
+  auto memory = std::make_shared<MemoryWrapper>();
+  uint64_t address = kStart;
+  address = AddCmd(*memory, address, AsmLui(T1, 3));
+  address = AddCmd(*memory, address, AsmAddi(A0, ZERO, -128));
+  // The first access of each type fills the entry, and the second one hits.
+  address = AddCmd(*memory, address, AsmSb(T1, A0, 0));
+  address = AddCmd(*memory, address, AsmSb(T1, A0, 1));
+  address = AddCmd(*memory, address, AsmLb(A1, T1, 1));
+  address = AddCmd(*memory, address, AsmLb(A2, T1, 0));
+  address = AddCmd(*memory, address, AsmLbu(A3, T1, 0));
+  // Misaligned, and 0x3002 is not written.
+  address = AddCmd(*memory, address, AsmLh(A4, T1, 1));
+  // The locked PMP entry applies to M-mode stores that hit before.
+  uint32_t val20, val12;
+  std::tie(val20, val12) = SplitImmediate(kPmpAddr0);
+  address = AddCmd(*memory, address, AsmLui(T0, val20));
+  address = AddCmd(*memory, address, AsmAddi(T0, T0, val12));
+  address = AddCmd(*memory, address, AsmCsrrw(ZERO, T0, PMPADDR0));
+  address = AddCmd(*memory, address, AsmAddi(T0, ZERO, kPmpCfg0));
+  address = AddCmd(*memory, address, AsmCsrrw(ZERO, T0, PMPCFG0));
+  address = AddCmd(*memory, address, AsmLui(T0, 1));
+  address = AddCmd(*memory, address, AsmAddi(T0, T0, kHandler - 0x1000));
+  address = AddCmd(*memory, address, AsmCsrrw(ZERO, T0, MTVEC));
+  address = AddCmd(*memory, address, AsmSb(T1, ZERO, 0));
+  address = AddCmd(*memory, kHandler, AsmCsrrs(A5, ZERO, MCAUSE));
+  address = AddCmd(*memory, address, AsmXor(RA, RA, RA));
+  AddCmd(*memory, address, AsmJalr(ZERO, RA, 0));
+
+  RiscvCpu cpu(en_64_bit);
+  RandomizeRegisters(cpu);
+  cpu.SetMemory(memory);
+  bool error = cpu.RunCpu(kStart, false) != 0;
+  const uint64_t mask = en_64_bit ? ~0ull : 0xFFFFFFFF;
+  error |= (cpu.ReadRegister(A1) & mask) != (static_cast<uint64_t>(-128) & mask);
+  error |= (cpu.ReadRegister(A2) & mask) != (static_cast<uint64_t>(-128) & mask);
+  error |= cpu.ReadRegister(A3) != 0x80;
+  error |= cpu.ReadRegister(A4) != 0x80;
+  error |= cpu.ReadRegister(A5) != STORE_ACCESS_FAULT;
+  error |= memory->Read16(0x3000) != 0x8080;
+  if (verbose) {
+    printf("Host TLB test %s.\n", error ? "failed" : "passed");
+  }
+  return error;
+}
+// Host TLB test ends here.
+
+// Snapshot test starts here.
+// The program is stopped between two loops and saved. The restored machine
+// has to end like the one that ran through.
+bool TestSnapshot(bool verbose) {
+  constexpr uint64_t kStart = 0x1000;
+  const std::string filename = "cpu_test_snapshot.bin";
+  auto image = std::make_shared<MemoryWrapper>();
+  uint64_t address = kStart;
+  address = AddCmd(*image, address, AsmAddi(T0, ZERO, 100));
+  address = AddCmd(*image, address, AsmAddi(A0, ZERO, 0));
+  address = AddCmd(*image, address, AsmLui(T1, 3));
+  const uint64_t first_loop = address;
+  address = AddCmd(*image, address, AsmAdd(A0, A0, T0));
+  address = AddCmd(*image, address, AsmSw(T1, A0, 0));
+  address = AddCmd(*image, address, AsmAddi(T1, T1, 4));
+  address = AddCmd(*image, address, AsmAddi(T0, T0, -1));
+  address = AddCmd(*image, address, AsmBne(T0, ZERO, first_loop - address));
+  const uint64_t marker = address;
+  address = AddCmd(*image, address, AsmAddi(T0, ZERO, 100));
+  const uint64_t second_loop = address;
+  address = AddCmd(*image, address, AsmAddi(T1, T1, -4));
+  address = AddCmd(*image, address, AsmLw(A1, T1, 0));
+  address = AddCmd(*image, address, AsmXor(A0, A0, A1));
+  address = AddCmd(*image, address, AsmAddi(T0, T0, -1));
+  address = AddCmd(*image, address, AsmBne(T0, ZERO, second_loop - address));
+  address = AddCmd(*image, address, AsmXor(RA, RA, RA));
+  AddCmd(*image, address, AsmJalr(ZERO, RA, 0));
+  // Zero pages are not saved.
+  image->Fill(0x100000, 0, 0x100000);
+
+  auto reference_memory = std::make_shared<MemoryWrapper>(std::shared_ptr<const MemoryWrapper>(image));
+  RiscvCpu reference(en_64_bit);
+  RandomizeRegisters(reference);
+  reference.SetMemory(reference_memory);
+  bool error = reference.RunCpu(kStart, false) != 0;
+
+  auto stopped_memory = std::make_shared<MemoryWrapper>(std::shared_ptr<const MemoryWrapper>(image));
+  RiscvCpu stopped(en_64_bit);
+  RandomizeRegisters(stopped);
+  stopped.SetMemory(stopped_memory);
+  stopped.SetStopPc(marker);
+  error |= stopped.RunCpu(kStart, false) != 0;
+  error |= !stopped.IsStopped() || stopped.GetNextPc() != marker;
+  error |= !SaveSnapshot(filename, stopped, *stopped_memory, nullptr);
+  std::ifstream file(filename, std::ios::binary | std::ios::ate);
+  error |= static_cast<size_t>(file.tellg()) > 0x20000;
+  file.close();
+
+  std::unique_ptr<RiscvCpu> restored;
+  std::shared_ptr<MemoryWrapper> restored_memory;
+  std::shared_ptr<std::vector<uint8_t>> disk_image;
+  error |= !LoadSnapshot(filename, &restored, &restored_memory, &disk_image);
+  if (!error) {
+    error |= *restored_memory != *stopped_memory;
+    error |= restored->RunCpu(restored->GetNextPc(), false) != 0;
+    for (uint32_t reg : {A0, A1, T0, T1}) {
+      error |= restored->ReadRegister(reg) != reference.ReadRegister(reg);
+    }
+    error |= *restored_memory != *reference_memory;
+  }
+
+  // Other versions are rejected.
+  std::fstream patch(filename, std::ios::binary | std::ios::in | std::ios::out);
+  patch.seekp(8);
+  patch.put(static_cast<char>(0x7F));
+  patch.close();
+  error |= LoadSnapshot(filename, &restored, &restored_memory, &disk_image);
+  std::remove(filename.c_str());
+  if (verbose) {
+    printf("Snapshot test %s.\n", error ? "failed" : "passed");
+  }
+  return error;
+}
+// Snapshot test ends here.
+
+bool TestCoverage(bool verbose) {
+  constexpr uint64_t kStart = 0x1000;
+  auto memory = std::make_shared<MemoryWrapper>();
+  uint64_t address = kStart;
+  address = AddCmd(*memory, address, AsmAddi(T0, ZERO, 10));
+  const uint64_t loop = address;
+  address = AddCmd(*memory, address, AsmAddi(T0, T0, -1));
+  address = AddCmd(*memory, address, AsmBne(T0, ZERO, loop - address));
+  address = AddCmd(*memory, address, AsmXor(RA, RA, RA));
+  AddCmd(*memory, address, AsmJalr(ZERO, RA, 0));
+
+  std::vector<uint8_t> map(RiscvCpu::kCoverageMapSize);
+  RiscvCpu cpu(en_64_bit);
+  cpu.SetMemory(memory);
+  cpu.SetCoverageMap(map.data(), map.size());
+  bool error = cpu.RunCpu(kStart, false) != 0;
+  // The first taken branch comes from the start, then eight more go around
+  // the loop, and the return ends it.
+  int edges = 0, count = 0;
+  for (uint8_t counter : map) {
+    edges += counter != 0;
+    count += counter;
+  }
+  error |= edges != 3 || count != 10;
+  error |= *std::max_element(map.begin(), map.end()) != 8;
+
+  std::fill(map.begin(), map.end(), 0);
+  cpu.SetCoverageMap(nullptr, 0);
+  error |= cpu.RunCpu(kStart, false) != 0;
+  error |= std::count(map.begin(), map.end(), 0) != static_cast<int>(map.size());
+  if (verbose) {
+    printf("Coverage test %s.\n", error ? "failed" : "passed");
+  }
+  return error;
+}
+// Coverage test ends here.
+
+bool TestForkServer(bool verbose) {
+  constexpr uint64_t kStart = 0x1000;
+  constexpr uint64_t kBuffer = 0x4000;
+  constexpr uint64_t kResult = 0x5000;
+  auto memory = std::make_shared<MemoryWrapper>();
+  uint64_t address = kStart;
+  address = AddCmd(*memory, address, AsmLui(A0, kBuffer >> 12));
+  address = AddCmd(*memory, address, AsmAddi(A1, ZERO, 16));
+  const uint64_t call = address;
+  const uint64_t harness = kStart + 0x100;
+  address = AddCmd(*memory, address, AsmJal(RA, harness - call));
+  address = AddCmd(*memory, address, AsmXor(RA, RA, RA));
+  AddCmd(*memory, address, AsmJalr(ZERO, RA, 0));
+  // Counts the runs, keeps the first byte and the size, and fails on '!'.
+  address = harness;
+  address = AddCmd(*memory, address, AsmLbu(T0, A0, 0));
+  address = AddCmd(*memory, address, AsmAddi(T1, ZERO, '!'));
+  address = AddCmd(*memory, address, AsmBne(T0, T1, 8));
+  address = AddCmd(*memory, address, 0);
+  address = AddCmd(*memory, address, AsmLui(T2, kResult >> 12));
+  address = AddCmd(*memory, address, AsmLw(T1, T2, 0));
+  address = AddCmd(*memory, address, AsmAddi(T1, T1, 1));
+  address = AddCmd(*memory, address, AsmSw(T2, T1, 0));
+  address = AddCmd(*memory, address, AsmSw(T2, T0, 4));
+  address = AddCmd(*memory, address, AsmSw(T2, A1, 8));
+  AddCmd(*memory, address, AsmJalr(ZERO, RA, 0));
+
+  RiscvCpu cpu(en_64_bit);
+  cpu.SetMemory(memory);
+  cpu.SetStopPc(harness);
+  bool error = cpu.RunCpu(kStart, false) != 0 || !cpu.IsStopped();
+  ForkServer server(&cpu, memory, kBuffer, 4);
+  // Each run starts from the entry, and only sees its own input.
+  for (const char *input : {"A", "BCDEFG", "C"}) {
+    error |= server.RunInput(reinterpret_cast<const uint8_t *>(input), std::strlen(input));
+    error |= !cpu.IsStopped();
+    error |= cpu.ReadRegister(T0) != static_cast<uint8_t>(input[0]);
+    error |= cpu.ReadRegister(A1) != std::min<size_t>(std::strlen(input), 4);
+  }
+  // The buffer, the results, and mtime.
+  error |= server.GetResetPages() != 3;
+  error |= !server.RunInput(reinterpret_cast<const uint8_t *>("!"), 1);
+  // The entry state is untouched by the runs.
+  error |= memory->Read32(kResult) != 0 || memory->ReadByte(kBuffer) != 0;
+
+#ifndef _WIN32
+  // The fork server protocol, with inputs in a file behind stdin.
+  int control[2], status[2];
+  FILE *input_file = std::tmpfile();
+  error |= !input_file || pipe(control) != 0 || pipe(status) != 0;
+  std::fflush(stdout);
+  pid_t server_pid = error ? -1 : fork();
+  if (server_pid == 0) {
+    dup2(control[0], 198);
+    dup2(status[1], 199);
+    dup2(fileno(input_file), 0);
+    for (int fd : {control[0], control[1], status[0], status[1]}) {
+      close(fd);
+    }
+    _exit(server.Serve());
+  }
+  close(control[0]);
+  close(status[1]);
+  uint32_t hello = ~0u;
+  error |= read(status[0], &hello, sizeof(hello)) != sizeof(hello) || hello != 0;
+  auto run_afl = [&](const char *input) {
+    error |= ftruncate(fileno(input_file), 0) != 0;
+    error |= pwrite(fileno(input_file), input, std::strlen(input), 0) != static_cast<ssize_t>(std::strlen(input));
+    uint32_t was_killed = 0;
+    int32_t pid = -1;
+    int wait_status = 0;
+    error |= write(control[1], &was_killed, sizeof(was_killed)) != sizeof(was_killed);
+    error |= read(status[0], &pid, sizeof(pid)) != sizeof(pid) || pid <= 0;
+    error |= read(status[0], &wait_status, sizeof(wait_status)) != sizeof(wait_status);
+    return wait_status;
+  };
+  if (server_pid > 0) {
+    int first = run_afl("A");
+    int crash = run_afl("!");
+    int after_crash = run_afl("B");
+    error |= !WIFSTOPPED(first) || !WIFSTOPPED(after_crash);
+    error |= !WIFSIGNALED(crash) || WTERMSIG(crash) != SIGABRT;
+    close(control[1]);
+    int server_status;
+    error |= waitpid(server_pid, &server_status, 0) != server_pid;
+    error |= !WIFEXITED(server_status) || WEXITSTATUS(server_status) != 0;
+  }
+  close(status[0]);
+  if (input_file) {
+    std::fclose(input_file);
+  }
+#endif
+  if (verbose) {
+    printf("Fork server test %s.\n", error ? "failed" : "passed");
+  }
+  return error;
+}
+// Fork server test ends here.
+
+bool TestRecordReplay(bool verbose) {
+  bool error = false;
+#ifndef _WIN32
+  char log_name[] = "/tmp/m99_replay_XXXXXX";
+  int log_fd = mkstemp(log_name);
+  error |= log_fd < 0;
+  if (log_fd >= 0) {
+    close(log_fd);
+  }
+
+  // Key events land at the instruction counts they were recorded at.
+  uint64_t clock = 5;
+  {
+    ReplayLog log;
+    log.SetClock(&clock);
+    error |= !log.StartRecording(log_name, nullptr);
+    log.RecordKey('a');
+    clock = 300;
+    log.RecordKey(KEY_BACKSPACE);
+  }
+  ReplayLog key_log;
+  clock = 0;
+  key_log.SetClock(&clock);
+  error |= !key_log.StartReplay(log_name, nullptr);
+  int key = 0;
+  error |= key_log.ReplayKey(&key);
+  clock = 5;
+  error |= !key_log.ReplayKey(&key) || key != 'a' || key_log.ReplayKey(&key);
+  clock = 300;
+  error |= !key_log.ReplayKey(&key) || key != KEY_BACKSPACE;
+  error |= !key_log.IsEnd() || key_log.HasDiverged();
+
+  // A rewound recording replays up to where it was, then records again.
+  ReplayLog rewound_log;
+  rewound_log.SetClock(&clock);
+  error |= !rewound_log.StartRecording("", nullptr);
+  clock = 5;
+  rewound_log.RecordKey('a');
+  clock = 10;
+  rewound_log.Rewind(3);
+  clock = 5;
+  error |= !rewound_log.IsReplaying() || !rewound_log.ReplayKey(&key) || key != 'a';
+  clock = 8;
+  error |= !rewound_log.IsReplaying() || rewound_log.IsRecording();
+  clock = 10;
+  error |= rewound_log.IsReplaying() || !rewound_log.IsRecording();
+
+  // A read system call from a file, replayed after the file changed.
+  constexpr uint64_t kStart = 0x1000;
+  constexpr uint64_t kBuffer = 0x4000;
+  auto make_memory = [&]() {
+    auto memory = std::make_shared<MemoryWrapper>();
+    uint64_t address = kStart;
+    address = AddCmd(*memory, address, AsmAddi(A7, ZERO, 63));
+    address = AddCmd(*memory, address, AsmLui(A1, kBuffer >> 12));
+    address = AddCmd(*memory, address, AsmAddi(A2, ZERO, 4));
+    address = AddCmd(*memory, address, AsmEcall());
+    address = AddCmd(*memory, address, AsmLbu(T0, A1, 0));
+    address = AddCmd(*memory, address, AsmXor(RA, RA, RA));
+    AddCmd(*memory, address, AsmJalr(ZERO, RA, 0));
+    return memory;
+  };
+  FILE *input_file = std::tmpfile();
+  error |= !input_file;
+  if (input_file) {
+    error |= pwrite(fileno(input_file), "REC!", 4, 0) != 4;
+  }
+  auto run = [&](std::shared_ptr<ReplayLog> log, std::shared_ptr<MemoryWrapper> memory) {
+    RiscvCpu cpu(en_64_bit);
+    cpu.SetMemory(memory);
+    cpu.SetEcallEmulationEnable(true);
+    cpu.SetReplayLog(log);
+    cpu.SetRegister(A0, input_file ? fileno(input_file) : -1);
+    error |= cpu.RunCpu(kStart, false) != 0;
+    error |= cpu.ReadRegister(A0) != 4 || cpu.ReadRegister(T0) != 'R';
+  };
+  auto recording = std::make_shared<ReplayLog>();
+  error |= !recording->StartRecording(log_name, nullptr);
+  auto recorded_memory = make_memory();
+  run(recording, recorded_memory);
+  recording.reset();
+
+  if (input_file) {
+    error |= pwrite(fileno(input_file), "xyz", 3, 0) != 3;
+  }
+  auto replay = std::make_shared<ReplayLog>();
+  error |= !replay->StartReplay(log_name, nullptr);
+  auto replayed_memory = make_memory();
+  run(replay, replayed_memory);
+  error |= replayed_memory->Read32(kBuffer) != recorded_memory->Read32(kBuffer);
+  error |= !replay->IsEnd() || replay->HasDiverged();
+
+  // The log belongs to one disk image.
+  std::vector<uint8_t> disk_image(512, 1);
+  error |= ReplayLog().StartReplay(log_name, &disk_image);
+
+  if (input_file) {
+    std::fclose(input_file);
+  }
+  std::remove(log_name);
+#endif
+  if (verbose) {
+    printf("Record replay test %s.\n", error ? "failed" : "passed");
+  }
+  return error;
+}
+// Record replay test ends here.
+
+bool TestTimeTravel(bool verbose) {
+  constexpr uint64_t kStart = 0x1000;
+  constexpr uint64_t kData = 0x4000;
+  constexpr int kLoops = 200;
+  // Counts up, and writes the count to one of four pages in turn.
+  auto make_memory = [&]() {
+    auto memory = std::make_shared<MemoryWrapper>();
+    uint64_t address = kStart;
+    address = AddCmd(*memory, address, AsmAddi(T0, ZERO, 0));
+    address = AddCmd(*memory, address, AsmLui(T1, kData >> 12));
+    address = AddCmd(*memory, address, AsmAddi(T3, ZERO, kLoops));
+    const uint64_t loop = address;
+    address = AddCmd(*memory, address, AsmAddi(T0, T0, 1));
+    address = AddCmd(*memory, address, AsmAndi(T2, T0, 3));
+    address = AddCmd(*memory, address, AsmSlli(T2, T2, 12));
+    address = AddCmd(*memory, address, AsmAdd(T2, T2, T1));
+    address = AddCmd(*memory, address, AsmSw(T2, T0, 0));
+    address = AddCmd(*memory, address, AsmBne(T0, T3, loop - address));
+    address = AddCmd(*memory, address, AsmXor(RA, RA, RA));
+    AddCmd(*memory, address, AsmJalr(ZERO, RA, 0));
+    return memory;
+  };
+  constexpr uint64_t kLoop = kStart + 12;
+  constexpr uint64_t kEnd = 3 + kLoops * 6 + 2;
+
+  RiscvCpu cpu(en_64_bit);
+  auto memory = make_memory();
+  cpu.SetMemory(memory);
+  cpu.SetStopInstructionCount(0);
+  bool error = cpu.RunCpu(kStart, false) != 0 || cpu.GetNextPc() != kStart;
+  // About four checkpoints fit.
+  constexpr size_t kBudget = 200 * 1024;
+  TimeTravel time_travel(&cpu, memory, nullptr, nullptr, 64, kBudget);
+
+  // The machine must be where a plain run stops at the same count.
+  auto check_at = [&](uint64_t count) {
+    RiscvCpu reference(en_64_bit);
+    auto reference_memory = make_memory();
+    reference.SetMemory(reference_memory);
+    reference.SetStopInstructionCount(count);
+    reference.RunCpu(kStart, false);
+    error |= cpu.GetInstructionCount() != count || cpu.GetNextPc() != reference.GetNextPc();
+    for (int i = 0; i < 32; ++i) {
+      error |= cpu.ReadRegister(i) != reference.ReadRegister(i);
+    }
+    for (uint64_t page = kData; page < kData + 4 * 4096; page += 4096) {
+      error |= time_travel.GetMemory().Read32(page) != reference_memory->Read32(page);
+    }
+  };
+  error |= time_travel.RunTo(130) != 0;
+  check_at(130);
+  error |= time_travel.RunTo(UINT64_MAX) != 0 || !time_travel.IsEnd();
+  check_at(kEnd);
+  error |= time_travel.GetHistoryBytes() > kBudget || time_travel.GetOldestInstructionCount() == 0;
+  error |= time_travel.GoTo(0);
+  for (uint64_t count : {kEnd - 1, kEnd - 100, kEnd - 64, kEnd - 65, kEnd - 3, kEnd}) {
+    error |= !time_travel.GoTo(count);
+    check_at(count);
+  }
+  // Back to the loop head at 1149, across the checkpoint at 1152, and
+  // forward to the next one.
+  error |= !time_travel.GoTo(1154);
+  error |= !time_travel.ReverseContinue(kLoop);
+  check_at(1149);
+  error |= cpu.GetNextPc() != kLoop;
+  error |= time_travel.RunTo(UINT64_MAX, kLoop) != 0;
+  check_at(1155);
+  error |= time_travel.ReverseContinue(kStart);
+  check_at(1155);
+
+  // A write to the disk image is undone by going back before it.
+  RiscvCpu disk_cpu(en_64_bit);
+  auto disk_memory = make_memory();
+  disk_cpu.SetMemory(disk_memory);
+  disk_cpu.SetStopInstructionCount(0);
+  disk_cpu.RunCpu(kStart, false);
+  auto disk_image = std::make_shared<std::vector<uint8_t>>(3 * 4096);
+  disk_cpu.SetDiskImage(disk_image);
+  TimeTravel disk_travel(&disk_cpu, disk_memory, disk_image, nullptr, 64, kBudget);
+  disk_travel.RunTo(70);
+  (*disk_image)[5000] = 9;
+  disk_cpu.MarkDiskWritten(5000, 1);
+  disk_travel.RunTo(140);
+  error |= !disk_travel.GoTo(130) || (*disk_image)[5000] != 9;
+  error |= !disk_travel.GoTo(100) || (*disk_image)[5000] != 0;
+
+  if (verbose) {
+    printf("Time travel test %s.\n", error ? "failed" : "passed");
+  }
+  return error;
+}
+// Time travel test ends here.
+
+bool TestProfiler(bool verbose) {
+  constexpr uint64_t kStart = 0x1000;
+  auto memory = std::make_shared<MemoryWrapper>();
+  uint64_t address = kStart;
+  address = AddCmd(*memory, address, AsmAddi(T0, ZERO, 10));
+  const uint64_t loop = address;
+  address = AddCmd(*memory, address, AsmAddi(T0, T0, -1));
+  address = AddCmd(*memory, address, AsmBne(T0, ZERO, loop - address));
+  const uint64_t end = address;
+  address = AddCmd(*memory, address, AsmXor(RA, RA, RA));
+  AddCmd(*memory, address, AsmJalr(ZERO, RA, 0));
+
+  // Every instruction.
+  Profiler profiler(1);
+  RiscvCpu cpu(en_64_bit);
+  cpu.SetMemory(memory);
+  cpu.SetProfiler(&profiler);
+  bool error = cpu.RunCpu(kStart, false) != 0;
+  error |= profiler.GetSampleCount() != cpu.GetInstructionCount() - 1;
+  error |= profiler.GetSamples(loop, PrivilegeMode::MACHINE_MODE) != 10;
+  error |= profiler.GetSamples(loop, PrivilegeMode::USER_MODE) != 0;
+
+  // Samples and stops at the same count both happen.
+  Profiler sparse_profiler(4);
+  RiscvCpu sparse_cpu(en_64_bit);
+  sparse_cpu.SetMemory(memory);
+  sparse_cpu.SetProfiler(&sparse_profiler);
+  sparse_cpu.SetStopInstructionCount(8);
+  error |= sparse_cpu.RunCpu(kStart, false) != 0 || !sparse_cpu.IsStopped();
+  error |= sparse_profiler.GetSampleCount() != 2;
+  error |= sparse_cpu.RunCpu(sparse_cpu.GetNextPc(), false) != 0;
+  error |= sparse_profiler.GetSampleCount() != sparse_cpu.GetInstructionCount() / 4;
+
+  profiler.SetSymbols({{kStart, 0, "setup"}, {loop, 8, "loop"}, {0, 0, ""}, {end + 4, 0, "tail"}});
+  error |= profiler.FindSymbol(kStart + 2) != "setup" || profiler.FindSymbol(loop + 4) != "loop";
+  error |= profiler.FindSymbol(end) != "" || profiler.FindSymbol(end + 4) != "tail";
+  error |= profiler.FindSymbol(kStart - 4) != "";
+  std::ostringstream report;
+  profiler.Report(report);
+  // The loop comes first, and the pc outside of the symbols on its own.
+  error |= report.str().find("M loop\n") == std::string::npos || report.str().find("M loop") > report.str().find("M setup");
+  error |= report.str().find(" M 0x") == std::string::npos;
+  if (verbose) {
+    printf("Profiler test %s.\n", error ? "failed" : "passed");
+  }
+  return error;
+}
+// Profiler test ends here.
+
+bool TestCallStacks(bool verbose) {
+  constexpr uint64_t kStart = 0x1000;
+  constexpr uint64_t kF = 0x1100;
+  constexpr uint64_t kG = 0x1200;
+  auto memory = std::make_shared<MemoryWrapper>();
+  // main calls f, which calls g, which loops.
+  uint64_t address = kStart;
+  address = AddCmd(*memory, address, AsmAddi(S0, RA, 0));
+  address = AddCmd(*memory, address, AsmJal(RA, kF - address));
+  address = AddCmd(*memory, address, AsmAddi(RA, S0, 0));
+  AddCmd(*memory, address, AsmJalr(ZERO, RA, 0));
+  address = kF;
+  address = AddCmd(*memory, address, AsmAddi(S1, RA, 0));
+  address = AddCmd(*memory, address, AsmJal(RA, kG - address));
+  address = AddCmd(*memory, address, AsmAddi(RA, S1, 0));
+  AddCmd(*memory, address, AsmJalr(ZERO, RA, 0));
+  address = kG;
+  address = AddCmd(*memory, address, AsmAddi(T0, ZERO, 100));
+  const uint64_t loop = address;
+  address = AddCmd(*memory, address, AsmAddi(T0, T0, -1));
+  address = AddCmd(*memory, address, AsmBne(T0, ZERO, loop - address));
+  AddCmd(*memory, address, AsmJalr(ZERO, RA, 0));
+
+  Profiler profiler(1);
+  profiler.EnableCallStacks();
+  profiler.SetSymbols({{kStart, 16, "main"}, {kF, 16, "f"}, {kG, 16, "g"}});
+  RiscvCpu cpu(en_64_bit);
+  cpu.SetMemory(memory);
+  cpu.SetProfiler(&profiler);
+  bool error = cpu.RunCpu(kStart, false) != 0;
+  std::ostringstream stacks;
+  profiler.WriteFoldedStacks(stacks);
+  // The first instruction comes before the first sample.
+  error |= stacks.str() != "machine;main 3\nmachine;main;f 4\nmachine;main;f;g 202\n";
+
+  // A return unwinds the calls that didn't return, and the return addresses
+  // without a symbol show as the call site.
+  Profiler unwind_profiler;
+  unwind_profiler.EnableCallStacks();
+  unwind_profiler.Call(0x104, PrivilegeMode::SUPERVISOR_MODE);
+  unwind_profiler.Call(0x204, PrivilegeMode::SUPERVISOR_MODE);
+  unwind_profiler.Return(0x104, PrivilegeMode::SUPERVISOR_MODE);
+  unwind_profiler.Sample(0x300, PrivilegeMode::SUPERVISOR_MODE);
+  unwind_profiler.Call(0x104, PrivilegeMode::SUPERVISOR_MODE);
+  unwind_profiler.Sample(0x300, PrivilegeMode::SUPERVISOR_MODE);
+  unwind_profiler.Sample(0x300, PrivilegeMode::USER_MODE);
+  unwind_profiler.ResetCallStack(PrivilegeMode::SUPERVISOR_MODE);
+  unwind_profiler.Sample(0x300, PrivilegeMode::SUPERVISOR_MODE);
+  std::ostringstream unwind_stacks;
+  unwind_profiler.WriteFoldedStacks(unwind_stacks);
+  error |= unwind_stacks.str() != "supervisor;0x103;0x300 1\nsupervisor;0x300 2\nuser;0x300 1\n";
+  if (verbose) {
+    printf("Call stacks test %s.\n", error ? "failed" : "passed");
+  }
+  return error;
+}
+// Call stacks test ends here.
+
+bool TestInstructionMix(bool verbose) {
+  constexpr uint64_t kStart = 0x1000;
+  auto memory = std::make_shared<MemoryWrapper>();
+  uint64_t address = kStart;
+  address = AddCmd(*memory, address, AsmAddi(T0, ZERO, 10));
+  const uint64_t loop = address;
+  address = AddCmdCType(*memory, address, AsmCAddi(T0, -1));
+  address = AddCmdCType(*memory, address, AsmCAddi(T1, 1));
+  address = AddCmd(*memory, address, AsmBne(T0, ZERO, loop - address));
+  address = AddCmd(*memory, address, AsmXor(RA, RA, RA));
+  AddCmd(*memory, address, AsmJalr(ZERO, RA, 0));
+
+  InstructionMix mix;
+  RiscvCpu cpu(en_64_bit);
+  cpu.SetMemory(memory);
+  cpu.SetInstructionMix(&mix);
+  bool error = cpu.RunCpu(kStart, false) != 0;
+  constexpr PrivilegeMode kMachine = PrivilegeMode::MACHINE_MODE;
+  error |= mix.GetCount(kMachine, false, INST_ADDI) != 1 || mix.GetCount(kMachine, true, INST_ADDI) != 20;
+  error |= mix.GetCount(kMachine, false, INST_BNE) != 10 || mix.GetCount(kMachine, false, INST_JALR) != 1;
+  error |= mix.GetCount(PrivilegeMode::USER_MODE, true, INST_ADDI) != 0;
+
+  // Other code at the same pc keeps the counts of the old.
+  AddCmd(*memory, kStart, AsmAddi(T0, ZERO, 3));
+  error |= cpu.RunCpu(kStart, false) != 0;
+  error |= mix.GetCount(kMachine, false, INST_ADDI) != 2 || mix.GetCount(kMachine, true, INST_ADDI) != 26;
+  error |= mix.GetCount(kMachine, false, INST_BNE) != 13 || mix.GetCount(kMachine, false, INST_XOR) != 2;
+
+  // So does code that differs after the first instruction of a block.
+  AddCmdCType(*memory, loop + 2, AsmCMv(T1, T0));
+  error |= cpu.RunCpu(kStart, false) != 0;
+  error |= mix.GetCount(kMachine, false, INST_ADDI) != 3 || mix.GetCount(kMachine, true, INST_ADDI) != 29;
+  error |= mix.GetCount(kMachine, true, INST_ADD) != 3 || mix.GetCount(kMachine, false, INST_BNE) != 16;
+  std::ostringstream report;
+  mix.Report(report);
+  error |= report.str().find("Instruction mix: 57 instructions.") == std::string::npos;
+  error |= report.str().find("c.addi") == std::string::npos || report.str().find("c.addi") > report.str().find("bne");
+  if (verbose) {
+    printf("Instruction mix test %s.\n", error ? "failed" : "passed");
+  }
+  return error;
+}
+// Instruction mix test ends here.
+
+bool TestBasicBlockVector(bool verbose) {
+  constexpr uint64_t kStart = 0x1000;
+  auto memory = std::make_shared<MemoryWrapper>();
+  uint64_t address = kStart;
+  address = AddCmd(*memory, address, AsmAddi(T0, ZERO, 10));
+  const uint64_t loop = address;
+  address = AddCmd(*memory, address, AsmAddi(T1, T1, 1));
+  address = AddCmd(*memory, address, AsmAddi(T0, T0, -1));
+  address = AddCmd(*memory, address, AsmBne(T0, ZERO, loop - address));
+  address = AddCmd(*memory, address, AsmXor(RA, RA, RA));
+  AddCmd(*memory, address, AsmJalr(ZERO, RA, 0));
+
+  std::ostringstream out;
+  BasicBlockVector bbv(&out, 10);
+  RiscvCpu cpu(en_64_bit);
+  cpu.SetMemory(memory);
+  cpu.SetBasicBlockVector(&bbv);
+  // The interval ends before the stop at the same count.
+  cpu.SetStopInstructionCount(10);
+  bool error = cpu.RunCpu(kStart, false) != 0 || !cpu.IsStopped();
+  error |= out.str() != "T:1:4 :2:6 \n";
+  // The first block runs into the loop, and the rest is in the loop. The
+  // last 3 instructions are a partial interval.
+  error |= cpu.RunCpu(cpu.GetNextPc(), false) != 0 || cpu.GetInstructionCount() != 33;
+  error |= out.str() != "T:1:4 :2:6 \nT:2:10 \nT:2:10 \n";
+  error |= bbv.GetBlockCount() != 2;
+  if (verbose) {
+    printf("Basic block vector test %s.\n", error ? "failed" : "passed");
+  }
+  return error;
+}
+// Basic block vector test ends here.
+
+bool TestTrace(bool verbose) {
+  bool error = false;
+#ifndef _WIN32
+  constexpr uint64_t kStart = 0x1000;
+  auto memory = std::make_shared<MemoryWrapper>();
+  uint64_t address = kStart;
+  address = AddCmd(*memory, address, AsmAddi(T0, ZERO, 0x200));
+  address = AddCmd(*memory, address, AsmSlli(T0, T0, 4));
+  address = AddCmd(*memory, address, AsmAddi(T1, ZERO, 77));
+  address = AddCmd(*memory, address, AsmSw(T0, T1, 0));
+  address = AddCmd(*memory, address, AsmLw(T2, T0, 0));
+  address = AddCmdCType(*memory, address, AsmCAddi(T2, 1));
+  address = AddCmd(*memory, address, AsmXor(RA, RA, RA));
+  AddCmd(*memory, address, AsmJalr(ZERO, RA, 0));
+
+  char trace_name[] = "/tmp/m99_trace_XXXXXX";
+  char text_name[] = "/tmp/m99_trace_text_XXXXXX";
+  int trace_fd = mkstemp(trace_name);
+  int text_fd = mkstemp(text_name);
+  error |= trace_fd < 0 || text_fd < 0;
+  if (trace_fd >= 0) {
+    close(trace_fd);
+  }
+  for (bool background : {false, true}) {
+    if (error) {
+      break;
+    }
+    TraceWriter writer;
+    error |= !writer.Open(trace_name, en_64_bit ? 2 : 1, background);
+    RiscvCpu cpu(en_64_bit);
+    cpu.SetMemory(memory);
+    cpu.SetTraceWriter(&writer);
+    // The text of -v goes to a file to compare the decoded trace with.
+    std::cout << std::flush;
+    std::fflush(stdout);
+    const int saved_stdout = dup(STDOUT_FILENO);
+    ftruncate(text_fd, 0);
+    lseek(text_fd, 0, SEEK_SET);
+    dup2(text_fd, STDOUT_FILENO);
+    // A register the host sets between runs is in the trace too.
+    cpu.SetStopInstructionCount(2);
+    error |= cpu.RunCpu(kStart, true) != 0;
+    cpu.SetRegister(A5, 0x1234);
+    error |= cpu.RunCpu(cpu.GetNextPc(), true) != 0;
+    std::cout << std::flush;
+    std::fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    error |= !writer.Close();
+
+    std::ifstream text_file(text_name);
+    const std::string text((std::istreambuf_iterator<char>(text_file)), std::istreambuf_iterator<char>());
+    TraceReader reader;
+    error |= !reader.Open(trace_name);
+    std::string decoded;
+    TraceEntry entry;
+    bool store = false;
+    bool load = false;
+    while (reader.Next(&entry)) {
+      decoded += FormatInstructionLine(entry.privilege, entry.pc, entry.ir, reader.GetMxl());
+      decoded += FormatRegisters(reader.GetRegisters());
+      store |= (entry.flags & TraceEntry::kStore) && entry.address == 0x2000 && entry.store_value == 77;
+      load |= (entry.flags & TraceEntry::kMemory) && !(entry.flags & TraceEntry::kStore) && entry.address == 0x2000 &&
+              entry.rd == T2 && entry.value == 77;
+    }
+    error |= reader.HasError() || !store || !load;
+    error |= decoded.empty() || decoded != text;
+    error |= reader.GetRegisters()[A5] != 0x1234 || reader.GetRegisters()[T2] != 78;
+  }
+  if (text_fd >= 0) {
+    close(text_fd);
+  }
+  std::remove(trace_name);
+  std::remove(text_name);
+#endif  // _WIN32
+  if (verbose) {
+    printf("Trace test %s.\n", error ? "failed" : "passed");
+  }
+  return error;
+}
+// Trace test ends here.
+
+bool TestDisassembler(bool verbose) {
+  const std::vector<std::pair<uint32_t, std::string>> cases = {
+      {AsmAddi(A0, ZERO, -1), "ADDI A0, ZERO, 0xffffffff"},
+      {AsmSw(T0, T1, 8), "SW T1, 0x8(T0)"},
+      {AsmLui(S11, 0x12345), "LUI S11, 0x12345 << 12"},
+      {AsmCAddi(A0, 1), "C.ADDI A0, 0x1"},
+      {AsmCsw(A0, A1, 4), "C.SW A1, 0x4(A0)"},
+      {AsmCBeqz(S1, 8), "C.BEQZ S1, 0x8"},
+  };
+  bool error = false;
+  DisassemblyCache cache;
+  char buffer[kMaxDisassemblySize];
+  for (const auto &c : cases) {
+    error |= Disassemble(c.first, 2) != c.second;
+    error |= Disassemble(c.first, 2, buffer, sizeof(buffer)) != c.second.size() || c.second != buffer;
+    // Twice, for a miss and a hit.
+    for (int i = 0; i < 2; ++i) {
+      size_t length;
+      error |= c.second != cache.Get(c.first, 2, &length) || length != c.second.size();
+    }
+  }
+  // A compressed instruction is cached without the bits above it.
+  error |= std::string(cache.Get(AsmCAddi(A0, 1) | 0x12340000, 2)) != "C.ADDI A0, 0x1";
+  // The text is cut to the buffer.
+  error |= Disassemble(AsmAddi(A0, ZERO, -1), 2, buffer, 8) != 7 || std::string(buffer) != "ADDI A0";
+  // The line of -v is the same from the cache.
+  char line[kInstructionLineSize];
+  const std::string expected = FormatInstructionLine(PrivilegeMode::SUPERVISOR_MODE, 0x80000000, AsmCAddi(A0, 1), 2);
+  error |= expected != "S 0000000080000000 (0505): C.ADDI A0, 0x1\n";
+  error |= std::string(line, FormatInstructionLine(PrivilegeMode::SUPERVISOR_MODE, 0x80000000, AsmCAddi(A0, 1), 2,
+                                                   &cache, line)) != expected;
+  // An unsupported compressed instruction writes nothing to std::cerr, as
+  // the flight recorder disassembles in a signal handler.
+  std::ostringstream captured;
+  std::streambuf *cerr_buffer = std::cerr.rdbuf(captured.rdbuf());
+  const std::string fld = Disassemble(AsmCFld(A0, A1, 8), 2);
+  const std::string zero = Disassemble(0x0000, 2);
+  std::cerr.rdbuf(cerr_buffer);
+  error |= !captured.str().empty() || fld.empty() || zero.empty();
+  if (verbose) {
+    printf("Disassembler test %s.\n", error ? "failed" : "passed");
+  }
+  return error;
+}
+// Disassembler test ends here.
+
+bool TestFlightRecorder(bool verbose) {
+  bool error = false;
+#ifndef _WIN32
+  constexpr uint64_t kStart = 0x1000;
+  constexpr uint64_t kHandler = 0x2000;
+  auto memory = std::make_shared<MemoryWrapper>();
+  uint64_t address = kStart;
+  address = AddCmd(*memory, address, AsmAddi(T0, ZERO, 3));
+  const uint64_t loop = address;
+  address = AddCmd(*memory, address, AsmAddi(T0, T0, -1));
+  address = AddCmd(*memory, address, AsmBne(T0, ZERO, loop - address));
+  const uint64_t ecall = address;
+  AddCmd(*memory, address, AsmEcall());
+  // The handler runs into an undefined instruction.
+  AddCmd(*memory, kHandler, 0xFFFFFFFF);
+
+  RiscvCpu cpu(en_64_bit);
+  cpu.SetMemory(memory);
+  cpu.SetCsr(MTVEC, kHandler);
+  error |= cpu.RunCpu(kStart, false) == 0;
+  int pipe_fds[2];
+  error |= pipe(pipe_fds) != 0;
+  if (!error) {
+    cpu.DumpFlightRecorder(pipe_fds[1]);
+    close(pipe_fds[1]);
+    std::string dump;
+    char buffer[256];
+    ssize_t size;
+    while ((size = read(pipe_fds[0], buffer, sizeof(buffer))) > 0) {
+      dump.append(buffer, size);
+    }
+    close(pipe_fds[0]);
+    auto line = [&](uint64_t pc) {
+      return FormatInstructionLine(PrivilegeMode::MACHINE_MODE, pc, memory->Read32(pc), cpu.GetMxl());
+    };
+    // The block of the loop is counted until the branch isn't taken, and
+    // the ecall is in it.
+    const std::string expected = "Flight recorder, the last 5 blocks and traps, oldest first:\n"
+                                 "           3  " + line(kStart) +
+                                 "           2  " + line(loop) +
+                                 "           3  " + line(loop) +
+                                 "exception 11  " + line(ecall) +
+                                 "           1  " + line(kHandler);
+    error |= dump != expected;
+    if (dump != expected && verbose) {
+      printf("%s", dump.c_str());
+    }
+  }
+#endif  // _WIN32
+  if (verbose) {
+    printf("Flight recorder test %s.\n", error ? "failed" : "passed");
+  }
+  return error;
+}
+// Flight recorder test ends here.
+
 bool RunTest() {
 
   // CPU address bus width.
@@ -2171,6 +3136,21 @@ bool RunTest() {
     error |= TestAmoTypeLoop(verbose);
     error |= TestSumQuiet(verbose);
     error |= TestSortQuiet(verbose);
+    error |= TestFetch(verbose);
+    error |= TestPmp(verbose);
+    error |= TestHostTlb(verbose);
+    error |= TestSnapshot(verbose);
+    error |= TestCoverage(verbose);
+    error |= TestForkServer(verbose);
+    error |= TestRecordReplay(verbose);
+    error |= TestTimeTravel(verbose);
+    error |= TestProfiler(verbose);
+    error |= TestCallStacks(verbose);
+    error |= TestInstructionMix(verbose);
+    error |= TestBasicBlockVector(verbose);
+    error |= TestTrace(verbose);
+    error |= TestDisassembler(verbose);
+    error |= TestFlightRecorder(verbose);
     // Add test for MRET
   }
 
@@ -0,0 +1,177 @@
+//
+// Random access benchmark of MemoryWrapper with and without huge pages.
+//
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include "memory_wrapper.h"
+
+using namespace RISCV_EMULATOR;
+
+namespace {
+
+constexpr size_t kDefaultFootprint = 256 << 20; // 256 MiB of guest RAM.
+constexpr size_t kDefaultAccesses = 20000000;
+constexpr size_t kGuestBase = 0x80000000;
+
+// Counts the host data TLB misses of this process. If the counter is not
+// available (e.g. no PMU in a VM or restricted by perf_event_paranoid), only
+// the time is reported.
+class DtlbMissCounter {
+public:
+  DtlbMissCounter() {
+#ifdef __linux__
+    struct perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd_ = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+  }
+
+  ~DtlbMissCounter() {
+#ifdef __linux__
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+#endif
+  }
+
+  bool IsAvailable() const { return fd_ >= 0; }
+
+  void Start() {
+#ifdef __linux__
+    if (fd_ >= 0) {
+      ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+  }
+
+  uint64_t Stop() {
+    uint64_t count = 0;
+#ifdef __linux__
+    if (fd_ >= 0) {
+      ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+      if (read(fd_, &count, sizeof(count)) != sizeof(count)) {
+        count = 0;
+      }
+    }
+#endif
+    return count;
+  }
+
+private:
+  int fd_ = -1;
+};
+
+void RunBenchmark(bool huge_pages, size_t footprint, size_t accesses) {
+  MemoryWrapper mw;
+  mw.EnableHugePages(huge_pages);
+  // Touch the whole footprint first, so that page faults are not measured.
+  mw.Fill(kGuestBase, 1, footprint);
+
+  std::mt19937_64 gen(1);
+  const size_t word_mask = (footprint - 1) & ~static_cast<size_t>(0b11);
+  DtlbMissCounter counter;
+  uint32_t sum = 0;
+  auto start = std::chrono::steady_clock::now();
+  counter.Start();
+  for (size_t i = 0; i < accesses; ++i) {
+    size_t address = kGuestBase + (gen() & word_mask);
+    if (i & 1) {
+      mw.Write32(address, sum);
+    } else {
+      sum += mw.Read32(address);
+    }
+  }
+  uint64_t misses = counter.Stop();
+  auto end = std::chrono::steady_clock::now();
+  double seconds = std::chrono::duration<double>(end - start).count();
+
+  std::cout << (huge_pages ? "Huge pages:  " : "Small pages: ") << seconds << " s, "
+            << accesses / seconds / 1e6 << " M accesses/s";
+  if (counter.IsAvailable()) {
+    std::cout << ", " << misses << " dTLB load misses";
+  } else {
+    std::cout << ", dTLB miss counter not available";
+  }
+  std::cout << " (checksum " << sum << ")" << std::endl;
+  if (huge_pages) {
+    std::cout << "  hugetlbfs regions: " << mw.GetHugeTlbRegionCount()
+              << ", transparent huge page regions: " << mw.GetTransparentHugeRegionCount() << std::endl;
+  }
+}
+
+// Compares two overlays of one base image that each wrote a few pages, like
+// snapshots of two runs of the same program.
+void RunCompareBenchmark(size_t footprint) {
+  constexpr int kWrittenPages = 1000;
+  auto base = std::make_shared<MemoryWrapper>();
+  base->Fill(kGuestBase, 1, footprint);
+  std::shared_ptr<const MemoryWrapper> image = base;
+  MemoryWrapper left(image), right(image);
+  left.EnablePageHashing(true);
+  right.EnablePageHashing(true);
+  std::mt19937_64 gen(2);
+  const size_t page_mask = (footprint - 1) & ~(MemoryWrapper::kPageSize - 1);
+  for (int i = 0; i < kWrittenPages; ++i) {
+    size_t address = kGuestBase + (gen() & page_mask);
+    left.Write32(address, i);
+    right.Write32(address, i + (i % 10 == 0));
+  }
+
+  // The first fingerprint fills the hash caches, the second one uses them.
+  auto start = std::chrono::steady_clock::now();
+  uint64_t fingerprints = left.Fingerprint() ^ right.Fingerprint();
+  auto hashed = std::chrono::steady_clock::now();
+  fingerprints = left.Fingerprint() ^ right.Fingerprint();
+  auto cached = std::chrono::steady_clock::now();
+  auto ranges = left.DiffPages(right);
+  bool equal = left == right;
+  auto end = std::chrono::steady_clock::now();
+  std::cout << "Fingerprint of two " << (footprint >> 20) << " MiB guests: "
+            << std::chrono::duration<double, std::milli>(hashed - start).count() << " ms, cached "
+            << std::chrono::duration<double, std::milli>(cached - hashed).count() << " ms ("
+            << (fingerprints ? "different" : "same") << ")" << std::endl;
+  std::cout << "DiffPages and operator==: " << std::chrono::duration<double, std::milli>(end - cached).count()
+            << " ms, " << ranges.size() << " differing ranges, " << (equal ? "equal" : "not equal") << std::endl;
+}
+
+} // namespace anonymous
+
+// Usage: memory_benchmark [footprint_MiB] [accesses]
+// The footprint is rounded down to a power of two.
+int main(int argc, char *argv[]) {
+  size_t footprint = kDefaultFootprint;
+  size_t accesses = kDefaultAccesses;
+  if (argc > 1) {
+    size_t mib = std::stoul(argv[1]);
+    footprint = MemoryWrapper::kHugePageSize;
+    while (footprint * 2 <= (mib << 20) && footprint * 2 <= (1ull << 30)) {
+      footprint *= 2;
+    }
+  }
+  if (argc > 2) {
+    accesses = std::stoul(argv[2]);
+  }
+  std::cout << "Footprint: " << (footprint >> 20) << " MiB, " << accesses << " random accesses." << std::endl;
+  RunBenchmark(false, footprint, accesses);
+  RunBenchmark(true, footprint, accesses);
+  RunCompareBenchmark(footprint);
+  return 0;
+}
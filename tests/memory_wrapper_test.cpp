@@ -6,6 +6,8 @@
 #include <algorithm>
 #include <random>
 #include <functional>
+#include <memory>
+#include <vector>
 #include "memory_wrapper.h"
 
 using namespace RISCV_EMULATOR;
@@ -221,6 +223,262 @@ bool Run16bitTest(int test_cycle, size_t test_size, bool verbose = false) {
   return result;
 }
 
+bool RunBlockTest(const size_t start, const size_t end, const size_t val,
+                  const bool verbose) {
+  if (verbose) {
+    std::cout << "Start: " << start << ", end: " << end << std::endl;
+  }
+  bool result = true;
+  MemoryWrapper mw;
+  const size_t length = end - start;
+  std::vector<uint8_t> source(length);
+  for (size_t i = 0; i < length; i++) {
+    source[i] = GetHash8(start + i + val);
+  }
+  mw.WriteBlock(start, source.data(), length);
+  for (size_t i = start; i < end && result; i++) {
+    result &= mw.ReadByte(i) == GetHash8(i + val);
+    if (!result) {
+      std::cout << "WriteBlock: at i = " << i << ", expectation = " << std::hex
+                << GetHash8(i + val) << ", actual = "
+                << static_cast<int>(mw.ReadByte(i)) << std::dec << std::endl;
+    }
+  }
+  std::vector<uint8_t> destination(length);
+  mw.ReadBlock(start, destination.data(), length);
+  result &= destination == source;
+  if (!result) {
+    std::cout << "ReadBlock mismatch." << std::endl;
+  }
+
+  // Fill the middle part, then look for the first zero from the start.
+  const size_t fill_start = start + length / 4;
+  const size_t fill_length = length / 2;
+  mw.Fill(fill_start, 0, fill_length);
+  for (size_t i = 0; i < length && result; i++) {
+    size_t address = start + i;
+    uint8_t expectation =
+        (fill_start <= address && address < fill_start + fill_length) ? 0 : source[i];
+    result &= mw.ReadByte(address) == expectation;
+    if (!result) {
+      std::cout << "Fill: at address = " << address << std::endl;
+    }
+  }
+  size_t expected_position = length;
+  for (size_t i = 0; i < length; i++) {
+    if (mw.ReadByte(start + i) == 0) {
+      expected_position = i;
+      break;
+    }
+  }
+  size_t position = mw.FindByte(start, 0, length);
+  result &= position == expected_position;
+  if (!result) {
+    std::cout << "FindByte: expectation = " << expected_position
+              << ", actual = " << position << std::endl;
+  }
+  // Unassigned memory reads as zero.
+  result &= mw.FindByte(end + kMaxTestSize, 0, length) == 0;
+  result &= mw.FindByte(end + kMaxTestSize, 1, length) == length;
+  return result;
+}
+
+bool RunBlockTest(int test_cycle, size_t test_size, bool verbose = false) {
+  bool result = true;
+  for (int i = 0; i < test_cycle && result; i++) {
+    InitRandom();
+    size_t start = 0, end = 0;
+    int val = 0;
+    while (end <= start || (end - start) > test_size) {
+      start = rand();
+      end = rand();
+      val = rand();
+    }
+    result = result && RunBlockTest(start, end, val, verbose);
+    if (i % 10 == 0 && i > 0) {
+      std::cout << i << " tests finished." << std::endl;
+    }
+  }
+  return result;
+}
+
+bool RunDirtyPageTest(bool verbose) {
+  bool result = true;
+  MemoryWrapper mw;
+  mw.Write32(0x1000, 1);
+  mw.EnableDirtyTracking(true);
+  // Writes before enabling are not tracked.
+  result &= !mw.IsPageDirty(0x1000);
+
+  std::vector<size_t> expectation = {0x2000, 0x5000, 0xFFFFF000, 0x100000, 0x101000};
+  mw.WriteByte(0x2003, 1);
+  mw.Write64(0x5ff8, 2);
+  mw.Write16(0xFFFFFFFE, 3);
+  // Crosses the page boundary in the middle of a chunk.
+  std::vector<uint8_t> data(8, 0xAA);
+  mw.WriteBlock(0x100FFC, data.data(), data.size());
+  std::sort(expectation.begin(), expectation.end());
+
+  std::vector<size_t> dirty;
+  for (size_t address : mw) {
+    dirty.push_back(address);
+  }
+  result &= dirty == expectation;
+  for (size_t address : expectation) {
+    result &= mw.IsPageDirty(address + 4);
+  }
+  result &= !mw.IsPageDirty(0x3000);
+
+  std::vector<size_t> taken = mw.TakeDirtyPages();
+  result &= taken == expectation;
+  result &= mw.begin() == mw.end();
+  result &= mw.TakeDirtyPages().empty();
+
+  mw.Fill(0x7000, 0, 2 * MemoryWrapper::kPageSize);
+  result &= mw.TakeDirtyPages() == std::vector<size_t>({0x7000, 0x8000});
+
+  mw.EnableDirtyTracking(false);
+  mw.Write32(0x9000, 1);
+  result &= !mw.IsPageDirty(0x9000);
+  if (verbose || !result) {
+    std::cout << "Dirty page test " << (result ? "passed." : "failed.") << std::endl;
+  }
+  return result;
+}
+
+bool RunOverlayTest(bool verbose) {
+  bool result = true;
+  // Never zero, so that FindByte only stops at the filled range.
+  auto pattern = [](size_t address) { return static_cast<uint8_t>(GetHash8(address) | 1); };
+  auto base = std::make_shared<MemoryWrapper>();
+  for (size_t i = 0x1000; i < 0x4000; i++) {
+    base->WriteByte(i, pattern(i));
+  }
+  base->Write32(0x200000, 0x12345678);
+  std::shared_ptr<const MemoryWrapper> image = base;
+  MemoryWrapper first(image);
+  MemoryWrapper second(image);
+
+  // Unwritten pages are read from the base.
+  result &= first.Read32(0x200000) == 0x12345678;
+  result &= !first.IsPagePrivate(0x1000);
+  result &= first == *base;
+
+  // The first write copies the page, and leaves the base and other overlays
+  // unchanged.
+  first.WriteByte(0x2001, 0xAA);
+  result &= first.IsPagePrivate(0x2000);
+  result &= !first.IsPagePrivate(0x1000);
+  result &= first.ReadByte(0x2001) == 0xAA;
+  result &= first.ReadByte(0x2002) == pattern(0x2002);
+  result &= base->ReadByte(0x2001) == pattern(0x2001);
+  result &= second.ReadByte(0x2001) == pattern(0x2001);
+  result &= first != second;
+
+  // Block accesses across shared and private pages.
+  std::vector<uint8_t> data(0x3000);
+  first.ReadBlock(0x1000, data.data(), data.size());
+  for (size_t i = 0; i < data.size(); i++) {
+    uint8_t expectation = (i == 0x1001) ? 0xAA : pattern(0x1000 + i);
+    result &= data[i] == expectation;
+  }
+  second.Fill(0x2800, 0, 0x1000);
+  result &= second.ReadByte(0x27FF) == pattern(0x27FF);
+  result &= second.ReadByte(0x2800) == 0 && second.ReadByte(0x37FF) == 0;
+  result &= second.ReadByte(0x3800) == pattern(0x3800);
+  result &= second.FindByte(0x2000, 0, 0x2000) == 0x800;
+  result &= base->FindByte(0x2000, 0, 0x2000) == 0x2000;
+  result &= *base == *base;
+
+  // A writable host page is copied and marked dirty first, and the mapping
+  // epoch tells that host pointers of the shared page are stale.
+  second.EnableDirtyTracking(true);
+  uint64_t epoch = second.GetMappingEpoch();
+  uint8_t *page = second.GetWritableHostPage(0x1234);
+  result &= second.IsPagePrivate(0x1000) && second.IsPageDirty(0x1000);
+  result &= second.GetMappingEpoch() != epoch;
+  result &= page[0x234] == pattern(0x1234);
+  page[0x234] = 0x55;
+  result &= second.ReadByte(0x1234) == 0x55 && base->ReadByte(0x1234) == pattern(0x1234);
+  second.TakeDirtyPages();
+  epoch = second.GetMappingEpoch();
+  result &= second.GetWritableHostPage(0x1FFF) == page && second.IsPageDirty(0x1000);
+  result &= second.GetMappingEpoch() == epoch;
+
+  // Reverting undoes the writes to the dirty pages. Pages written before the
+  // last clean state keep their contents.
+  second.Write32(0x200000, 0);
+  result &= second.RevertDirtyPages() == 2;
+  result &= second.GetMappingEpoch() != epoch;
+  result &= second.ReadByte(0x1234) == pattern(0x1234) && !second.IsPagePrivate(0x1000);
+  result &= second.Read32(0x200000) == 0x12345678;
+  result &= second.ReadByte(0x2800) == 0 && second.IsPagePrivate(0x2000);
+  result &= second.begin() == second.end();
+  if (verbose || !result) {
+    std::cout << "Overlay test " << (result ? "passed." : "failed.") << std::endl;
+  }
+  return result;
+}
+
+bool RunHugePageTest(bool verbose) {
+  bool result = true;
+  MemoryWrapper mw;
+  mw.EnableHugePages(true);
+  // The region covers the chunk pair 0x80000000-0x801FFFFF.
+  mw.Write32(0x80100000, 0x11111111);
+  mw.Write32(0x800FFFFC, 0x22222222);
+  mw.Write32(0x80200000, 0x33333333);
+  result &= mw.Read32(0x80100000) == 0x11111111;
+  result &= mw.Read32(0x800FFFFC) == 0x22222222;
+  result &= mw.Read32(0x80200000) == 0x33333333;
+  result &= mw.Read32(0x80000000) == 0 && mw.Read32(0x801FFFFC) == 0;
+  std::vector<uint8_t> data(0x200000, 0x5A);
+  mw.WriteBlock(0x80300000, data.data(), data.size());
+  std::vector<uint8_t> copy(data.size());
+  mw.ReadBlock(0x80300000, copy.data(), copy.size());
+  result &= copy == data;
+  if (verbose || !result) {
+    std::cout << "Huge page test " << (result ? "passed." : "failed.")
+              << " hugetlbfs regions: " << mw.GetHugeTlbRegionCount()
+              << ", transparent huge page regions: " << mw.GetTransparentHugeRegionCount() << std::endl;
+  }
+  return result;
+}
+
+bool RunHashTest(bool verbose) {
+  bool result = true;
+  MemoryWrapper left, right;
+  left.EnablePageHashing(true);
+  for (size_t i = 0; i < 0x3000; i += 4) {
+    left.Write32(0x10000 + i, GetHash32(i));
+  }
+  for (size_t i = 0x3000; i > 0; i -= 4) {
+    right.Write32(0x10000 + i - 4, GetHash32(i - 4));
+  }
+  // Zero filled pages are equal to pages that were never written.
+  right.Fill(0x400000, 0, 0x2000);
+  result &= left == right;
+  result &= left.Fingerprint() == right.Fingerprint();
+  result &= left.PageHash(0x11000) == right.PageHash(0x11000);
+  result &= left.PageHash(0x400000) == right.PageHash(0x500000);
+  result &= left.DiffPages(right).empty();
+
+  uint64_t hash = left.PageHash(0x11000);
+  left.WriteByte(0x11FFF, left.ReadByte(0x11FFF) + 1);
+  result &= left.PageHash(0x11000) != hash;
+  left.Write32(0x12000, ~left.Read32(0x12000));
+  right.Write32(0xFFFFF000, 1);
+  result &= left != right;
+  result &= left.Fingerprint() != right.Fingerprint();
+  std::vector<std::pair<size_t, size_t>> expectation = {{0x11000, 0x13000}, {0xFFFFF000, 0x100000000}};
+  result &= left.DiffPages(right) == expectation;
+  result &= right.DiffPages(left) == expectation;
+  if (verbose || !result) {
+    std::cout << "Hash test " << (result ? "passed." : "failed.") << std::endl;
+  }
+  return result;
+}
+
 } // namespace anonymous
 
 int main() {
@@ -254,5 +512,35 @@ int main() {
   } else {
     std::cout << "16 bit read/write test fail." << std::endl;
   }
+  result = result && RunBlockTest(kTestCycle, kMaxTestSize, false);
+  if (result) {
+    std::cout << "Block read/write test pass." << std::endl;
+  } else {
+    std::cout << "Block read/write test fail." << std::endl;
+  }
+  result = result && RunDirtyPageTest(false);
+  if (result) {
+    std::cout << "Dirty page tracking test pass." << std::endl;
+  } else {
+    std::cout << "Dirty page tracking test fail." << std::endl;
+  }
+  result = result && RunOverlayTest(false);
+  if (result) {
+    std::cout << "Copy-on-write overlay test pass." << std::endl;
+  } else {
+    std::cout << "Copy-on-write overlay test fail." << std::endl;
+  }
+  result = result && RunHugePageTest(false);
+  if (result) {
+    std::cout << "Huge page test pass." << std::endl;
+  } else {
+    std::cout << "Huge page test fail." << std::endl;
+  }
+  result = result && RunHashTest(false);
+  if (result) {
+    std::cout << "Page hash and equality test pass." << std::endl;
+  } else {
+    std::cout << "Page hash and equality test fail." << std::endl;
+  }
   return result ? 0 : 1;
 }
\ No newline at end of file
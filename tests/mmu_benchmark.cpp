@@ -0,0 +1,109 @@
+//
+// Address translation benchmark of Mmu for Sv39, Sv48 and Sv57.
+//
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include "Mmu.h"
+#include "memory_wrapper.h"
+
+using namespace RISCV_EMULATOR;
+
+namespace {
+
+constexpr int kDefaultPages = 1 << 16; // 256 MiB of 4 KiB pages.
+constexpr size_t kDefaultTranslations = 20000000;
+constexpr int kHotPages = 256; // Fits in the TLB.
+constexpr uint64_t kTableBase = 0x10000;
+constexpr uint64_t kVirtualBase = 0x40000000;
+constexpr uint64_t kPhysicalBase = 0x80000000;
+constexpr uint64_t kPteV = 1 << 0;
+constexpr uint64_t kLeafFlags = kPteV | (1 << 1) | (1 << 2) | (1 << 6) | (1 << 7); // VRWAD
+
+// Builds |levels| level page tables with a new table allocated when needed.
+class PageTableBuilder {
+public:
+  PageTableBuilder(MemoryWrapper &mem, int levels) : mem_(mem), levels_(levels) {}
+
+  void Map(uint64_t virtual_address, uint64_t physical_address) {
+    uint64_t table = kTableBase;
+    for (int level = levels_ - 1; level > 0; --level) {
+      uint64_t pte_address = table + ((virtual_address >> (12 + level * 9)) & 0x1FF) * 8;
+      uint64_t pte = mem_.Read64(pte_address);
+      if (!(pte & kPteV)) {
+        next_table_ += 0x1000;
+        pte = ((next_table_ >> 12) << 10) | kPteV;
+        mem_.Write64(pte_address, pte);
+      }
+      table = (pte >> 10) << 12;
+    }
+    mem_.Write64(table + ((virtual_address >> 12) & 0x1FF) * 8, ((physical_address >> 12) << 10) | kLeafFlags);
+  }
+
+  uint64_t GetSatp() const { return (static_cast<uint64_t>(levels_ + 5) << 60) | (kTableBase >> 12); }
+
+private:
+  MemoryWrapper &mem_;
+  const int levels_;
+  uint64_t next_table_ = kTableBase;
+};
+
+double Measure(Mmu &mmu, uint64_t satp, int pages, size_t translations, uint64_t &checksum) {
+  std::mt19937_64 gen(1);
+  const uint64_t page_mask = pages - 1;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < translations; ++i) {
+    uint64_t address = kVirtualBase + ((gen() & page_mask) << 12) + (i & 0xFF8);
+    checksum += mmu.VirtualToPhysical(address, satp, i & 1);
+  }
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() / translations;
+}
+
+void RunBenchmark(int levels, int pages, size_t translations) {
+  auto memory = std::make_shared<MemoryWrapper>();
+  PageTableBuilder builder(*memory, levels);
+  for (int i = 0; i < pages; ++i) {
+    builder.Map(kVirtualBase + (static_cast<uint64_t>(i) << 12), kPhysicalBase + (static_cast<uint64_t>(i) << 12));
+  }
+  Mmu mmu;
+  mmu.SetMemory(memory);
+  mmu.SetMxl(2);
+  mmu.SetPrivilege(PrivilegeMode::SUPERVISOR_MODE);
+
+  uint64_t checksum = 0;
+  double hit = Measure(mmu, builder.GetSatp(), kHotPages, translations, checksum);
+  auto statistics = mmu.GetStatistics();
+  double miss = Measure(mmu, builder.GetSatp(), pages, translations, checksum);
+  uint64_t misses = mmu.GetStatistics().tlb_misses - statistics.tlb_misses;
+  std::cout << "Sv" << (levels * 9 + 12) << ": TLB hit " << hit << " ns, random over " << pages << " pages "
+            << miss << " ns (" << misses * 100.0 / translations << "% TLB misses, checksum " << std::hex
+            << checksum << std::dec << ")" << std::endl;
+}
+
+} // namespace anonymous
+
+// Usage: mmu_benchmark [pages] [translations]
+// The number of pages is rounded down to a power of two.
+int main(int argc, char *argv[]) {
+  int pages = kDefaultPages;
+  size_t translations = kDefaultTranslations;
+  if (argc > 1) {
+    int requested = std::stoi(argv[1]);
+    pages = kHotPages;
+    while (pages * 2 <= requested && pages * 2 <= (1 << 18)) {
+      pages *= 2;
+    }
+  }
+  if (argc > 2) {
+    translations = std::stoul(argv[2]);
+  }
+  std::cout << translations << " translations per measurement." << std::endl;
+  for (int levels = 3; levels <= 5; ++levels) {
+    RunBenchmark(levels, pages, translations);
+  }
+  return 0;
+}
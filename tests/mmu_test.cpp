@@ -0,0 +1,300 @@
+//
+// Tests of the address translation and the TLB of Mmu.
+//
+
+#include <iostream>
+#include <memory>
+#include <vector>
+#include "Mmu.h"
+#include "memory_wrapper.h"
+
+using namespace RISCV_EMULATOR;
+
+namespace {
+
+constexpr uint64_t kPteV = 1 << 0;
+constexpr uint64_t kPteR = 1 << 1;
+constexpr uint64_t kPteW = 1 << 2;
+constexpr uint64_t kPteX = 1 << 3;
+constexpr uint64_t kPteG = 1 << 5;
+constexpr uint64_t kPteA = 1 << 6;
+constexpr uint64_t kPteD = 1 << 7;
+
+// Sv39 tables.
+constexpr uint64_t kRoot64 = 0x10000;
+constexpr uint64_t kLevel1Table64 = 0x11000;
+constexpr uint64_t kLevel0Table64 = 0x12000;
+constexpr uint16_t kAsid = 5;
+constexpr uint64_t kSatp64 = (8ull << 60) | (static_cast<uint64_t>(kAsid) << 44) | (kRoot64 >> 12);
+
+// Sv32 tables.
+constexpr uint64_t kRoot32 = 0x20000;
+constexpr uint64_t kLevel0Table32 = 0x21000;
+constexpr uint64_t kSatp32 = (1u << 31) | (kRoot32 >> 12);
+
+uint64_t Pte64(uint64_t physical_address, uint64_t flags) {
+  return ((physical_address >> 12) << 10) | flags;
+}
+
+uint32_t Pte32(uint64_t physical_address, uint64_t flags) {
+  return static_cast<uint32_t>(((physical_address >> 12) << 10) | flags);
+}
+
+bool Check(bool condition, const char *message) {
+  if (!condition) {
+    std::cerr << "Failed: " << message << std::endl;
+  }
+  return condition;
+}
+
+// 0x40000000 -> 0x80000000, 0x40001000 -> 0x80005000 (global),
+// 0x80000000 - 0xBFFFFFFF identity mapped with a gigapage.
+void SetupSv39(MemoryWrapper &mem) {
+  mem.Write64(kRoot64 + 1 * 8, Pte64(kLevel1Table64, kPteV));
+  mem.Write64(kRoot64 + 2 * 8, Pte64(0x80000000, kPteV | kPteR | kPteW | kPteX));
+  mem.Write64(kLevel1Table64, Pte64(kLevel0Table64, kPteV));
+  mem.Write64(kLevel0Table64, Pte64(0x80000000, kPteV | kPteR | kPteW));
+  mem.Write64(kLevel0Table64 + 8, Pte64(0x80005000, kPteV | kPteR | kPteG));
+}
+
+bool TestSv39Tlb() {
+  bool result = true;
+  auto memory = std::make_shared<MemoryWrapper>();
+  SetupSv39(*memory);
+  Mmu mmu;
+  mmu.SetMemory(memory);
+  mmu.SetMxl(2);
+  mmu.SetPrivilege(PrivilegeMode::SUPERVISOR_MODE);
+
+  result &= Check(mmu.VirtualToPhysical(0x40000123, kSatp64) == 0x80000123, "4 KiB page translation");
+  result &= Check(mmu.GetStatistics().tlb_misses == 1 && mmu.GetStatistics().tlb_hits == 0, "first access misses");
+  result &= Check(mmu.VirtualToPhysical(0x40000FF8, kSatp64) == 0x80000FF8, "cached translation");
+  result &= Check(mmu.GetStatistics().tlb_hits == 1, "second access hits");
+  result &= Check((memory->Read64(kLevel0Table64) & (kPteA | kPteD)) == kPteA, "walk sets A only");
+  result &= Check(!(mmu.GetTlbFlags(0x40000000) & Mmu::kTlbDirty), "clean TLB entry");
+
+  // The first store walks the table again to set D.
+  result &= Check(mmu.VirtualToPhysical(0x40000010, kSatp64, true) == 0x80000010, "store translation");
+  result &= Check(mmu.GetStatistics().tlb_misses == 2, "first store misses");
+  result &= Check((memory->Read64(kLevel0Table64) & kPteD) != 0, "store sets D");
+  result &= Check((mmu.GetTlbFlags(0x40000000) & (Mmu::kTlbDirty | Mmu::kTlbWrite | Mmu::kTlbRead)) ==
+                  (Mmu::kTlbDirty | Mmu::kTlbWrite | Mmu::kTlbRead), "permission bits");
+  mmu.VirtualToPhysical(0x40000010, kSatp64, true);
+  result &= Check(mmu.GetStatistics().tlb_hits == 2, "second store hits");
+
+  // A changed PTE is only seen after sfence.vma.
+  memory->Write64(kLevel0Table64, Pte64(0x90000000, kPteV | kPteR | kPteW | kPteA | kPteD));
+  result &= Check(mmu.VirtualToPhysical(0x40000000, kSatp64) == 0x80000000, "stale until sfence.vma");
+  mmu.FlushTlb(true, 0x40000000, false, 0);
+  result &= Check(mmu.VirtualToPhysical(0x40000000, kSatp64) == 0x90000000, "sfence.vma by address");
+
+  // Flushing one ASID keeps the global entries.
+  result &= Check(mmu.VirtualToPhysical(0x40001004, kSatp64) == 0x80005004, "global page translation");
+  result &= Check((mmu.GetTlbFlags(0x40001000) & Mmu::kTlbGlobal) != 0, "global bit");
+  mmu.FlushTlb(false, 0, true, kAsid + 1);
+  result &= Check(mmu.GetTlbFlags(0x40000000) != 0, "other ASID is not flushed");
+  mmu.FlushTlb(false, 0, true, kAsid);
+  result &= Check(mmu.GetTlbFlags(0x40000000) == 0, "ASID flush");
+  result &= Check(mmu.GetTlbFlags(0x40001000) != 0, "ASID flush keeps global entries");
+
+  // A gigapage is cached per 4 KiB page, and flushed as a whole.
+  result &= Check(mmu.VirtualToPhysical(0x80001234, kSatp64) == 0x80001234, "gigapage translation");
+  result &= Check(mmu.VirtualToPhysical(0xBFFFF000, kSatp64) == 0xBFFFF000, "gigapage translation (end)");
+  mmu.FlushTlb(true, 0x90000000, false, 0);
+  result &= Check(mmu.GetTlbFlags(0x80001000) == 0 && mmu.GetTlbFlags(0xBFFFF000) == 0, "gigapage flush");
+  result &= Check(mmu.GetTlbFlags(0x40001000) != 0, "address flush keeps other pages");
+
+  // A SATP change flushes everything.
+  uint64_t flushes = mmu.GetStatistics().tlb_flushes;
+  mmu.VirtualToPhysical(0x40001000, kSatp64 + 1);
+  result &= Check(mmu.GetStatistics().tlb_flushes == flushes + 1, "SATP change flushes");
+  return result;
+}
+
+// The PTE is only written back when A or D changes.
+bool TestAccessedDirtyWriteBack() {
+  bool result = true;
+  auto memory = std::make_shared<MemoryWrapper>();
+  SetupSv39(*memory);
+  memory->Write64(kLevel0Table64 + 8, Pte64(0x80005000, kPteV | kPteR | kPteW | kPteA));
+  memory->EnableDirtyTracking(true);
+  Mmu mmu;
+  mmu.SetMemory(memory);
+  mmu.SetMxl(2);
+  mmu.SetPrivilege(PrivilegeMode::SUPERVISOR_MODE);
+
+  mmu.VirtualToPhysical(0x40001000, kSatp64);
+  result &= Check(!memory->IsPageDirty(kLevel0Table64), "A already set");
+  mmu.VirtualToPhysical(0x40000000, kSatp64);
+  result &= Check(memory->TakeDirtyPages() == std::vector<size_t>({kLevel0Table64}), "A set");
+  mmu.VirtualToPhysical(0x40001000, kSatp64, true);
+  result &= Check(memory->TakeDirtyPages() == std::vector<size_t>({kLevel0Table64}), "D set");
+  // Only the first store to a clean page walks the table.
+  uint64_t misses = mmu.GetStatistics().tlb_misses;
+  mmu.VirtualToPhysical(0x40001008, kSatp64, true);
+  result &= Check(mmu.GetStatistics().tlb_misses == misses, "store to a dirty page hits");
+  mmu.FlushTlb();
+  mmu.VirtualToPhysical(0x40001000, kSatp64, true);
+  result &= Check(!memory->IsPageDirty(kLevel0Table64), "A and D already set");
+  result &= Check((memory->Read64(kLevel0Table64 + 8) & (kPteA | kPteD)) == (kPteA | kPteD), "A and D");
+  return result;
+}
+
+// Maps one 4 KiB page with a full walk of |levels| levels, tables from
+// |table|, and a superpage at each level of a second VPN. Returns the SATP.
+uint64_t SetupWalk(MemoryWrapper &mem, int levels, uint64_t table, uint64_t virtual_address,
+                   uint64_t physical_address) {
+  const uint64_t mode = levels + 5;
+  const uint64_t root = table;
+  for (int level = levels - 1; level > 0; --level) {
+    uint64_t vpn = (virtual_address >> (12 + level * 9)) & 0x1FF;
+    mem.Write64(table + vpn * 8, Pte64(table + 0x1000, kPteV));
+    table += 0x1000;
+  }
+  mem.Write64(table + ((virtual_address >> 12) & 0x1FF) * 8, Pte64(physical_address, kPteV | kPteR | kPteW));
+  return (mode << 60) | (root >> 12);
+}
+
+// Sv48 and Sv57 use the same walk as Sv39 with more levels.
+bool TestSv48Sv57() {
+  bool result = true;
+  for (int levels = 4; levels <= 5; ++levels) {
+    auto memory = std::make_shared<MemoryWrapper>();
+    const uint64_t virtual_address = (1ull << (12 + (levels - 1) * 9)) | (3ull << 30) | 0x5000;
+    const uint64_t satp = SetupWalk(*memory, levels, 0x30000, virtual_address, 0x80007000);
+    // The largest superpage in the root maps 0 - 512 GiB (Sv48) or 256 TiB (Sv57).
+    memory->Write64(0x30000, Pte64(0, kPteV | kPteR | kPteX));
+    // A 1 GiB page below the full walk is misaligned.
+    memory->Write64(0x30000 + (levels - 3) * 0x1000 + 2 * 8, Pte64(0x1000, kPteV | kPteR));
+    Mmu mmu;
+    mmu.SetMemory(memory);
+    mmu.SetMxl(2);
+    mmu.SetPrivilege(PrivilegeMode::SUPERVISOR_MODE);
+
+    result &= Check(mmu.VirtualToPhysical(virtual_address + 0x10, satp) == 0x80007010, "4 KiB page translation");
+    result &= Check(!mmu.GetPageFault(), "no page fault");
+    result &= Check(mmu.VirtualToPhysical(virtual_address + 0x20, satp) == 0x80007020, "cached translation");
+    result &= Check(mmu.GetStatistics().tlb_hits == 1, "TLB hit");
+    result &= Check(mmu.VirtualToPhysical(0x76543210, satp) == 0x76543210, "root level superpage");
+    // The top VPN bits are a part of the tag.
+    result &= Check(mmu.GetTlbFlags(virtual_address) != 0 &&
+                    mmu.GetTlbFlags(virtual_address & ~(1ull << (12 + (levels - 1) * 9))) == 0,
+                    "top VPN bits in the tag");
+    mmu.VirtualToPhysical((virtual_address & ~(0x1FFull << 30)) | (2ull << 30), satp);
+    result &= Check(mmu.GetPageFault(), "misaligned superpage");
+    mmu.FlushTlb(true, virtual_address, false, 0);
+    result &= Check(mmu.GetTlbFlags(virtual_address) == 0, "flush by address");
+  }
+  return result;
+}
+
+// Walks after the first one read only the last level, until sfence.vma or
+// a SATP change.
+bool TestWalkCache() {
+  bool result = true;
+  auto memory = std::make_shared<MemoryWrapper>();
+  SetupSv39(*memory);
+  memory->Write64(kLevel0Table64 + 2 * 8, Pte64(0x80002000, kPteV | kPteR | kPteA));
+  Mmu mmu;
+  mmu.SetMemory(memory);
+  mmu.SetMxl(2);
+  mmu.SetPrivilege(PrivilegeMode::SUPERVISOR_MODE);
+
+  mmu.VirtualToPhysical(0x40000000, kSatp64);
+  result &= Check(mmu.GetStatistics().walk_cache_misses == 1, "first walk reads the root");
+  result &= Check(mmu.VirtualToPhysical(0x40001000, kSatp64) == 0x80005000, "walk from the cached table");
+  result &= Check(mmu.GetStatistics().walk_cache_hits == 1, "walk cache hit");
+  // The cached level 0 table is used without reading the upper levels.
+  memory->Write64(kRoot64 + 1 * 8, 0);
+  result &= Check(mmu.VirtualToPhysical(0x40002000, kSatp64) == 0x80002000, "upper levels are not read");
+  result &= Check((mmu.GetTlbFlags(0x40001000) & Mmu::kTlbGlobal) != 0, "global leaf");
+  mmu.FlushTlb(true, 0x40002000, false, 0);
+  mmu.VirtualToPhysical(0x40002000, kSatp64);
+  result &= Check(mmu.GetPageFault(), "sfence.vma flushes the walk cache");
+  result &= Check(mmu.GetStatistics().walk_cache_hits == 2 && mmu.GetStatistics().walk_cache_misses == 2,
+                  "walk cache statistics");
+
+  // A gigapage walk caches nothing.
+  const uint64_t other_satp = kSatp64 + (1ull << 44);
+  memory->Write64(kRoot64 + 1 * 8, Pte64(kLevel1Table64, kPteV));
+  mmu.VirtualToPhysical(0x40000000, other_satp);
+  mmu.VirtualToPhysical(0x80000000, other_satp);
+  result &= Check(mmu.GetStatistics().walk_cache_misses == 4, "gigapage walk");
+  mmu.VirtualToPhysical(0x40002000, other_satp);
+  result &= Check(mmu.GetStatistics().walk_cache_hits == 3, "walk cache after SATP change");
+  return result;
+}
+
+// The page walk reads the PTEs as S-mode, so PMP applies.
+bool TestPteAccessFault() {
+  bool result = true;
+  auto memory = std::make_shared<MemoryWrapper>();
+  SetupSv39(*memory);
+  Pmp pmp;
+  pmp.SetMxl(2);
+  // Only the root table can be accessed.
+  pmp.WriteCsr(Pmp::kPmpAddr0, (kRoot64 >> 2) | ((0x1000 >> 3) - 1));
+  pmp.WriteCsr(Pmp::kPmpCfg0, (3 << 3) | Pmp::kRead | Pmp::kWrite);
+  Mmu mmu;
+  mmu.SetMemory(memory);
+  mmu.SetMxl(2);
+  mmu.SetPrivilege(PrivilegeMode::SUPERVISOR_MODE);
+  mmu.SetPmp(&pmp);
+
+  result &= Check(mmu.VirtualToPhysical(0x80001000, kSatp64) == 0x80001000 && !mmu.GetAccessFault(),
+                  "gigapage in the root table");
+  mmu.VirtualToPhysical(0x40000000, kSatp64);
+  result &= Check(mmu.GetAccessFault() && !mmu.GetPageFault(), "level 1 table access fault");
+  result &= Check(mmu.GetFaultingAddress() == 0x40000000, "faulting address");
+  result &= Check(mmu.GetTlbFlags(0x40000000) == 0, "access faults are not cached");
+  return result;
+}
+
+bool TestSv32Tlb() {
+  bool result = true;
+  auto memory = std::make_shared<MemoryWrapper>();
+  memory->Write32(kRoot32 + 1 * 4, Pte32(kLevel0Table32, kPteV));
+  memory->Write32(kLevel0Table32 + 2 * 4, Pte32(0x3000, kPteV | kPteR | kPteW | kPteX));
+  // Megapage 0x80000000 - 0x803FFFFF.
+  memory->Write32(kRoot32 + 0x200 * 4, Pte32(0x80000000, kPteV | kPteR | kPteX));
+  Mmu mmu;
+  mmu.SetMemory(memory);
+  mmu.SetMxl(1);
+  mmu.SetPrivilege(PrivilegeMode::USER_MODE);
+
+  result &= Check(mmu.VirtualToPhysical(0x00402ABC, kSatp32) == 0x3ABC, "Sv32 translation");
+  result &= Check(mmu.VirtualToPhysical(0x00402000, kSatp32) == 0x3000, "Sv32 cached translation");
+  result &= Check(mmu.VirtualToPhysical(0x80123456, kSatp32) == 0x80123456, "Sv32 megapage translation");
+  result &= Check(mmu.GetStatistics().tlb_hits == 1 && mmu.GetStatistics().tlb_misses == 2, "Sv32 statistics");
+  result &= Check(mmu.VirtualToPhysical(0x00401000, kSatp32) == 0x00401000 && mmu.GetPageFault(), "Sv32 fault");
+  result &= Check(mmu.GetStatistics().walk_cache_hits == 1 && mmu.GetStatistics().walk_cache_misses == 2,
+                  "Sv32 walk cache");
+  mmu.VirtualToPhysical(0x00403000, kSatp32);
+  result &= Check(mmu.GetPageFault(), "Sv32 page fault");
+  result &= Check(mmu.GetTlbFlags(0x00403000) == 0, "faults are not cached");
+
+  // Machine mode and bare mode don't use the TLB.
+  mmu.SetPrivilege(PrivilegeMode::MACHINE_MODE);
+  result &= Check(mmu.VirtualToPhysical(0x00402000, kSatp32) == 0x00402000, "machine mode");
+  mmu.SetPrivilege(PrivilegeMode::SUPERVISOR_MODE);
+  result &= Check(mmu.VirtualToPhysical(0x00402000, 0) == 0x00402000, "bare mode");
+  result &= Check(mmu.GetStatistics().tlb_hits == 1, "no lookups without paging");
+  return result;
+}
+
+} // namespace anonymous
+
+int main() {
+  bool result = TestSv39Tlb();
+  result &= TestAccessedDirtyWriteBack();
+  result &= TestSv48Sv57();
+  result &= TestWalkCache();
+  result &= TestPteAccessFault();
+  result &= TestSv32Tlb();
+  if (result) {
+    std::cout << "Mmu test passed." << std::endl;
+  } else {
+    std::cout << "Mmu test failed." << std::endl;
+  }
+  return result ? 0 : 1;
+}
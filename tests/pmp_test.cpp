@@ -0,0 +1,117 @@
+//
+// Tests of the PMP CSRs and access checks.
+//
+
+#include <iostream>
+#include "Pmp.h"
+
+using namespace RISCV_EMULATOR;
+
+namespace {
+
+constexpr PrivilegeMode kMachine = PrivilegeMode::MACHINE_MODE;
+constexpr PrivilegeMode kSupervisor = PrivilegeMode::SUPERVISOR_MODE;
+constexpr PrivilegeMode kUser = PrivilegeMode::USER_MODE;
+constexpr uint8_t kRwx = Pmp::kRead | Pmp::kWrite | Pmp::kExecute;
+
+constexpr uint8_t kTor = 1 << 3;
+constexpr uint8_t kNa4 = 2 << 3;
+constexpr uint8_t kNapot = 3 << 3;
+constexpr uint8_t kLock = 1 << 7;
+
+bool Check(bool condition, const char *message) {
+  if (!condition) {
+    std::cerr << "Failed: " << message << std::endl;
+  }
+  return condition;
+}
+
+bool TestAddressMatching() {
+  bool result = true;
+  Pmp pmp;
+  result &= Check(!pmp.IsActive() && pmp.Check(0x80000000, 4, kRwx, kUser), "no entry allows everything");
+
+  // 0: [0x80000000, 0x80001800) RX, 1: NA4 at 0x80001800 RW,
+  // 2: NAPOT [0x80000000, 0x80010000) R.
+  pmp.WriteCsr(Pmp::kPmpAddr0, 0x80000000 >> 2);
+  pmp.WriteCsr(Pmp::kPmpAddr0 + 1, 0x80001800 >> 2);
+  pmp.WriteCsr(Pmp::kPmpAddr0 + 2, 0x80001800 >> 2);
+  pmp.WriteCsr(Pmp::kPmpAddr0 + 3, (0x80000000 >> 2) | ((0x10000 >> 3) - 1));
+  uint64_t cfg = (kNa4 | Pmp::kRead | Pmp::kWrite) << 16 | (kTor | Pmp::kRead | Pmp::kExecute) << 8;
+  cfg |= static_cast<uint64_t>(kNapot | Pmp::kRead) << 24;
+  pmp.WriteCsr(Pmp::kPmpCfg0, cfg);
+  result &= Check(pmp.ReadCsr(Pmp::kPmpCfg0) == cfg, "pmpcfg0");
+  result &= Check(pmp.IsActive(), "active");
+
+  result &= Check(pmp.Check(0x80000000, 4, Pmp::kExecute, kUser), "TOR execute");
+  result &= Check(!pmp.Check(0x80000000, 4, Pmp::kWrite, kSupervisor), "TOR write");
+  result &= Check(!pmp.Check(0x7FFFFFFC, 4, Pmp::kRead, kUser), "below TOR, unmatched");
+  result &= Check(pmp.Check(0x7FFFFFFC, 4, Pmp::kRead, kMachine), "unmatched machine mode access");
+  result &= Check(pmp.Check(0x80000000, 4, Pmp::kWrite, kMachine), "unlocked entries don't apply to M-mode");
+  // The page 0x80001000 is split between TOR, NA4 and NAPOT.
+  result &= Check(pmp.Check(0x800017FC, 4, Pmp::kExecute, kUser), "TOR end");
+  result &= Check(!pmp.Check(0x800017FE, 4, Pmp::kRead, kUser), "access across regions");
+  result &= Check(pmp.Check(0x80001800, 4, Pmp::kWrite, kUser), "NA4 write");
+  result &= Check(!pmp.Check(0x80001804, 4, Pmp::kWrite, kUser), "NAPOT write");
+  result &= Check(pmp.Check(0x80001804, 4, Pmp::kRead, kUser), "NAPOT read");
+  result &= Check(pmp.Check(0x8000FFF8, 8, Pmp::kRead, kUser), "NAPOT end");
+  result &= Check(!pmp.Check(0x80010000, 1, Pmp::kRead, kUser), "above NAPOT");
+
+  // Cached page permissions are dropped when the configuration changes.
+  pmp.WriteCsr(Pmp::kPmpCfg0, cfg | (Pmp::kWrite << 24));
+  result &= Check(pmp.Check(0x80001804, 4, Pmp::kWrite, kUser), "NAPOT write after change");
+  pmp.WriteCsr(Pmp::kPmpCfg0, 0);
+  result &= Check(!pmp.IsActive() && pmp.Check(0x7FFFFFFC, 4, kRwx, kUser), "all entries off");
+  return result;
+}
+
+bool TestLock() {
+  bool result = true;
+  Pmp pmp;
+  pmp.WriteCsr(Pmp::kPmpAddr0, 0x1000 >> 2);
+  pmp.WriteCsr(Pmp::kPmpAddr0 + 1, 0x2000 >> 2);
+  // Entry 1 is a locked TOR [0x1000, 0x2000) without write.
+  pmp.WriteCsr(Pmp::kPmpCfg0, (kLock | kTor | Pmp::kRead | Pmp::kExecute) << 8);
+  result &= Check(!pmp.Check(0x1000, 4, Pmp::kWrite, kMachine), "locked entry applies to M-mode");
+  result &= Check(pmp.Check(0x1000, 4, Pmp::kRead, kMachine), "locked entry read");
+  result &= Check(pmp.Check(0x3000, 4, Pmp::kWrite, kMachine), "unmatched M-mode access");
+  const uint64_t generation = pmp.GetGeneration();
+  pmp.WriteCsr(Pmp::kPmpAddr0, 0);
+  pmp.WriteCsr(Pmp::kPmpAddr0 + 1, 0x3000 >> 2);
+  pmp.WriteCsr(Pmp::kPmpCfg0, 0);
+  result &= Check(pmp.ReadCsr(Pmp::kPmpAddr0) == (0x1000 >> 2), "TOR base is locked");
+  result &= Check(pmp.ReadCsr(Pmp::kPmpAddr0 + 1) == (0x2000 >> 2), "pmpaddr is locked");
+  result &= Check(pmp.ReadCsr(Pmp::kPmpCfg0) == (kLock | kTor | Pmp::kRead | Pmp::kExecute) << 8, "pmpcfg is locked");
+  result &= Check(pmp.GetGeneration() == generation, "ignored writes");
+  return result;
+}
+
+bool TestRv64Csrs() {
+  bool result = true;
+  Pmp pmp;
+  pmp.SetMxl(2);
+  pmp.WriteCsr(Pmp::kPmpAddr0 + 8, ~0ull);
+  result &= Check(pmp.ReadCsr(Pmp::kPmpAddr0 + 8) == (1ull << 54) - 1, "54 bit pmpaddr");
+  pmp.WriteCsr(Pmp::kPmpCfg0 + 1, ~0ull);
+  result &= Check(pmp.ReadCsr(Pmp::kPmpCfg0 + 1) == 0 && !pmp.IsActive(), "no pmpcfg1 in RV64");
+  // Entry 8 in pmpcfg2, NAPOT of the whole address space. W without R is reserved.
+  pmp.WriteCsr(Pmp::kPmpCfg0 + 2, kNapot | Pmp::kWrite | Pmp::kExecute | 0x60);
+  result &= Check(pmp.ReadCsr(Pmp::kPmpCfg0 + 2) == (kNapot | Pmp::kExecute), "WARL pmpcfg");
+  result &= Check(pmp.Check(0xFFFFFFFFFFFF00ull, 8, Pmp::kExecute, kUser), "whole address space");
+  result &= Check(!pmp.Check(0x80000000, 8, Pmp::kRead, kUser), "no read");
+  return result;
+}
+
+} // namespace anonymous
+
+int main() {
+  bool result = TestAddressMatching();
+  result &= TestLock();
+  result &= TestRv64Csrs();
+  if (result) {
+    std::cout << "Pmp test passed." << std::endl;
+  } else {
+    std::cout << "Pmp test failed." << std::endl;
+  }
+  return result ? 0 : 1;
+}
@@ -126,6 +126,24 @@ bool WriteTest() {
   return result;
 }
 
+bool Ppn64Test() {
+  bool result = true;
+  for (int i = 0; i < kTestCaseSize && result; ++i) {
+    uint64_t value = (static_cast<uint64_t>(GetRandom32()) << 32) | GetRandom32();
+    uint64_t ppn = ((static_cast<uint64_t>(GetRandom32()) << 32) | GetRandom32()) & ((1ull << 44) - 1);
+    Pte64 pte(value);
+    result &= pte.GetPpn() == ((value >> 10) & ((1ull << 44) - 1));
+    pte.SetPpn(ppn);
+    result &= pte.GetPpn() == ppn;
+    // The flags and the bits above the PPN are kept.
+    result &= (pte.GetValue() & ~(((1ull << 44) - 1) << 10)) == (value & ~(((1ull << 44) - 1) << 10));
+    if (!result) {
+      std::cerr << "pte = " << std::bitset<64>(value) << ", ppn = " << std::bitset<44>(ppn) << std::endl;
+    }
+  }
+  return result;
+}
+
 bool Test() {
   bool test_result = true;
   for (int i = 0; i < kTestCaseSize && test_result; ++i) {
@@ -134,6 +152,7 @@ bool Test() {
   }
   test_result &= CheckValidAndLeaf();
   test_result &= WriteTest();
+  test_result &= Ppn64Test();
   return test_result;
 }
 